@@ -2734,6 +2734,34 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Set *<b>usec_out</b> to the number of microseconds of CPU time that the
+ * calling thread has used so far.  Return 0 on success, or -1 if we can't
+ * tell on this platform. */
+int
+tor_get_thread_cpu_usec(uint64_t *usec_out)
+{
+#ifdef _WIN32
+  FILETIME created, exited, kernel, user;
+  uint64_t k, u;
+  if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+    return -1;
+  k = (((uint64_t)kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+  u = (((uint64_t)user.dwHighDateTime) << 32) | user.dwLowDateTime;
+  /* FILETIMEs count 100-nsec units. */
+  *usec_out = (k + u) / 10;
+  return 0;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return -1;
+  *usec_out = ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  return 0;
+#else
+  (void) usec_out;
+  return -1;
+#endif
+}
+
 #if !defined(_WIN32)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
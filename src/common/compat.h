@@ -341,6 +341,7 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+int tor_get_thread_cpu_usec(uint64_t *usec_out);
 
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
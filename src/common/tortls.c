@@ -231,6 +231,7 @@ static X509* tor_tls_create_certificate(crypto_pk_t *rsa,
                                         const char *cname_sign,
                                         unsigned int cert_lifetime);
 
+static void tor_tls_session_cache_clear(void);
 static int tor_tls_context_init_one(tor_tls_context_t **ppcontext,
                                     crypto_pk_t *identity,
                                     unsigned int key_lifetime,
@@ -503,6 +504,8 @@ tor_tls_free_all(void)
 {
   check_no_tls_errors();
 
+  tor_tls_session_cache_clear();
+
   if (server_tls_context) {
     tor_tls_context_t *ctx = server_tls_context;
     server_tls_context = NULL;
@@ -1001,6 +1004,163 @@ tor_tls_cert_is_valid(int severity,
   return 0;
 }
 
+/** The most TLS sessions we'll remember, as a client and as a server. */
+#define TOR_TLS_SESSION_CACHE_MAX 256
+/** How long, in seconds, will we keep trying to resume a TLS session? */
+#define TOR_TLS_SESSION_LIFETIME (60*60)
+
+/** A TLS session we negotiated as a client with a relay whose identity we
+ * have verified, which we may offer the next time we connect to that
+ * relay. */
+typedef struct tls_cached_session_t {
+  SSL_SESSION *session;
+  time_t added;
+} tls_cached_session_t;
+
+/** Map from relay identity digest to tls_cached_session_t, for outgoing
+ * connections; NULL if we haven't cached any sessions. */
+static digestmap_t *client_session_cache = NULL;
+/** True iff we should offer and remember client TLS sessions. */
+static int client_session_resumption_enabled = 0;
+/** How many outgoing TLS handshakes have we looked up in
+ * client_session_cache? */
+static uint64_t n_session_lookups = 0;
+/** How many of those lookups found a session to offer? */
+static uint64_t n_sessions_offered = 0;
+/** How many outgoing handshakes did the server let us resume? */
+static uint64_t n_sessions_resumed = 0;
+
+/** Release all storage held by <b>ent</b>. */
+static void
+tls_cached_session_free(tls_cached_session_t *ent)
+{
+  if (!ent)
+    return;
+  SSL_SESSION_free(ent->session);
+  tor_free(ent);
+}
+
+/** Helper for digestmap_free(). */
+static void
+tls_cached_session_free_(void *ent)
+{
+  tls_cached_session_free(ent);
+}
+
+/** Forget every cached client TLS session. */
+static void
+tor_tls_session_cache_clear(void)
+{
+  digestmap_free(client_session_cache, tls_cached_session_free_);
+  client_session_cache = NULL;
+}
+
+/** Remove every expired session from the client session cache.  If the
+ * cache is still full, also remove its oldest session. */
+static void
+tor_tls_session_cache_clean(time_t now)
+{
+  char oldest_key[DIGEST_LEN];
+  time_t oldest = 0;
+
+  if (!client_session_cache)
+    return;
+
+  DIGESTMAP_FOREACH_MODIFY(client_session_cache, k,
+                           tls_cached_session_t *, ent) {
+    if (ent->added + TOR_TLS_SESSION_LIFETIME < now) {
+      tls_cached_session_free(ent);
+      MAP_DEL_CURRENT(k);
+    } else if (!oldest || ent->added < oldest) {
+      memcpy(oldest_key, k, DIGEST_LEN);
+      oldest = ent->added;
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  if (oldest &&
+      digestmap_size(client_session_cache) >= TOR_TLS_SESSION_CACHE_MAX)
+    tls_cached_session_free(digestmap_remove(client_session_cache,
+                                             oldest_key));
+}
+
+/** Client only: if we have a usable TLS session from an earlier connection
+ * to the relay with identity digest <b>identity_digest</b>, have
+ * <b>tls</b> offer it, so that the relay can let us skip most of the
+ * handshake.  Call this before starting the handshake on <b>tls</b>. */
+void
+tor_tls_offer_cached_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tls_cached_session_t *ent;
+  tor_assert(tls);
+  tor_assert(!tls->isServer);
+
+  if (!client_session_resumption_enabled ||
+      tor_digest_is_zero(identity_digest))
+    return;
+
+  ++n_session_lookups;
+  if (!client_session_cache)
+    return;
+  ent = digestmap_get(client_session_cache, identity_digest);
+  if (!ent)
+    return;
+  if (ent->added + TOR_TLS_SESSION_LIFETIME < time(NULL)) {
+    tls_cached_session_free(digestmap_remove(client_session_cache,
+                                             identity_digest));
+    return;
+  }
+  if (SSL_set_session(tls->ssl, ent->session))
+    ++n_sessions_offered;
+}
+
+/** Client only: <b>tls</b> is open, and we have checked that the relay at
+ * the other end has identity digest <b>identity_digest</b>.  Remember its
+ * TLS session for the next time we connect to that relay, and note whether
+ * this connection resumed an older one. */
+void
+tor_tls_cache_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tls_cached_session_t *ent;
+  SSL_SESSION *session;
+  tor_assert(tls);
+  tor_assert(!tls->isServer);
+
+  if (!client_session_resumption_enabled ||
+      tor_digest_is_zero(identity_digest))
+    return;
+
+  if (SSL_session_reused(tls->ssl))
+    ++n_sessions_resumed;
+
+  if (!(session = SSL_get1_session(tls->ssl)))
+    return;
+
+  if (!client_session_cache)
+    client_session_cache = digestmap_new();
+  else
+    tor_tls_session_cache_clean(time(NULL));
+
+  ent = tor_malloc_zero(sizeof(tls_cached_session_t));
+  ent->session = session;
+  ent->added = time(NULL);
+  tls_cached_session_free(digestmap_set(client_session_cache,
+                                        identity_digest, ent));
+}
+
+/** Set *<b>n_lookups_out</b>, *<b>n_offered_out</b>, and
+ * *<b>n_resumed_out</b> to the number of outgoing TLS handshakes for which
+ * we looked for a cached session, the number for which we found one, and
+ * the number that the other side let us resume. */
+void
+tor_tls_get_session_cache_stats(uint64_t *n_lookups_out,
+                                uint64_t *n_offered_out,
+                                uint64_t *n_resumed_out)
+{
+  *n_lookups_out = n_session_lookups;
+  *n_offered_out = n_sessions_offered;
+  *n_resumed_out = n_sessions_resumed;
+}
+
 /** Increase the reference count of <b>ctx</b>. */
 static void
 tor_tls_context_incref(tor_tls_context_t *ctx)
@@ -1027,6 +1187,10 @@ tor_tls_context_init(unsigned flags,
   const int is_public_server = flags & TOR_TLS_CTX_IS_PUBLIC_SERVER;
   check_no_tls_errors();
 
+  /* Sessions from our old keys are no use to us now. */
+  tor_tls_session_cache_clear();
+  client_session_resumption_enabled = !!(flags & TOR_TLS_CTX_ALLOW_RESUMPTION);
+
   if (is_public_server) {
     tor_tls_context_t *new_ctx;
     tor_tls_context_t *old_ctx;
@@ -1269,7 +1433,19 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
       idcert = NULL;
     }
   }
-  SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  if (!is_client && (flags & TOR_TLS_CTX_ALLOW_RESUMPTION)) {
+    /* Remember the sessions we negotiate as a server, so that relays which
+     * reconnect to us can skip the public-key part of the handshake. We
+     * still don't issue tickets. */
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(result->ctx, TOR_TLS_SESSION_CACHE_MAX);
+    SSL_CTX_set_timeout(result->ctx, TOR_TLS_SESSION_LIFETIME);
+    if (!SSL_CTX_set_session_id_context(result->ctx,
+                                        (const unsigned char *)"tor", 3))
+      goto error;
+  } else {
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  }
   if (!is_client) {
     tor_assert(rsa);
     if (!(pkey = crypto_pk_get_evp_pkey_(rsa,1)))
@@ -1854,6 +2030,12 @@ tor_tls_free(tor_tls_t *tls)
 #ifdef SSL_set_tlsext_host_name
   SSL_set_tlsext_host_name(tls->ssl, NULL);
 #endif
+  /* We almost never send a TLS close_notify; our link protocol doesn't
+   * need one.  Tell OpenSSL that this connection ended cleanly anyway, or
+   * else SSL_free() will drop its session from our server session cache
+   * and nobody could resume it. */
+  if (tls->state == TOR_TLS_ST_OPEN)
+    SSL_set_shutdown(tls->ssl, SSL_get_shutdown(tls->ssl)|SSL_SENT_SHUTDOWN);
   SSL_free(tls->ssl);
   tls->ssl = NULL;
   tls->negotiated_callback = NULL;
@@ -1914,8 +2096,8 @@ static uint64_t total_bytes_written_by_tls = 0;
  * number of characters written.  On failure, returns TOR_TLS_ERROR,
  * TOR_TLS_WANTREAD, or TOR_TLS_WANTWRITE.
  */
-int
-tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+MOCK_IMPL(int,
+tor_tls_write,(tor_tls_t *tls, const char *cp, size_t n))
 {
   int r, err;
   tor_assert(tls);
@@ -2398,8 +2580,8 @@ tor_tls_get_pending_bytes(tor_tls_t *tls)
 
 /** If <b>tls</b> requires that the next write be of a particular size,
  * return that size.  Otherwise, return 0. */
-size_t
-tor_tls_get_forced_write_size(tor_tls_t *tls)
+MOCK_IMPL(size_t,
+tor_tls_get_forced_write_size,(tor_tls_t *tls))
 {
   return tls->wantwrite_n;
 }
@@ -59,6 +59,7 @@ void tor_tls_free_all(void);
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
 #define TOR_TLS_CTX_USE_ECDHE_P256   (1u<<1)
 #define TOR_TLS_CTX_USE_ECDHE_P224   (1u<<2)
+#define TOR_TLS_CTX_ALLOW_RESUMPTION (1u<<3)
 
 int tor_tls_context_init(unsigned flags,
                          crypto_pk_t *client_identity,
@@ -66,6 +67,12 @@ int tor_tls_context_init(unsigned flags,
                          unsigned int key_lifetime);
 tor_tls_t *tor_tls_new(int sock, int is_server);
 void tor_tls_set_logged_address(tor_tls_t *tls, const char *address);
+void tor_tls_offer_cached_session(tor_tls_t *tls,
+                                  const char *identity_digest);
+void tor_tls_cache_session(tor_tls_t *tls, const char *identity_digest);
+void tor_tls_get_session_cache_stats(uint64_t *n_lookups_out,
+                                     uint64_t *n_offered_out,
+                                     uint64_t *n_resumed_out);
 void tor_tls_set_renegotiate_callback(tor_tls_t *tls,
                                       void (*cb)(tor_tls_t *, void *arg),
                                       void *arg);
@@ -78,7 +85,7 @@ int tor_tls_check_lifetime(int severity,
                            tor_tls_t *tls, int past_tolerance,
                            int future_tolerance);
 MOCK_DECL(int, tor_tls_read, (tor_tls_t *tls, char *cp, size_t len));
-int tor_tls_write(tor_tls_t *tls, const char *cp, size_t n);
+MOCK_DECL(int, tor_tls_write, (tor_tls_t *tls, const char *cp, size_t n));
 int tor_tls_handshake(tor_tls_t *tls);
 int tor_tls_finish_handshake(tor_tls_t *tls);
 int tor_tls_renegotiate(tor_tls_t *tls);
@@ -87,7 +94,7 @@ void tor_tls_block_renegotiation(tor_tls_t *tls);
 void tor_tls_assert_renegotiation_unblocked(tor_tls_t *tls);
 int tor_tls_shutdown(tor_tls_t *tls);
 int tor_tls_get_pending_bytes(tor_tls_t *tls);
-size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
+MOCK_DECL(size_t, tor_tls_get_forced_write_size, (tor_tls_t *tls));
 
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
                              size_t *n_read, size_t *n_written);
@@ -33,6 +33,10 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
+  /** Number of threads that haven't exited yet. */
+  int n_threads_running;
+  /** True iff threadpool_free() has told the threads to exit. */
+  int exiting;
   /** Mutex to protect all the above fields. */
   tor_mutex_t lock;
 
@@ -163,6 +167,24 @@ worker_thread_has_work(workerthread_t *thread)
     thread->generation != thread->in_pool->generation;
 }
 
+/** Called in a worker thread, without holding the pool's lock, when the
+ * thread is about to exit: free its state, and tell threadpool_free() that
+ * it's gone.  The thread must not touch the pool after calling this. */
+static void
+worker_thread_exit(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  if (pool->free_thread_state_fn)
+    pool->free_thread_state_fn(thread->state);
+  thread->state = NULL;
+
+  tor_mutex_acquire(&pool->lock);
+  --pool->n_threads_running;
+  /* threadpool_free() waits on the same condition as the workers. */
+  tor_cond_signal_all(&pool->condition);
+  tor_mutex_release(&pool->lock);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -175,9 +197,9 @@ worker_thread_main(void *thread_)
   int result;
 
   tor_mutex_acquire(&pool->lock);
-  while (1) {
+  while (! pool->exiting) {
     /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
+    while (! pool->exiting && worker_thread_has_work(thread)) {
       /* lock must be held at this point. */
       if (thread->in_pool->generation != thread->generation) {
         void *arg = thread->in_pool->update_args[thread->index];
@@ -189,6 +211,7 @@ worker_thread_main(void *thread_)
         int r = update_fn(thread->state, arg);
 
         if (r < 0) {
+          worker_thread_exit(thread);
           return;
         }
 
@@ -209,12 +232,15 @@ worker_thread_main(void *thread_)
 
       /* We may need to exit the thread. */
       if (result >= WQ_RPL_ERROR) {
+        worker_thread_exit(thread);
         return;
       }
       tor_mutex_acquire(&pool->lock);
     }
     /* At this point the lock is held, and there is no work in this thread's
      * queue. */
+    if (pool->exiting)
+      break;
 
     /* TODO: support an idle-function */
 
@@ -223,6 +249,8 @@ worker_thread_main(void *thread_)
       log_warn(LD_GENERAL, "Fail tor_cond_wait.");
     }
   }
+  tor_mutex_release(&pool->lock);
+  worker_thread_exit(thread);
 }
 
 /** Put a reply on the reply queue.  The reply must not currently be on
@@ -387,6 +415,7 @@ threadpool_start_threads(threadpool_t *pool, int n)
     }
     thr->index = pool->n_threads;
     pool->threads[pool->n_threads++] = thr;
+    ++pool->n_threads_running;
   }
   tor_mutex_release(&pool->lock);
 
@@ -428,6 +457,50 @@ threadpool_new(int n_threads,
   return pool;
 }
 
+/**
+ * Tell every thread in <b>pool</b> to exit once it's done with the work it
+ * is running now, wait for them all to exit, and release all storage held
+ * by <b>pool</b>.  Work that no thread has started is discarded without
+ * running its reply function.  Replies that the threads have already
+ * queued stay on the pool's reply queue.
+ */
+void
+threadpool_free(threadpool_t *pool)
+{
+  int i;
+  if (!pool)
+    return;
+
+  tor_mutex_acquire(&pool->lock);
+  pool->exiting = 1;
+  tor_cond_signal_all(&pool->condition);
+  while (pool->n_threads_running > 0) {
+    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  while (!TOR_TAILQ_EMPTY(&pool->work)) {
+    workqueue_entry_t *ent = TOR_TAILQ_FIRST(&pool->work);
+    TOR_TAILQ_REMOVE(&pool->work, ent, next_work);
+    workqueue_entry_free(ent);
+  }
+  tor_mutex_release(&pool->lock);
+
+  for (i = 0; i < pool->n_threads; ++i)
+    tor_free(pool->threads[i]);
+  tor_free(pool->threads);
+  if (pool->update_args) {
+    for (i = 0; i < pool->n_threads; ++i) {
+      if (pool->update_args[i] && pool->free_update_arg_fn)
+        pool->free_update_arg_fn(pool->update_args[i]);
+    }
+    tor_free(pool->update_args);
+  }
+  tor_cond_uninit(&pool->condition);
+  tor_mutex_uninit(&pool->lock);
+  tor_free(pool);
+}
+
 /** Return the reply queue associated with a given thread pool. */
 replyqueue_t *
 threadpool_get_replyqueue(threadpool_t *tp)
@@ -456,6 +529,26 @@ replyqueue_new(uint32_t alertsocks_flags)
   return rq;
 }
 
+/**
+ * Release all storage held by the reply queue <b>rq</b>, discarding any
+ * replies on it without running their reply functions.  No thread pool may
+ * still be using <b>rq</b>.
+ */
+void
+replyqueue_free(replyqueue_t *rq)
+{
+  if (!rq)
+    return;
+  while (!TOR_TAILQ_EMPTY(&rq->answers)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&rq->answers);
+    TOR_TAILQ_REMOVE(&rq->answers, work, next_work);
+    workqueue_entry_free(work);
+  }
+  alert_sockets_close(&rq->alert);
+  tor_mutex_uninit(&rq->lock);
+  tor_free(rq);
+}
+
 /**
  * Return the "read socket" for a given reply queue.  The main thread should
  * listen for read events on this socket, and call replyqueue_process() every
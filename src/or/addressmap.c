@@ -41,10 +41,18 @@
  * any address that ends with a . followed by the key for this entry will
  * get remapped by it.  If "dst_wildcard" is also true, then only the
  * matching suffix of such addresses will get replaced by new_address.
+ *
+ * Mappings that can expire are also kept in a priority queue ordered by
+ * expiry time, so that addressmap_clean() needn't look at the rest.
  */
 typedef struct {
+  /** The address this entry is stored under in the addressmap. */
+  char *address;
   char *new_address;
   time_t expires;
+  /** Index of this entry in addressmap_expiry_pqueue, or -1 if it isn't
+   * there. */
+  int expiry_idx;
   addressmap_entry_source_bitfield_t source:3;
   unsigned src_wildcard:1;
   unsigned dst_wildcard:1;
@@ -61,6 +69,15 @@ typedef struct {
 /** A hash table to store client-side address rewrite instructions. */
 static strmap_t *addressmap=NULL;
 
+/** Priority queue of the addressmap_entry_t objects in addressmap that
+ * can expire (those with expires > 1), soonest first. */
+static smartlist_t *addressmap_expiry_pqueue=NULL;
+
+/** How many entries in addressmap have src_wildcard set?  When there are
+ * none, we needn't look up the superdomains of each address we
+ * rewrite. */
+static int n_wildcard_entries=0;
+
 /**
  * Table mapping addresses to which virtual address, if any, we
  * assigned them to.
@@ -79,6 +96,51 @@ addressmap_init(void)
 {
   addressmap = strmap_new();
   virtaddress_reversemap = strmap_new();
+  addressmap_expiry_pqueue = smartlist_new();
+}
+
+/** Helper for the expiry priority queue: compare addressmap entries by
+ * expiry time. */
+static int
+compare_addressmap_ents_by_expiry_(const void *_a, const void *_b)
+{
+  const addressmap_entry_t *a = _a, *b = _b;
+  if (a->expires < b->expires)
+    return -1;
+  else if (a->expires == b->expires)
+    return 0;
+  else
+    return 1;
+}
+
+/** Make and return a new addressmap entry for <b>address</b>, with no
+ * mapping, and add it to the addressmap. */
+static addressmap_entry_t *
+addressmap_ent_new(const char *address)
+{
+  addressmap_entry_t *ent = tor_malloc_zero(sizeof(addressmap_entry_t));
+  ent->address = tor_strdup(address);
+  ent->expiry_idx = -1;
+  strmap_set(addressmap, address, ent);
+  return ent;
+}
+
+/** Set the expiry time of <b>ent</b> to <b>expires</b>, and keep the
+ * expiry priority queue up to date. */
+static void
+addressmap_ent_set_expires(addressmap_entry_t *ent, time_t expires)
+{
+  if (ent->expiry_idx >= 0)
+    smartlist_pqueue_remove(addressmap_expiry_pqueue,
+                            compare_addressmap_ents_by_expiry_,
+                            STRUCT_OFFSET(addressmap_entry_t, expiry_idx),
+                            ent);
+  ent->expires = expires;
+  if (expires > 1)
+    smartlist_pqueue_add(addressmap_expiry_pqueue,
+                         compare_addressmap_ents_by_expiry_,
+                         STRUCT_OFFSET(addressmap_entry_t, expiry_idx),
+                         ent);
 }
 
 /** Free the memory associated with the addressmap entry <b>_ent</b>. */
@@ -90,6 +152,7 @@ addressmap_ent_free(void *_ent)
     return;
 
   ent = _ent;
+  tor_free(ent->address);
   tor_free(ent->new_address);
   tor_free(ent);
 }
@@ -140,6 +203,9 @@ static void
 addressmap_ent_remove(const char *address, addressmap_entry_t *ent)
 {
   addressmap_virtaddress_remove(address, ent);
+  addressmap_ent_set_expires(ent, 0);
+  if (ent->src_wildcard)
+    --n_wildcard_entries;
   addressmap_ent_free(ent);
 }
 
@@ -294,7 +360,18 @@ addressmap_clear_transient(void)
 void
 addressmap_clean(time_t now)
 {
-  addressmap_get_mappings(NULL, 2, now, 0);
+  addressmap_entry_t *ent;
+
+  if (!addressmap_expiry_pqueue)
+    return;
+
+  while (smartlist_len(addressmap_expiry_pqueue)) {
+    ent = smartlist_get(addressmap_expiry_pqueue, 0);
+    if (ent->expires >= now)
+      break;
+    strmap_remove(addressmap, ent->address);
+    addressmap_ent_remove(ent->address, ent);
+  }
 }
 
 /** Free all the elements in the addressmap, and free the addressmap
@@ -304,6 +381,9 @@ addressmap_free_all(void)
 {
   strmap_free(addressmap, addressmap_ent_free);
   addressmap = NULL;
+  smartlist_free(addressmap_expiry_pqueue);
+  addressmap_expiry_pqueue = NULL;
+  n_wildcard_entries = 0;
 
   strmap_free(virtaddress_reversemap, addressmap_virtaddress_ent_free);
   virtaddress_reversemap = NULL;
@@ -323,21 +403,28 @@ addressmap_free_all(void)
 static addressmap_entry_t *
 addressmap_match_superdomains(char *address)
 {
-  addressmap_entry_t *val;
-  char *cp;
+  addressmap_entry_t *val = NULL;
+  char *lc, *cp;
+
+  if (!n_wildcard_entries)
+    return NULL;
 
-  cp = address;
+  lc = tor_strdup(address);
+  tor_strlower(lc);
+  cp = lc;
   while ((cp = strchr(cp, '.'))) {
     /* cp now points to a suffix of address that begins with a . */
-    val = strmap_get_lc(addressmap, cp+1);
+    val = strmap_get(addressmap, cp+1);
     if (val && val->src_wildcard) {
       if (val->dst_wildcard)
-        *cp = '\0';
-      return val;
+        address[cp - lc] = '\0';
+      break;
     }
+    val = NULL;
     ++cp;
   }
-  return NULL;
+  tor_free(lc);
+  return val;
 }
 
 /** Look at address, and rewrite it until it doesn't want any
@@ -364,14 +451,17 @@ addressmap_rewrite(char *address, size_t maxlen,
   int rewrites;
   time_t expires = TIME_MAX;
   addressmap_entry_source_t exit_source = ADDRMAPSRC_NONE;
-  char *addr_orig = tor_strdup(address);
+  const int orig_is_exit = !strcmpend(address, ".exit");
   char *log_addr_orig = NULL;
 
   for (rewrites = 0; rewrites < 16; rewrites++) {
     int exact_match = 0;
-    log_addr_orig = tor_strdup(escaped_safe_str_client(address));
 
     ent = strmap_get(addressmap, address);
+    /* Only remember the address for logging once we know there's a
+     * mapping for it; most lookups find nothing. */
+    if (ent || n_wildcard_entries)
+      log_addr_orig = tor_strdup(escaped_safe_str_client(address));
 
     if (!ent || !ent->new_address) {
       ent = addressmap_match_superdomains(address);
@@ -430,7 +520,7 @@ addressmap_rewrite(char *address, size_t maxlen,
     }
 
     if (!strcmpend(address, ".exit") &&
-        strcmpend(addr_orig, ".exit") &&
+        !orig_is_exit &&
         exit_source == ADDRMAPSRC_NONE) {
       exit_source = ent->source;
     }
@@ -448,7 +538,6 @@ addressmap_rewrite(char *address, size_t maxlen,
   /* it's fine to rewrite a rewrite, but don't loop forever */
 
  done:
-  tor_free(addr_orig);
   tor_free(log_addr_orig);
   if (exit_source_out)
     *exit_source_out = exit_source;
@@ -510,7 +599,7 @@ addressmap_have_mapping(const char *address, int update_expiry)
   if (!(ent=strmap_get_lc(addressmap, address)))
     return 0;
   if (update_expiry && ent->source==ADDRMAPSRC_TRACKEXIT)
-    ent->expires=time(NULL) + update_expiry;
+    addressmap_ent_set_expires(ent, time(NULL) + update_expiry);
   return 1;
 }
 
@@ -559,8 +648,7 @@ addressmap_register(const char *address, char *new_address, time_t expires,
     return;
   }
   if (!ent) { /* make a new one and register it */
-    ent = tor_malloc_zero(sizeof(addressmap_entry_t));
-    strmap_set(addressmap, address, ent);
+    ent = addressmap_ent_new(address);
   } else if (ent->new_address) { /* we need to clean up the old mapping. */
     if (expires > 1) {
       log_info(LD_APP,"Temporary addressmap ('%s' to '%s') not performed, "
@@ -581,11 +669,15 @@ addressmap_register(const char *address, char *new_address, time_t expires,
   } /* else { we have an in-progress resolve with no mapping. } */
 
   ent->new_address = new_address;
-  ent->expires = expires==2 ? 1 : expires;
+  addressmap_ent_set_expires(ent, expires==2 ? 1 : expires);
   ent->num_resolve_failures = 0;
   ent->source = source;
+  if (ent->src_wildcard)
+    --n_wildcard_entries;
   ent->src_wildcard = wildcard_addr ? 1 : 0;
   ent->dst_wildcard = wildcard_new_addr ? 1 : 0;
+  if (ent->src_wildcard)
+    ++n_wildcard_entries;
 
   log_info(LD_CONFIG, "Addressmap: (re)mapped '%s' to '%s'",
            safe_str_client(address),
@@ -602,9 +694,8 @@ client_dns_incr_failures(const char *address)
 {
   addressmap_entry_t *ent = strmap_get(addressmap, address);
   if (!ent) {
-    ent = tor_malloc_zero(sizeof(addressmap_entry_t));
-    ent->expires = time(NULL) + MAX_DNS_ENTRY_AGE;
-    strmap_set(addressmap,address,ent);
+    ent = addressmap_ent_new(address);
+    addressmap_ent_set_expires(ent, time(NULL) + MAX_DNS_ENTRY_AGE);
   }
   if (ent->num_resolve_failures < SHORT_MAX)
     ++ent->num_resolve_failures; /* don't overflow */
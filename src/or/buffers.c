@@ -64,6 +64,8 @@ static int parse_socks(const char *data, size_t datalen, socks_request_t *req,
 static int parse_socks_client(const uint8_t *data, size_t datalen,
                               int state, char **reason,
                               ssize_t *drain_out);
+static INLINE void peek_from_buf(char *string, size_t string_len,
+                                 const buf_t *buf);
 
 /* Chunk manipulation functions */
 
@@ -656,6 +658,31 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+/** The largest amount of plaintext that fits in a single TLS record. */
+#define TLS_RECORD_MAX_PLAINTEXT 16384
+
+/** How many calls to tor_tls_write() have flush_buf_tls() made that
+ * succeeded? */
+static uint64_t n_tls_flush_writes = 0;
+/** How many of those writes combined data from more than one chunk? */
+static uint64_t n_tls_flush_coalesced = 0;
+/** How many bytes have those writes sent? */
+static uint64_t n_tls_flush_bytes = 0;
+
+/** Helper for flush_buf_tls(): note that a write of <b>r</b> bytes
+ * succeeded.  If <b>coalesced</b>, the bytes came from more than one
+ * chunk. */
+static INLINE void
+note_tls_flush(int r, int coalesced)
+{
+  if (r <= 0)
+    return;
+  ++n_tls_flush_writes;
+  n_tls_flush_bytes += r;
+  if (coalesced)
+    ++n_tls_flush_coalesced;
+}
+
 /** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
  * more if there is a forced pending write size.)  On success, deduct the
@@ -683,6 +710,7 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
   r = tor_tls_write(tls, data, sz);
   if (r < 0)
     return r;
+  note_tls_flush(r, 0);
   if (*buf_flushlen > (size_t)r)
     *buf_flushlen -= r;
   else
@@ -693,6 +721,67 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
   return r;
 }
 
+/** Set *<b>n_writes_out</b>, *<b>n_bytes_out</b>, and
+ * *<b>n_coalesced_out</b> to the number of TLS writes we have made from
+ * connection buffers, the number of bytes they carried, and the number of
+ * them that combined more than one buffer chunk.  Each write turns into at
+ * least one TLS record, so a low byte count per write means we are paying
+ * for a lot of record framing. */
+void
+buf_get_tls_flush_stats(uint64_t *n_writes_out, uint64_t *n_bytes_out,
+                        uint64_t *n_coalesced_out)
+{
+  *n_writes_out = n_tls_flush_writes;
+  *n_bytes_out = n_tls_flush_bytes;
+  *n_coalesced_out = n_tls_flush_coalesced;
+}
+
+/** Helper for flush_buf_tls(): the first chunk of <b>buf</b> is too small
+ * to fill a TLS record, but more data is waiting behind it.  Copy up to
+ * <b>sz</b> bytes (and at least any forced pending write size) into one
+ * contiguous block, and write them with a single call to tor_tls_write(),
+ * so that a backlogged connection sends full-sized records rather than one
+ * small record per chunk.  On success, deduct the bytes written from
+ * *<b>buf_flushlen</b>.  Return the number of bytes written on success, and
+ * a TOR_TLS error code on failure or blocking.
+ *
+ * If the write blocks, OpenSSL wants the same bytes again next time; we
+ * haven't removed anything from <b>buf</b>, so we will copy the same data
+ * on the retry, and the TLS object has SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+ * set.
+ */
+static int
+flush_coalesced_tls(tor_tls_t *tls, buf_t *buf, size_t sz,
+                    size_t *buf_flushlen)
+{
+  char data[TLS_RECORD_MAX_PLAINTEXT];
+  size_t forced;
+  int r;
+
+  forced = tor_tls_get_forced_write_size(tls);
+  if (forced > sz)
+    sz = forced;
+  if (sz > sizeof(data))
+    sz = sizeof(data);
+  if (sz > buf->datalen)
+    sz = buf->datalen;
+  tor_assert(forced <= sz);
+
+  peek_from_buf(data, sz, buf);
+  r = tor_tls_write(tls, data, sz);
+  if (r < 0)
+    return r;
+  note_tls_flush(r, 1);
+  if (*buf_flushlen > (size_t)r)
+    *buf_flushlen -= r;
+  else
+    *buf_flushlen = 0;
+  buf_remove_from_front(buf, r);
+  log_debug(LD_NET,"flushed %d coalesced bytes, %d ready to flush, "
+            "%d remain.", r,(int)*buf_flushlen,(int)buf->datalen);
+  return r;
+}
+
 /** Write data from <b>buf</b> to the socket <b>s</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -736,6 +825,10 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
 
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
+ *
+ * We never hold data back waiting for more to arrive: whatever is ready
+ * goes out now.  But when several small chunks are queued, we hand them to
+ * TLS together so that they share a record.
  */
 int
 flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
@@ -755,7 +848,7 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
 
   check();
   do {
-    size_t flushlen0;
+    size_t flushlen0, forced;
     if (buf->head) {
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
@@ -765,7 +858,17 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
       flushlen0 = 0;
     }
 
-    r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
+    forced = tor_tls_get_forced_write_size(tls);
+    if (buf->head && buf->head->next &&
+        flushlen0 < TLS_RECORD_MAX_PLAINTEXT &&
+        forced <= TLS_RECORD_MAX_PLAINTEXT &&
+        ((ssize_t)flushlen0 < sz || forced > buf->head->datalen)) {
+      /* The first chunk won't fill a record by itself, and there's more
+       * to send behind it (or a blocked coalesced write to retry). */
+      r = flush_coalesced_tls(tls, buf, (size_t)sz, buf_flushlen);
+    } else {
+      r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
+    }
     check();
     if (r < 0)
       return r;
@@ -25,6 +25,8 @@
 #include "config.h"
 #include "connection_or.h" /* For var_cell_free() */
 #include "circuitmux.h"
+#include "circuitmux_drr.h"
+#include "circuitmux_ewma.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "nodelist.h"
@@ -2994,6 +2996,43 @@ channel_set_cmux_policy_everywhere(circuitmux_policy_t *pol)
   } SMARTLIST_FOREACH_END(curr);
 }
 
+/**
+ * Return the cmux policy that newly created channels should use, or NULL
+ * if they should just round-robin between their circuits.
+ */
+
+circuitmux_policy_t *
+channel_get_default_cmux_policy(void)
+{
+  circuitmux_policy_t *pol = cell_drr_get_policy();
+
+  if (!pol && cell_ewma_enabled())
+    pol = &ewma_policy;
+
+  return pol;
+}
+
+/**
+ * Recompute the cmux policy parameters from <b>options</b> and
+ * <b>consensus</b>, and switch all active channels over if that changed
+ * which policy we want.
+ */
+
+void
+channel_update_cmux_policy(const or_options_t *options,
+                           const networkstatus_t *consensus)
+{
+  circuitmux_policy_t *old_pol = channel_get_default_cmux_policy();
+  circuitmux_policy_t *new_pol;
+
+  cell_ewma_set_scale_factor(options, consensus);
+  cell_drr_set_parameters(options, consensus);
+
+  new_pol = channel_get_default_cmux_policy();
+  if (new_pol != old_pol)
+    channel_set_cmux_policy_everywhere(new_pol);
+}
+
 /**
  * Clean up channels
  *
@@ -351,6 +351,9 @@ void channel_listener_dumpstats(int severity);
 
 /* Set the cmux policy on all active channels */
 void channel_set_cmux_policy_everywhere(circuitmux_policy_t *pol);
+circuitmux_policy_t *channel_get_default_cmux_policy(void);
+void channel_update_cmux_policy(const or_options_t *options,
+                                const networkstatus_t *consensus);
 
 #ifdef TOR_CHANNEL_INTERNAL_
 
@@ -19,7 +19,6 @@
 #include "channel.h"
 #include "channeltls.h"
 #include "circuitmux.h"
-#include "circuitmux_ewma.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
@@ -130,9 +129,7 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  if (cell_ewma_enabled()) {
-    circuitmux_set_policy(chan->cmux, &ewma_policy);
-  }
+  circuitmux_set_policy(chan->cmux, channel_get_default_cmux_policy());
 }
 
 /**
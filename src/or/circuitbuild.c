@@ -1490,31 +1490,6 @@ circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
   return enough;
 }
 
-/** Return 1 if <b>node</b> can handle one or more of the ports in
- * <b>needed_ports</b>, else return 0.
- */
-static int
-node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
-{ /* XXXX MOVE */
-  int i;
-  uint16_t port;
-
-  for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
-    /* alignment issues aren't a worry for this dereference, since
-       needed_ports is explicitly a smartlist of uint16_t's */
-    port = *(uint16_t *)smartlist_get(needed_ports, i);
-    tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
-      return 1;
-  }
-  return 0;
-}
-
 /** Return true iff <b>conn</b> needs another general circuit to be
  * built. */
 static int
@@ -1691,6 +1666,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 
     int attempt;
     smartlist_t *needed_ports, *supporting;
+    bitarray_t *handles_needed_port;
 
     if (best_support == -1) {
       if (need_uptime || need_capacity) {
@@ -1708,12 +1684,14 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     }
     supporting = smartlist_new();
     needed_ports = circuit_get_unhandled_ports(time(NULL));
+    handles_needed_port = nodelist_get_nodes_exiting_to_some_port(
+                                                              needed_ports);
     for (attempt = 0; attempt < 2; attempt++) {
       /* try once to pick only from routers that satisfy a needed port,
        * then if there are none, pick from any that support exiting. */
       SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
         if (n_supported[node_sl_idx] != -1 &&
-            (attempt || node_handles_some_port(node, needed_ports))) {
+            (attempt || bitarray_is_set(handles_needed_port, node_sl_idx))) {
 //          log_fn(LOG_DEBUG,"Try %d: '%s' is a possibility.",
 //                 try, router->nickname);
           smartlist_add(supporting, (void*)node);
@@ -1732,6 +1710,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     SMARTLIST_FOREACH(needed_ports, uint16_t *, cp, tor_free(cp));
     smartlist_free(needed_ports);
     smartlist_free(supporting);
+    bitarray_free(handles_needed_port);
   }
 
   tor_free(n_supported);
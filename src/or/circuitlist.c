@@ -18,6 +18,7 @@
 #include "circuitstats.h"
 #include "connection.h"
 #include "config.h"
+#include "congestion.h"
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
@@ -810,6 +811,8 @@ circuit_free(circuit_t *circ)
 
   extend_info_free(circ->n_hop);
   tor_free(circ->n_chan_create_cell);
+  circuit_cc_free(circ->cc);
+  circ->cc = NULL;
 
   if (circ->global_circuitlist_idx != -1) {
     int idx = circ->global_circuitlist_idx;
@@ -924,6 +927,7 @@ circuit_free_cpath_node(crypt_path_t *victim)
   onion_handshake_state_release(&victim->handshake_state);
   crypto_dh_free(victim->rend_dh_handshake_state);
   extend_info_free(victim->extend_info);
+  circuit_cc_free(victim->cc);
 
   memwipe(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
   tor_free(victim);
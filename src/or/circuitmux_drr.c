@@ -0,0 +1,523 @@
+/* * Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_drr.c
+ * \brief Deficit round-robin circuit selection as a circuitmux_t policy
+ *
+ * Active circuits are kept in a ring.  The circuit at the head of the ring
+ * may send cells until it has used up its deficit counter; then it moves to
+ * the tail and its counter is refilled with one quantum.  Circuits that go
+ * idle lose whatever deficit they had left, as in classic DRR.
+ *
+ * Since all cells have the same size, a quantum of one cell degenerates to
+ * the plain round-robin that we use when no policy is installed.  Larger
+ * quanta let a backlogged circuit send a burst of cells at a time, which
+ * trades some interactive latency for fewer switches between circuits.
+ *
+ * The weighted variant (WDRR) scales each circuit's quantum by a weight
+ * that depends on which way its cells are going on this channel, so that
+ * operators can favour the exitward direction (mostly requests and
+ * SENDMEs) over the clientward one (mostly bulk downloads).
+ **/
+
+#define TOR_CIRCUITMUX_DRR_C_
+
+#include "or.h"
+#include "circuitmux.h"
+#include "circuitmux_drr.h"
+#include "config.h"
+#include "networkstatus.h"
+
+/*** DRR parameter #defines ***/
+
+/** The default quantum, in cells, if it hasn't been overridden by a
+ * consensus or a configuration setting. */
+#define DRR_DEFAULT_QUANTUM 4
+/** Largest quantum we accept from a consensus or configuration. */
+#define DRR_MAX_QUANTUM 1000
+
+/** Default WDRR weight for circuits whose cells travel towards the client
+ * on this channel. */
+#define WDRR_DEFAULT_IN_WEIGHT 1
+/** Default WDRR weight for circuits whose cells travel away from the client
+ * on this channel. */
+#define WDRR_DEFAULT_OUT_WEIGHT 2
+/** Largest WDRR weight we accept from a consensus. */
+#define WDRR_MAX_WEIGHT 100
+
+/*** DRR structures ***/
+
+typedef struct drr_policy_data_s drr_policy_data_t;
+typedef struct drr_policy_circ_data_s drr_policy_circ_data_t;
+
+struct drr_policy_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+
+  /**
+   * Pointer back to the circuit_t this is for, so that
+   * drr_pick_active_circuit() can return it.
+   */
+  circuit_t *circ;
+
+  /** Link in the active ring of the drr_policy_data_t that owns us. */
+  TOR_TAILQ_ENTRY(drr_policy_circ_data_s) active_entry;
+
+  /**
+   * How many more cells this circuit may send before it has to yield the
+   * head of the ring.  May go negative if we are told about more cells
+   * than we allowed; the overdraft is paid back from the next quantum.
+   */
+  int deficit;
+
+  /** True iff this circuit is currently in the active ring. */
+  unsigned int is_active : 1;
+  /** True iff this is the data for a circuit's previous channel. */
+  unsigned int is_for_p_chan : 1;
+};
+
+struct drr_policy_data_s {
+  circuitmux_policy_data_t base_;
+
+  /**
+   * Ring of drr_policy_circ_data_t for circuits with queued cells; the
+   * head of the ring is the circuit that we're currently serving.
+   */
+  TOR_TAILQ_HEAD(drr_active_ring_s, drr_policy_circ_data_s) active_ring;
+
+  /** True iff this cmux is using wdrr_policy rather than drr_policy. */
+  unsigned int weighted : 1;
+};
+
+#define DRR_POL_DATA_MAGIC 0x4dd2a05cU
+#define DRR_POL_CIRC_DATA_MAGIC 0x91c3be07U
+
+/*** Downcasts for the above types ***/
+
+/**
+ * Downcast a circuitmux_policy_data_t to a drr_policy_data_t and assert
+ * if the cast is impossible.
+ */
+
+static INLINE drr_policy_data_t *
+TO_DRR_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == DRR_POL_DATA_MAGIC);
+    return DOWNCAST(drr_policy_data_t, pol);
+  }
+}
+
+/**
+ * Downcast a circuitmux_policy_circ_data_t to a drr_policy_circ_data_t
+ * and assert if the cast is impossible.
+ */
+
+static INLINE drr_policy_circ_data_t *
+TO_DRR_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assert(pol->magic == DRR_POL_CIRC_DATA_MAGIC);
+    return DOWNCAST(drr_policy_circ_data_t, pol);
+  }
+}
+
+/*** Circuitmux policy methods ***/
+
+static circuitmux_policy_data_t * drr_alloc_cmux_data(circuitmux_t *cmux);
+static circuitmux_policy_data_t * wdrr_alloc_cmux_data(circuitmux_t *cmux);
+static void drr_free_cmux_data(circuitmux_t *cmux,
+                               circuitmux_policy_data_t *pol_data);
+static circuitmux_policy_circ_data_t *
+drr_alloc_circ_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+                    circuit_t *circ, cell_direction_t direction,
+                    unsigned int cell_count);
+static void
+drr_free_circ_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data,
+                   circuit_t *circ,
+                   circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+drr_notify_circ_active(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+drr_notify_circ_inactive(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data);
+static void
+drr_notify_xmit_cells(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      circuitmux_policy_circ_data_t *pol_circ_data,
+                      unsigned int n_cells);
+static circuit_t *
+drr_pick_active_circuit(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data);
+
+/*** DRR global variables ***/
+
+/** Number of cells a circuit may send each time it reaches the head of the
+ * active ring (before weighting). */
+static unsigned int drr_quantum = DRR_DEFAULT_QUANTUM;
+/** WDRR weight for circuits whose cells go towards the client. */
+static unsigned int wdrr_in_weight = WDRR_DEFAULT_IN_WEIGHT;
+/** WDRR weight for circuits whose cells go away from the client. */
+static unsigned int wdrr_out_weight = WDRR_DEFAULT_OUT_WEIGHT;
+/** Which DRR policy, if any, the configuration or consensus asked for. */
+static circuitmux_policy_t *drr_configured_policy = NULL;
+
+/*** DRR circuitmux_policy_t method tables ***/
+
+/* There's no meaningful order between two rings, so neither table has a
+ * cmp_cmux method and the scheduler treats all DRR channels as equal. */
+
+circuitmux_policy_t drr_policy = {
+  /*.alloc_cmux_data =*/ drr_alloc_cmux_data,
+  /*.free_cmux_data =*/ drr_free_cmux_data,
+  /*.alloc_circ_data =*/ drr_alloc_circ_data,
+  /*.free_circ_data =*/ drr_free_circ_data,
+  /*.notify_circ_active =*/ drr_notify_circ_active,
+  /*.notify_circ_inactive =*/ drr_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* DRR doesn't need this */
+  /*.notify_xmit_cells =*/ drr_notify_xmit_cells,
+  /*.pick_active_circuit =*/ drr_pick_active_circuit,
+  /*.cmp_cmux =*/ NULL
+};
+
+circuitmux_policy_t wdrr_policy = {
+  /*.alloc_cmux_data =*/ wdrr_alloc_cmux_data,
+  /*.free_cmux_data =*/ drr_free_cmux_data,
+  /*.alloc_circ_data =*/ drr_alloc_circ_data,
+  /*.free_circ_data =*/ drr_free_circ_data,
+  /*.notify_circ_active =*/ drr_notify_circ_active,
+  /*.notify_circ_inactive =*/ drr_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL,
+  /*.notify_xmit_cells =*/ drr_notify_xmit_cells,
+  /*.pick_active_circuit =*/ drr_pick_active_circuit,
+  /*.cmp_cmux =*/ NULL
+};
+
+/*** DRR helpers ***/
+
+/** Return the number of cells that the circuit with <b>cdata</b> on the
+ * cmux with <b>pol</b> gets each time around the ring. */
+static unsigned int
+drr_circ_quantum(const drr_policy_data_t *pol,
+                 const drr_policy_circ_data_t *cdata)
+{
+  if (!pol->weighted)
+    return drr_quantum;
+
+  return drr_quantum * (cdata->is_for_p_chan ?
+                        wdrr_in_weight : wdrr_out_weight);
+}
+
+/*** DRR method implementations ***/
+
+/** Helper: allocate a drr_policy_data_t, weighted or not. */
+static drr_policy_data_t *
+drr_policy_data_new(int weighted)
+{
+  drr_policy_data_t *pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = DRR_POL_DATA_MAGIC;
+  TOR_TAILQ_INIT(&pol->active_ring);
+  pol->weighted = weighted ? 1 : 0;
+  return pol;
+}
+
+/**
+ * Allocate a drr_policy_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to drr_policy.
+ */
+
+static circuitmux_policy_data_t *
+drr_alloc_cmux_data(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  return TO_CMUX_POL_DATA(drr_policy_data_new(0));
+}
+
+/**
+ * As drr_alloc_cmux_data(), but for wdrr_policy.
+ */
+
+static circuitmux_policy_data_t *
+wdrr_alloc_cmux_data(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  return TO_CMUX_POL_DATA(drr_policy_data_new(1));
+}
+
+/**
+ * Free a drr_policy_data_t allocated with drr_alloc_cmux_data() or
+ * wdrr_alloc_cmux_data().
+ */
+
+static void
+drr_free_cmux_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data)
+{
+  drr_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_DRR_POL_DATA(pol_data);
+
+  tor_free(pol);
+}
+
+/**
+ * Allocate a drr_policy_circ_data_t and upcast it to a
+ * circuitmux_policy_circ_data_t; this is called when attaching a circuit
+ * to a circuitmux_t with drr_policy or wdrr_policy.
+ */
+
+static circuitmux_policy_circ_data_t *
+drr_alloc_circ_data(circuitmux_t *cmux,
+                    circuitmux_policy_data_t *pol_data,
+                    circuit_t *circ,
+                    cell_direction_t direction,
+                    unsigned int cell_count)
+{
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(direction == CELL_DIRECTION_OUT ||
+             direction == CELL_DIRECTION_IN);
+  /* Shut the compiler up without triggering -Wtautological-compare */
+  (void)cell_count;
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = DRR_POL_CIRC_DATA_MAGIC;
+  cdata->circ = circ;
+  cdata->is_for_p_chan = (direction == CELL_DIRECTION_IN) ? 1 : 0;
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/**
+ * Free a drr_policy_circ_data_t allocated with drr_alloc_circ_data()
+ */
+
+static void
+drr_free_circ_data(circuitmux_t *cmux,
+                   circuitmux_policy_data_t *pol_data,
+                   circuit_t *circ,
+                   circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  drr_policy_data_t *pol = NULL;
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  pol = TO_DRR_POL_DATA(pol_data);
+  cdata = TO_DRR_POL_CIRC_DATA(pol_circ_data);
+  /* The circuitmux should have made us inactive already, but don't leave a
+   * dangling pointer in the ring if it didn't. */
+  if (cdata->is_active) {
+    TOR_TAILQ_REMOVE(&pol->active_ring, cdata, active_entry);
+    cdata->is_active = 0;
+  }
+
+  tor_free(cdata);
+}
+
+/**
+ * Handle circuit activation; this gives the circuit a fresh quantum and
+ * puts it at the tail of the active ring.
+ */
+
+static void
+drr_notify_circ_active(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  drr_policy_data_t *pol = NULL;
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_DRR_POL_DATA(pol_data);
+  cdata = TO_DRR_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(!cdata->is_active);
+
+  cdata->deficit = (int)drr_circ_quantum(pol, cdata);
+  cdata->is_active = 1;
+  TOR_TAILQ_INSERT_TAIL(&pol->active_ring, cdata, active_entry);
+}
+
+/**
+ * Handle circuit deactivation; this removes the circuit from the active
+ * ring and forgets its deficit.
+ */
+
+static void
+drr_notify_circ_inactive(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  drr_policy_data_t *pol = NULL;
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_DRR_POL_DATA(pol_data);
+  cdata = TO_DRR_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(cdata->is_active);
+
+  TOR_TAILQ_REMOVE(&pol->active_ring, cdata, active_entry);
+  cdata->is_active = 0;
+  cdata->deficit = 0;
+}
+
+/**
+ * Charge the circuit for the cells we just sent; if it has used up its
+ * deficit, move it to the tail of the ring and top it up with one more
+ * quantum.
+ */
+
+static void
+drr_notify_xmit_cells(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      circuitmux_policy_circ_data_t *pol_circ_data,
+                      unsigned int n_cells)
+{
+  drr_policy_data_t *pol = NULL;
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_DRR_POL_DATA(pol_data);
+  cdata = TO_DRR_POL_CIRC_DATA(pol_circ_data);
+
+  /* We only ever hand out the head of the ring, so that's who sent. */
+  tor_assert(cdata->is_active);
+  tor_assert(TOR_TAILQ_FIRST(&pol->active_ring) == cdata);
+
+  cdata->deficit -= (int)n_cells;
+  if (cdata->deficit <= 0) {
+    TOR_TAILQ_REMOVE(&pol->active_ring, cdata, active_entry);
+    TOR_TAILQ_INSERT_TAIL(&pol->active_ring, cdata, active_entry);
+    cdata->deficit += (int)drr_circ_quantum(pol, cdata);
+  }
+}
+
+/**
+ * Pick the preferred circuit to send from; this is always the head of the
+ * active ring.
+ */
+
+static circuit_t *
+drr_pick_active_circuit(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data)
+{
+  drr_policy_data_t *pol = NULL;
+  drr_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_DRR_POL_DATA(pol_data);
+  cdata = TOR_TAILQ_FIRST(&pol->active_ring);
+
+  return cdata ? cdata->circ : NULL;
+}
+
+/*** Parameters ***/
+
+/** Return the DRR policy that should be installed on channels, or NULL if
+ * neither DRR variant is in use. */
+circuitmux_policy_t *
+cell_drr_get_policy(void)
+{
+  return drr_configured_policy;
+}
+
+/** Return the current per-round quantum, in cells. */
+unsigned int
+cell_drr_get_quantum(void)
+{
+  return drr_quantum;
+}
+
+/** Adjust the DRR policy choice, quantum and weights based on
+ * <b>options</b> and <b>consensus</b>. */
+void
+cell_drr_set_parameters(const or_options_t *options,
+                        const networkstatus_t *consensus)
+{
+  int32_t policy_param;
+  const char *source;
+
+  if (options && options->CircuitMuxPolicy_parsed != CMUX_POLICY_AUTO) {
+    policy_param = options->CircuitMuxPolicy_parsed == CMUX_POLICY_DRR ? 1 :
+      options->CircuitMuxPolicy_parsed == CMUX_POLICY_WDRR ? 2 : 0;
+    source = "CircuitMuxPolicy in configuration";
+  } else {
+    policy_param = networkstatus_get_param(consensus, "CircuitMuxPolicy",
+                                           0, 0, 2);
+    source = "CircuitMuxPolicy in consensus";
+  }
+
+  if (options && options->CircuitMuxQuantum > 0) {
+    drr_quantum = (unsigned) MIN(options->CircuitMuxQuantum, DRR_MAX_QUANTUM);
+  } else {
+    drr_quantum = (unsigned) networkstatus_get_param(consensus,
+                                              "CircuitMuxQuantum",
+                                              DRR_DEFAULT_QUANTUM,
+                                              1, DRR_MAX_QUANTUM);
+  }
+  wdrr_in_weight = (unsigned) networkstatus_get_param(consensus,
+                                                 "CircuitMuxWDRRInWeight",
+                                                 WDRR_DEFAULT_IN_WEIGHT,
+                                                 1, WDRR_MAX_WEIGHT);
+  wdrr_out_weight = (unsigned) networkstatus_get_param(consensus,
+                                                  "CircuitMuxWDRROutWeight",
+                                                  WDRR_DEFAULT_OUT_WEIGHT,
+                                                  1, WDRR_MAX_WEIGHT);
+
+  switch (policy_param) {
+    case 1:
+      drr_configured_policy = &drr_policy;
+      log_info(LD_OR, "Enabled cell DRR algorithm because of value in %s; "
+               "quantum is %u cells", source, drr_quantum);
+      break;
+    case 2:
+      drr_configured_policy = &wdrr_policy;
+      log_info(LD_OR, "Enabled cell WDRR algorithm because of value in %s; "
+               "quantum is %u cells, weights are %u in / %u out",
+               source, drr_quantum, wdrr_in_weight, wdrr_out_weight);
+      break;
+    default:
+      drr_configured_policy = NULL;
+      break;
+  }
+}
+
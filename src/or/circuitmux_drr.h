@@ -0,0 +1,30 @@
+/* * Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_drr.h
+ * \brief Header file for circuitmux_drr.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_DRR_H
+#define TOR_CIRCUITMUX_DRR_H
+
+#include "or.h"
+#include "circuitmux.h"
+
+/* Everything but circuitmux_drr.c should see these externs */
+#ifndef TOR_CIRCUITMUX_DRR_C_
+
+extern circuitmux_policy_t drr_policy;
+extern circuitmux_policy_t wdrr_policy;
+
+#endif /* !(TOR_CIRCUITMUX_DRR_C_) */
+
+/* Externally visible DRR functions */
+circuitmux_policy_t *cell_drr_get_policy(void);
+unsigned int cell_drr_get_quantum(void);
+void cell_drr_set_parameters(const or_options_t *options,
+                             const networkstatus_t *consensus);
+
+#endif /* TOR_CIRCUITMUX_DRR_H */
+
@@ -653,6 +653,15 @@ get_scale_factor(unsigned from_tick, unsigned to_tick)
   return pow(ewma_scale_factor, diff);
 }
 
+/** Return the multiplier necessary to convert the value of a cell sent in
+ * <b>from_tick</b> to one sent in <b>to_tick</b>, for EWMAs that should
+ * decay at the same rate as circuits' cell counts. */
+double
+cell_ewma_get_scale_factor(unsigned from_tick, unsigned to_tick)
+{
+  return get_scale_factor(from_tick, to_tick);
+}
+
 /** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
  * <b>cur_tick</b> */
 static void
@@ -22,6 +22,7 @@ extern circuitmux_policy_t ewma_policy;
 /* Externally visible EWMA functions */
 int cell_ewma_enabled(void);
 unsigned int cell_ewma_get_tick(void);
+double cell_ewma_get_scale_factor(unsigned from_tick, unsigned to_tick);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 
@@ -34,6 +34,8 @@
 
 static void circuit_expire_old_circuits_clientside(void);
 static void circuit_increment_failure_count(void);
+static int connection_ap_handshake_attach_circuit_impl(
+                                              entry_connection_t *conn);
 
 /** Return 1 if <b>circ</b> could be returned by circuit_get_best().
  * Else return 0.
@@ -1534,14 +1536,14 @@ void
 circuit_try_attaching_streams(origin_circuit_t *circ)
 {
   /* Attach streams to this circuit if we can. */
-  connection_ap_attach_pending();
+  connection_ap_attach_pending_for_circ(circ);
 
   /* The call to circuit_try_clearing_isolation_state here will do
    * nothing and return 0 if we didn't attach any streams to circ
    * above. */
   if (circuit_try_clearing_isolation_state(circ)) {
     /* Maybe *now* we can attach some streams to this circuit. */
-    connection_ap_attach_pending();
+    connection_ap_attach_pending_for_circ(circ);
   }
 }
 
@@ -2312,6 +2314,22 @@ connection_ap_handshake_attach_chosen_circuit(entry_connection_t *conn,
  * its callers shouldn't have to worry about that. */
 int
 connection_ap_handshake_attach_circuit(entry_connection_t *conn)
+{
+  connection_t *base_conn = ENTRY_TO_CONN(conn);
+  int r = connection_ap_handshake_attach_circuit_impl(conn);
+
+  /* If it's still waiting, remember it so that we can try again when
+   * something changes. */
+  if (r >= 0 && !base_conn->marked_for_close &&
+      base_conn->state == AP_CONN_STATE_CIRCUIT_WAIT)
+    connection_ap_mark_as_pending_circuit(conn);
+  return r;
+}
+
+/** Helper for connection_ap_handshake_attach_circuit(): do everything but
+ * remember connections that are still waiting. */
+static int
+connection_ap_handshake_attach_circuit_impl(entry_connection_t *conn)
 {
   connection_t *base_conn = ENTRY_TO_CONN(conn);
   int retval;
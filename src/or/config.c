@@ -17,7 +17,6 @@
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuitmux.h"
-#include "circuitmux_ewma.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
@@ -185,6 +184,8 @@ static config_var_t option_vars_[] = {
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
+  V(CircuitMuxPolicy,            STRING,   "auto"),
+  V(CircuitMuxQuantum,           INT,      "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
@@ -420,6 +421,7 @@ static config_var_t option_vars_[] = {
   V(Tor2webMode,                 BOOL,     "0"),
   V(Tor2webRendezvousPoints,      ROUTERSET, NULL),
   V(TLSECGroup,                  STRING,   NULL),
+  V(TLSSessionResumption,        BOOL,     "0"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   V(TransListenAddress,          LINELIST, NULL),
@@ -1348,6 +1350,9 @@ options_transition_requires_fresh_tls_context(const or_options_t *old_options,
   if (!opt_streq(old_options->TLSECGroup, new_options->TLSECGroup))
     return 1;
 
+  if (old_options->TLSSessionResumption != new_options->TLSSessionResumption)
+    return 1;
+
   return 0;
 }
 
@@ -1369,7 +1374,6 @@ options_act(const or_options_t *old_options)
   char *msg=NULL;
   const int transition_affects_workers =
     old_options && options_transition_affects_workers(old_options, options);
-  int old_ewma_enabled;
 
   /* disable ptrace and later, other basic debugging techniques */
   {
@@ -1600,16 +1604,9 @@ options_act(const or_options_t *old_options)
     connection_bucket_init();
 #endif
 
-  old_ewma_enabled = cell_ewma_enabled();
-  /* Change the cell EWMA settings */
-  cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
-  /* If we just enabled ewma, set the cmux policy on all active channels */
-  if (cell_ewma_enabled() && !old_ewma_enabled) {
-    channel_set_cmux_policy_everywhere(&ewma_policy);
-  } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-    /* Turn it off everywhere */
-    channel_set_cmux_policy_everywhere(NULL);
-  }
+  /* Change the cell EWMA/DRR settings, and adjust the cmux policy on all
+   * active channels if needed */
+  channel_update_cmux_policy(options, networkstatus_get_latest_consensus());
 
   /* Update the BridgePassword's hashed version as needed.  We store this as a
    * digest so that we can do side-channel-proof comparisons on it.
@@ -2742,6 +2739,24 @@ options_validate(or_options_t *old_options, or_options_t *options,
         "undefined, and there aren't any hidden services configured.  "
         "Tor will still run, but probably won't do anything.");
 
+  options->CircuitMuxPolicy_parsed = CMUX_POLICY_AUTO;
+  if (options->CircuitMuxPolicy) {
+    if (!strcasecmp(options->CircuitMuxPolicy, "auto")) {
+      options->CircuitMuxPolicy_parsed = CMUX_POLICY_AUTO;
+    } else if (!strcasecmp(options->CircuitMuxPolicy, "EWMA")) {
+      options->CircuitMuxPolicy_parsed = CMUX_POLICY_EWMA;
+    } else if (!strcasecmp(options->CircuitMuxPolicy, "DRR")) {
+      options->CircuitMuxPolicy_parsed = CMUX_POLICY_DRR;
+    } else if (!strcasecmp(options->CircuitMuxPolicy, "WDRR")) {
+      options->CircuitMuxPolicy_parsed = CMUX_POLICY_WDRR;
+    } else {
+      REJECT("Unrecognized value for CircuitMuxPolicy");
+    }
+  }
+
+  if (options->CircuitMuxQuantum < 0)
+    REJECT("CircuitMuxQuantum must be non-negative.");
+
   options->TransProxyType_parsed = TPT_DEFAULT;
 #ifdef USE_TRANSPARENT
   if (options->TransProxyType) {
@@ -0,0 +1,223 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion.c
+ * \brief Delay-based congestion control for circuit package windows.
+ *
+ * The other end of a circuit sends a circuit-level SENDME for every
+ * CIRCWINDOW_INCREMENT cells it receives, so by remembering when we sent
+ * each such cell we learn the circuit's round trip time.  As in TCP Vegas,
+ * the difference between that and the smallest round trip time we've seen
+ * tells us roughly how many of our cells are sitting in queues along the
+ * path.  When that number is small we let ourselves use more of the package
+ * window; when it's large we use less, so that a bulk download doesn't
+ * fill every queue between us and the client.
+ *
+ * Paths change, so we only trust the smallest round trip time for a
+ * CC_MIN_RTT_EPOCH_MSEC measurement epoch or two; after that we take the
+ * smallest one from the epoch that just ended instead.
+ *
+ * The congestion window can never grow past the package window we started
+ * with: the other side closes the circuit if we send more than that without
+ * waiting for a SENDME.  And it can never shrink below
+ * CIRCWINDOW_INCREMENT, or the other side would never send a SENDME.  So
+ * this is a throttle within the window the protocol already gives us, not
+ * congestion control that can open a wider one.
+ *
+ * All of this is off unless the consensus turns it on.  Until then, no
+ * circuit_cc_t gets allocated.  A circuit that was already sending when it
+ * got turned on waits until all of its cells are acknowledged, so that its
+ * window and its count of cells between SENDMEs start out right.
+ **/
+
+#define CONGESTION_PRIVATE
+
+#include "or.h"
+#include "circuitlist.h"
+#include "congestion.h"
+#include "networkstatus.h"
+
+/** If the number of cells that we think are queued along the path is
+ * below this, grow the window. */
+#define CC_DEFAULT_ALPHA 100
+/** If the number of cells that we think are queued along the path is
+ * above this, shrink the window. */
+#define CC_DEFAULT_BETA 200
+/** How many cells do we grow or shrink the window by at a time? */
+#define CC_DEFAULT_INCREMENT 50
+/** The smallest window we'll use. */
+#define CC_DEFAULT_MIN_WINDOW 300
+/** How long, in msec, is each epoch over which we measure the smallest
+ * round trip time? */
+#define CC_MIN_RTT_EPOCH_MSEC 10000
+
+/** True iff we're limiting package windows by congestion. */
+static int cc_enabled = 0;
+/** Current values of the CircuitCC* consensus parameters. */
+static int cc_alpha = CC_DEFAULT_ALPHA;
+static int cc_beta = CC_DEFAULT_BETA;
+static int cc_increment = CC_DEFAULT_INCREMENT;
+static int cc_min_window = CC_DEFAULT_MIN_WINDOW;
+
+/** Read our congestion control parameters from <b>consensus</b>. */
+void
+circuit_cc_set_parameters(const networkstatus_t *consensus)
+{
+  cc_enabled = networkstatus_get_param(consensus,
+                                       "CircuitCongestionControl", 0, 0, 1);
+  cc_alpha = networkstatus_get_param(consensus, "CircuitCCAlpha",
+                                     CC_DEFAULT_ALPHA, 0,
+                                     CIRCWINDOW_START_MAX);
+  cc_beta = networkstatus_get_param(consensus, "CircuitCCBeta",
+                                    CC_DEFAULT_BETA, 0,
+                                    CIRCWINDOW_START_MAX);
+  if (cc_beta < cc_alpha)
+    cc_beta = cc_alpha;
+  cc_increment = networkstatus_get_param(consensus, "CircuitCCIncrement",
+                                         CC_DEFAULT_INCREMENT, 1,
+                                         CIRCWINDOW_START_MAX);
+  cc_min_window = networkstatus_get_param(consensus, "CircuitCCMinWindow",
+                                          CC_DEFAULT_MIN_WINDOW,
+                                          CIRCWINDOW_INCREMENT,
+                                          CIRCWINDOW_START_MAX);
+  if (cc_enabled)
+    log_info(LD_CIRC, "Limiting circuit package windows by congestion: "
+             "alpha %d, beta %d, increment %d, minimum window %d cells.",
+             cc_alpha, cc_beta, cc_increment, cc_min_window);
+}
+
+/** Return how many more cells we should package with the congestion control
+ * state <b>cc</b> (which may be NULL), given that the other side would
+ * accept <b>package_window</b> more.  Never returns less than 0. */
+int
+circuit_cc_get_package_window(const circuit_cc_t *cc, int package_window)
+{
+  int window;
+  if (!cc_enabled || !cc || !cc->cwnd)
+    return package_window;
+  /* max_cwnd - package_window cells are unacknowledged; we want no more
+   * than cwnd. */
+  window = package_window - (cc->max_cwnd - cc->cwnd);
+  return window < 0 ? 0 : window;
+}
+
+/** Note that we're about to package a cell with the congestion control
+ * state *<b>ccp</b> when our package window is <b>package_window</b> and
+ * the time is <b>now_msec</b>.  If congestion control is on, *<b>ccp</b>
+ * is NULL, and every cell we've sent has been acknowledged, allocate it. */
+STATIC void
+circuit_cc_note_cell_sent_at(circuit_cc_t **ccp, int package_window,
+                             int64_t now_msec)
+{
+  circuit_cc_t *cc;
+
+  if (!*ccp) {
+    /* If some of our cells are unacknowledged, we don't know where the
+     * other side is in counting them for SENDMEs, and package_window isn't
+     * the whole window. */
+    if (!cc_enabled || package_window != circuit_initial_package_window())
+      return;
+    *ccp = cc = tor_malloc_zero(sizeof(circuit_cc_t));
+    cc->cwnd = cc->max_cwnd = package_window;
+    cc->epoch_start_msec = now_msec;
+  }
+  cc = *ccp;
+
+  if (++cc->cells_since_sendme < CIRCWINDOW_INCREMENT)
+    return;
+  cc->cells_since_sendme = 0;
+
+  /* The other side will send a SENDME when it gets this cell. */
+  if (cc->n_pending_sendmes == CIRCUIT_CC_MAX_PENDING_SENDMES) {
+    /* Can't happen unless the window was bigger than we thought; forget the
+     * oldest. */
+    cc->sendme_head = (cc->sendme_head + 1) % CIRCUIT_CC_MAX_PENDING_SENDMES;
+    --cc->n_pending_sendmes;
+  }
+  cc->sendme_cell_sent_msec[(cc->sendme_head + cc->n_pending_sendmes) %
+                            CIRCUIT_CC_MAX_PENDING_SENDMES] = now_msec;
+  ++cc->n_pending_sendmes;
+}
+
+/** Note that we got a circuit-level SENDME at <b>now_msec</b>, and adjust
+ * the congestion window of <b>cc</b> to match the round trip time. */
+STATIC void
+circuit_cc_note_sendme_at(circuit_cc_t *cc, int64_t now_msec)
+{
+  int64_t rtt;
+  int queued;
+
+  if (!cc || !cc->n_pending_sendmes)
+    return;
+  rtt = now_msec - cc->sendme_cell_sent_msec[cc->sendme_head];
+  cc->sendme_head = (cc->sendme_head + 1) % CIRCUIT_CC_MAX_PENDING_SENDMES;
+  --cc->n_pending_sendmes;
+
+  if (rtt < 1)
+    rtt = 1;
+  if (rtt > UINT32_MAX)
+    rtt = UINT32_MAX;
+  cc->last_rtt_msec = (uint32_t) rtt;
+  if (now_msec - cc->epoch_start_msec >= CC_MIN_RTT_EPOCH_MSEC) {
+    /* Forget round trip times from before the epoch that just ended. */
+    cc->min_rtt_msec = cc->epoch_min_rtt_msec;
+    cc->epoch_min_rtt_msec = 0;
+    cc->epoch_start_msec = now_msec;
+  }
+  if (!cc->epoch_min_rtt_msec || cc->last_rtt_msec < cc->epoch_min_rtt_msec)
+    cc->epoch_min_rtt_msec = cc->last_rtt_msec;
+  if (!cc->min_rtt_msec || cc->last_rtt_msec < cc->min_rtt_msec)
+    cc->min_rtt_msec = cc->last_rtt_msec;
+
+  /* Vegas: if we got the throughput that the smallest RTT would give us,
+   * how many cells would be queued? */
+  queued = (int) (((int64_t)cc->cwnd) *
+                  (cc->last_rtt_msec - cc->min_rtt_msec) / cc->last_rtt_msec);
+  if (queued < cc_alpha)
+    cc->cwnd += cc_increment;
+  else if (queued > cc_beta)
+    cc->cwnd -= cc_increment;
+
+  if (cc->cwnd > cc->max_cwnd)
+    cc->cwnd = cc->max_cwnd;
+  if (cc->cwnd < cc_min_window)
+    cc->cwnd = MIN(cc_min_window, cc->max_cwnd);
+}
+
+/** Return the current time in msec, for timing SENDMEs. */
+static int64_t
+circuit_cc_now_msec(void)
+{
+  struct timeval now;
+  tor_gettimeofday_cached_monotonic(&now);
+  return tv_to_msec(&now);
+}
+
+/** Note that we're about to package a cell with the congestion control
+ * state *<b>ccp</b>, when our package window is <b>package_window</b>. */
+void
+circuit_cc_note_cell_sent(circuit_cc_t **ccp, int package_window)
+{
+  if (!*ccp && !cc_enabled)
+    return;
+  circuit_cc_note_cell_sent_at(ccp, package_window, circuit_cc_now_msec());
+}
+
+/** Note that we got a circuit-level SENDME for the package window whose
+ * congestion control state is <b>cc</b>, which may be NULL. */
+void
+circuit_cc_note_sendme(circuit_cc_t *cc)
+{
+  if (!cc)
+    return;
+  circuit_cc_note_sendme_at(cc, circuit_cc_now_msec());
+}
+
+/** Release all storage held by <b>cc</b>. */
+void
+circuit_cc_free(circuit_cc_t *cc)
+{
+  tor_free(cc);
+}
+
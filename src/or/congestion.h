@@ -0,0 +1,26 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion.h
+ * \brief Header file for congestion.c.
+ **/
+
+#ifndef TOR_CONGESTION_H
+#define TOR_CONGESTION_H
+
+void circuit_cc_set_parameters(const networkstatus_t *consensus);
+int circuit_cc_get_package_window(const circuit_cc_t *cc, int package_window);
+void circuit_cc_note_cell_sent(circuit_cc_t **ccp, int package_window);
+void circuit_cc_note_sendme(circuit_cc_t *cc);
+void circuit_cc_free(circuit_cc_t *cc);
+
+#ifdef CONGESTION_PRIVATE
+STATIC void circuit_cc_note_cell_sent_at(circuit_cc_t **ccp,
+                                         int package_window,
+                                         int64_t now_msec);
+STATIC void circuit_cc_note_sendme_at(circuit_cc_t *cc, int64_t now_msec);
+#endif
+
+#endif
+
@@ -568,6 +568,7 @@ connection_free_(connection_t *conn)
   }
   if (conn->type == CONN_TYPE_AP) {
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
+    connection_ap_mark_as_non_pending_circuit(entry_conn);
     tor_free(entry_conn->chosen_exit_name);
     tor_free(entry_conn->original_dest_address);
     if (entry_conn->socks_request)
@@ -80,6 +80,14 @@ static int connection_exit_connect_dir(edge_connection_t *exitconn);
 static int consider_plaintext_ports(entry_connection_t *conn, uint16_t port);
 static int connection_ap_supports_optimistic_data(const entry_connection_t *);
 
+/** List of AP connections to ordinary destinations that might be in state
+ * AP_CONN_STATE_CIRCUIT_WAIT.  Every AP connection in that state is here,
+ * or on pending_rend_entry_connections; connections that have left the state
+ * are removed the next time we look at them. */
+static smartlist_t *pending_entry_connections = NULL;
+/** As pending_entry_connections, but for streams to hidden services. */
+static smartlist_t *pending_rend_entry_connections = NULL;
+
 /** An AP stream has failed/finished. If it hasn't already sent back
  * a socks reply, send one now (based on endreason). Also set
  * has_sent_end to 1, and mark the conn.
@@ -711,26 +719,126 @@ connection_ap_expire_beginning(void)
   } SMARTLIST_FOREACH_END(base_conn);
 }
 
-/** Tell any AP streams that are waiting for a new circuit to try again,
- * either attaching to an available circ or launching a new one.
- */
+/** Return the list of pending AP connections that <b>entry_conn</b>
+ * belongs on, creating it if necessary. */
+static smartlist_t *
+pending_list_for_conn(const entry_connection_t *entry_conn)
+{
+  smartlist_t **lst = ENTRY_TO_EDGE_CONN(entry_conn)->rend_data ?
+    &pending_rend_entry_connections : &pending_entry_connections;
+  if (!*lst)
+    *lst = smartlist_new();
+  return *lst;
+}
+
+/** Remember that <b>entry_conn</b>, which is in state
+ * AP_CONN_STATE_CIRCUIT_WAIT, is waiting for a circuit, so that
+ * connection_ap_attach_pending() will try it again. */
 void
-connection_ap_attach_pending(void)
+connection_ap_mark_as_pending_circuit(entry_connection_t *entry_conn)
 {
-  entry_connection_t *entry_conn;
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+  tor_assert(ENTRY_TO_CONN(entry_conn)->state == AP_CONN_STATE_CIRCUIT_WAIT);
+  if (entry_conn->is_pending_circuit)
+    return;
+  entry_conn->is_pending_circuit = 1;
+  smartlist_add(pending_list_for_conn(entry_conn), entry_conn);
+}
+
+/** Forget that <b>entry_conn</b> was waiting for a circuit.  Called when
+ * we free it. */
+void
+connection_ap_mark_as_non_pending_circuit(entry_connection_t *entry_conn)
+{
+  if (!entry_conn->is_pending_circuit)
+    return;
+  entry_conn->is_pending_circuit = 0;
+  if (pending_entry_connections)
+    smartlist_remove(pending_entry_connections, entry_conn);
+  if (pending_rend_entry_connections)
+    smartlist_remove(pending_rend_entry_connections, entry_conn);
+}
+
+/** Release all storage held by connection_edge.c. */
+void
+connection_edge_free_all(void)
+{
+  smartlist_free(pending_entry_connections);
+  pending_entry_connections = NULL;
+  smartlist_free(pending_rend_entry_connections);
+  pending_rend_entry_connections = NULL;
+}
+
+/** Return true iff the pending AP connection <b>entry_conn</b> might be
+ * able to use <b>circ</b>.  This is only a quick check to skip streams that
+ * certainly can't: connection_ap_handshake_attach_circuit() decides. */
+static int
+pending_conn_might_use_circ(const entry_connection_t *entry_conn,
+                            const origin_circuit_t *circ)
+{
+  const edge_connection_t *edge_conn = ENTRY_TO_EDGE_CONN(entry_conn);
+  if (!circ->rend_data)
+    return 1;
+  return edge_conn->rend_data &&
+    !rend_cmp_service_ids(edge_conn->rend_data->onion_address,
+                          circ->rend_data->onion_address);
+}
+
+/** Try to attach every AP connection on <b>*lstp</b> that is still waiting
+ * for a circuit and that might use <b>circ</b> (or every one, if <b>circ</b>
+ * is NULL).  Drop connections that are no longer waiting from the list. */
+static void
+connection_ap_attach_pending_list(smartlist_t **lstp,
+                                  const origin_circuit_t *circ)
+{
+  /* Attaching a stream can make other streams pending, or call us again;
+   * so work on a list of our own, and let anything else go onto a fresh
+   * list. */
+  smartlist_t *pending = *lstp;
+  if (!pending)
+    return;
+  *lstp = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(pending, entry_connection_t *, entry_conn) {
+    connection_t *conn = ENTRY_TO_CONN(entry_conn);
+    entry_conn->is_pending_circuit = 0;
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
-    entry_conn = TO_ENTRY_CONN(conn);
+    if (circ && !pending_conn_might_use_circ(entry_conn, circ)) {
+      connection_ap_mark_as_pending_circuit(entry_conn);
+      continue;
+    }
+    /* If this stream stays pending, connection_ap_handshake_attach_circuit()
+     * puts it back on the list. */
     if (connection_ap_handshake_attach_circuit(entry_conn) < 0) {
       if (!conn->marked_for_close)
         connection_mark_unattached_ap(entry_conn,
                                       END_STREAM_REASON_CANT_ATTACH);
     }
-  } SMARTLIST_FOREACH_END(conn);
+  } SMARTLIST_FOREACH_END(entry_conn);
+
+  smartlist_free(pending);
+}
+
+/** Tell any AP streams that are waiting for a new circuit to try again,
+ * either attaching to an available circ or launching a new one.
+ */
+void
+connection_ap_attach_pending(void)
+{
+  connection_ap_attach_pending_list(&pending_entry_connections, NULL);
+  connection_ap_attach_pending_list(&pending_rend_entry_connections, NULL);
+}
+
+/** Tell the AP streams that are waiting for a new circuit, and that might
+ * be able to use <b>circ</b>, to try again. */
+void
+connection_ap_attach_pending_for_circ(const origin_circuit_t *circ)
+{
+  if (circ->rend_data)
+    connection_ap_attach_pending_list(&pending_rend_entry_connections, circ);
+  else
+    connection_ap_attach_pending_list(&pending_entry_connections, circ);
 }
 
 /** Tell any AP streams that are waiting for a one-hop tunnel to
@@ -742,15 +850,17 @@ void
 connection_ap_fail_onehop(const char *failed_digest,
                           cpath_build_state_t *build_state)
 {
-  entry_connection_t *entry_conn;
   char digest[DIGEST_LEN];
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+  if (!pending_entry_connections)
+    return;
+  /* One-hop streams never go to hidden services, so they're all on
+   * pending_entry_connections. */
+  SMARTLIST_FOREACH_BEGIN(pending_entry_connections,
+                          entry_connection_t *, entry_conn) {
+    connection_t *conn = ENTRY_TO_CONN(entry_conn);
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
-    entry_conn = TO_ENTRY_CONN(conn);
     if (!entry_conn->want_onehop)
       continue;
     if (hexdigest_to_digest(entry_conn->chosen_exit_name, digest) < 0 ||
@@ -772,7 +882,7 @@ connection_ap_fail_onehop(const char *failed_digest,
                      "just failed.", entry_conn->chosen_exit_name,
                      entry_conn->socks_request->address);
     connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-  } SMARTLIST_FOREACH_END(conn);
+  } SMARTLIST_FOREACH_END(entry_conn);
 }
 
 /** A circuit failed to finish on its last hop <b>info</b>. If there
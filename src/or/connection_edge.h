@@ -64,7 +64,11 @@ int connection_edge_is_rendezvous_stream(edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
 void connection_ap_expire_beginning(void);
+void connection_ap_mark_as_pending_circuit(entry_connection_t *entry_conn);
+void connection_ap_mark_as_non_pending_circuit(entry_connection_t *entry_conn);
 void connection_ap_attach_pending(void);
+void connection_ap_attach_pending_for_circ(const origin_circuit_t *circ);
+void connection_edge_free_all(void);
 void connection_ap_fail_onehop(const char *failed_digest,
                                cpath_build_state_t *build_state);
 void circuit_discard_optional_exit_enclaves(extend_info_t *info);
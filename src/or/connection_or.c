@@ -1373,6 +1373,8 @@ connection_tls_start_handshake,(or_connection_t *conn, int receiving))
   }
   tor_tls_set_logged_address(conn->tls, // XXX client and relay?
       escaped_safe_str(conn->base_.address));
+  if (!receiving)
+    tor_tls_offer_cached_session(conn->tls, conn->identity_digest);
 
 #ifdef USE_BUFFEREVENTS
   if (connection_type_uses_bufferevent(TO_CONN(conn))) {
@@ -1971,6 +1973,11 @@ or_handshake_state_record_var_cell(or_connection_t *conn,
 int
 connection_or_set_state_open(or_connection_t *conn)
 {
+  /* By now we know who is at the other end, so it's safe to remember the
+   * session under their identity. */
+  if (conn->tls && connection_or_nonopen_was_started_here(conn))
+    tor_tls_cache_session(conn->tls, conn->identity_digest);
+
   connection_or_change_state(conn, OR_CONN_STATE_OPEN);
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
 
@@ -8,18 +8,23 @@
  * application of diffs in a minimal ed format.
  *
  * The consensus diff application is done in consdiff_apply_diff, which relies
- * on apply_ed_diff for the main ed diff part and on some digest helper
- * functions to check the digest hashes found in the consensus diff header.
+ * on parse_ed_diff and apply_ed_cmds for the main ed diff part and on some
+ * digest helper functions to check the digest hashes found in the consensus
+ * diff header. The new consensus is written straight into a single string
+ * and hashed as it's written, so that the only full copy of it that we make
+ * is the one we return.
  *
  * The consensus diff generation is more complex. consdiff_gen_diff generates
  * it, relying on gen_ed_diff to generate the ed diff and some digest helper
  * functions to generate the digest hashes.
  *
- * gen_ed_diff is the tricky bit. In it simplest form, it will take quadratic
- * time and linear space to generate an ed diff given two smartlists. As shown
- * in its comment section, calling calc_changes on the entire two consensuses
- * will calculate what is to be added and what is to be deleted in the diff.
- * Its comment section briefly explains how it works.
+ * gen_ed_diff is the tricky bit. In it simplest form, it will take O((N+M)D)
+ * time and linear space to generate an ed diff given two smartlists, where D
+ * is the size of the diff. As shown in its comment section, calling
+ * calc_changes on the entire two consensuses will calculate what is to be
+ * added and what is to be deleted in the diff. calc_changes hashes every
+ * line and then runs Myers' diff algorithm, so that unequal lines can
+ * almost always be told apart without comparing them.
  *
  * In our case specific to consensuses, we take advantage of the fact that
  * consensuses list routers sorted by their identities. We use that
@@ -73,58 +78,6 @@ smartlist_slice(smartlist_t *list, int start, int end)
   return slice;
 }
 
-/** Helper: Compute the longest common subsequence lengths for the two slices.
- * Used as part of the diff generation to find the column at which to split
- * slice2 while still having the optimal solution.
- * If direction is -1, the navigation is reversed. Otherwise it must be 1.
- * The length of the resulting integer array is that of the second slice plus
- * one.
- */
-static int *
-lcs_lengths(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
-            int direction)
-{
-  size_t a_size = sizeof(int) * (slice2->len+1);
-
-  /* Resulting lcs lengths. */
-  int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
-  int *prev = tor_malloc(a_size);
-
-  tor_assert(direction == 1 || direction == -1);
-
-  int si = slice1->offset;
-  if (direction == -1) {
-    si += (slice1->len-1);
-  }
-
-  for (int i = 0; i < slice1->len; ++i, si+=direction) {
-
-    const char *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
-
-    int sj = slice2->offset;
-    if (direction == -1) {
-      sj += (slice2->len-1);
-    }
-
-    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
-
-      const char *line2 = smartlist_get(slice2->list, sj);
-      if (!strcmp(line1, line2)) {
-        /* If the lines are equal, the lcs is one line longer. */
-        result[j + 1] = prev[j] + 1;
-      } else {
-        /* If not, see what lcs parent path is longer. */
-        result[j + 1] = MAX(result[j], prev[j + 1]);
-      }
-    }
-  }
-  tor_free(prev);
-  return result;
-}
-
 /** Helper: Trim any number of lines that are equally at the start or the end
  * of both slices.
  */
@@ -199,32 +152,203 @@ set_changed(bitarray_t *changed1, bitarray_t *changed2,
   }
 }
 
-/*
- * Helper: Given that slice1 has been split by half into top and bot, we want
- * to fetch the column at which to split slice2 so that we are still on track
- * to the optimal diff solution, i.e. the shortest one. We use lcs_lengths
- * since the shortest diff is just another way to say the longest common
- * subsequence.
+/** State shared by the Myers diff helpers below: the two slices being
+ * compared, a hash of each of their lines, and the bitarrays in which to
+ * record which lines are gone and which are new. */
+typedef struct {
+  smartlist_slice_t *slice1;
+  smartlist_slice_t *slice2;
+  uint64_t *hashes1;
+  uint64_t *hashes2;
+  bitarray_t *changed1;
+  bitarray_t *changed2;
+} myers_diff_t;
+
+/** Helper: Hash every line in <b>slice</b>, so that the diff engine can
+ * tell most unequal lines apart without comparing them. The resulting
+ * array has one element per line of the slice.
  */
-static int
-optimal_column_to_split(smartlist_slice_t *top, smartlist_slice_t *bot,
-                        smartlist_slice_t *slice2)
+static uint64_t *
+slice_line_hashes(smartlist_slice_t *slice)
+{
+  uint64_t *hashes = tor_calloc(MAX(slice->len, 1), sizeof(uint64_t));
+  for (int i = 0; i < slice->len; ++i) {
+    const char *line = smartlist_get(slice->list, slice->offset + i);
+    hashes[i] = siphash24g(line, strlen(line));
+  }
+  return hashes;
+}
+
+/** Helper: Return true iff line <b>i1</b> of the first slice is equal to
+ * line <b>i2</b> of the second slice, counting from the start of each
+ * slice.
+ */
+static INLINE int
+myers_lines_eq(const myers_diff_t *md, int i1, int i2)
+{
+  if (md->hashes1[i1] != md->hashes2[i2]) {
+    return 0;
+  }
+  return !strcmp(smartlist_get(md->slice1->list, md->slice1->offset + i1),
+                 smartlist_get(md->slice2->list, md->slice2->offset + i2));
+}
+
+static void myers_diff(myers_diff_t *md, int lo1, int hi1, int lo2, int hi2);
+
+/** Helper: Find the middle snake of the shortest edit script between lines
+ * [<b>lo1</b>, <b>hi1</b>) of the first slice and lines [<b>lo2</b>,
+ * <b>hi2</b>) of the second one, by running Myers' greedy algorithm from
+ * both ends at once until the two paths meet. Then diff the two halves on
+ * either side of the meeting point separately. This takes time
+ * proportional to the total length times the size of the diff, and space
+ * proportional to the total length.
+ *
+ * Neither range may be empty, and their first and last lines must differ.
+ */
+static void
+myers_bisect(myers_diff_t *md, int lo1, int hi1, int lo2, int hi2)
 {
-  int *lens_top = lcs_lengths(top, slice2, 1);
-  int *lens_bot = lcs_lengths(bot, slice2, -1);
-  int column=0, max_sum=-1;
-
-  for (int i = 0; i < slice2->len+1; ++i) {
-    int sum = lens_top[i] + lens_bot[slice2->len-i];
-    if (sum > max_sum) {
-      column = i;
-      max_sum = sum;
+  const int len1 = hi1 - lo1, len2 = hi2 - lo2;
+  const int max_d = (len1 + len2 + 1) / 2;
+  const int v_offset = max_d;
+  const int v_len = 2 * max_d + 2;
+  const int delta = len1 - len2;
+  /* If the difference in length is odd, the forward path is the one that
+   * will run into the reverse one. */
+  const int front = (delta % 2 != 0);
+  int *v1 = tor_malloc(sizeof(int) * v_len);
+  int *v2 = tor_malloc(sizeof(int) * v_len);
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  int x_split = -1, y_split = -1;
+
+  /* v1[v_offset+k] is how far along the first range the furthest forward
+   * path on diagonal k has reached; v2 is the same for reverse paths,
+   * counted from the ends of the ranges. */
+  for (int i = 0; i < v_len; ++i) {
+    v1[i] = v2[i] = -1;
+  }
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (int d = 0; d < max_d && x_split < 0; ++d) {
+    /* Extend each forward path by one edit and then along its snake. */
+    for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      int k1_offset = v_offset + k1;
+      int x1, y1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) {
+        x1 = v1[k1_offset + 1];
+      } else {
+        x1 = v1[k1_offset - 1] + 1;
+      }
+      y1 = x1 - k1;
+      while (x1 < len1 && y1 < len2 &&
+             myers_lines_eq(md, lo1 + x1, lo2 + y1)) {
+        x1++;
+        y1++;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > len1) {
+        /* Ran off the right of the edit graph. */
+        k1end += 2;
+      } else if (y1 > len2) {
+        /* Ran off the bottom of the edit graph. */
+        k1start += 2;
+      } else if (front) {
+        int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_len && v2[k2_offset] != -1) {
+          /* Mirror x2 onto the top-left coordinate system. */
+          int x2 = len1 - v2[k2_offset];
+          if (x1 >= x2) {
+            x_split = x1;
+            y_split = y1;
+            break;
+          }
+        }
+      }
     }
+    if (x_split >= 0)
+      break;
+
+    /* Same thing, backwards from the ends of the ranges. */
+    for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      int k2_offset = v_offset + k2;
+      int x2, y2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) {
+        x2 = v2[k2_offset + 1];
+      } else {
+        x2 = v2[k2_offset - 1] + 1;
+      }
+      y2 = x2 - k2;
+      while (x2 < len1 && y2 < len2 &&
+             myers_lines_eq(md, hi1 - x2 - 1, hi2 - y2 - 1)) {
+        x2++;
+        y2++;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > len1) {
+        k2end += 2;
+      } else if (y2 > len2) {
+        k2start += 2;
+      } else if (!front) {
+        int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_len && v1[k1_offset] != -1) {
+          int x1 = v1[k1_offset];
+          int y1 = v_offset + x1 - k1_offset;
+          if (x1 >= len1 - x2) {
+            x_split = x1;
+            y_split = y1;
+            break;
+          }
+        }
+      }
+    }
+  }
+  tor_free(v1);
+  tor_free(v2);
+
+  if (x_split < 0) {
+    /* No line in common at all. */
+    for (int i = lo1; i < hi1; ++i) {
+      bitarray_set(md->changed1, md->slice1->offset + i);
+    }
+    for (int i = lo2; i < hi2; ++i) {
+      bitarray_set(md->changed2, md->slice2->offset + i);
+    }
+    return;
+  }
+
+  myers_diff(md, lo1, lo1 + x_split, lo2, lo2 + y_split);
+  myers_diff(md, lo1 + x_split, hi1, lo2 + y_split, hi2);
+}
+
+/** Helper: Set the changed bits for the shortest edit script between lines
+ * [<b>lo1</b>, <b>hi1</b>) of the first slice and lines [<b>lo2</b>,
+ * <b>hi2</b>) of the second one.
+ */
+static void
+myers_diff(myers_diff_t *md, int lo1, int hi1, int lo2, int hi2)
+{
+  /* Lines in common at either end are never part of the diff. */
+  while (lo1 < hi1 && lo2 < hi2 && myers_lines_eq(md, lo1, lo2)) {
+    lo1++;
+    lo2++;
+  }
+  while (lo1 < hi1 && lo2 < hi2 && myers_lines_eq(md, hi1 - 1, hi2 - 1)) {
+    hi1--;
+    hi2--;
   }
-  tor_free(lens_top);
-  tor_free(lens_bot);
 
-  return column;
+  if (lo1 == hi1) {
+    for (int i = lo2; i < hi2; ++i) {
+      bitarray_set(md->changed2, md->slice2->offset + i);
+    }
+  } else if (lo2 == hi2) {
+    for (int i = lo1; i < hi1; ++i) {
+      bitarray_set(md->changed1, md->slice1->offset + i);
+    }
+  } else {
+    myers_bisect(md, lo1, hi1, lo2, hi2);
+  }
 }
 
 /**
@@ -234,10 +358,9 @@ optimal_column_to_split(smartlist_slice_t *top, smartlist_slice_t *bot,
  * bitarray means it's new.
  *
  * In its base case, either of the smartlists is of length <= 1 and we can
- * quickly see what elements are new or are gone. In the other case, we will
- * split one smartlist by half and we'll use optimal_column_to_split to find
- * the optimal column at which to split the second smartlist so that we are
- * finding the smallest diff possible.
+ * quickly see what elements are new or are gone. In the other case, we hash
+ * every line and run Myers' O((N+M)D) diff algorithm on the two slices,
+ * comparing lines by hash before comparing them as strings.
  */
 static void
 calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
@@ -251,29 +374,17 @@ calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
   } else if (slice2->len <= 1) {
     set_changed(changed2, changed1, slice2, slice1);
 
-  /* Keep on splitting the slices in two. */
   } else {
-
-    smartlist_slice_t *top, *bot, *left, *right;
-
-    /* Split the first slice in half. */
-    int mid = slice1->len/2;
-    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+mid);
-    bot = smartlist_slice(slice1->list, slice1->offset+mid,
-        slice1->offset+slice1->len);
-
-    /* Split the second slice by the optimal column. */
-    int mid2 = optimal_column_to_split(top, bot, slice2);
-    left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+mid2);
-    right = smartlist_slice(slice2->list, slice2->offset+mid2,
-        slice2->offset+slice2->len);
-
-    calc_changes(top, left, changed1, changed2);
-    calc_changes(bot, right, changed1, changed2);
-    tor_free(top);
-    tor_free(bot);
-    tor_free(left);
-    tor_free(right);
+    myers_diff_t md;
+    md.slice1 = slice1;
+    md.slice2 = slice2;
+    md.hashes1 = slice_line_hashes(slice1);
+    md.hashes2 = slice_line_hashes(slice2);
+    md.changed1 = changed1;
+    md.changed2 = changed2;
+    myers_diff(&md, 0, slice1->len, 0, slice2->len);
+    tor_free(md.hashes1);
+    tor_free(md.hashes2);
   }
 }
 
@@ -421,7 +532,7 @@ base64cmp(const char *hash1, const char *hash2)
  * were not properly ordered.
  *
  * This implementation is consensus-specific. To generate an ed diff for any
- * given input in quadratic time, you can replace all the code until the
+ * given input in O((N+M)D) time, you can replace all the code until the
  * navigation in reverse order with the following:
  *
  *   int len1 = smartlist_len(cons1);
@@ -654,16 +765,38 @@ gen_ed_diff(smartlist_t *cons1, smartlist_t *cons2)
   return NULL;
 }
 
-/** Apply the ed diff to the consensus and return a new consensus, also as a
- * line-based smartlist. Will return NULL if the ed diff is not properly
- * formatted.
+/** A line of a consensus, without its newline; it need not be
+ * NUL-terminated. */
+typedef struct cons_line_t {
+  const char *s;
+  size_t len;
+} cons_line_t;
+
+/** One command from an ed diff, as parsed by parse_ed_diff(). */
+typedef struct ed_cmd_t {
+  /** First and last lines of the base consensus that the command applies
+   * to, counting from 1. */
+  int start;
+  int end;
+  /** 'a', 'c' or 'd'. */
+  char action;
+  /** For 'a' and 'c': the indexes in the ed diff of the first and last
+   * lines to add. */
+  int added_first;
+  int added_last;
+} ed_cmd_t;
+
+/** Parse the ed diff <b>diff</b>, to be applied to a consensus with
+ * <b>n_lines</b> lines, and return its commands as a smartlist of ed_cmd_t,
+ * in the order that they appear in the diff: from the end of the consensus
+ * to its start. Will return NULL if the ed diff is not properly formatted.
  */
 static smartlist_t *
-apply_ed_diff(smartlist_t *cons1, smartlist_t *diff)
+parse_ed_diff(smartlist_t *diff, int n_lines)
 {
   int diff_len = smartlist_len(diff);
-  int j = smartlist_len(cons1);
-  smartlist_t *cons2 = smartlist_new();
+  int j = n_lines;
+  smartlist_t *cmds = smartlist_new();
 
   for (int i=0; i<diff_len; ++i) {
     const char *diff_line = smartlist_get(diff, i);
@@ -681,15 +814,15 @@ apply_ed_diff(smartlist_t *cons1, smartlist_t *diff)
     if (*endptr1 == ',') {
         end = (int)strtol(endptr1+1, &endptr2, 10);
         if (endptr2 == endptr1+1) {
-          goto error_cleanup;
           log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
               "an ed command was missing a range end line number.");
+          goto error_cleanup;
         }
         /* Incoherent range. */
         if (end <= start) {
-          goto error_cleanup;
           log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
               "an invalid range was found in an ed command.");
+          goto error_cleanup;
         }
 
     /* We'll take <n1> as <n1>,<n1> for simplicity. */
@@ -723,22 +856,16 @@ apply_ed_diff(smartlist_t *cons1, smartlist_t *diff)
         goto error_cleanup;
     }
 
-    /* Add unchanged lines. */
-    for (; j > end; --j) {
-      const char *cons_line = smartlist_get(cons1, j-1);
-      smartlist_add(cons2, tor_strdup(cons_line));
-    }
+    ed_cmd_t *cmd = tor_malloc_zero(sizeof(ed_cmd_t));
+    cmd->start = start;
+    cmd->end = end;
+    cmd->action = action;
+    smartlist_add(cmds, cmd);
 
-    /* Ignore removed lines. */
-    if (action == 'c' || action == 'd') {
-      while (--j >= start) {
-        /* Skip line */
-      }
-    }
+    /* Lines after this command are unchanged; so are the ones it appends
+     * after, but the ones it changes or deletes are gone. */
+    j = (action == 'a') ? end : start-1;
 
-    /* Add new lines in reverse order, since it will all be reversed at the
-     * end.
-     */
     if (action == 'a' || action == 'c') {
       int added_end = i;
 
@@ -763,27 +890,324 @@ apply_ed_diff(smartlist_t *cons1, smartlist_t *diff)
         goto error_cleanup;
       }
 
-      while (added_i > added_end) {
-        const char *added_line = smartlist_get(diff, added_i--);
-        smartlist_add(cons2, tor_strdup(added_line));
+      cmd->added_first = added_end+1;
+      cmd->added_last = added_i;
+    }
+  }
+
+  return cmds;
+
+  error_cleanup:
+
+  SMARTLIST_FOREACH(cmds, ed_cmd_t *, cmd, tor_free(cmd));
+  smartlist_free(cmds);
+
+  return NULL;
+}
+
+/** Function to receive each line of the consensus that results from
+ * applying an ed diff, in order: <b>len</b> bytes at <b>line</b>, without
+ * the newline. */
+typedef void (*ed_line_fn_t)(const char *line, size_t len, void *arg);
+
+/** Apply the ed commands <b>cmds</b>, as returned by parse_ed_diff() for
+ * <b>diff</b>, to the <b>n_lines</b> lines of <b>lines</b>, passing each
+ * line of the result to <b>fn</b> along with <b>arg</b>. */
+static void
+apply_ed_cmds(const cons_line_t *lines, int n_lines, smartlist_t *diff,
+              smartlist_t *cmds, ed_line_fn_t fn, void *arg)
+{
+  /* The next line of the base consensus to consider, counting from 1. */
+  int next = 1;
+
+  /* The diff goes from the end of the consensus to its start; we go the
+   * other way, so that we can hand out the lines in order. */
+  for (int i = smartlist_len(cmds)-1; i >= 0; --i) {
+    const ed_cmd_t *cmd = smartlist_get(cmds, i);
+    int last_kept = (cmd->action == 'a') ? cmd->end : cmd->start-1;
+
+    /* Unchanged lines. */
+    for (; next <= last_kept; ++next) {
+      fn(lines[next-1].s, lines[next-1].len, arg);
+    }
+    /* Removed lines. */
+    if (cmd->action != 'a') {
+      next = cmd->end+1;
+    }
+    /* New lines. */
+    if (cmd->action != 'd') {
+      for (int k = cmd->added_first; k <= cmd->added_last; ++k) {
+        const char *added_line = smartlist_get(diff, k);
+        fn(added_line, strlen(added_line), arg);
+      }
+    }
+  }
+
+  /* Remaining unchanged lines. */
+  for (; next <= n_lines; ++next) {
+    fn(lines[next-1].s, lines[next-1].len, arg);
+  }
+}
+
+/** Return a newly allocated array of the lines in the smartlist of strings
+ * <b>sl</b>. */
+static cons_line_t *
+cons_lines_from_smartlist(smartlist_t *sl)
+{
+  cons_line_t *lines = tor_calloc(smartlist_len(sl)+1, sizeof(cons_line_t));
+  SMARTLIST_FOREACH_BEGIN(sl, const char *, line) {
+    lines[line_sl_idx].s = line;
+    lines[line_sl_idx].len = strlen(line);
+  } SMARTLIST_FOREACH_END(line);
+  return lines;
+}
+
+/** Return a newly allocated array of the lines in the <b>len</b> bytes at
+ * <b>s</b>, and set *<b>n_lines_out</b> to how many there are. Like
+ * tor_split_lines(), treat both CR and LF as line endings and skip empty
+ * lines; but don't modify or copy <b>s</b>. */
+static cons_line_t *
+cons_lines_from_string(const char *s, size_t len, int *n_lines_out)
+{
+  const char *eos = s + len;
+  int n_lines = 0, n_allocated = 64;
+  cons_line_t *lines = tor_calloc(n_allocated, sizeof(cons_line_t));
+
+  while (s < eos) {
+    const char *eol = memchr(s, '\n', eos - s);
+    const char *cr;
+    if (!eol)
+      eol = eos;
+    if ((cr = memchr(s, '\r', eol - s)))
+      eol = cr;
+    if (eol > s) {
+      if (n_lines == n_allocated) {
+        n_allocated *= 2;
+        lines = tor_reallocarray(lines, n_allocated, sizeof(cons_line_t));
       }
+      lines[n_lines].s = s;
+      lines[n_lines].len = eol - s;
+      ++n_lines;
     }
+    s = eol + 1;
   }
 
-  /* Add remaining unchanged lines. */
-  for (; j > 0; --j) {
-    const char *cons_line = smartlist_get(cons1, j-1);
-    smartlist_add(cons2, tor_strdup(cons_line));
+  *n_lines_out = n_lines;
+  return lines;
+}
+
+/** Helper for apply_ed_diff: add a copy of <b>line</b> to the smartlist
+ * <b>arg</b>. */
+static void
+add_line_to_smartlist(const char *line, size_t len, void *arg)
+{
+  smartlist_add((smartlist_t *)arg, tor_strndup(line, len));
+}
+
+/** Apply the ed diff to the consensus and return a new consensus, also as a
+ * line-based smartlist. Will return NULL if the ed diff is not properly
+ * formatted.
+ */
+static smartlist_t *
+apply_ed_diff(smartlist_t *cons1, smartlist_t *diff)
+{
+  smartlist_t *cmds = parse_ed_diff(diff, smartlist_len(cons1));
+  if (!cmds) {
+    return NULL;
   }
 
-  /* Reverse the whole thing since we did it from the end. */
-  smartlist_reverse(cons2);
+  cons_line_t *lines = cons_lines_from_smartlist(cons1);
+  smartlist_t *cons2 = smartlist_new();
+  apply_ed_cmds(lines, smartlist_len(cons1), diff, cmds,
+                add_line_to_smartlist, cons2);
+
+  tor_free(lines);
+  SMARTLIST_FOREACH(cmds, ed_cmd_t *, cmd, tor_free(cmd));
+  smartlist_free(cmds);
   return cons2;
+}
+
+/** Where we are in hashing a consensus as consdiff_output_line() builds it:
+ * see router_get_networkstatus_v3_hashes() for which part is hashed. */
+typedef enum {
+  /** We haven't seen any lines yet. */
+  CONSDIFF_HASH_NOT_STARTED,
+  /** We've hashed the network-status-version line and everything since. */
+  CONSDIFF_HASH_STARTED,
+  /** We've hashed the start of the directory-signature line. */
+  CONSDIFF_HASH_DONE,
+  /** The consensus isn't shaped as we expected, so we'll have to hash it
+   * once we're done. */
+  CONSDIFF_HASH_GIVE_UP,
+} consdiff_hash_state_t;
+
+/** A consensus that we're building as a single string while applying a
+ * diff to another one. */
+typedef struct consdiff_output_t {
+  /** The string we're building, or NULL if we're only counting how long it
+   * will be. */
+  char *buf;
+  /** How many bytes we've added to <b>buf</b>, or would have. */
+  size_t len;
+  /** Running SHA256 digest of the hashed part of the consensus. */
+  crypto_digest_t *digest;
+  /** How far through the hashed part of the consensus we are. */
+  consdiff_hash_state_t hash_state;
+} consdiff_output_t;
+
+/** Helper for apply_diff_impl: add <b>line</b> and a newline to the
+ * consdiff_output_t <b>arg</b>, and hash it as needed while it's still in
+ * cache. */
+static void
+consdiff_output_line(const char *line, size_t len, void *arg)
+{
+  consdiff_output_t *out = arg;
+  const char *start_str = "network-status-version";
+  const char *end_str = "directory-signature";
+
+  if (!out->buf) {
+    out->len += len+1;
+    return;
+  }
+
+  char *cp = out->buf + out->len;
+  memcpy(cp, line, len);
+  cp[len] = '\n';
+  out->len += len+1;
+
+  if (out->hash_state == CONSDIFF_HASH_NOT_STARTED) {
+    if (len >= strlen(start_str) && !memcmp(line, start_str,
+                                            strlen(start_str))) {
+      out->hash_state = CONSDIFF_HASH_STARTED;
+    } else {
+      out->hash_state = CONSDIFF_HASH_GIVE_UP;
+    }
+  } else if (out->hash_state == CONSDIFF_HASH_STARTED &&
+             len >= strlen(end_str) &&
+             !memcmp(line, end_str, strlen(end_str))) {
+    /* The hashed part ends with the first space after the token. */
+    const char *sp = memchr(line+strlen(end_str), ' ', len-strlen(end_str));
+    if (sp) {
+      crypto_digest_add_bytes(out->digest, cp, sp-line+1);
+      out->hash_state = CONSDIFF_HASH_DONE;
+    } else {
+      out->hash_state = CONSDIFF_HASH_GIVE_UP;
+    }
+    return;
+  }
+
+  if (out->hash_state == CONSDIFF_HASH_STARTED) {
+    crypto_digest_add_bytes(out->digest, cp, len+1);
+  }
+}
+
+/** Apply the consensus diff <b>diff</b> to the consensus whose
+ * <b>n_lines</b> lines are in <b>lines</b> and whose digests are
+ * <b>digests1</b>. Return the resulting consensus as a string, or NULL if
+ * the diff could not be applied.
+ *
+ * We build the new consensus straight into one string of the right size,
+ * hashing it as we go, rather than making a copy of each line and then
+ * joining and hashing them. */
+static char *
+apply_diff_impl(const cons_line_t *lines, int n_lines, smartlist_t *diff,
+                const digests_t *digests1)
+{
+  smartlist_t *cmds = NULL;
+  consdiff_output_t out;
+  char e_cons1_hash[DIGEST256_LEN];
+  char e_cons2_hash[DIGEST256_LEN];
+  char cons2_hash[DIGEST256_LEN];
+
+  memset(&out, 0, sizeof(out));
+
+  if (consdiff_get_digests(diff,
+        e_cons1_hash, NULL, e_cons2_hash, NULL) != 0) {
+    goto error_cleanup;
+  }
+
+  /* See that the consensus that was given to us matches its hash. */
+  if (memcmp(digests1->d[DIGEST_SHA256], e_cons1_hash,
+             DIGEST256_LEN) != 0) {
+    char hex_digest1[HEX_DIGEST256_LEN+1];
+    char e_hex_digest1[HEX_DIGEST256_LEN+1];
+    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
+        "the base consensus doesn't match its own digest as found in "
+        "the consensus diff header.");
+    base16_encode(hex_digest1, HEX_DIGEST256_LEN+1,
+        digests1->d[DIGEST_SHA256], DIGEST256_LEN);
+    base16_encode(e_hex_digest1, HEX_DIGEST256_LEN+1,
+        e_cons1_hash, DIGEST256_LEN);
+    log_warn(LD_CONSDIFF, "Expected: %s Found: %s\n",
+             hex_digest1, e_hex_digest1);
+    goto error_cleanup;
+  }
+
+  /* Grab the ed diff and calculate the resulting consensus. */
+  /* To avoid copying memory or iterating over all the elements, make a
+   * read-only smartlist without the two header lines.
+   */
+  smartlist_t ed_diff;
+  ed_diff.list = diff->list+2;
+  ed_diff.num_used = diff->num_used-2;
+  ed_diff.capacity = diff->capacity-2;
+  cmds = parse_ed_diff(&ed_diff, n_lines);
+
+  /* ed diff could not be applied - reason already logged by parse_ed_diff.
+   */
+  if (!cmds) {
+    goto error_cleanup;
+  }
+
+  /* Once to see how long the result is; once to build and hash it. */
+  apply_ed_cmds(lines, n_lines, &ed_diff, cmds, consdiff_output_line, &out);
+  out.buf = tor_malloc(out.len+1);
+  out.len = 0;
+  out.digest = crypto_digest256_new(DIGEST_SHA256);
+  apply_ed_cmds(lines, n_lines, &ed_diff, cmds, consdiff_output_line, &out);
+  out.buf[out.len] = '\0';
+
+  if (out.hash_state == CONSDIFF_HASH_DONE) {
+    crypto_digest_get_digest(out.digest, cons2_hash, DIGEST256_LEN);
+  } else {
+    digests_t cons2_digests;
+    if (router_get_networkstatus_v3_hashes(out.buf, &cons2_digests)<0) {
+      log_warn(LD_CONSDIFF, "Could not compute digests of the consensus "
+          "resulting from applying a consensus diff.");
+      goto error_cleanup;
+    }
+    memcpy(cons2_hash, cons2_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  }
+
+  /* See that the resulting consensus matches its hash. */
+  if (memcmp(cons2_hash, e_cons2_hash, DIGEST256_LEN) != 0) {
+    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
+        "the resulting consensus doesn't match its own digest as found in "
+        "the consensus diff header.");
+    char hex_digest2[HEX_DIGEST256_LEN+1];
+    char e_hex_digest2[HEX_DIGEST256_LEN+1];
+    base16_encode(hex_digest2, HEX_DIGEST256_LEN+1,
+        cons2_hash, DIGEST256_LEN);
+    base16_encode(e_hex_digest2, HEX_DIGEST256_LEN+1,
+        e_cons2_hash, DIGEST256_LEN);
+    log_warn(LD_CONSDIFF, "Expected: %s Found: %s\n",
+             hex_digest2, e_hex_digest2);
+    goto error_cleanup;
+  }
+
+  crypto_digest_free(out.digest);
+  SMARTLIST_FOREACH(cmds, ed_cmd_t *, cmd, tor_free(cmd));
+  smartlist_free(cmds);
+  return out.buf;
 
   error_cleanup:
 
-  SMARTLIST_FOREACH(cons2, char*, line, tor_free(line));
-  smartlist_free(cons2);
+  crypto_digest_free(out.digest);
+  tor_free(out.buf);
+  if (cmds) {
+    SMARTLIST_FOREACH(cmds, ed_cmd_t *, cmd, tor_free(cmd));
+    smartlist_free(cmds);
+  }
 
   return NULL;
 }
@@ -934,99 +1358,33 @@ consdiff_get_digests(smartlist_t *diff,
   return 1;
 }
 
-/** Apply the consensus diff to the given consensus and return a new
- * consensus, also as a line-based smartlist. Will return NULL if the diff
- * could not be applied. Neither the consensus nor the diff are modified in
- * any way, so it's up to the caller to free their resources.
+/** Apply the consensus diff to the given consensus and return the new
+ * consensus as a string. Will return NULL if the diff could not be applied.
+ * Neither the consensus nor the diff are modified in any way, so it's up to
+ * the caller to free their resources.
  */
 char *
 consdiff_apply_diff(smartlist_t *cons1, smartlist_t *diff,
                     digests_t *digests1)
 {
-  smartlist_t *cons2 = NULL;
-  char *cons2_str = NULL;
-  char e_cons1_hash[DIGEST256_LEN];
-  char e_cons2_hash[DIGEST256_LEN];
-
-  if (consdiff_get_digests(diff,
-        e_cons1_hash, NULL, e_cons2_hash, NULL) != 0) {
-    goto error_cleanup;
-  }
-
-  /* See that the consensus that was given to us matches its hash. */
-  if (memcmp(digests1->d[DIGEST_SHA256], e_cons1_hash,
-             DIGEST256_LEN) != 0) {
-    char hex_digest1[HEX_DIGEST256_LEN+1];
-    char e_hex_digest1[HEX_DIGEST256_LEN+1];
-    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
-        "the base consensus doesn't match its own digest as found in "
-        "the consensus diff header.");
-    base16_encode(hex_digest1, HEX_DIGEST256_LEN+1,
-        digests1->d[DIGEST_SHA256], DIGEST256_LEN);
-    base16_encode(e_hex_digest1, HEX_DIGEST256_LEN+1,
-        e_cons1_hash, DIGEST256_LEN);
-    log_warn(LD_CONSDIFF, "Expected: %s Found: %s\n",
-             hex_digest1, e_hex_digest1);
-    goto error_cleanup;
-  }
-
-  /* Grab the ed diff and calculate the resulting consensus. */
-  /* To avoid copying memory or iterating over all the elements, make a
-   * read-only smartlist without the two header lines.
-   */
-  smartlist_t *ed_diff = tor_malloc(sizeof(smartlist_t));
-  ed_diff->list = diff->list+2;
-  ed_diff->num_used = diff->num_used-2;
-  ed_diff->capacity = diff->capacity-2;
-  cons2 = apply_ed_diff(cons1, ed_diff);
-  tor_free(ed_diff);
-
-  /* ed diff could not be applied - reason already logged by apply_ed_diff. */
-  if (!cons2) {
-    goto error_cleanup;
-  }
-
-  cons2_str = smartlist_join_strings(cons2, "\n", 1, NULL);
-  SMARTLIST_FOREACH(cons2, char *, cp, tor_free(cp));
-  smartlist_free(cons2);
-
-  digests_t cons2_digests;
-  if (router_get_networkstatus_v3_hashes(cons2_str,
-                                         &cons2_digests)<0) {
-    log_warn(LD_CONSDIFF, "Could not compute digests of the consensus "
-        "resulting from applying a consensus diff.");
-    goto error_cleanup;
-  }
-
-  /* See that the resulting consensus matches its hash. */
-  if (memcmp(cons2_digests.d[DIGEST_SHA256], e_cons2_hash,
-             DIGEST256_LEN) != 0) {
-    log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
-        "the resulting consensus doesn't match its own digest as found in "
-        "the consensus diff header.");
-    char hex_digest2[HEX_DIGEST256_LEN+1];
-    char e_hex_digest2[HEX_DIGEST256_LEN+1];
-    base16_encode(hex_digest2, HEX_DIGEST256_LEN+1,
-        cons2_digests.d[DIGEST_SHA256], DIGEST256_LEN);
-    base16_encode(e_hex_digest2, HEX_DIGEST256_LEN+1,
-        e_cons2_hash, DIGEST256_LEN);
-    log_warn(LD_CONSDIFF, "Expected: %s Found: %s\n",
-             hex_digest2, e_hex_digest2);
-    goto error_cleanup;
-  }
-
-  return cons2_str;
-
-  error_cleanup:
-
-  if (cons2) {
-    SMARTLIST_FOREACH(cons2, char *, cp, tor_free(cp));
-    smartlist_free(cons2);
-  }
-  if (cons2_str) {
-    tor_free(cons2_str);
-  }
+  cons_line_t *lines = cons_lines_from_smartlist(cons1);
+  char *cons2 = apply_diff_impl(lines, smartlist_len(cons1), diff, digests1);
+  tor_free(lines);
+  return cons2;
+}
 
-  return NULL;
+/** As consdiff_apply_diff, but take the base consensus as the <b>len</b>
+ * bytes at <b>cons1</b>, which need not be NUL-terminated; for instance, a
+ * memory-mapped file. The base consensus is neither copied nor split.
+ */
+char *
+consdiff_apply_diff_from_str(const char *cons1, size_t len,
+                             smartlist_t *diff, digests_t *digests1)
+{
+  int n_lines;
+  cons_line_t *lines = cons_lines_from_string(cons1, len, &n_lines);
+  char *cons2 = apply_diff_impl(lines, n_lines, diff, digests1);
+  tor_free(lines);
+  return cons2;
 }
 
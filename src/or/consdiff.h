@@ -13,6 +13,9 @@ consdiff_gen_diff(smartlist_t *cons1, smartlist_t *cons2,
 char *
 consdiff_apply_diff(smartlist_t *cons1, smartlist_t *diff,
                     digests_t *digests1);
+char *
+consdiff_apply_diff_from_str(const char *cons1, size_t len,
+                             smartlist_t *diff, digests_t *digests1);
 int
 consdiff_get_digests(smartlist_t *diff,
                      char *digest1, char *digest1_hex,
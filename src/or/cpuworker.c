@@ -8,7 +8,12 @@
  * \brief Uses the workqueue/threadpool code to farm CPU-intensive activities
  * out to subprocesses.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins and (through
+ * cpuworker_queue_work()) for parsing votes.  Long jobs that nothing is
+ * waiting for, like generating consensus diffs and rebuilding the
+ * descriptor stores, go through cpuworker_queue_background_work() to a
+ * separate pool with a single thread, so that they can't hold up circuit
+ * handshakes.
  **/
 #include "or.h"
 #include "channel.h"
@@ -55,6 +60,9 @@ worker_state_free(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** The pool for cpuworker_queue_background_work().  Its replies go to
+ * <b>replyqueue</b> too. */
+static threadpool_t *background_threadpool = NULL;
 static struct event *reply_event = NULL;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
@@ -62,6 +70,20 @@ static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
 
+/** Background work needs no per-thread state, but the threadpool wants
+ * some. */
+static void *
+background_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+static void
+background_state_free(void *arg)
+{
+  tor_free(arg);
+}
+
 static void
 replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
 {
@@ -95,6 +117,13 @@ cpu_init(void)
                                 worker_state_free,
                                 NULL);
   }
+  if (!background_threadpool) {
+    background_threadpool = threadpool_new(1,
+                                           replyqueue,
+                                           background_state_new,
+                                           background_state_free,
+                                           NULL);
+  }
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
   crypto_seed_weak_rng(&request_sample_rng);
@@ -193,6 +222,36 @@ cpuworkers_rotate_keyinfo(void)
   }
 }
 
+/** Queue <b>fn</b> to be run on <b>arg</b> in a worker thread, and then
+ * <b>reply_fn</b> to be run on <b>arg</b> in the main thread once it's done.
+ * <b>fn</b> must not touch anything that the main thread might be using.
+ *
+ * Return the queued work on success.  Return NULL if we have no worker
+ * threads or couldn't queue the work; the caller should then do it itself.
+ */
+MOCK_IMPL(struct workqueue_entry_s *,
+cpuworker_queue_work,(int (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return NULL;
+  return threadpool_queue_work(threadpool, fn, reply_fn, arg);
+}
+
+/** As cpuworker_queue_work(), but for long jobs that nothing is waiting
+ * on: run <b>fn</b> on the background thread, behind any other background
+ * work, rather than on the threads that process onionskins. */
+MOCK_IMPL(struct workqueue_entry_s *,
+cpuworker_queue_background_work,(int (*fn)(void *, void *),
+                                 void (*reply_fn)(void *),
+                                 void *arg))
+{
+  if (!background_threadpool)
+    return NULL;
+  return threadpool_queue_work(background_threadpool, fn, reply_fn, arg);
+}
+
 /** Indexed by handshake type: how many onionskins have we processed and
  * counted of that type? */
 static uint64_t onionskins_n_processed[MAX_ONION_HANDSHAKE_TYPE+1];
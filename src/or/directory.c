@@ -1680,13 +1680,13 @@ resolve_fetched_consensus(const char *body, size_t body_len,
       return NULL;
     }
     networkstatus_t *c = networkstatus_get_latest_consensus_by_flavor(flavor);
-    char *base_cons = tor_strndup(cons_mmap->data, cons_mmap->size);
+    /* Apply the diff to the mapped consensus in place, rather than copying
+     * it and splitting the copy into lines. */
+    char *diff_result = consdiff_apply_diff_from_str(cons_mmap->data,
+                                                     cons_mmap->size,
+                                                     body_lines,
+                                                     &c->digests);
     tor_munmap_file(cons_mmap);
-    smartlist_t *base_cons_lines = smartlist_new();
-    tor_split_lines(base_cons_lines, base_cons, (int)strlen(base_cons));
-    char *diff_result = consdiff_apply_diff(base_cons_lines, body_lines,
-                                      &c->digests);
-    tor_free(base_cons); smartlist_free(base_cons_lines);
     tor_free(body_dup); smartlist_free(body_lines);
 
     if (diff_result) {
@@ -1977,8 +1977,6 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
   }
   if (conn->base_.purpose == DIR_PURPOSE_FETCH_STATUS_VOTE) {
-    const char *msg;
-    int st;
     log_info(LD_DIR,"Got votes (size %d) from server %s:%d",
              (int)body_len, conn->base_.address, conn->base_.port);
     if (status_code != 200) {
@@ -1990,12 +1988,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       tor_free(body); tor_free(headers); tor_free(reason);
       return -1;
     }
-    dirvote_add_vote(body, &msg, &st);
-    if (st > 299) {
-      log_warn(LD_DIR, "Error adding retrieved vote: %s", msg);
-    } else {
-      log_info(LD_DIR, "Added vote(s) successfully [msg: %s]", msg);
-    }
+    dirvote_add_vote_in_background(body, 0);
   }
   if (conn->base_.purpose == DIR_PURPOSE_FETCH_DETACHED_SIGNATURES) {
     const char *msg = NULL;
@@ -3474,16 +3467,8 @@ directory_handle_command_post(dir_connection_t *conn, const char *headers,
 
   if (authdir_mode_v3(options) &&
       !strcmp(url,"/tor/post/vote")) { /* v3 networkstatus vote */
-    const char *msg = "OK";
-    int status;
-    if (dirvote_add_vote(body, &msg, &status)) {
-      write_http_status_line(conn, status, "Vote stored");
-    } else {
-      tor_assert(msg);
-      log_warn(LD_DIRSERV, "Rejected vote from %s (\"%s\").",
-               conn->base_.address, msg);
-      write_http_status_line(conn, status, msg);
-    }
+    /* We answer once the vote is parsed; see directory_vote_added(). */
+    dirvote_add_vote_in_background(body, TO_CONN(conn)->global_identifier);
     goto done;
   }
 
@@ -3508,6 +3493,43 @@ directory_handle_command_post(dir_connection_t *conn, const char *headers,
   return 0;
 }
 
+/** Called when we've finished adding the votes that the directory
+ * connection with global identifier <b>conn_id</b> posted to us, or the
+ * votes that we fetched if <b>conn_id</b> is 0.  <b>added</b> is true iff
+ * we stored any of them; <b>msg</b> and <b>status</b> are the HTTP response
+ * and status code from dirvote_add_vote().  Answer the connection, if it's
+ * still open. */
+MOCK_IMPL(void,
+directory_vote_added,(uint64_t conn_id, int added, const char *msg,
+                      int status))
+{
+  connection_t *conn;
+  tor_assert(msg);
+
+  if (!conn_id) {
+    if (status > 299) {
+      log_warn(LD_DIR, "Error adding retrieved vote: %s", msg);
+    } else {
+      log_info(LD_DIR, "Added vote(s) successfully [msg: %s]", msg);
+    }
+    return;
+  }
+
+  conn = connection_get_by_global_id(conn_id);
+  if (!conn || conn->marked_for_close || conn->type != CONN_TYPE_DIR) {
+    log_info(LD_DIRSERV, "Connection that posted a vote closed before we "
+             "could answer it (\"%s\").", msg);
+    return;
+  }
+  if (added) {
+    write_http_status_line(TO_DIR_CONN(conn), status, "Vote stored");
+  } else {
+    log_warn(LD_DIRSERV, "Rejected vote from %s (\"%s\").",
+             conn->address, msg);
+    write_http_status_line(TO_DIR_CONN(conn), status, msg);
+  }
+}
+
 /** Called when a dirserver receives data on a directory connection;
  * looks for an HTTP request.  If the request is complete, remove it
  * from the inbuf, try to process it; otherwise, leave it on the
@@ -64,6 +64,8 @@ int connection_dir_process_inbuf(dir_connection_t *conn);
 int connection_dir_finished_flushing(dir_connection_t *conn);
 int connection_dir_finished_connecting(dir_connection_t *conn);
 void connection_dir_about_to_close(dir_connection_t *dir_conn);
+MOCK_DECL(void, directory_vote_added, (uint64_t conn_id, int added,
+                                       const char *msg, int status));
 void directory_initiate_command(const tor_addr_t *addr,
                                 uint16_t or_port, uint16_t dir_port,
                                 const char *digest,
@@ -15,6 +15,7 @@
 #include "connection_or.h"
 #include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -30,6 +31,7 @@
 #include "routerparse.h"
 #include "routerset.h"
 #include "torcert.h"
+#include "workqueue.h"
 
 /**
  * \file dirserv.c
@@ -1202,14 +1204,13 @@ new_cached_dir(char *s, time_t published)
 }
 
 /** Allocate and return a new cached_dir_t containing the compressed string
- * <b>s</b> of len <b>s_len</b>, published at <b>published</b>. */
+ * <b>s</b> of len <b>s_len</b>, published at <b>published</b>.  The
+ * cached_dir_t takes ownership of <b>s</b>. */
 static cached_dir_t *
 new_cached_dir_comp(char *s, size_t s_len, time_t published)
 {
   cached_dir_t *d = tor_malloc_zero(sizeof(cached_dir_t));
   d->refcnt = 1;
-  d->dir = s;
-  d->dir_len = s_len;
   d->dir_z = s;
   d->dir_z_len = s_len;
   d->published = published;
@@ -1247,10 +1248,7 @@ free_old_cached_consensus_(void *_c)
 
   c = (old_cached_consensus_t *)_c;
 
-  if (c->cached_dir && --c->cached_dir->refcnt == 0) {
-    tor_munmap_file(c->diff_mmap);
-    tor_free(c->cached_dir);
-  }
+  cached_dir_decref(c->cached_dir);
   tor_free(c->hex_digest);
   tor_free(c);
 }
@@ -1363,11 +1361,12 @@ dirserv_refresh_stored_consensuses(void)
       c->hex_digest = tor_strdup(digest);
       char *consensus_diff_fname = get_datadir_fname2(flavdir_diff, name);
       // TODO: check that the stored consensus is intact
-      c->diff_mmap = tor_mmap_file(consensus_diff_fname);
-      if (c->diff_mmap) {
-        c->cached_dir = new_cached_dir_comp((char*)c->diff_mmap->data,
-                                            c->diff_mmap->size,
-                                            0);
+      struct stat diff_stat;
+      char *diff_comp = read_file_to_str(consensus_diff_fname,
+                                         RFTS_BIN|RFTS_IGNORE_MISSING,
+                                         &diff_stat);
+      if (diff_comp) {
+        c->cached_dir = new_cached_dir_comp(diff_comp, diff_stat.st_size, 0);
       } else {
         c->cached_dir = NULL;
       }
@@ -1419,7 +1418,6 @@ dirserv_store_consensus(const char *consensus, const char *flavor,
   c->flavor = networkstatus_parse_flavor_name(flavor);
   c->valid_after = valid_after;
   c->hex_digest = tor_strdup(digest);
-  c->diff_mmap = NULL;
   c->cached_dir = NULL;
   strmap_set(old_cached_consensus_by_digest, digest, c);
 
@@ -1485,7 +1483,7 @@ dirserv_remove_old_consensuses(int32_t old_consensuses_to_keep)
       strmap_remove(old_cached_consensus_by_digest, c->hex_digest);
       tor_free(consensus_fname);
       tor_free(diff_fname);
-      tor_free(c->cached_dir);
+      cached_dir_decref(c->cached_dir);
       tor_free(c->hex_digest);
       tor_free(c);
     }
@@ -1493,9 +1491,180 @@ dirserv_remove_old_consensuses(int32_t old_consensuses_to_keep)
   smartlist_free(old_consensuses);
 }
 
-/** Updates all cached consensus diffs of a certain flavor given a consensus
- * diff. Writes the newly created consensus diffs to disk using zlib. Updates
- * old_cached_consensus_by_digest with the new diff file mmaps accordingly.
+/** A consensus that we're generating diffs to, shared by all the diff jobs
+ * for it.  Worker threads may read it but not change it. */
+typedef struct consdiff_target_t {
+  /** Number of references to this target: one for each diff job that's
+   * using it, and one while we're queueing them.  Only changed in the main
+   * thread. */
+  int refcnt;
+  /** A copy of the consensus, split in place into <b>lines</b>. */
+  char *body;
+  smartlist_t *lines;
+  /** Digests of the consensus. */
+  digests_t digests;
+} consdiff_target_t;
+
+/** A job for a worker thread: generate the compressed diff from a stored
+ * consensus to a target consensus, and write it to disk. */
+typedef struct consdiff_job_t {
+  /** The consensus we're generating a diff to. */
+  consdiff_target_t *target;
+  /** Flavor of both consensuses. */
+  consensus_flavor_t flavor;
+  /** Value of consdiff_generation[flavor] when this job was queued. */
+  unsigned generation;
+  /** valid_after time of the target consensus. */
+  time_t published;
+  /** Hex sha256 digest of the stored consensus we're diffing from. */
+  char *base_hex_digest;
+  /** Filename of the stored, compressed consensus we're diffing from. */
+  char *base_fname;
+  /** Where the worker writes the compressed diff. */
+  char *tmp_fname;
+  /** Where we move the compressed diff once we publish it. */
+  char *diff_fname;
+  /** Severity for complaints about a corrupt stored consensus.  Chosen when
+   * the job is queued, since the worker can't look at the options. */
+  int protocol_warn_severity;
+  /** The compressed diff, once the worker is done, or NULL if it failed. */
+  char *diff_comp;
+  size_t diff_comp_len;
+} consdiff_job_t;
+
+/** Indexed by consensus flavor: how many times have we started generating
+ * diffs to a new consensus? Lets us tell when a finished diff leads to a
+ * consensus that isn't current any more. */
+static unsigned consdiff_generation[N_CONSENSUS_FLAVORS];
+
+/** Drop a reference to <b>target</b>, freeing it if there are no more. */
+static void
+consdiff_target_decref(consdiff_target_t *target)
+{
+  if (!target || --target->refcnt > 0)
+    return;
+  smartlist_free(target->lines);
+  tor_free(target->body);
+  tor_free(target);
+}
+
+/** Release all storage held by <b>job</b>. */
+static void
+consdiff_job_free(consdiff_job_t *job)
+{
+  if (!job)
+    return;
+  consdiff_target_decref(job->target);
+  tor_free(job->base_hex_digest);
+  tor_free(job->base_fname);
+  tor_free(job->tmp_fname);
+  tor_free(job->diff_fname);
+  tor_free(job->diff_comp);
+  tor_free(job);
+}
+
+/** Worker thread function: read and uncompress the stored consensus for
+ * <b>work_</b> (a consdiff_job_t), diff it against the target, and compress
+ * the diff and write it to the job's temporary file.  Uses only the job's
+ * own fields, so that it's safe to run outside the main thread. */
+static int
+consdiff_job_threadfn(void *state_, void *work_)
+{
+  consdiff_job_t *job = work_;
+  char *stored_consensus_comp = NULL, *stored_consensus = NULL;
+  char *diff = NULL;
+  size_t stored_consensus_len, diff_len;
+  smartlist_t *stored_consensus_sl = NULL, *diff_sl = NULL;
+  digests_t stored_cons_digests;
+  struct stat comp_stat;
+  (void) state_;
+
+  stored_consensus_comp = read_file_to_str(job->base_fname,
+                                           RFTS_BIN, &comp_stat);
+  if (!stored_consensus_comp)
+    goto done;
+  if (tor_gzip_uncompress(&stored_consensus, &stored_consensus_len,
+                          stored_consensus_comp, comp_stat.st_size,
+                          ZLIB_METHOD, 1, job->protocol_warn_severity) < 0)
+    goto done;
+  if (router_get_networkstatus_v3_hashes(stored_consensus,
+                                         &stored_cons_digests) < 0)
+    goto done;
+
+  stored_consensus_sl = smartlist_new();
+  tor_split_lines(stored_consensus_sl, stored_consensus,
+                  (int)strlen(stored_consensus));
+  diff_sl = consdiff_gen_diff(stored_consensus_sl, job->target->lines,
+                              &stored_cons_digests, &job->target->digests);
+  if (!diff_sl)
+    goto done;
+
+  diff = smartlist_join_strings(diff_sl, "\n", 0, &diff_len);
+  if (tor_gzip_compress(&job->diff_comp, &job->diff_comp_len,
+                        diff, diff_len, ZLIB_METHOD) < 0) {
+    job->diff_comp = NULL;
+    goto done;
+  }
+  if (write_bytes_to_file(job->tmp_fname, job->diff_comp,
+                          job->diff_comp_len, 1) < 0) {
+    tor_free(job->diff_comp);
+  }
+
+ done:
+  if (diff_sl) {
+    SMARTLIST_FOREACH(diff_sl, char *, cp, tor_free(cp));
+    smartlist_free(diff_sl);
+  }
+  smartlist_free(stored_consensus_sl);
+  tor_free(diff);
+  tor_free(stored_consensus);
+  tor_free(stored_consensus_comp);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread function, run when a worker is done with <b>work_</b> (a
+ * consdiff_job_t): if the diff it made still leads to the current
+ * consensus, move it into place and start serving it. */
+static void
+consdiff_job_replyfn(void *work_)
+{
+  consdiff_job_t *job = work_;
+  old_cached_consensus_t *c = NULL;
+
+  if (job->generation == consdiff_generation[job->flavor] &&
+      old_cached_consensus_by_digest)
+    c = strmap_get(old_cached_consensus_by_digest, job->base_hex_digest);
+
+  if (!job->diff_comp) {
+    if (c)
+      log_warn(LD_DIRSERV, "Unable to generate a consensus diff from the "
+               "stored consensus %s.", job->base_hex_digest);
+  } else if (!c) {
+    /* A newer consensus arrived, or the stored one went away, while we
+     * were working. */
+    log_info(LD_DIRSERV, "Discarding out-of-date consensus diff from %s.",
+             job->base_hex_digest);
+    unlink(job->tmp_fname);
+  } else if (replace_file(job->tmp_fname, job->diff_fname) < 0) {
+    log_warn(LD_FS, "Unable to move consensus diff into place at %s: %s",
+             job->diff_fname, strerror(errno));
+    unlink(job->tmp_fname);
+  } else {
+    cached_dir_decref(c->cached_dir);
+    c->cached_dir = new_cached_dir_comp(job->diff_comp, job->diff_comp_len,
+                                        job->published);
+    job->diff_comp = NULL;
+  }
+
+  consdiff_job_free(job);
+}
+
+/** Starts regenerating all cached consensus diffs of a certain flavor so
+ * that they lead to the consensus <b>cur_consensus</b>. Each diff is
+ * generated, compressed with zlib and written to disk by a worker thread,
+ * and we start serving it as soon as it's ready; until then, we serve no
+ * diff from that stored consensus. (If we have no worker threads, as at
+ * startup, we generate the diffs right here.)
  * To make sure no diffs stay around forever, and since all diffs are
  * regenerated and written to disk again anyway, the complete directory will
  * be removed first. */
@@ -1504,7 +1673,6 @@ dirserv_update_consensus_diffs(const char *cur_consensus,
                                time_t published,
                                const char *flavname)
 {
-  int r = 0;
   digests_t cur_cons_digests;
   if (router_get_networkstatus_v3_hashes(cur_consensus,
                                          &cur_cons_digests) < 0) {
@@ -1521,12 +1689,18 @@ dirserv_update_consensus_diffs(const char *cur_consensus,
     return -1;
   }
 
-  consensus_flavor_t flavor = networkstatus_parse_flavor_name(flavname);
+  int flavor = networkstatus_parse_flavor_name(flavname);
+  if (flavor < 0) {
+    return -1;
+  }
+  unsigned generation = ++consdiff_generation[flavor];
 
-  char *cur_consensus_dup = tor_strdup(cur_consensus);
-  smartlist_t *cur_consensus_sl = smartlist_new();
-  tor_split_lines(cur_consensus_sl, cur_consensus_dup,
-      (int)strlen(cur_consensus_dup));
+  consdiff_target_t *target = tor_malloc_zero(sizeof(consdiff_target_t));
+  target->refcnt = 1;
+  target->body = tor_strdup(cur_consensus);
+  target->lines = smartlist_new();
+  tor_split_lines(target->lines, target->body, (int)strlen(target->body));
+  memcpy(&target->digests, &cur_cons_digests, sizeof(digests_t));
 
   char flavdir[64];
   tor_snprintf(flavdir, sizeof(flavdir),
@@ -1538,81 +1712,35 @@ dirserv_update_consensus_diffs(const char *cur_consensus,
     if (c->flavor != flavor) {
       continue;
     }
-    r = -1;
+
+    /* The diff we have leads to the previous consensus; stop serving it. */
+    cached_dir_decref(c->cached_dir);
+    c->cached_dir = NULL;
 
     char name[128];
     tor_snprintf(name, sizeof(name), "%ld-%s", c->valid_after, digest);
-    char *consensus_fname = get_datadir_fname2(flavdir, name);
-    struct stat comp_stat;
-    char *stored_consensus_comp = read_file_to_str(consensus_fname,
-                                             RFTS_BIN, &comp_stat);
-    tor_free(consensus_fname);
-    if (!stored_consensus_comp) {
-      break;
+    consdiff_job_t *job = tor_malloc_zero(sizeof(consdiff_job_t));
+    job->target = target;
+    ++target->refcnt;
+    job->flavor = flavor;
+    job->generation = generation;
+    job->published = published;
+    job->protocol_warn_severity = LOG_PROTOCOL_WARN;
+    job->base_hex_digest = tor_strdup(digest);
+    job->base_fname = get_datadir_fname2(flavdir, name);
+    job->diff_fname = get_datadir_fname2(flavdir_diff, name);
+    tor_asprintf(&job->tmp_fname, "%s.%u", job->diff_fname, generation);
+
+    if (!cpuworker_queue_background_work(consdiff_job_threadfn,
+                                         consdiff_job_replyfn, job)) {
+      consdiff_job_threadfn(NULL, job);
+      consdiff_job_replyfn(job);
     }
-    char *stored_consensus;
-    size_t stored_consensus_len;
-    r = tor_gzip_uncompress(&stored_consensus, &stored_consensus_len,
-                            stored_consensus_comp, comp_stat.st_size,
-                            ZLIB_METHOD, 1, LOG_PROTOCOL_WARN);
-    tor_free(stored_consensus_comp);
-
-    digests_t stored_cons_digests;
-    if ((r=router_get_networkstatus_v3_hashes(stored_consensus,
-                                           &stored_cons_digests)) < 0) {
-      tor_free(stored_consensus);
-      break;
-    }
-
-    smartlist_t *stored_consensus_sl = smartlist_new();
-    tor_split_lines(stored_consensus_sl, stored_consensus,
-        (int)strlen(stored_consensus));
-
-    smartlist_t *diff_sl = consdiff_gen_diff(
-        stored_consensus_sl, cur_consensus_sl,
-        &stored_cons_digests, &cur_cons_digests);
-    smartlist_free(stored_consensus_sl);
-    tor_free(stored_consensus);
-    if (!diff_sl) {
-      break;
-    }
-
-    size_t diff_len;
-    char *diff = smartlist_join_strings(diff_sl, "\n", 0, &diff_len);
-    SMARTLIST_FOREACH(diff_sl, char *, cp, tor_free(cp));
-    smartlist_free(diff_sl);
-
-    char *diff_comp;
-    size_t diff_comp_len;
-    r = tor_gzip_compress(&diff_comp, &diff_comp_len,
-                          diff, diff_len,
-                          ZLIB_METHOD);
-    tor_free(diff);
-    if (r < 0) {
-      break;
-    }
-
-    char *consensus_diff_fname = get_datadir_fname2(flavdir_diff, name);
-    r = write_bytes_to_file(consensus_diff_fname, diff_comp,
-                            diff_comp_len, 1);
-    tor_munmap_file(c->diff_mmap);
-    c->diff_mmap = tor_mmap_file(consensus_diff_fname);
-    tor_free(c->cached_dir);
-    c->cached_dir = new_cached_dir_comp((char*)c->diff_mmap->data,
-                                        c->diff_mmap->size,
-                                        published);
-    tor_free(consensus_diff_fname);
-    tor_free(diff_comp);
-    if (r < 0) {
-      break;
-    }
-
   } STRMAP_FOREACH_END;
 
-  tor_free(cur_consensus_dup);
-  smartlist_free(cur_consensus_sl);
+  consdiff_target_decref(target);
 
-  return r;
+  return 0;
 }
 
 /** If a router's uptime is at least this value, then it is always
@@ -2233,11 +2361,16 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char ipaddr[INET_NTOA_BUF_LEN];
+  struct in_addr in;
   smartlist_t *chunks = smartlist_new();
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  /* Not fmt_addr32(): we format consensus entries on worker threads. */
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, ipaddr, sizeof(ipaddr));
 
   smartlist_add_asprintf(chunks,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -2246,7 +2379,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   ipaddr,
                    (int)rs->or_port,
                    (int)rs->dir_port);
 
@@ -2261,8 +2394,10 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    char ipv6addr[TOR_ADDR_BUF_LEN];
+    tor_addr_to_str(ipv6addr, &rs->ipv6_addr, sizeof(ipv6addr), 1);
+    smartlist_add_asprintf(chunks, "a %s:%d\n",
+                           ipv6addr, (int)rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS)
@@ -39,11 +39,11 @@ typedef struct old_cached_consensus_t {
   char *hex_digest;
   /* valid_after time as found in the consensus. */
   time_t valid_after;
-  /* Memory map of the zlib-compressed consensus diff on disk. */
-  tor_mmap_t *diff_mmap;
   /* Flavor of the consensus. */
   consensus_flavor_t flavor;
-  /* Cached dir element used when serving consensus diffs. */
+  /* Cached dir element used when serving consensus diffs, holding the
+   * zlib-compressed diff to the current consensus.  NULL while that diff is
+   * being generated. */
   cached_dir_t *cached_dir;
 } old_cached_consensus_t;
 
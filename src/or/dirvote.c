@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "dircollate.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -19,6 +20,7 @@
 #include "routerparse.h"
 #include "entrynodes.h" /* needed for guardfraction methods */
 #include "torcert.h"
+#include "workqueue.h"
 
 /**
  * \file dirvote.c
@@ -466,10 +468,11 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      char addr[TOR_ADDR_BUF_LEN];
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      tor_addr_to_str(addr, &most_alt_orport->addr, sizeof(addr), 1);
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%d",
+                most->status.nickname, addr, (int)most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -1108,6 +1111,579 @@ update_total_bandwidth_weights(const routerstatus_t *rs,
   }
 }
 
+/** Everything that networkstatus_compute_consensus() works out from the
+ * votes before it looks at the routers they list.  Batches of routers share
+ * this, read-only, possibly from several threads at once. */
+typedef struct consensus_router_ctx_t {
+  smartlist_t *votes;
+  const smartlist_t *flags;
+  dircollator_t *collator;
+  int consensus_method;
+  int total_authorities;
+  consensus_flavor_t flavor;
+  routerstatus_format_type_t rs_format;
+  uint32_t max_unmeasured_bw_kb;
+  int n_authorities_measuring_bandwidth;
+  /** n_voter_flags[j] is the number of flags that votes[j] knows about. */
+  const int *n_voter_flags;
+  /** n_flag_voters[f] is the number of votes that care about flags[f]. */
+  const int *n_flag_voters;
+  /** flag_map[j][b] is an index f such that flags[f] is the same flag as
+   * votes[j]->known_flags[b]. */
+  int **flag_map;
+  /** Index of the flag "Named" for votes[j] */
+  const int *named_flag;
+  strmap_t *name_to_id_map;
+} consensus_router_ctx_t;
+
+/** The consensus entries for the routers that the collator of <b>ctx</b>
+ * numbers <b>lo</b> through <b>hi</b>-1. */
+typedef struct consensus_router_batch_t {
+  const consensus_router_ctx_t *ctx;
+  int lo, hi;
+  /** The text of the entries. */
+  smartlist_t *chunks;
+  /** Bandwidth weight totals for these routers, as for
+   * update_total_bandwidth_weights(). */
+  int64_t G, M, E, D, T;
+  /** True iff a worker thread is computing this batch. */
+  int queued;
+  /** True iff the worker thread is done with this batch, and won't touch
+   * it again.  Protected by consensus_batch_lock. */
+  int done;
+} consensus_router_batch_t;
+
+/** Don't split the routers into batches of fewer than this many. */
+STATIC int min_routers_per_consensus_batch = 512;
+
+/** Threads that compute batches of consensus entries, and the queue for
+ * their replies.  These aren't the cpuworker threads: the main thread waits
+ * for these, and it mustn't wait behind queued onionskins. */
+STATIC threadpool_t *consensus_batch_pool = NULL;
+static replyqueue_t *consensus_batch_replyqueue = NULL;
+
+/** Lock and condition with which worker threads tell
+ * networkstatus_compute_consensus() that they've finished a batch. */
+static tor_mutex_t *consensus_batch_lock = NULL;
+static tor_cond_t *consensus_batch_cond = NULL;
+
+/** Compute the consensus entries for the routers in <b>batch</b>. */
+static void
+compute_consensus_router_entries(consensus_router_batch_t *batch)
+{
+  const consensus_router_ctx_t *ctx = batch->ctx;
+  const int n_votes = smartlist_len(ctx->votes);
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  int i;
+  smartlist_t *matching_descs = smartlist_new();
+  smartlist_t *chosen_flags = smartlist_new();
+  smartlist_t *versions = smartlist_new();
+  smartlist_t *exitsummaries = smartlist_new();
+  uint32_t *bandwidths_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  uint32_t *measured_bws_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  uint32_t *measured_guardfraction = tor_calloc(n_votes, sizeof(uint32_t));
+  int num_bandwidths;
+  int num_mbws;
+  int num_guardfraction_inputs;
+
+  flag_counts = tor_calloc(smartlist_len(ctx->flags), sizeof(int));
+  for (i = batch->lo; i < batch->hi; ++i) {
+    vote_routerstatus_t **vrs_lst =
+      dircollator_get_votes_for_router(ctx->collator, i);
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *current_rsa_id = NULL;
+    const char *chosen_version;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    char microdesc_digest[DIGEST256_LEN];
+    tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(ctx->flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions);
+    num_bandwidths = 0;
+    num_mbws = 0;
+    num_guardfraction_inputs = 0;
+
+    /* Okay, go through all the entries for this digest. */
+    for (int voter_idx = 0; voter_idx < n_votes; ++voter_idx) {
+      if (vrs_lst[voter_idx] == NULL)
+        continue; /* This voter had nothing to say about this entry. */
+      rs = vrs_lst[voter_idx];
+      ++n_listing;
+
+      current_rsa_id = rs->status.identity_digest;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions, rs->version);
+
+      /* Tally up all the flags. */
+      for (int flag = 0; flag < ctx->n_voter_flags[voter_idx]; ++flag) {
+        if (rs->flags & (U64_LITERAL(1) << flag))
+          ++flag_counts[ctx->flag_map[voter_idx][flag]];
+      }
+      if (ctx->named_flag[voter_idx] >= 0 &&
+          (rs->flags & (U64_LITERAL(1) << ctx->named_flag[voter_idx]))) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                     chosen_name, rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* Count guardfraction votes and note down the values. */
+      if (rs->status.has_guardfraction) {
+        measured_guardfraction[num_guardfraction_inputs++] =
+          rs->status.guardfraction_percentage;
+      }
+
+      /* count bandwidths */
+      if (rs->has_measured_bw)
+        measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
+
+      if (rs->status.has_bandwidth)
+        bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
+    }
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= ctx->total_authorities/2)
+      continue;
+
+    /* The clangalyzer can't figure out that this will never be NULL
+     * if n_listing is at least 1 */
+    tor_assert(current_rsa_id);
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, ctx->consensus_method,
+                                        microdesc_digest, &alt_orport);
+    /* Copy bits of that into rs_out. */
+    memset(&rs_out, 0, sizeof(rs_out));
+    tor_assert(fast_memeq(current_rsa_id,
+                          rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    rs_out.addr = rs->status.addr;
+    rs_out.published_on = rs->status.published_on;
+    rs_out.dir_port = rs->status.dir_port;
+    rs_out.or_port = rs->status.or_port;
+    if (ctx->consensus_method >= MIN_METHOD_FOR_A_LINES) {
+      tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
+      rs_out.ipv6_orport = alt_orport.port;
+    }
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    {
+      const char *d = strmap_get_lc(ctx->name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
+    SMARTLIST_FOREACH_BEGIN(ctx->flags, const char *, fl) {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed")) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > ctx->n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+        }
+      }
+    } SMARTLIST_FOREACH_END(fl);
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (!is_running)
+      continue;
+
+    /* Pick the version. */
+    if (smartlist_len(versions)) {
+      sort_version_list(versions, 0);
+      chosen_version = get_most_frequent_member(versions);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* If it's a guard and we have enough guardfraction votes,
+       calculate its consensus guardfraction value. */
+    if (is_guard && num_guardfraction_inputs > 2 &&
+        ctx->consensus_method >= MIN_METHOD_FOR_GUARDFRACTION) {
+      rs_out.has_guardfraction = 1;
+      rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
+                                                   num_guardfraction_inputs);
+      /* final value should be an integer percentage! */
+      tor_assert(rs_out.guardfraction_percentage <= 100);
+    }
+
+    /* Pick a bandwidth */
+    if (num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 0;
+      rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
+    } else if (num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 1;
+      rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
+      if (ctx->consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW &&
+          ctx->n_authorities_measuring_bandwidth > 2) {
+        /* Cap non-measured bandwidths. */
+        if (rs_out.bandwidth_kb > ctx->max_unmeasured_bw_kb) {
+          rs_out.bandwidth_kb = ctx->max_unmeasured_bw_kb;
+        }
+      }
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    is_exit = is_exit && !is_bad_exit;
+
+    /* Update total bandwidth weights with the bandwidths of this router. */
+    {
+      update_total_bandwidth_weights(&rs_out,
+                                     is_exit, is_guard,
+                                     &batch->G, &batch->M, &batch->E,
+                                     &batch->D, &batch->T);
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code)).
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      } SMARTLIST_FOREACH_END(vsr);
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+                 " for router %s with descriptor %s.  This really shouldn't"
+                 " have happened.", id, dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "Not one of the voters that made us select"
+                 "descriptor %s for router %s had an exit policy"
+                 "summary", dd, id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                   "policy summary for %s.  Wow.", id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    if (ctx->flavor == FLAV_MICRODESC &&
+        tor_digest256_is_zero(microdesc_digest)) {
+      /* With no microdescriptor digest, we omit the entry entirely. */
+      continue;
+    }
+
+    {
+      char *buf;
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      buf = routerstatus_format_entry(&rs_out, NULL, ctx->rs_format, NULL);
+      if (buf)
+        smartlist_add(batch->chunks, buf);
+    }
+    /*     Now an m line, if applicable. */
+    if (ctx->flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      char m[BASE64_DIGEST256_LEN+1];
+      digest256_to_base64(m, microdesc_digest);
+      smartlist_add_asprintf(batch->chunks, "m %s\n", m);
+    }
+    /*     Next line is all flags.  The "\n" is missing. */
+    smartlist_add(batch->chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add(batch->chunks, tor_strdup("\nv "));
+      smartlist_add(batch->chunks, tor_strdup(chosen_version));
+    }
+    smartlist_add(batch->chunks, tor_strdup("\n"));
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      char *guardfraction_str = NULL;
+      int unmeasured = rs_out.bw_is_unmeasured &&
+        ctx->consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW;
+
+      /* If we have guardfraction info, include it in the 'w' line. */
+      if (rs_out.has_guardfraction) {
+        tor_asprintf(&guardfraction_str,
+                     " GuardFraction=%u", rs_out.guardfraction_percentage);
+      }
+      smartlist_add_asprintf(batch->chunks, "w Bandwidth=%d%s%s\n",
+                             rs_out.bandwidth_kb,
+                             unmeasured?" Unmeasured=1":"",
+                             guardfraction_str ? guardfraction_str : "");
+
+      tor_free(guardfraction_str);
+    }
+
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && ctx->flavor == FLAV_NS) {
+      smartlist_add_asprintf(batch->chunks, "p %s\n", rs_out.exitsummary);
+    }
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths_kb);
+  tor_free(measured_bws_kb);
+  tor_free(measured_guardfraction);
+}
+
+/** Worker thread function: compute the batch of consensus entries in
+ * <b>work_</b>, and tell networkstatus_compute_consensus() when we're
+ * done. */
+static int
+consensus_batch_threadfn(void *state_, void *work_)
+{
+  consensus_router_batch_t *batch = work_;
+  (void) state_;
+
+  compute_consensus_router_entries(batch);
+
+  /* Once we set done, the batch belongs to the main thread again. */
+  tor_mutex_acquire(consensus_batch_lock);
+  batch->done = 1;
+  tor_cond_signal_all(consensus_batch_cond);
+  tor_mutex_release(consensus_batch_lock);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread reply function for consensus_batch_threadfn(). */
+static void
+consensus_batch_replyfn(void *work_)
+{
+  /* compute_consensus_router_entries_in_batches() has already taken the
+   * results and freed the batch. */
+  (void) work_;
+}
+
+static void *
+consensus_batch_state_new(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+consensus_batch_state_free(void *state)
+{
+  tor_free(state);
+}
+
+/** Start the threads that compute batches of consensus entries, if we
+ * haven't already.  Return 0 on success, -1 on failure. */
+static int
+consensus_batch_pool_init(void)
+{
+  int n_threads;
+
+  if (consensus_batch_pool)
+    return 0;
+  if (!consensus_batch_replyqueue) {
+    consensus_batch_replyqueue = replyqueue_new(0);
+    if (!consensus_batch_replyqueue)
+      return -1;
+  }
+  if (!consensus_batch_lock) {
+    consensus_batch_lock = tor_mutex_new_nonrecursive();
+    consensus_batch_cond = tor_cond_new();
+  }
+  /* The main thread computes one batch itself. */
+  n_threads = get_num_cpus(get_options()) - 1;
+  if (n_threads < 1)
+    n_threads = 1;
+  consensus_batch_pool = threadpool_new(n_threads,
+                                        consensus_batch_replyqueue,
+                                        consensus_batch_state_new,
+                                        consensus_batch_state_free,
+                                        NULL);
+  return consensus_batch_pool ? 0 : -1;
+}
+
+/** Add the consensus entries for every router that <b>ctx</b> describes
+ * to <b>chunks</b>, in order, and add their bandwidths to the totals in
+ * <b>G</b>, <b>M</b>, <b>E</b>, <b>D</b>, and <b>T</b>.  If there are
+ * enough routers and we have more than one CPU, split the routers into
+ * batches and have the threads in consensus_batch_pool compute all but the
+ * first.
+ *
+ * This blocks the main thread until every batch is done, as computing the
+ * whole consensus here always has.  It only waits for the consensus batch
+ * threads, which do nothing else. */
+static void
+compute_consensus_router_entries_in_batches(const consensus_router_ctx_t *ctx,
+                                            smartlist_t *chunks,
+                                            int64_t *G, int64_t *M,
+                                            int64_t *E, int64_t *D,
+                                            int64_t *T)
+{
+  const int num_routers = dircollator_n_routers(ctx->collator);
+  consensus_router_batch_t **batches;
+  int n_batches = get_num_cpus(get_options());
+  int i, n_queued = 0;
+
+  if (n_batches > num_routers / min_routers_per_consensus_batch)
+    n_batches = num_routers / min_routers_per_consensus_batch;
+  if (n_batches < 1)
+    n_batches = 1;
+
+  batches = tor_calloc(n_batches, sizeof(consensus_router_batch_t *));
+  for (i = 0; i < n_batches; ++i) {
+    batches[i] = tor_malloc_zero(sizeof(consensus_router_batch_t));
+    batches[i]->ctx = ctx;
+    batches[i]->lo = (int)(((int64_t)num_routers) * i / n_batches);
+    batches[i]->hi = (int)(((int64_t)num_routers) * (i+1) / n_batches);
+    batches[i]->chunks = smartlist_new();
+  }
+
+  if (n_batches > 1 && consensus_batch_pool_init() == 0) {
+    /* Clean up after the last consensus's batches. */
+    replyqueue_process(consensus_batch_replyqueue);
+    for (i = 1; i < n_batches; ++i) {
+      if (threadpool_queue_work(consensus_batch_pool,
+                                consensus_batch_threadfn,
+                                consensus_batch_replyfn, batches[i])) {
+        batches[i]->queued = 1;
+        ++n_queued;
+      }
+    }
+  }
+  if (n_queued)
+    log_info(LD_DIR, "Computing consensus entries for %d routers in %d "
+             "batches on worker threads.", num_routers, n_queued+1);
+
+  /* Whatever the workers aren't doing, we do ourselves. */
+  for (i = 0; i < n_batches; ++i) {
+    if (!batches[i]->queued)
+      compute_consensus_router_entries(batches[i]);
+  }
+  if (n_queued) {
+    tor_mutex_acquire(consensus_batch_lock);
+    for (i = 1; i < n_batches; ++i) {
+      while (batches[i]->queued && !batches[i]->done)
+        tor_cond_wait(consensus_batch_cond, consensus_batch_lock, NULL);
+    }
+    tor_mutex_release(consensus_batch_lock);
+  }
+
+  /* Put the batches back together, in order. */
+  for (i = 0; i < n_batches; ++i) {
+    consensus_router_batch_t *batch = batches[i];
+    smartlist_add_all(chunks, batch->chunks);
+    smartlist_free(batch->chunks);
+    batch->chunks = NULL;
+    *G += batch->G;
+    *M += batch->M;
+    *E += batch->E;
+    *D += batch->D;
+    *T += batch->T;
+    tor_free(batch);
+  }
+  tor_free(batches);
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1367,22 +1943,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
   {
     int *index; /* index[j] is the current index into votes[j]. */
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
     int i;
-    smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
-    smartlist_t *versions = smartlist_new();
-    smartlist_t *exitsummaries = smartlist_new();
-    uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
-                                         sizeof(uint32_t));
-    uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
-                                           sizeof(uint32_t));
-    uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
-                                                  sizeof(uint32_t));
-    int num_bandwidths;
-    int num_mbws;
-    int num_guardfraction_inputs;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1506,339 +2067,26 @@ networkstatus_compute_consensus(smartlist_t *votes,
     dircollator_collate(collator, consensus_method);
 
     /* Now go through all the votes */
-    flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
-    const int num_routers = dircollator_n_routers(collator);
-    for (i = 0; i < num_routers; ++i) {
-      vote_routerstatus_t **vrs_lst =
-        dircollator_get_votes_for_router(collator, i);
-
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *current_rsa_id = NULL;
-      const char *chosen_version;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      char microdesc_digest[DIGEST256_LEN];
-      tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      num_bandwidths = 0;
-      num_mbws = 0;
-      num_guardfraction_inputs = 0;
-
-      /* Okay, go through all the entries for this digest. */
-      for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
-        if (vrs_lst[voter_idx] == NULL)
-          continue; /* This voter had nothing to say about this entry. */
-        rs = vrs_lst[voter_idx];
-        ++n_listing;
-
-        current_rsa_id = rs->status.identity_digest;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        /* Tally up all the flags. */
-        for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
-          if (rs->flags & (U64_LITERAL(1) << flag))
-            ++flag_counts[flag_map[voter_idx][flag]];
-        }
-        if (named_flag[voter_idx] >= 0 &&
-            (rs->flags & (U64_LITERAL(1) << named_flag[voter_idx]))) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* Count guardfraction votes and note down the values. */
-        if (rs->status.has_guardfraction) {
-          measured_guardfraction[num_guardfraction_inputs++] =
-            rs->status.guardfraction_percentage;
-        }
-
-        /* count bandwidths */
-        if (rs->has_measured_bw)
-          measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
-
-        if (rs->status.has_bandwidth)
-          bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
-      }
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      /* The clangalyzer can't figure out that this will never be NULL
-       * if n_listing is at least 1 */
-      tor_assert(current_rsa_id);
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest, &alt_orport);
-      /* Copy bits of that into rs_out. */
-      memset(&rs_out, 0, sizeof(rs_out));
-      tor_assert(fast_memeq(current_rsa_id,
-                            rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      rs_out.addr = rs->status.addr;
-      rs_out.published_on = rs->status.published_on;
-      rs_out.dir_port = rs->status.dir_port;
-      rs_out.or_port = rs->status.or_port;
-      if (consensus_method >= MIN_METHOD_FOR_A_LINES) {
-        tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
-        rs_out.ipv6_orport = alt_orport.port;
-      }
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed")) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-          }
-        }
-      } SMARTLIST_FOREACH_END(fl);
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (!is_running)
-        continue;
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* If it's a guard and we have enough guardfraction votes,
-         calculate its consensus guardfraction value. */
-      if (is_guard && num_guardfraction_inputs > 2 &&
-          consensus_method >= MIN_METHOD_FOR_GUARDFRACTION) {
-        rs_out.has_guardfraction = 1;
-        rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
-                                                     num_guardfraction_inputs);
-        /* final value should be an integer percentage! */
-        tor_assert(rs_out.guardfraction_percentage <= 100);
-      }
-
-      /* Pick a bandwidth */
-      if (num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 0;
-        rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
-      } else if (num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 1;
-        rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
-        if (consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW &&
-            n_authorities_measuring_bandwidth > 2) {
-          /* Cap non-measured bandwidths. */
-          if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
-            rs_out.bandwidth_kb = max_unmeasured_bw_kb;
-          }
-        }
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      is_exit = is_exit && !is_bad_exit;
-
-      /* Update total bandwidth weights with the bandwidths of this router. */
-      {
-        update_total_bandwidth_weights(&rs_out,
-                                       is_exit, is_guard,
-                                       &G, &M, &E, &D, &T);
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code)).
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        } SMARTLIST_FOREACH_END(vsr);
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      if (flavor == FLAV_MICRODESC &&
-          tor_digest256_is_zero(microdesc_digest)) {
-        /* With no microdescriptor digest, we omit the entry entirely. */
-        continue;
-      }
-
-      {
-        char *buf;
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        buf = routerstatus_format_entry(&rs_out, NULL, rs_format, NULL);
-        if (buf)
-          smartlist_add(chunks, buf);
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1];
-        digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
-      }
-      smartlist_add(chunks, tor_strdup("\n"));
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *guardfraction_str = NULL;
-        int unmeasured = rs_out.bw_is_unmeasured &&
-          consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW;
-
-        /* If we have guardfraction info, include it in the 'w' line. */
-        if (rs_out.has_guardfraction) {
-          tor_asprintf(&guardfraction_str,
-                       " GuardFraction=%u", rs_out.guardfraction_percentage);
-        }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
-
-        tor_free(guardfraction_str);
-      }
-
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
-      }
-
-      /* And the loop is over and we move on to the next router */
+    {
+      consensus_router_ctx_t ctx;
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.votes = votes;
+      ctx.flags = flags;
+      ctx.collator = collator;
+      ctx.consensus_method = consensus_method;
+      ctx.total_authorities = total_authorities;
+      ctx.flavor = flavor;
+      ctx.rs_format = rs_format;
+      ctx.max_unmeasured_bw_kb = max_unmeasured_bw_kb;
+      ctx.n_authorities_measuring_bandwidth =
+        n_authorities_measuring_bandwidth;
+      ctx.n_voter_flags = n_voter_flags;
+      ctx.n_flag_voters = n_flag_voters;
+      ctx.flag_map = flag_map;
+      ctx.named_flag = named_flag;
+      ctx.name_to_id_map = name_to_id_map;
+      compute_consensus_router_entries_in_batches(&ctx, chunks,
+                                                  &G, &M, &E, &D, &T);
     }
 
     tor_free(index);
@@ -1848,17 +2096,9 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths_kb);
-    tor_free(measured_bws_kb);
-    tor_free(measured_guardfraction);
   }
 
   /* Mark the directory footer region */
@@ -2821,156 +3061,183 @@ list_v3_auth_ids(void)
   return keys;
 }
 
-/** Called when we have received a networkstatus vote in <b>vote_body</b>.
- * Parse and validate it, and on success store it as a pending vote (which we
- * then return).  Return NULL on failure.  Sets *<b>msg_out</b> and
- * *<b>status_out</b> to an HTTP response and status code.  (V3 authority
- * only) */
-pending_vote_t *
-dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
-{
+/** A vote that we've received, and what we got when we parsed it. */
+typedef struct parsed_vote_t {
+  /** The text of the vote. */
+  char *body;
+  /** The parsed vote, or NULL if we couldn't parse it. */
   networkstatus_t *vote;
-  networkstatus_voter_info_t *vi;
-  dir_server_t *ds;
+} parsed_vote_t;
+
+/** Parse every vote in <b>vote_body</b>, which may hold several of them one
+ * after another, as networkstatus_parse_vote_from_string_ext() does with
+ * <b>protocol_warn_severity</b> and <b>testing_tor_network</b>.  Return a
+ * newly allocated list of parsed_vote_t, one for each vote, in order.  This
+ * is the part of adding a vote that we can do on a worker thread: it doesn't
+ * look at our options, our pending votes, or our list of authorities. */
+static smartlist_t *
+dirvote_parse_votes(const char *vote_body, int protocol_warn_severity,
+                    int testing_tor_network)
+{
+  smartlist_t *parsed = smartlist_new();
+  const char *end_of_vote;
+
+  for (;;) {
+    parsed_vote_t *pv = tor_malloc_zero(sizeof(parsed_vote_t));
+    end_of_vote = NULL;
+    pv->vote = networkstatus_parse_vote_from_string_ext(vote_body,
+                                                  &end_of_vote, NS_TYPE_VOTE,
+                                                  protocol_warn_severity,
+                                                  testing_tor_network);
+    if (!end_of_vote)
+      end_of_vote = vote_body + strlen(vote_body);
+    if (!pv->vote)
+      log_warn(LD_DIR, "Couldn't parse vote: length was %d",
+               (int)strlen(vote_body));
+    pv->body = tor_strndup(vote_body, end_of_vote-vote_body);
+    smartlist_add(parsed, pv);
+
+    if (end_of_vote == vote_body ||
+        strcmpstart(end_of_vote, "network-status-version "))
+      break;
+    vote_body = end_of_vote;
+  }
+
+  return parsed;
+}
+
+/** Validate each vote in <b>parsed</b>, a list of parsed_vote_t from
+ * dirvote_parse_votes(), and store the good ones as pending votes.  Free
+ * <b>parsed</b>.  Return the last vote that we stored, or NULL if we stored
+ * none or any vote failed.  Sets *<b>msg_out</b> and *<b>status_out</b> to
+ * an HTTP response and status code. */
+static pending_vote_t *
+dirvote_add_parsed_votes(smartlist_t *parsed, const char **msg_out,
+                         int *status_out)
+{
   pending_vote_t *pending_vote = NULL;
-  const char *end_of_vote = NULL;
   int any_failed = 0;
-  tor_assert(vote_body);
-  tor_assert(msg_out);
-  tor_assert(status_out);
 
   if (!pending_vote_list)
     pending_vote_list = smartlist_new();
   *status_out = 0;
   *msg_out = NULL;
 
- again:
-  vote = networkstatus_parse_vote_from_string(vote_body, &end_of_vote,
-                                              NS_TYPE_VOTE);
-  if (!end_of_vote)
-    end_of_vote = vote_body + strlen(vote_body);
-  if (!vote) {
-    log_warn(LD_DIR, "Couldn't parse vote: length was %d",
-             (int)strlen(vote_body));
-    *msg_out = "Unable to parse vote";
-    goto err;
-  }
-  tor_assert(smartlist_len(vote->voters) == 1);
-  vi = get_voter(vote);
-  {
-    int any_sig_good = 0;
-    SMARTLIST_FOREACH(vi->sigs, document_signature_t *, sig,
-                      if (sig->good_signature)
-                        any_sig_good = 1);
-    tor_assert(any_sig_good);
-  }
-  ds = trusteddirserver_get_by_v3_auth_digest(vi->identity_digest);
-  if (!ds) {
-    char *keys = list_v3_auth_ids();
-    log_warn(LD_DIR, "Got a vote from an authority (nickname %s, address %s) "
-             "with authority key ID %s. "
-             "This key ID is not recognized.  Known v3 key IDs are: %s",
-             vi->nickname, vi->address,
-             hex_str(vi->identity_digest, DIGEST_LEN), keys);
-    tor_free(keys);
-    *msg_out = "Vote not from a recognized v3 authority";
-    goto err;
-  }
-  tor_assert(vote->cert);
-  if (!authority_cert_get_by_digests(vote->cert->cache_info.identity_digest,
-                                     vote->cert->signing_key_digest)) {
-    /* Hey, it's a new cert! */
-    trusted_dirs_load_certs_from_string(
-                               vote->cert->cache_info.signed_descriptor_body,
-                               TRUSTED_DIRS_CERTS_SRC_FROM_VOTE, 1 /*flush*/);
+  SMARTLIST_FOREACH_BEGIN(parsed, parsed_vote_t *, pv) {
+    networkstatus_t *vote = pv->vote;
+    networkstatus_voter_info_t *vi;
+    dir_server_t *ds;
+
+    if (!vote) {
+      *msg_out = "Unable to parse vote";
+      goto err;
+    }
+    tor_assert(smartlist_len(vote->voters) == 1);
+    vi = get_voter(vote);
+    {
+      int any_sig_good = 0;
+      SMARTLIST_FOREACH(vi->sigs, document_signature_t *, sig,
+                        if (sig->good_signature)
+                          any_sig_good = 1);
+      tor_assert(any_sig_good);
+    }
+    ds = trusteddirserver_get_by_v3_auth_digest(vi->identity_digest);
+    if (!ds) {
+      char *keys = list_v3_auth_ids();
+      log_warn(LD_DIR, "Got a vote from an authority (nickname %s, address "
+               "%s) with authority key ID %s. "
+               "This key ID is not recognized.  Known v3 key IDs are: %s",
+               vi->nickname, vi->address,
+               hex_str(vi->identity_digest, DIGEST_LEN), keys);
+      tor_free(keys);
+      *msg_out = "Vote not from a recognized v3 authority";
+      goto err;
+    }
+    tor_assert(vote->cert);
     if (!authority_cert_get_by_digests(vote->cert->cache_info.identity_digest,
                                        vote->cert->signing_key_digest)) {
-      log_warn(LD_BUG, "We added a cert, but still couldn't find it.");
+      /* Hey, it's a new cert! */
+      trusted_dirs_load_certs_from_string(
+                               vote->cert->cache_info.signed_descriptor_body,
+                               TRUSTED_DIRS_CERTS_SRC_FROM_VOTE, 1 /*flush*/);
+      if (!authority_cert_get_by_digests(
+                                     vote->cert->cache_info.identity_digest,
+                                     vote->cert->signing_key_digest)) {
+        log_warn(LD_BUG, "We added a cert, but still couldn't find it.");
+      }
     }
-  }
 
-  /* Is it for the right period? */
-  if (vote->valid_after != voting_schedule.interval_starts) {
-    char tbuf1[ISO_TIME_LEN+1], tbuf2[ISO_TIME_LEN+1];
-    format_iso_time(tbuf1, vote->valid_after);
-    format_iso_time(tbuf2, voting_schedule.interval_starts);
-    log_warn(LD_DIR, "Rejecting vote from %s with valid-after time of %s; "
-             "we were expecting %s", vi->address, tbuf1, tbuf2);
-    *msg_out = "Bad valid-after time";
-    goto err;
-  }
+    /* Is it for the right period? */
+    if (vote->valid_after != voting_schedule.interval_starts) {
+      char tbuf1[ISO_TIME_LEN+1], tbuf2[ISO_TIME_LEN+1];
+      format_iso_time(tbuf1, vote->valid_after);
+      format_iso_time(tbuf2, voting_schedule.interval_starts);
+      log_warn(LD_DIR, "Rejecting vote from %s with valid-after time of %s; "
+               "we were expecting %s", vi->address, tbuf1, tbuf2);
+      *msg_out = "Bad valid-after time";
+      goto err;
+    }
 
-  /* Fetch any new router descriptors we just learned about */
-  update_consensus_router_descriptor_downloads(time(NULL), 1, vote);
-
-  /* Now see whether we already have a vote from this authority. */
-  SMARTLIST_FOREACH_BEGIN(pending_vote_list, pending_vote_t *, v) {
-      if (fast_memeq(v->vote->cert->cache_info.identity_digest,
-                   vote->cert->cache_info.identity_digest,
-                   DIGEST_LEN)) {
-        networkstatus_voter_info_t *vi_old = get_voter(v->vote);
-        if (fast_memeq(vi_old->vote_digest, vi->vote_digest, DIGEST_LEN)) {
-          /* Ah, it's the same vote. Not a problem. */
-          log_info(LD_DIR, "Discarding a vote we already have (from %s).",
-                   vi->address);
-          if (*status_out < 200)
-            *status_out = 200;
-          goto discard;
-        } else if (v->vote->published < vote->published) {
-          log_notice(LD_DIR, "Replacing an older pending vote from this "
-                     "directory (%s)", vi->address);
-          cached_dir_decref(v->vote_body);
-          networkstatus_vote_free(v->vote);
-          v->vote_body = new_cached_dir(tor_strndup(vote_body,
-                                                    end_of_vote-vote_body),
-                                        vote->published);
-          v->vote = vote;
-          if (end_of_vote &&
-              !strcmpstart(end_of_vote, "network-status-version"))
-            goto again;
-
-          if (*status_out < 200)
-            *status_out = 200;
-          if (!*msg_out)
-            *msg_out = "OK";
-          return v;
-        } else {
-          *msg_out = "Already have a newer pending vote";
-          goto err;
+    /* Fetch any new router descriptors we just learned about */
+    update_consensus_router_descriptor_downloads(time(NULL), 1, vote);
+
+    /* Now see whether we already have a vote from this authority. */
+    SMARTLIST_FOREACH_BEGIN(pending_vote_list, pending_vote_t *, v) {
+        if (fast_memeq(v->vote->cert->cache_info.identity_digest,
+                     vote->cert->cache_info.identity_digest,
+                     DIGEST_LEN)) {
+          networkstatus_voter_info_t *vi_old = get_voter(v->vote);
+          if (fast_memeq(vi_old->vote_digest, vi->vote_digest, DIGEST_LEN)) {
+            /* Ah, it's the same vote. Not a problem. */
+            log_info(LD_DIR, "Discarding a vote we already have (from %s).",
+                     vi->address);
+            if (*status_out < 200)
+              *status_out = 200;
+            goto discard;
+          } else if (v->vote->published < vote->published) {
+            log_notice(LD_DIR, "Replacing an older pending vote from this "
+                       "directory (%s)", vi->address);
+            cached_dir_decref(v->vote_body);
+            networkstatus_vote_free(v->vote);
+            v->vote_body = new_cached_dir(pv->body, vote->published);
+            pv->body = NULL;
+            v->vote = vote;
+            pending_vote = v;
+
+            if (*status_out < 200)
+              *status_out = 200;
+            if (!*msg_out)
+              *msg_out = "OK";
+            goto next;
+          } else {
+            *msg_out = "Already have a newer pending vote";
+            goto err;
+          }
         }
-      }
-  } SMARTLIST_FOREACH_END(v);
-
-  pending_vote = tor_malloc_zero(sizeof(pending_vote_t));
-  pending_vote->vote_body = new_cached_dir(tor_strndup(vote_body,
-                                                       end_of_vote-vote_body),
-                                           vote->published);
-  pending_vote->vote = vote;
-  smartlist_add(pending_vote_list, pending_vote);
-
-  if (!strcmpstart(end_of_vote, "network-status-version ")) {
-    vote_body = end_of_vote;
-    goto again;
-  }
-
-  goto done;
-
- err:
-  any_failed = 1;
-  if (!*msg_out)
-    *msg_out = "Error adding vote";
-  if (*status_out < 400)
-    *status_out = 400;
-
- discard:
-  networkstatus_vote_free(vote);
-
-  if (end_of_vote && !strcmpstart(end_of_vote, "network-status-version ")) {
-    vote_body = end_of_vote;
-    goto again;
-  }
+    } SMARTLIST_FOREACH_END(v);
 
- done:
+    pending_vote = tor_malloc_zero(sizeof(pending_vote_t));
+    pending_vote->vote_body = new_cached_dir(pv->body, vote->published);
+    pv->body = NULL;
+    pending_vote->vote = vote;
+    smartlist_add(pending_vote_list, pending_vote);
+    goto next;
+
+  err:
+    any_failed = 1;
+    if (!*msg_out)
+      *msg_out = "Error adding vote";
+    if (*status_out < 400)
+      *status_out = 400;
+
+  discard:
+    networkstatus_vote_free(vote);
+
+  next:
+    tor_free(pv->body);
+    tor_free(pv);
+  } SMARTLIST_FOREACH_END(pv);
+  smartlist_free(parsed);
 
   if (*status_out < 200)
     *status_out = 200;
@@ -2985,6 +3252,112 @@ dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
   return any_failed ? NULL : pending_vote;
 }
 
+/** Called when we have received a networkstatus vote in <b>vote_body</b>.
+ * Parse and validate it, and on success store it as a pending vote (which we
+ * then return).  Return NULL on failure.  Sets *<b>msg_out</b> and
+ * *<b>status_out</b> to an HTTP response and status code.  (V3 authority
+ * only) */
+pending_vote_t *
+dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
+{
+  tor_assert(vote_body);
+  tor_assert(msg_out);
+  tor_assert(status_out);
+
+  return dirvote_add_parsed_votes(
+                       dirvote_parse_votes(vote_body, LOG_PROTOCOL_WARN,
+                                           get_options()->TestingTorNetwork),
+                       msg_out, status_out);
+}
+
+/** Votes that we've asked a worker thread to parse for us. */
+typedef struct vote_parse_job_t {
+  /** The text of the votes.  The worker frees it once it's done. */
+  char *vote_body;
+  /** What to tell dirvote_parse_votes(), which can't look at the options
+   * itself. */
+  int protocol_warn_severity;
+  int testing_tor_network;
+  /** The votes, as parsed by dirvote_parse_votes(). */
+  smartlist_t *parsed;
+  /** The global identifier of the directory connection that posted the
+   * votes to us, or 0 if we fetched them ourselves. */
+  uint64_t conn_id;
+} vote_parse_job_t;
+
+/** How many vote_parse_job_t have we handed to worker threads that haven't
+ * come back yet? */
+static int n_vote_parse_jobs = 0;
+/** Don't hand more than this many vote_parse_job_t to worker threads at
+ * once.  Past this, we parse votes in the main thread, so that a flood of
+ * uploaded votes can't pile up in memory waiting for a worker. */
+STATIC int max_vote_parse_jobs = 16;
+
+/** Parse the votes in <b>job</b>.  Runs on a worker thread. */
+static int
+vote_parse_job_threadfn(void *state_, void *work_)
+{
+  vote_parse_job_t *job = work_;
+  (void) state_;
+
+  job->parsed = dirvote_parse_votes(job->vote_body,
+                                    job->protocol_warn_severity,
+                                    job->testing_tor_network);
+  tor_free(job->vote_body);
+  return WQ_RPL_REPLY;
+}
+
+/** Called in the main thread when a worker has parsed the votes in
+ * <b>work_</b>: validate and store them, and say how that went. */
+static void
+vote_parse_job_replyfn(void *work_)
+{
+  vote_parse_job_t *job = work_;
+  pending_vote_t *pending_vote;
+  const char *msg = NULL;
+  int status = 0;
+
+  --n_vote_parse_jobs;
+  pending_vote = dirvote_add_parsed_votes(job->parsed, &msg, &status);
+  directory_vote_added(job->conn_id, pending_vote != NULL, msg, status);
+  tor_free(job);
+}
+
+/** Called when we have received a networkstatus vote in <b>vote_body</b>,
+ * from the directory connection whose global identifier is <b>conn_id</b>,
+ * or from a fetch of ours if <b>conn_id</b> is 0.  Parse and check its
+ * signatures on a worker thread if we can, so that votes which arrive
+ * together don't wait for one another; then add it as dirvote_add_vote()
+ * would, and tell directory_vote_added() how that went.  If too many votes
+ * are already waiting for a worker, or we have no workers, do all of this
+ * right away. (V3 authority only) */
+void
+dirvote_add_vote_in_background(const char *vote_body, uint64_t conn_id)
+{
+  pending_vote_t *pending_vote;
+  const char *msg = NULL;
+  int status = 0;
+  tor_assert(vote_body);
+
+  if (n_vote_parse_jobs < max_vote_parse_jobs) {
+    vote_parse_job_t *job = tor_malloc_zero(sizeof(vote_parse_job_t));
+    job->vote_body = tor_strdup(vote_body);
+    job->conn_id = conn_id;
+    job->protocol_warn_severity = LOG_PROTOCOL_WARN;
+    job->testing_tor_network = get_options()->TestingTorNetwork;
+    if (cpuworker_queue_work(vote_parse_job_threadfn, vote_parse_job_replyfn,
+                             job)) {
+      ++n_vote_parse_jobs;
+      return;
+    }
+    tor_free(job->vote_body);
+    tor_free(job);
+  }
+
+  pending_vote = dirvote_add_vote(vote_body, &msg, &status);
+  directory_vote_added(conn_id, pending_vote != NULL, msg, status);
+}
+
 /** Try to compute a v3 networkstatus consensus from the currently pending
  * votes.  Return 0 on success, -1 on failure.  Store the consensus in
  * pending_consensus: it won't be ready to be published until we have
@@ -3361,6 +3734,15 @@ dirvote_free_all(void)
 
   dirvote_clear_pending_consensuses();
   tor_free(pending_consensus_signatures);
+  /* The batches are freed already, so their replies need no processing. */
+  threadpool_free(consensus_batch_pool);
+  consensus_batch_pool = NULL;
+  replyqueue_free(consensus_batch_replyqueue);
+  consensus_batch_replyqueue = NULL;
+  tor_mutex_free(consensus_batch_lock);
+  consensus_batch_lock = NULL;
+  tor_cond_free(consensus_batch_cond);
+  consensus_batch_cond = NULL;
   if (pending_consensus_signature_list) {
     /* now empty as a result of dirvote_clear_votes(). */
     smartlist_free(pending_consensus_signature_list);
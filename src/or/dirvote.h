@@ -131,6 +131,7 @@ void dirvote_act(const or_options_t *options, time_t now);
 struct pending_vote_t * dirvote_add_vote(const char *vote_body,
                                          const char **msg_out,
                                          int *status_out);
+void dirvote_add_vote_in_background(const char *vote_body, uint64_t conn_id);
 int dirvote_add_signatures(const char *detached_signatures_body,
                            const char *source,
                            const char **msg_out);
@@ -176,6 +177,11 @@ STATIC char *format_networkstatus_vote(crypto_pk_t *private_key,
 STATIC char *dirvote_compute_params(smartlist_t *votes, int method,
                              int total_authorities);
 STATIC char *compute_consensus_package_lines(smartlist_t *votes);
+#ifdef TOR_UNIT_TESTS
+extern int min_routers_per_consensus_batch;
+extern struct threadpool_s *consensus_batch_pool;
+extern int max_vote_parse_jobs;
+#endif
 #endif
 
 #endif
@@ -11,6 +11,8 @@
  * be nonblocking.)
  **/
 
+#define DNS_PRIVATE
+
 #include "or.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -81,13 +83,65 @@ struct evdns_request;
 
 #endif
 
-/** Longest hostname we're willing to resolve. */
-#define MAX_ADDRESSLEN 256
-
 /** How long will we wait for an answer from the resolver before we decide
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
+/** How many queries will we let evdns have in flight at once, for each
+ * nameserver we're using?  (Libevent's default is 64 in all.) */
+#define DNS_MAX_INFLIGHT_PER_NAMESERVER 256
+
+/** @name Nameserver timeouts
+ *
+ * We tell evdns to give up on a query after a few times the time our
+ * nameservers usually take to answer, so that a lost packet doesn't cost
+ * a stream several seconds when the nameservers are fast.  Evdns only
+ * understands whole seconds.
+ *
+ * @{ */
+/** The shortest timeout, in seconds, that we'll use. */
+#define DNS_MIN_TIMEOUT 2
+/** The timeout, in seconds, that we start with and never exceed when we
+ * have more than one nameserver. */
+#define DNS_MAX_TIMEOUT 5
+/** The timeout, in seconds, that we start with and never exceed when we
+ * have only one nameserver. */
+#define DNS_MAX_TIMEOUT_ONE_NAMESERVER 10
+/** How many times our smoothed answer time should the timeout be? */
+#define DNS_TIMEOUT_LATENCY_MULTIPLIER 4
+/** Don't lower the timeout until it would be this many seconds below the
+ * next whole second, so that it doesn't flap between two values. */
+#define DNS_TIMEOUT_HYSTERESIS 0.5
+/** How many seconds of queries timing out in a row, with more than one
+ * nameserver, before evdns marks a nameserver down?  (This is the 3
+ * max-timeouts at a 5 second timeout that we always used to set.) */
+#define DNS_MAX_TIMEOUT_SECONDS 15
+/** As DNS_MAX_TIMEOUT_SECONDS, with only one nameserver: 16 max-timeouts
+ * at a 10 second timeout. */
+#define DNS_MAX_TIMEOUT_SECONDS_ONE_NAMESERVER 160
+/** Each new answer time counts for 1/this of the smoothed answer time. */
+#define DNS_LATENCY_EWMA_DIVISOR 8
+/**@}*/
+
+/** How many cached answers with at least one address or hostname will we
+ * keep at once? */
+#define MAX_DNS_CACHE_POSITIVE 65536
+/** How many of those may be answers that have been asked for again since
+ * we cached them?  The rest are kept for answers that have been asked for
+ * only once, so that a flood of one-off names can't push out popular
+ * ones. */
+#define MAX_DNS_CACHE_PROTECTED (MAX_DNS_CACHE_POSITIVE / 5 * 4)
+/** How many cached answers with no address or hostname will we keep at
+ * once? */
+#define MAX_DNS_CACHE_NEGATIVE 8192
+
+/** The limits we actually enforce: MAX_DNS_CACHE_POSITIVE,
+ * MAX_DNS_CACHE_PROTECTED and MAX_DNS_CACHE_NEGATIVE, unless a test has
+ * lowered them. */
+STATIC int dns_cache_max_positive = MAX_DNS_CACHE_POSITIVE;
+STATIC int dns_cache_max_protected = MAX_DNS_CACHE_PROTECTED;
+STATIC int dns_cache_max_negative = MAX_DNS_CACHE_NEGATIVE;
+
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
@@ -102,87 +156,16 @@ static char *resolv_conf_fname = NULL;
  * the nameservers?  Used to check whether we need to reconfigure. */
 static time_t resolv_conf_mtime = 0;
 
-/** Linked list of connections waiting for a DNS answer. */
-typedef struct pending_connection_t {
-  edge_connection_t *conn;
-  struct pending_connection_t *next;
-} pending_connection_t;
-
-/** Value of 'magic' field for cached_resolve_t.  Used to try to catch bad
- * pointers and memory stomping. */
-#define CACHED_RESOLVE_MAGIC 0x1234F00D
-
-/* Possible states for a cached resolve_t */
-/** We are waiting for the resolver system to tell us an answer here.
- * When we get one, or when we time out, the state of this cached_resolve_t
- * will become "DONE" and we'll possibly add a CACHED
- * entry. This cached_resolve_t will be in the hash table so that we will
- * know not to launch more requests for this addr, but rather to add more
- * connections to the pending list for the addr. */
-#define CACHE_STATE_PENDING 0
-/** This used to be a pending cached_resolve_t, and we got an answer for it.
- * Now we're waiting for this cached_resolve_t to expire.  This should
- * have no pending connections, and should not appear in the hash table. */
-#define CACHE_STATE_DONE 1
-/** We are caching an answer for this address. This should have no pending
- * connections, and should appear in the hash table. */
-#define CACHE_STATE_CACHED 2
-
-/** @name status values for a single DNS request.
- *
- * @{ */
-/** The DNS request is in progress. */
-#define RES_STATUS_INFLIGHT 1
-/** The DNS request finished and gave an answer */
-#define RES_STATUS_DONE_OK 2
-/** The DNS request finished and gave an error */
-#define RES_STATUS_DONE_ERR 3
-/**@}*/
-
-/** A DNS request: possibly completed, possibly pending; cached_resolve
- * structs are stored at the OR side in a hash table, and as a linked
- * list from oldest to newest.
- */
-typedef struct cached_resolve_t {
-  HT_ENTRY(cached_resolve_t) node;
-  uint32_t magic;  /**< Must be CACHED_RESOLVE_MAGIC */
-  char address[MAX_ADDRESSLEN]; /**< The hostname to be resolved. */
-
-  union {
-    uint32_t addr_ipv4; /**< IPv4 addr for <b>address</b>, if successful.
-                         * (In host order.) */
-    int err_ipv4; /**< One of DNS_ERR_*, if IPv4 lookup failed. */
-  } result_ipv4; /**< Outcome of IPv4 lookup */
-  union {
-    struct in6_addr addr_ipv6; /**< IPv6 addr for <b>address</b>, if
-                                * successful */
-    int err_ipv6; /**< One of DNS_ERR_*, if IPv6 lookup failed. */
-  } result_ipv6; /**< Outcome of IPv6 lookup, if any */
-  union {
-    char *hostname; /** A hostname, if PTR lookup happened successfully*/
-    int err_hostname; /** One of DNS_ERR_*, if PTR lookup failed. */
-  } result_ptr;
-  /** @name Status fields
-   *
-   * These take one of the RES_STATUS_* values, depending on the state
-   * of the corresponding lookup.
-   *
-   * @{ */
-  unsigned int res_status_ipv4 : 2;
-  unsigned int res_status_ipv6 : 2;
-  unsigned int res_status_hostname : 2;
-  /**@}*/
-  uint8_t state; /**< Is this cached entry pending/done/informative? */
-
-  time_t expire; /**< Remove items from cache after this time. */
-  uint32_t ttl_ipv4; /**< What TTL did the nameserver tell us? */
-  uint32_t ttl_ipv6; /**< What TTL did the nameserver tell us? */
-  uint32_t ttl_hostname; /**< What TTL did the nameserver tell us? */
-  /** Connections that want to know when we get an answer for this resolve. */
-  pending_connection_t *pending_connections;
-  /** Position of this element in the heap*/
-  int minheap_idx;
-} cached_resolve_t;
+/** The argument that we pass to evdns_callback(): what we asked for, and
+ * when. */
+typedef struct dns_query_arg_t {
+  /** When did we launch this query? */
+  struct timeval launched;
+  /** One of DNS_IPv4_A, DNS_IPv6_AAAA, or DNS_PTR. */
+  uint8_t query_type;
+  /** The address we're resolving. */
+  char address[MAX_ADDRESSLEN];
+} dns_query_arg_t;
 
 static void purge_expired_resolves(time_t now);
 static void dns_found_answer(const char *address, uint8_t query_type,
@@ -194,18 +177,12 @@ static void send_resolved_cell(edge_connection_t *conn, uint8_t answer_type,
                                const cached_resolve_t *resolve);
 static int launch_resolve(cached_resolve_t *resolve);
 static void add_wildcarded_test_address(const char *address);
-static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
-static int dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
-                            or_circuit_t *oncirc, char **resolved_to_hostname,
-                            int *made_connection_pending_out,
-                            cached_resolve_t **resolve_out);
 static int set_exitconn_info_from_resolve(edge_connection_t *exitconn,
                                           const cached_resolve_t *resolve,
                                           char **hostname_out);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
-static void make_pending_resolve_cached(cached_resolve_t *cached);
 
 #ifdef DEBUG_DNS_CACHE
 static void assert_cache_ok_(void);
@@ -218,6 +195,22 @@ static void assert_resolve_ok(cached_resolve_t *resolve);
 /** Hash table of cached_resolve objects. */
 static HT_HEAD(cache_map, cached_resolve_t) cache_root;
 
+/** Type of a list of cached answers. */
+TOR_TAILQ_HEAD(cached_resolve_lru_t, cached_resolve_t);
+/** The DNS_LRU_* lists of cached answers, indexed by list. */
+static struct cached_resolve_lru_t cache_lru[DNS_N_LRU_LISTS];
+/** How many entries are on each of the lists in cache_lru? */
+static int cache_lru_len[DNS_N_LRU_LISTS];
+
+/** How many times has an exit stream found a cached answer? */
+static uint64_t n_dns_cache_hits = 0;
+/** How many of those answers had no successful lookups? */
+static uint64_t n_dns_cache_negative_hits = 0;
+/** How many times have we had to launch a new resolve for a stream? */
+static uint64_t n_dns_cache_misses = 0;
+/** How many cached answers have we dropped before they expired? */
+static uint64_t n_dns_cache_evictions = 0;
+
 /** Global: how many IPv6 requests have we made in all? */
 static uint64_t n_ipv6_requests_made = 0;
 /** Global: how many IPv6 requests have timed out? */
@@ -225,6 +218,16 @@ static uint64_t n_ipv6_timeouts = 0;
 /** Global: Do we think that IPv6 DNS is broken? */
 static int dns_is_broken_for_ipv6 = 0;
 
+/** Smoothed time, in msec, that our nameservers have taken to answer, or
+ * a negative number if we haven't had any answers yet. */
+static double dns_answer_msec = -1.0;
+/** The timeout, in seconds, that we last told evdns to use, or 0 if we
+ * haven't told it one yet. */
+static int dns_current_timeout = 0;
+/** The max-timeouts that we last told evdns to use, or 0 if we haven't
+ * told it one yet. */
+static int dns_current_max_timeouts = 0;
+
 /** Function to compare hashed resolves on their addresses; used to
  * implement hash tables. */
 static INLINE int
@@ -247,11 +250,31 @@ HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
 HT_GENERATE2(cache_map, cached_resolve_t, node, cached_resolve_hash,
              cached_resolves_eq, 0.6, tor_reallocarray_, tor_free_)
 
+/** Return the cached_resolve_t in the cache whose address matches
+ * <b>query</b>'s, or NULL if there is none. */
+STATIC cached_resolve_t *
+dns_get_cache_entry(cached_resolve_t *query)
+{
+  return HT_FIND(cache_map, &cache_root, query);
+}
+
+/** Add <b>new_entry</b> to the cache's hash table. */
+STATIC void
+dns_insert_cache_entry(cached_resolve_t *new_entry)
+{
+  HT_INSERT(cache_map, &cache_root, new_entry);
+}
+
 /** Initialize the DNS cache. */
 static void
 init_cache_map(void)
 {
+  int i;
   HT_INIT(cache_map, &cache_root);
+  for (i = 0; i < DNS_N_LRU_LISTS; ++i) {
+    TOR_TAILQ_INIT(&cache_lru[i]);
+    cache_lru_len[i] = 0;
+  }
 }
 
 /** Helper: called by eventdns when eventdns wants to log something. */
@@ -488,6 +511,170 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Return true iff none of the lookups for <b>resolve</b> succeeded. */
+static int
+cached_resolve_is_negative(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 != RES_STATUS_DONE_OK &&
+          resolve->res_status_ipv6 != RES_STATUS_DONE_OK &&
+          resolve->res_status_hostname != RES_STATUS_DONE_OK);
+}
+
+/** Put <b>resolve</b> at the front of the LRU list <b>list</b>. */
+static void
+cache_lru_add(cached_resolve_t *resolve, uint8_t list)
+{
+  tor_assert(resolve->lru_list == DNS_LRU_NONE);
+  tor_assert(list != DNS_LRU_NONE && list < DNS_N_LRU_LISTS);
+  TOR_TAILQ_INSERT_HEAD(&cache_lru[list], resolve, lru_entry);
+  ++cache_lru_len[list];
+  resolve->lru_list = list;
+}
+
+/** Take <b>resolve</b> off whatever LRU list it's on. */
+static void
+cache_lru_remove(cached_resolve_t *resolve)
+{
+  const uint8_t list = resolve->lru_list;
+  if (list == DNS_LRU_NONE)
+    return;
+  TOR_TAILQ_REMOVE(&cache_lru[list], resolve, lru_entry);
+  --cache_lru_len[list];
+  resolve->lru_list = DNS_LRU_NONE;
+}
+
+/** Remove the cached answer <b>resolve</b> from the cache before it
+ * expires, and free it. */
+static void
+cache_evict(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed;
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  tor_assert(!resolve->pending_connections);
+
+  log_debug(LD_EXIT, "Evicting cached resolve for %s",
+            escaped_safe_str(resolve->address));
+  cache_lru_remove(resolve);
+  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  tor_assert(removed == resolve);
+  smartlist_pqueue_remove(cached_resolve_pqueue,
+                          compare_cached_resolves_by_expiry_,
+                          STRUCT_OFFSET(cached_resolve_t, minheap_idx),
+                          resolve);
+  free_cached_resolve_(resolve);
+  ++n_dns_cache_evictions;
+}
+
+/** Evict the least recently used answer on LRU list <b>list</b>.  Return
+ * 0 on success, or -1 if the list was empty. */
+static int
+cache_evict_lru(uint8_t list)
+{
+  cached_resolve_t *victim = TOR_TAILQ_LAST(&cache_lru[list],
+                                            cached_resolve_lru_t);
+  if (!victim)
+    return -1;
+  cache_evict(victim);
+  return 0;
+}
+
+/** Evict cached answers until we're within MAX_DNS_CACHE_NEGATIVE and
+ * MAX_DNS_CACHE_POSITIVE.  Answers that nobody has asked for twice go
+ * first. */
+static void
+cache_enforce_limits(void)
+{
+  while (cache_lru_len[DNS_LRU_NEGATIVE] > dns_cache_max_negative)
+    cache_evict_lru(DNS_LRU_NEGATIVE);
+  while (cache_lru_len[DNS_LRU_PROBATION] +
+         cache_lru_len[DNS_LRU_PROTECTED] > dns_cache_max_positive) {
+    if (cache_evict_lru(DNS_LRU_PROBATION) < 0)
+      cache_evict_lru(DNS_LRU_PROTECTED);
+  }
+}
+
+/** Called when a stream has used the cached answer <b>resolve</b>: note
+ * the hit, and move the answer to the front of the right LRU list. */
+STATIC void
+cache_note_hit(cached_resolve_t *resolve)
+{
+  uint8_t list = resolve->lru_list;
+
+  ++n_dns_cache_hits;
+  if (list == DNS_LRU_NEGATIVE)
+    ++n_dns_cache_negative_hits;
+  else if (list == DNS_LRU_PROBATION)
+    list = DNS_LRU_PROTECTED;
+  else if (list == DNS_LRU_NONE)
+    return;
+
+  cache_lru_remove(resolve);
+  cache_lru_add(resolve, list);
+
+  /* If the protected list is full, give its oldest entry another chance on
+   * the probation list. */
+  while (cache_lru_len[DNS_LRU_PROTECTED] > dns_cache_max_protected) {
+    cached_resolve_t *oldest = TOR_TAILQ_LAST(&cache_lru[DNS_LRU_PROTECTED],
+                                              cached_resolve_lru_t);
+    cache_lru_remove(oldest);
+    cache_lru_add(oldest, DNS_LRU_PROBATION);
+  }
+}
+
+/** Return the approximate number of bytes used by the DNS cache.  Like
+ * dump_dns_mem_usage(), this undercounts hostnames from reverse
+ * lookups. */
+size_t
+dns_cache_get_total_allocation(void)
+{
+  if (!cached_resolve_pqueue)
+    return 0;
+  return smartlist_len(cached_resolve_pqueue) * sizeof(cached_resolve_t) +
+    HT_MEM_USAGE(&cache_root);
+}
+
+/** Called when we're low on memory: drop expired answers, and then cached
+ * answers in least-useful-first order, until we've freed at least
+ * <b>min_remove_bytes</b>.  Return the number of bytes we freed. */
+size_t
+dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  static const uint8_t lists[] = {
+    DNS_LRU_NEGATIVE, DNS_LRU_PROBATION, DNS_LRU_PROTECTED
+  };
+  const size_t start = dns_cache_get_total_allocation();
+  size_t removed = 0;
+  unsigned i;
+
+  purge_expired_resolves(now);
+  removed = start - dns_cache_get_total_allocation();
+
+  for (i = 0; i < ARRAY_LENGTH(lists) && removed < min_remove_bytes; ++i) {
+    while (removed < min_remove_bytes && cache_evict_lru(lists[i]) == 0)
+      removed += sizeof(cached_resolve_t);
+  }
+
+  log_notice(LD_EXIT, "We're low on memory. Removed %lu bytes from the DNS "
+             "cache; it now holds %d entries.", (unsigned long)removed,
+             (int)HT_SIZE(&cache_root));
+  return removed;
+}
+
+/** Set *<b>hits_out</b> to the number of exit streams that found a cached
+ * DNS answer, *<b>negative_hits_out</b> to how many of those answers were
+ * failures, *<b>misses_out</b> to the number that needed a new resolve, and
+ * *<b>evictions_out</b> to the number of answers we dropped before they
+ * expired. */
+void
+dns_cache_get_stats(uint64_t *hits_out, uint64_t *negative_hits_out,
+                    uint64_t *misses_out, uint64_t *evictions_out)
+{
+  *hits_out = n_dns_cache_hits;
+  *negative_hits_out = n_dns_cache_negative_hits;
+  *misses_out = n_dns_cache_misses;
+  *evictions_out = n_dns_cache_evictions;
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -507,6 +694,7 @@ dns_free_all(void)
     free_cached_resolve_(item);
   }
   HT_CLEAR(cache_map, &cache_root);
+  init_cache_map();
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
   tor_free(resolv_conf_fname);
@@ -584,6 +772,7 @@ purge_expired_resolves(time_t now)
       cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
       tor_assert(tmp != resolve);
     }
+    cache_lru_remove(resolve);
     if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
       tor_free(resolve->result_ptr.hostname);
     resolve->magic = 0xF0BBF0BB;
@@ -800,7 +989,7 @@ dns_resolve(edge_connection_t *exitconn)
  *
  * Set *<b>resolve_out</b> to a cached resolve, if we found one.
  */
-static int
+STATIC int
 dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                  or_circuit_t *oncirc, char **hostname_out,
                  int *made_connection_pending_out,
@@ -882,7 +1071,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
 
   /* now check the hash table to see if 'address' is already there. */
   strlcpy(search.address, exitconn->base_.address, sizeof(search.address));
-  resolve = HT_FIND(cache_map, &cache_root, &search);
+  resolve = dns_get_cache_entry(&search);
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
       case CACHE_STATE_PENDING:
@@ -904,6 +1093,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
+        cache_note_hit(resolve);
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
       case CACHE_STATE_DONE:
@@ -914,6 +1104,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
+  ++n_dns_cache_misses;
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
@@ -927,7 +1118,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   *made_connection_pending_out = 1;
 
   /* Add this resolve to the cache and priority queue. */
-  HT_INSERT(cache_map, &cache_root, resolve);
+  dns_insert_cache_entry(resolve);
   set_expiry(resolve, now + RESOLVE_MAX_TIMEOUT);
 
   log_debug(LD_EXIT,"Launching %s.",
@@ -1367,7 +1558,7 @@ inform_pending_connections(cached_resolve_t *resolve)
  * This function is only necessary because of the perversity of our
  * cache timeout code; see inline comment for ideas on eliminating it.
  **/
-static void
+STATIC void
 make_pending_resolve_cached(cached_resolve_t *resolve)
 {
   cached_resolve_t *removed;
@@ -1396,9 +1587,10 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
         tor_strdup(resolve->result_ptr.hostname);
 
     new_resolve->state = CACHE_STATE_CACHED;
+    new_resolve->lru_list = DNS_LRU_NONE;
 
     assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
+    dns_insert_cache_entry(new_resolve);
 
     if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
          resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
@@ -1416,6 +1608,9 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
       ttl = resolve->ttl_hostname;
 
     set_expiry(new_resolve, time(NULL) + dns_get_expiry_ttl(ttl));
+    cache_lru_add(new_resolve, cached_resolve_is_negative(new_resolve) ?
+                  DNS_LRU_NEGATIVE : DNS_LRU_PROBATION);
+    cache_enforce_limits();
   }
 
   assert_cache_ok();
@@ -1437,13 +1632,109 @@ evdns_err_is_transient(int err)
   }
 }
 
+/** Tell evdns how long to wait for each query, based on how long our
+ * nameservers have been taking to answer, and how many queries in a row
+ * may time out before it marks a nameserver down.  We scale the latter so
+ * that a nameserver still has to stop answering for as many seconds as it
+ * did with the old fixed timeouts.  Unless <b>force</b> is true (because
+ * evdns has just reread its configuration), only tell evdns about values
+ * that have changed. */
+static void
+dns_update_timeout(int force)
+{
+  const int one_nameserver =
+    evdns_base_count_nameservers(the_evdns_base) == 1;
+  const int max_timeout = one_nameserver ?
+    DNS_MAX_TIMEOUT_ONE_NAMESERVER : DNS_MAX_TIMEOUT;
+  const int max_timeout_seconds = one_nameserver ?
+    DNS_MAX_TIMEOUT_SECONDS_ONE_NAMESERVER : DNS_MAX_TIMEOUT_SECONDS;
+  int timeout = max_timeout, max_timeouts;
+  char buf[16];
+
+  if (dns_answer_msec >= 0.0) {
+    const double wanted =
+      dns_answer_msec * DNS_TIMEOUT_LATENCY_MULTIPLIER / 1000.0;
+    timeout = (int) ((dns_answer_msec * DNS_TIMEOUT_LATENCY_MULTIPLIER
+                      + 999.0) / 1000.0);
+    if (timeout < DNS_MIN_TIMEOUT)
+      timeout = DNS_MIN_TIMEOUT;
+    else if (timeout > max_timeout)
+      timeout = max_timeout;
+    if (!force && timeout < dns_current_timeout &&
+        dns_current_timeout <= max_timeout &&
+        wanted > dns_current_timeout - 1 - DNS_TIMEOUT_HYSTERESIS)
+      timeout = dns_current_timeout;
+  }
+  max_timeouts = CEIL_DIV(max_timeout_seconds, timeout);
+
+  if (force || timeout != dns_current_timeout) {
+    log_info(LD_EXIT, "Our nameservers have been taking %.f msec to "
+             "answer; setting the DNS timeout to %d seconds.",
+             dns_answer_msec >= 0.0 ? dns_answer_msec : 0.0, timeout);
+    tor_snprintf(buf, sizeof(buf), "%d", timeout);
+    evdns_base_set_option_(the_evdns_base, "timeout:", buf);
+    dns_current_timeout = timeout;
+  }
+  if (force || max_timeouts != dns_current_max_timeouts) {
+    tor_snprintf(buf, sizeof(buf), "%d", max_timeouts);
+    evdns_base_set_option_(the_evdns_base, "max-timeouts:", buf);
+    dns_current_max_timeouts = max_timeouts;
+  }
+}
+
+/** Called when a nameserver has answered the query we launched at
+ * <b>launched</b>, or when evdns has given up on it because of timeouts
+ * (if <b>timed_out</b> is true).  Update our idea of how long answers
+ * take, and the timeout that goes with it. */
+static void
+dns_note_answer_time(const struct timeval *launched, int timed_out)
+{
+  double msec;
+
+  if (timed_out) {
+    msec = dns_current_timeout * 1000.0;
+  } else {
+    struct timeval now;
+    tor_gettimeofday(&now);
+    msec = (double) tv_mdiff(launched, &now);
+    if (msec < 0.0)
+      msec = 0.0;
+  }
+
+  if (dns_answer_msec < 0.0)
+    dns_answer_msec = msec;
+  else
+    dns_answer_msec += (msec - dns_answer_msec) / DNS_LATENCY_EWMA_DIVISOR;
+
+  if (the_evdns_base)
+    dns_update_timeout(0);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the timeout, in seconds, that we have told evdns to use for each
+ * query.  Private; used only by the unit tests. */
+STATIC int
+dns_get_current_timeout(void)
+{
+  return dns_current_timeout;
+}
+
+/** Return the max-timeouts that we have told evdns to use.  Private; used
+ * only by the unit tests. */
+STATIC int
+dns_get_current_max_timeouts(void)
+{
+  return dns_current_max_timeouts;
+}
+#endif
+
 /** Configure eventdns nameservers if force is true, or if the configuration
  * has changed since the last time we called this function, or if we failed on
  * our last attempt.  On Unix, this reads from /etc/resolv.conf or
  * options->ServerDNSResolvConfFile; on Windows, this reads from
  * options->ServerDNSResolvConfFile or the registry.  Return 0 on success or
  * -1 on failure. */
-static int
+STATIC int
 configure_nameservers(int force)
 {
   const or_options_t *options;
@@ -1548,12 +1839,14 @@ configure_nameservers(int force)
 
 #define SET(k,v)  evdns_base_set_option_(the_evdns_base, (k), (v))
 
-  if (evdns_base_count_nameservers(the_evdns_base) == 1) {
-    SET("max-timeouts:", "16");
-    SET("timeout:", "10");
-  } else {
-    SET("max-timeouts:", "3");
-    SET("timeout:", "5");
+  dns_update_timeout(1);
+
+  {
+    char buf[32];
+    tor_snprintf(buf, sizeof(buf), "%d",
+                 evdns_base_count_nameservers(the_evdns_base) *
+                 DNS_MAX_INFLIGHT_PER_NAMESERVER);
+    SET("max-inflight:", buf);
   }
 
   if (options->ServerDNSRandomizeCase)
@@ -1590,9 +1883,9 @@ static void
 evdns_callback(int result, char type, int count, int ttl, void *addresses,
                void *arg)
 {
-  char *arg_ = arg;
-  uint8_t orig_query_type = arg_[0];
-  char *string_address = arg_ + 1;
+  dns_query_arg_t *arg_ = arg;
+  uint8_t orig_query_type = arg_->query_type;
+  char *string_address = arg_->address;
   tor_addr_t addr;
   const char *hostname = NULL;
   int was_wildcarded = 0;
@@ -1690,9 +1983,11 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
     log_warn(LD_BUG, "Weird; orig_query_type == %d but type == %d",
              (int)orig_query_type, (int)type);
   }
-  if (result != DNS_ERR_SHUTDOWN)
+  if (result != DNS_ERR_SHUTDOWN) {
+    dns_note_answer_time(&arg_->launched, result == DNS_ERR_TIMEOUT);
     dns_found_answer(string_address, orig_query_type,
                      result, &addr, hostname, ttl);
+  }
 
   tor_free(arg_);
 }
@@ -1706,11 +2001,11 @@ launch_one_resolve(const char *address, uint8_t query_type,
 {
   const int options = get_options()->ServerDNSSearchDomains ? 0
     : DNS_QUERY_NO_SEARCH;
-  const size_t addr_len = strlen(address);
   struct evdns_request *req = 0;
-  char *addr = tor_malloc(addr_len + 2);
-  addr[0] = (char) query_type;
-  memcpy(addr+1, address, addr_len + 1);
+  dns_query_arg_t *addr = tor_malloc_zero(sizeof(dns_query_arg_t));
+  tor_gettimeofday(&addr->launched);
+  addr->query_type = query_type;
+  strlcpy(addr->address, address, sizeof(addr->address));
 
   switch (query_type) {
   case DNS_IPv4_A:
@@ -2170,6 +2465,15 @@ dump_dns_mem_usage(int severity)
   tor_log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   tor_log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
+  tor_log(severity, LD_MM, "Our DNS cache holds %d successful and %d failed "
+          "answers, and has had "U64_FORMAT" hits ("U64_FORMAT" for failed "
+          "answers), "U64_FORMAT" misses, and "U64_FORMAT" evictions.",
+          cache_lru_len[DNS_LRU_PROBATION] + cache_lru_len[DNS_LRU_PROTECTED],
+          cache_lru_len[DNS_LRU_NEGATIVE],
+          U64_PRINTF_ARG(n_dns_cache_hits),
+          U64_PRINTF_ARG(n_dns_cache_negative_hits),
+          U64_PRINTF_ARG(n_dns_cache_misses),
+          U64_PRINTF_ARG(n_dns_cache_evictions));
 }
 
 #ifdef DEBUG_DNS_CACHE
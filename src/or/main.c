@@ -2725,6 +2725,7 @@ tor_free_all(int postfork)
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  connection_edge_free_all();
   scheduler_free_all();
   memarea_clear_freelist();
   nodelist_free_all();
@@ -2933,12 +2934,15 @@ sandbox_init_filter(void)
   OPEN_DATADIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_DATADIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_DATADIR("cached-descriptors.tmp.tmp");
+  OPEN_DATADIR_SUFFIX("cached-descriptors", ".bgtmp");
   OPEN_DATADIR_SUFFIX("cached-extrainfo", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-extrainfo.new", ".tmp");
   OPEN_DATADIR("cached-extrainfo.tmp.tmp");
+  OPEN_DATADIR_SUFFIX("cached-extrainfo", ".bgtmp");
   OPEN_DATADIR_SUFFIX("state", ".tmp");
   OPEN_DATADIR_SUFFIX("unparseable-desc", ".tmp");
   OPEN_DATADIR_SUFFIX("v3-status-votes", ".tmp");
@@ -2978,12 +2982,15 @@ sandbox_init_filter(void)
   RENAME_SUFFIX("cached-microdescs", ".tmp");
   RENAME_SUFFIX("cached-microdescs", ".new");
   RENAME_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".new");
   RENAME_SUFFIX("cached-descriptors.new", ".tmp");
+  RENAME_SUFFIX("cached-descriptors", ".bgtmp");
   RENAME_SUFFIX("cached-extrainfo", ".tmp");
   RENAME_SUFFIX("cached-extrainfo", ".new");
   RENAME_SUFFIX("cached-extrainfo.new", ".tmp");
+  RENAME_SUFFIX("cached-extrainfo", ".bgtmp");
   RENAME_SUFFIX("state", ".tmp");
   RENAME_SUFFIX("unparseable-desc", ".tmp");
   RENAME_SUFFIX("v3-status-votes", ".tmp");
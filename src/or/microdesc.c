@@ -18,7 +18,12 @@
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.
+ *
+ * Whenever we write the cache file, we also write an "index file" that says
+ * where each microdescriptor is in it.  When we load the cache, we read the
+ * index instead of parsing the cache file, and parse each microdescriptor
+ * only once somebody looks it up. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -28,6 +33,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -118,6 +125,7 @@ get_microdesc_cache(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->index_fname = get_datadir_fname("cached-microdescs.idx");
     microdesc_cache_reload(cache);
     the_microdesc_cache = cache;
   }
@@ -340,6 +348,188 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->bytes_dropped = 0;
 }
 
+/* The index file starts with a header:
+ *     MD_INDEX_MAGIC                     [8 bytes]
+ *     Length of the cache file           [8 bytes]
+ *     Number of entries                  [4 bytes]
+ *     Reserved, zero                     [4 bytes]
+ * and then holds one entry for every microdescriptor in the cache file:
+ *     SHA256 digest of the body          [32 bytes]
+ *     Offset of the body in the file     [8 bytes]
+ *     Length of the body                 [4 bytes]
+ *     Reserved, zero                     [4 bytes]
+ *     last_listed                        [8 bytes]
+ * All integers are in network order. */
+#define MD_INDEX_MAGIC "tormdix1"
+#define MD_INDEX_HEADER_LEN 24
+#define MD_INDEX_ENTRY_LEN 56
+
+/** Store the 64-bit integer <b>v</b> at <b>cp</b> in network order. */
+static void
+md_index_set_u64(char *cp, uint64_t v)
+{
+  set_uint32(cp, htonl((uint32_t)(v >> 32)));
+  set_uint32(cp+4, htonl((uint32_t)v));
+}
+
+/** Return the 64-bit integer stored at <b>cp</b> in network order. */
+static uint64_t
+md_index_get_u64(const char *cp)
+{
+  return (((uint64_t)ntohl(get_uint32(cp))) << 32) | ntohl(get_uint32(cp+4));
+}
+
+/** Write an index file for the cache file of <b>cache</b>, listing every
+ * microdescriptor whose body is in it.  Return 0 on success, -1 on
+ * failure. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  char *buf, *cp;
+  size_t len;
+  uint32_t n = 0;
+  int r;
+
+  if (!cache->cache_content) {
+    /* No cache file: no index either. */
+    unlink(cache->index_fname);
+    return 0;
+  }
+
+  len = MD_INDEX_HEADER_LEN + HT_SIZE(&cache->map) * MD_INDEX_ENTRY_LEN;
+  buf = tor_malloc_zero(len);
+  cp = buf + MD_INDEX_HEADER_LEN;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_CACHE || !md->body)
+      continue;
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    md_index_set_u64(cp+32, (uint64_t)md->off);
+    set_uint32(cp+40, htonl((uint32_t)md->bodylen));
+    md_index_set_u64(cp+48, (uint64_t)(int64_t)md->last_listed);
+    cp += MD_INDEX_ENTRY_LEN;
+    ++n;
+  }
+  memcpy(buf, MD_INDEX_MAGIC, 8);
+  md_index_set_u64(buf+8, cache->cache_content->size);
+  set_uint32(buf+16, htonl(n));
+
+  r = write_bytes_to_file(cache->index_fname, buf, cp - buf, 1);
+  tor_free(buf);
+  if (r < 0)
+    log_warn(LD_DIR, "Couldn't write microdescriptor index to %s",
+             cache->index_fname);
+  return r;
+}
+
+/** Try to load every microdescriptor in the cache file of <b>cache</b> from
+ * the index file, without parsing any of them.  Return the number of
+ * microdescriptors loaded, or -1 if the index is missing or doesn't match
+ * the cache file. */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *cache_mm = cache->cache_content;
+  tor_mmap_t *mm;
+  const char *cp;
+  uint32_t n, i;
+  int r = -1;
+
+  if (!cache_mm)
+    return -1;
+  mm = tor_mmap_file(cache->index_fname);
+  if (!mm)
+    return -1;
+
+  if (mm->size < MD_INDEX_HEADER_LEN ||
+      fast_memneq(mm->data, MD_INDEX_MAGIC, 8) ||
+      md_index_get_u64(mm->data+8) != cache_mm->size)
+    goto done;
+  n = ntohl(get_uint32(mm->data+16));
+  if (mm->size != MD_INDEX_HEADER_LEN + (uint64_t)n * MD_INDEX_ENTRY_LEN)
+    goto done;
+
+  /* Make sure every entry points somewhere sensible before we use any of
+   * them. */
+  for (i = 0, cp = mm->data + MD_INDEX_HEADER_LEN; i < n;
+       ++i, cp += MD_INDEX_ENTRY_LEN) {
+    uint64_t off = md_index_get_u64(cp+32);
+    uint32_t bodylen = ntohl(get_uint32(cp+40));
+    if (off > cache_mm->size || bodylen > cache_mm->size - off ||
+        bodylen < 9 || fast_memneq(cache_mm->data + off, "onion-key", 9))
+      goto done;
+  }
+
+  for (i = 0, cp = mm->data + MD_INDEX_HEADER_LEN; i < n;
+       ++i, cp += MD_INDEX_ENTRY_LEN) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, cp, DIGEST256_LEN);
+    md->off = (off_t) md_index_get_u64(cp+32);
+    md->bodylen = ntohl(get_uint32(cp+40));
+    md->last_listed = (time_t)(int64_t) md_index_get_u64(cp+48);
+    md->body = (char*)cache_mm->data + md->off;
+    md->saved_location = SAVED_IN_CACHE;
+    md->unparsed = 1;
+    if (HT_FIND(microdesc_map, &cache->map, md)) {
+      tor_free(md);
+      continue;
+    }
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+  }
+  r = (int) n;
+
+ done:
+  if (r < 0)
+    log_info(LD_DIR, "Microdescriptor index in %s doesn't match the cache; "
+             "ignoring it.", cache->index_fname);
+  tor_munmap_file(mm);
+  return r;
+}
+
+/** Parse the body of <b>md</b>, which we loaded from the cache index, and
+ * fill in its fields.  Return 0 on success, -1 if the body isn't a valid
+ * microdescriptor with the digest we expected. */
+static int
+microdesc_parse_unparsed(microdesc_t *md)
+{
+  smartlist_t *parsed;
+  microdesc_t *p;
+  int r = -1;
+
+  tor_assert(md->unparsed);
+  if (!md->body)
+    return -1;
+
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                        0, SAVED_IN_CACHE, NULL);
+  if (smartlist_len(parsed) == 1 &&
+      (p = smartlist_get(parsed, 0)) &&
+      tor_memeq(p->digest, md->digest, DIGEST256_LEN)) {
+    md->onion_pkey = p->onion_pkey;
+    md->onion_curve25519_pkey = p->onion_curve25519_pkey;
+    md->ed25519_identity_pkey = p->ed25519_identity_pkey;
+    tor_addr_copy(&md->ipv6_addr, &p->ipv6_addr);
+    md->ipv6_orport = p->ipv6_orport;
+    md->family = p->family;
+    md->exit_policy = p->exit_policy;
+    md->ipv6_exit_policy = p->ipv6_exit_policy;
+    p->onion_pkey = NULL;
+    p->onion_curve25519_pkey = NULL;
+    p->ed25519_identity_pkey = NULL;
+    p->family = NULL;
+    p->exit_policy = p->ipv6_exit_policy = NULL;
+    md->unparsed = 0;
+    r = 0;
+  }
+  SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(parsed);
+  return r;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -349,18 +539,22 @@ microdesc_cache_reload(microdesc_cache_t *cache)
   char *journal_content;
   smartlist_t *added;
   tor_mmap_t *mm;
-  int total = 0;
+  int total = 0, n_indexed = -1;
 
   microdesc_cache_clear(cache);
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
-  if (mm) {
+  if (mm && (n_indexed = microdesc_cache_load_index(cache)) >= 0) {
+    total += n_indexed;
+  } else if (mm) {
     added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
                                     SAVED_IN_CACHE, 0, -1, NULL);
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
     }
+    /* Next time, we won't need to parse them all. */
+    microdesc_cache_write_index(cache);
   }
 
   journal_content = read_file_to_str(cache->journal_fname,
@@ -376,8 +570,8 @@ microdesc_cache_reload(microdesc_cache_t *cache)
     }
     tor_free(journal_content);
   }
-  log_info(LD_DIR, "Reloaded microdescriptor cache. Found %d descriptors.",
-           total);
+  log_info(LD_DIR, "Reloaded microdescriptor cache. Found %d descriptors%s.",
+           total, n_indexed >= 0 ? " (from the index)" : "");
 
   microdesc_cache_rebuild(cache, 0 /* don't force */);
 
@@ -596,6 +790,10 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     smartlist_add(wrote, md);
   }
 
+  /* The old index doesn't describe the new file; don't let a crash leave
+   * it lying around. */
+  unlink(cache->index_fname);
+
   /* We must do this unmap _before_ we call finish_writing_to_file(), or
    * windows will not actually replace the file. */
   if (cache->cache_content) {
@@ -652,6 +850,8 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   smartlist_free(wrote);
 
+  microdesc_cache_write_index(cache);
+
   write_str_to_file(cache->journal_fname, "", 1);
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
@@ -760,20 +960,42 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 }
 
+/** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
+ * <b>d</b>, return it, even if we haven't parsed it yet.  Otherwise return
+ * NULL. */
+static microdesc_t *
+microdesc_cache_find_by_digest256(microdesc_cache_t *cache, const char *d)
+{
+  microdesc_t search;
+  if (!cache)
+    cache = get_microdesc_cache();
+  memcpy(search.digest, d, DIGEST256_LEN);
+  return HT_FIND(microdesc_map, &cache->map, &search);
+}
+
 /** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
  * <b>d</b>, return it.  Otherwise return NULL. */
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
-  microdesc_t *md, search;
+  microdesc_t *md;
   if (!cache)
     cache = get_microdesc_cache();
-  memcpy(search.digest, d, DIGEST256_LEN);
-  md = HT_FIND(microdesc_map, &cache->map, &search);
+  md = microdesc_cache_find_by_digest256(cache, d);
+  if (md && md->unparsed && microdesc_parse_unparsed(md) < 0) {
+    /* The cache file changed under the index; we'll download it again. */
+    log_warn(LD_DIR, "Microdescriptor at offset %ld in %s didn't match its "
+             "index entry. Dropping it.", (long)md->off, cache->cache_fname);
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+    microdesc_free(md);
+    md = NULL;
+  }
   return md;
 }
 
@@ -801,7 +1023,7 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
   time_t now = time(NULL);
   tor_assert(ns->flavor == FLAV_MICRODESC);
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
+    if (microdesc_cache_find_by_digest256(cache, rs->descriptor_digest))
       continue;
     if (downloadable_only &&
         !download_status_is_ready(&rs->dl_status, now,
@@ -879,7 +1101,7 @@ update_microdescs_from_networkstatus(time_t now)
   tor_assert(ns->flavor == FLAV_MICRODESC);
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    md = microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+    md = microdesc_cache_find_by_digest256(cache, rs->descriptor_digest);
     if (md && ns->valid_after > md->last_listed)
       md->last_listed = ns->valid_after;
   } SMARTLIST_FOREACH_END(rs);
@@ -14,9 +14,9 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
-#include "circuitmux_ewma.h"
 #include "circuitstats.h"
 #include "config.h"
+#include "congestion.h"
 #include "connection.h"
 #include "connection_or.h"
 #include "consdiff.h"
@@ -1010,8 +1010,8 @@ consensus_is_waiting_for_certs(void)
 
 /** Return the most recent consensus that we have downloaded, or NULL if we
  * don't have one. */
-networkstatus_t *
-networkstatus_get_latest_consensus(void)
+MOCK_IMPL(networkstatus_t *,
+networkstatus_get_latest_consensus,(void))
 {
   return current_consensus;
 }
@@ -1144,12 +1144,33 @@ notify_control_networkstatus_changed(const networkstatus_t *old_c,
   smartlist_free(changed);
 }
 
+/** Return true iff <b>a</b> and <b>b</b> say exactly the same thing about
+ * their router: that is, iff every field we got from the consensus is the
+ * same in both. */
+STATIC int
+routerstatus_content_eq(const routerstatus_t *a, const routerstatus_t *b)
+{
+  /* All the fields up to exitsummary are plain data, and routerstatus_t
+   * objects are allocated zeroed, so even their padding matches. */
+  if (fast_memneq(a, b, STRUCT_OFFSET(routerstatus_t, exitsummary)))
+    return 0;
+  if (!a->exitsummary || !b->exitsummary)
+    return a->exitsummary == b->exitsummary;
+  return !strcmp(a->exitsummary, b->exitsummary);
+}
+
 /** Copy all the ancillary information (like router download status and so on)
- * from <b>old_c</b> to <b>new_c</b>. */
-static void
+ * from <b>old_c</b> to <b>new_c</b>.
+ *
+ * Most entries in a consensus are the same as in the one before it; for
+ * those, we move the old routerstatus_t into <b>new_c</b> in place of the
+ * new one, so that anything still pointing at it stays correct.  The new
+ * entry goes into <b>old_c</b>, to be freed along with it. */
+STATIC void
 networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
-                                      const networkstatus_t *old_c)
+                                      networkstatus_t *old_c)
 {
+  int n_reused = 0;
   if (old_c == new_c)
     return;
   if (!old_c || !smartlist_len(old_c->routerstatus_list))
@@ -1161,6 +1182,14 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
                                 rs_new->identity_digest, DIGEST_LEN),
                          STMT_NIL) {
     /* Okay, so we're looking at the same identity. */
+    if (routerstatus_content_eq(rs_old, rs_new)) {
+      /* Nothing has changed: keep the old entry, download status and all. */
+      smartlist_set(new_c->routerstatus_list, rs_new_sl_idx, rs_old);
+      smartlist_set(old_c->routerstatus_list, rs_old_sl_idx, rs_new);
+      ++n_reused;
+      continue;
+    }
+
     rs_new->last_dir_503_at = rs_old->last_dir_503_at;
 
     if (tor_memeq(rs_old->descriptor_digest, rs_new->descriptor_digest,
@@ -1169,6 +1198,15 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
       memcpy(&rs_new->dl_status, &rs_old->dl_status,sizeof(download_status_t));
     }
   } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
+
+  if (n_reused && new_c->desc_digest_map) {
+    /* It points at entries we just moved; build it again when needed. */
+    digestmap_free(new_c->desc_digest_map, NULL);
+    new_c->desc_digest_map = NULL;
+  }
+
+  log_info(LD_DIR, "Kept %d of %d router status entries from the previous "
+           "consensus.", n_reused, smartlist_len(new_c->routerstatus_list));
 }
 
 /** Get what number of old consensuses should we keep cached on disk to be
@@ -1228,7 +1266,6 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
-  int old_ewma_enabled;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1433,17 +1470,9 @@ networkstatus_set_current_consensus(const char *consensus,
     dirvote_recalculate_timing(options, now);
     routerstatus_list_update_named_server_map();
 
-    /* Update ewma and adjust policy if needed; first cache the old value */
-    old_ewma_enabled = cell_ewma_enabled();
-    /* Change the cell EWMA settings */
-    cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
-    /* If we just enabled ewma, set the cmux policy on all active channels */
-    if (cell_ewma_enabled() && !old_ewma_enabled) {
-      channel_set_cmux_policy_everywhere(&ewma_policy);
-    } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-      /* Turn it off everywhere */
-      channel_set_cmux_policy_everywhere(NULL);
-    }
+    /* Update ewma/drr settings and adjust policy if needed */
+    channel_update_cmux_policy(options, networkstatus_get_latest_consensus());
+    circuit_cc_set_parameters(networkstatus_get_latest_consensus());
 
     /* XXXX024 this call might be unnecessary here: can changing the
      * current consensus really alter our view of any OR's rate limits? */
@@ -1464,8 +1493,6 @@ networkstatus_set_current_consensus(const char *consensus,
       dirserv_remove_old_consensuses(old_consensuses_to_keep);
     }
     if (old_consensuses_to_keep > 0) {
-      // TODO: might want to do this in the background and have a lock to not
-      // serve consensus diffs until they are updated
       if (dirserv_update_consensus_diffs(consensus, c->valid_after,
                                          flavor)<0) {
         log_warn(LD_DIR, "Failed to update the stored consensus diffs.");
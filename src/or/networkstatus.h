@@ -64,7 +64,7 @@ void update_certificate_downloads(time_t now);
 int consensus_is_waiting_for_certs(void);
 int client_would_use_router(const routerstatus_t *rs, time_t now,
                             const or_options_t *options);
-networkstatus_t *networkstatus_get_latest_consensus(void);
+MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus,(void));
 MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus_by_flavor,
           (consensus_flavor_t f));
 tor_mmap_t *networkstatus_get_latest_consensus_mmap_by_flavor(
@@ -109,6 +109,10 @@ int networkstatus_get_weight_scale_param(networkstatus_t *ns);
 
 #ifdef NETWORKSTATUS_PRIVATE
 STATIC void vote_routerstatus_free(vote_routerstatus_t *rs);
+STATIC int routerstatus_content_eq(const routerstatus_t *a,
+                                   const routerstatus_t *b);
+STATIC void networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
+                                                  networkstatus_t *old_c);
 #endif
 
 #endif
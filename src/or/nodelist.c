@@ -54,9 +54,30 @@ typedef struct nodelist_t {
   smartlist_t *nodes;
   /* Hash table to map from node ID digest to node. */
   HT_HEAD(nodelist_map, node_t) nodes_by_id;
+  /* A list of port_exit_set_t, least recently used first. */
+  smartlist_t *port_exit_sets;
 
 } nodelist_t;
 
+/** The largest number of port_exit_set_t that we'll keep at once. */
+#define MAX_PORT_EXIT_SETS 64
+
+/** For a single port, the set of nodes whose exit policies might allow
+ * connections to that port. */
+typedef struct port_exit_set_t {
+  /** The port in question. */
+  uint16_t port;
+  /** How many bits have we allocated in <b>nodes</b>? */
+  int n_bits;
+  /** A bit for each node, indexed by its nodelist_idx: set iff
+   * node_might_exit_to_port() is true for that node. */
+  bitarray_t *nodes;
+} port_exit_set_t;
+
+static void port_exit_sets_update_node(const node_t *node);
+static void port_exit_sets_move_node(int from_idx, int to_idx);
+static void port_exit_set_free(port_exit_set_t *set);
+
 static INLINE unsigned int
 node_id_hash(const node_t *node)
 {
@@ -84,6 +105,7 @@ init_nodelist(void)
     the_nodelist = tor_malloc_zero(sizeof(nodelist_t));
     HT_INIT(nodelist_map, &the_nodelist->nodes_by_id);
     the_nodelist->nodes = smartlist_new();
+    the_nodelist->port_exit_sets = smartlist_new();
   }
 }
 
@@ -131,6 +153,8 @@ node_get_or_create(const char *identity_digest)
 
   node->country = -1;
 
+  port_exit_sets_update_node(node);
+
   return node;
 }
 
@@ -170,6 +194,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  port_exit_sets_update_node(node);
 
   if (node->country == -1)
     node_set_country(node);
@@ -210,6 +235,7 @@ nodelist_add_microdesc(microdesc_t *md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    port_exit_sets_update_node(node);
   }
   return node;
 }
@@ -230,8 +256,15 @@ nodelist_set_consensus(networkstatus_t *ns)
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
+  /* Nodes that are in the new consensus get their routerstatus back below.
+   * (If an entry hasn't changed since the last consensus, the new consensus
+   * holds the very same routerstatus_t: see
+   * networkstatus_copy_old_consensus_info().) */
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
+  /* The new consensus brings new flags, bandwidths and bandwidth weights,
+   * so the cached weights for choosing nodes are all stale. */
+  router_weighted_node_tables_clear();
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
@@ -245,10 +278,14 @@ nodelist_set_consensus(networkstatus_t *ns)
                                                        rs->descriptor_digest);
         if (node->md)
           node->md->held_by_nodes++;
+        port_exit_sets_update_node(node);
       }
     }
 
-    node_set_country(node);
+    /* Most relays keep their address from one consensus to the next; don't
+     * look it up again. */
+    if (node->country_addr != rs->addr)
+      node_set_country(node);
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -306,6 +343,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    port_exit_sets_update_node(node);
   }
 }
 
@@ -319,6 +357,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      port_exit_sets_update_node(node);
     }
   }
 }
@@ -344,6 +384,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp = smartlist_get(the_nodelist->nodes, idx);
     tmp->nodelist_idx = idx;
   }
+  port_exit_sets_move_node(smartlist_len(the_nodelist->nodes), idx);
+  router_weighted_node_tables_clear();
   node->nodelist_idx = -1;
 }
 
@@ -395,6 +437,7 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      port_exit_sets_update_node(node);
     }
 
     if (node_is_usable(node)) {
@@ -415,6 +458,7 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  router_weighted_node_tables_clear();
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
     node->nodelist_idx = -1;
@@ -423,9 +467,160 @@ nodelist_free_all(void)
 
   smartlist_free(the_nodelist->nodes);
 
+  SMARTLIST_FOREACH(the_nodelist->port_exit_sets, port_exit_set_t *, set,
+                    port_exit_set_free(set));
+  smartlist_free(the_nodelist->port_exit_sets);
+
   tor_free(the_nodelist);
 }
 
+/** Return true iff <b>node</b>'s exit policy might allow connections to
+ * <b>port</b> at some address we don't yet know. */
+static INLINE int
+node_might_exit_to_port(const node_t *node, uint16_t port)
+{
+  addr_policy_result_t r = compare_tor_addr_to_node_policy(NULL, port, node);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Set or clear the bit for <b>node</b> in <b>set</b>, growing the set if
+ * needed. */
+static void
+port_exit_set_update_node(port_exit_set_t *set, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  if (idx >= set->n_bits) {
+    int n_bits = smartlist_len(the_nodelist->nodes);
+    if (n_bits <= idx)
+      n_bits = idx + 1;
+    set->nodes = bitarray_expand(set->nodes, set->n_bits, n_bits);
+    set->n_bits = n_bits;
+  }
+  if (node_might_exit_to_port(node, set->port))
+    bitarray_set(set->nodes, idx);
+  else
+    bitarray_clear(set->nodes, idx);
+}
+
+/** Return a new port_exit_set_t for <b>port</b>, covering every node in
+ * the nodelist. */
+static port_exit_set_t *
+port_exit_set_new(uint16_t port)
+{
+  port_exit_set_t *set = tor_malloc_zero(sizeof(port_exit_set_t));
+  set->port = port;
+  set->n_bits = smartlist_len(the_nodelist->nodes);
+  set->nodes = bitarray_init_zero(set->n_bits);
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, const node_t *, node) {
+    if (node_might_exit_to_port(node, port))
+      bitarray_set(set->nodes, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  return set;
+}
+
+/** Release storage held by <b>set</b>. */
+static void
+port_exit_set_free(port_exit_set_t *set)
+{
+  if (!set)
+    return;
+  bitarray_free(set->nodes);
+  tor_free(set);
+}
+
+/** Called when the exit policy that we'd use for <b>node</b> may have
+ * changed: recompute its bit in every port_exit_set_t. */
+static void
+port_exit_sets_update_node(const node_t *node)
+{
+  SMARTLIST_FOREACH(the_nodelist->port_exit_sets, port_exit_set_t *, set,
+                    port_exit_set_update_node(set, node));
+}
+
+/** Called when the node at <b>from_idx</b> in the nodelist has moved to
+ * <b>to_idx</b>, and <b>from_idx</b> is now past the end of the list. */
+static void
+port_exit_sets_move_node(int from_idx, int to_idx)
+{
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->port_exit_sets, port_exit_set_t *,
+                          set) {
+    int bit = 0;
+    if (from_idx < set->n_bits) {
+      bit = bitarray_is_set(set->nodes, from_idx);
+      bitarray_clear(set->nodes, from_idx);
+    }
+    if (to_idx < from_idx && to_idx < set->n_bits) {
+      if (bit)
+        bitarray_set(set->nodes, to_idx);
+      else
+        bitarray_clear(set->nodes, to_idx);
+    }
+  } SMARTLIST_FOREACH_END(set);
+}
+
+/** Return the port_exit_set_t for <b>port</b>, creating it (and discarding
+ * the least recently used set) as needed. */
+static port_exit_set_t *
+nodelist_get_port_exit_set(uint16_t port)
+{
+  smartlist_t *sets = the_nodelist->port_exit_sets;
+  port_exit_set_t *set;
+
+  SMARTLIST_FOREACH_BEGIN(sets, port_exit_set_t *, s) {
+    if (s->port == port) {
+      /* Move it to the end, so that we discard it last. */
+      smartlist_del_keeporder(sets, s_sl_idx);
+      smartlist_add(sets, s);
+      return s;
+    }
+  } SMARTLIST_FOREACH_END(s);
+
+  if (smartlist_len(sets) >= MAX_PORT_EXIT_SETS) {
+    port_exit_set_free(smartlist_get(sets, 0));
+    smartlist_del_keeporder(sets, 0);
+  }
+  set = port_exit_set_new(port);
+  smartlist_add(sets, set);
+  return set;
+}
+
+/** Return a newly allocated bitarray, with one bit for each node in
+ * nodelist_get_list(), in which the bit for a node is set iff that node's
+ * exit policy might allow connections to at least one of the uint16_t
+ * ports in <b>ports</b>.  We keep a set of nodes for each recently
+ * requested port, and update it as descriptors come and go, so that
+ * callers don't need to check every policy against every port. */
+bitarray_t *
+nodelist_get_nodes_exiting_to_some_port(const smartlist_t *ports)
+{
+  bitarray_t *result;
+  int n_nodes, n_words, i;
+
+  init_nodelist();
+  n_nodes = smartlist_len(the_nodelist->nodes);
+  n_words = (n_nodes + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  result = bitarray_init_zero(n_nodes);
+
+  SMARTLIST_FOREACH_BEGIN(ports, const uint16_t *, port) {
+    port_exit_set_t *set = nodelist_get_port_exit_set(*port);
+    tor_assert(set->n_bits >= n_nodes);
+    for (i = 0; i < n_words; ++i)
+      result[i] |= set->nodes[i];
+  } SMARTLIST_FOREACH_END(port);
+
+  return result;
+}
+
+/** Tell the nodelist that <b>node</b>'s exit policy has changed in a way
+ * that it can't see for itself. */
+void
+nodelist_note_exit_policy_changed(const node_t *node)
+{
+  if (PREDICT_UNLIKELY(the_nodelist == NULL) || node->nodelist_idx < 0)
+    return;
+  port_exit_sets_update_node(node);
+}
+
 /** Check that the nodelist is internally consistent, and consistent with
  * the directory info it's derived from.
  */
@@ -1008,6 +1203,7 @@ node_set_country(node_t *node)
     tor_addr_from_ipv4h(&addr, node->ri->addr);
 
   node->country = geoip_get_country_by_addr(&addr);
+  node->country_addr = tor_addr_to_ipv4h(&addr);
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -1343,6 +1539,7 @@ router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
   rend_hsdir_routers_changed();
+  router_weighted_node_tables_clear();
 }
 
 /** Return a string describing what we're missing before we have enough
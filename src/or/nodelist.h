@@ -27,6 +27,8 @@ void nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md);
 void nodelist_remove_routerinfo(routerinfo_t *ri);
 void nodelist_purge(void);
 smartlist_t *nodelist_find_nodes_with_microdesc(const microdesc_t *md);
+bitarray_t *nodelist_get_nodes_exiting_to_some_port(const smartlist_t *ports);
+void nodelist_note_exit_policy_changed(const node_t *node);
 
 void nodelist_free_all(void);
 void nodelist_assert_ok(void);
@@ -1554,6 +1554,13 @@ typedef struct edge_connection_t {
   int package_window; /**< How many more relay cells can I send into the
                        * circuit? */
   int deliver_window; /**< How many more relay cells can end at me? */
+  /** Exponentially weighted moving average of how many cells this stream
+   * has packaged recently, as of package_ewma_tick.  Streams that have been
+   * quiet get to package first when their circuit's window opens. */
+  double package_ewma;
+  /** The EWMA tick (see cell_ewma_get_tick()) at which package_ewma was
+   * last brought up to date. */
+  unsigned package_ewma_tick;
 
   struct circuit_t *on_circuit; /**< The circuit (if any) that this edge
                                  * connection is using. */
@@ -1677,6 +1684,10 @@ typedef struct entry_connection_t {
 
   /** Are we a socks SocksSocket listener? */
   unsigned int is_socks_socket:1;
+
+  /** True iff this connection is on one of the lists of AP connections
+   * waiting for a circuit in connection_edge.c. */
+  unsigned int is_pending_circuit:1;
 } entry_connection_t;
 
 typedef enum {
@@ -2060,6 +2071,11 @@ typedef struct {
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
+  /** A copy of exit_policy compiled for fast lookups, or NULL if we haven't
+   * needed one yet or if exit_policy_too_big_to_compile is set. */
+  struct compiled_addr_policy_t *compiled_exit_policy;
+  /** True iff exit_policy was too big to compile, so we scan it instead. */
+  unsigned int exit_policy_too_big_to_compile:1;
   long uptime; /**< How many seconds the router claims to have been up */
   smartlist_t *declared_family; /**< Nicknames of router which this router
                                  * claims are its family. */
@@ -2230,6 +2246,9 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we loaded this microdesc from the cache index, and haven't
+   * parsed its body yet: only the cache information is set. */
+  unsigned int unparsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -2341,6 +2360,8 @@ typedef struct node_t {
   /** According to the geoip db what country is this router in? */
   /* XXXprop186 what is this suppose to mean with multiple OR ports? */
   country_t country;
+  /** The IPv4 address that we looked up <b>country</b> for, or 0. */
+  uint32_t country_addr;
 
   /* The below items are used only by authdirservers for
    * reachability testing. */
@@ -2645,6 +2666,43 @@ typedef struct {
   } u;
 } onion_handshake_state_t;
 
+/** How many SENDME cells can we be waiting for at once on one package
+ * window? */
+#define CIRCUIT_CC_MAX_PENDING_SENDMES \
+  (CIRCWINDOW_START_MAX / CIRCWINDOW_INCREMENT)
+
+/** Congestion control state for a circuit-level package window: how far
+ * we're letting ourselves use it, and how long SENDMEs take to come back.
+ * See congestion.c. */
+typedef struct circuit_cc_t {
+  /** How many cells do we let ourselves have unacknowledged at once, or 0
+   * if we haven't sent anything yet? */
+  int cwnd;
+  /** The package window that we started with: we can never have more cells
+   * than this unacknowledged. */
+  int max_cwnd;
+  /** How many cells have we sent since the last one that the other side
+   * will answer with a SENDME? */
+  int cells_since_sendme;
+  /** When did we send each of the cells whose SENDMEs we're waiting for,
+   * in msec?  A ring buffer: oldest first, starting at sendme_head. */
+  int64_t sendme_cell_sent_msec[CIRCUIT_CC_MAX_PENDING_SENDMES];
+  /** Index of the oldest entry in sendme_cell_sent_msec. */
+  uint8_t sendme_head;
+  /** How many entries of sendme_cell_sent_msec are in use? */
+  uint8_t n_pending_sendmes;
+  /** Smallest round trip time that we've seen in this measurement epoch
+   * or the one before, in msec, or 0 if we haven't seen one yet. */
+  uint32_t min_rtt_msec;
+  /** Smallest round trip time that we've seen in this measurement epoch, in
+   * msec, or 0 if we haven't seen one yet. */
+  uint32_t epoch_min_rtt_msec;
+  /** When did this measurement epoch start, in msec? */
+  int64_t epoch_start_msec;
+  /** The most recent round trip time that we've seen, in msec. */
+  uint32_t last_rtt_msec;
+} circuit_cc_t;
+
 /** Holds accounting information for a single step in the layered encryption
  * performed by a circuit.  Used only at the client edge of a circuit. */
 typedef struct crypt_path_t {
@@ -2695,6 +2753,9 @@ typedef struct crypt_path_t {
                        * at this step? */
   int deliver_window; /**< How many cells are we willing to deliver originating
                        * at this step? */
+  /** Congestion control state for package_window, or NULL if we haven't
+   * packaged a cell here while congestion control was on. */
+  circuit_cc_t *cc;
 } crypt_path_t;
 
 /** A reference-counted pointer to a crypt_path_t, used only to share
@@ -2847,6 +2908,9 @@ typedef struct circuit_t {
    * circuit-level sendme cells to indicate that we're willing to accept
    * more. */
   int deliver_window;
+  /** Congestion control state for package_window, or NULL if we haven't
+   * packaged a cell here while congestion control was on. */
+  circuit_cc_t *cc;
 
   /** Temporary field used during circuits_handle_oom. */
   uint32_t age_tmp;
@@ -4149,6 +4213,20 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** Which circuitmux policy should we use to pick circuits within a
+   * connection?  "auto" means "whatever the consensus says". */
+  char *CircuitMuxPolicy;
+  /** Parsed value of CircuitMuxPolicy. */
+  enum {
+    CMUX_POLICY_AUTO,
+    CMUX_POLICY_EWMA,
+    CMUX_POLICY_DRR,
+    CMUX_POLICY_WDRR,
+  } CircuitMuxPolicy_parsed;
+  /** How many cells may a circuit send each time it gets its turn under the
+   * DRR and WDRR policies?  Zero means "use the consensus value". */
+  int CircuitMuxQuantum;
+
   /** If true, do not enable IOCP on windows with bufferevents, even if
    * we think we could. */
   int DisableIOCP;
@@ -4248,6 +4326,10 @@ typedef struct {
 
   char *TLSECGroup; /**< One of "P256", "P224", or nil for auto */
 
+  /** If true, let relays that reconnect to us resume their earlier TLS
+   * sessions, and try to resume ours when we reconnect to them. */
+  int TLSSessionResumption;
+
   /** Autobool: should we use the ntor handshake if we can? */
   int UseNTorHandshake;
 
@@ -802,6 +802,486 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/* Compiled address policies.
+ *
+ * Checking an address and port against a policy with
+ * compare_tor_addr_to_addr_policy() means a first-match scan over every
+ * rule in the policy.  Exits do that for every BEGIN cell, and clients do
+ * it for every candidate exit when they build circuits, so for long
+ * policies we compile them into something faster:
+ *
+ * We split the ports 0..65535 into ranges such that every rule either
+ * covers a whole range or misses it entirely.  For each range we remember
+ * the first rule covering it that matches every address in a family (like
+ * "accept *:80"), and we group ranges that are covered by the same set of
+ * address-specific rules into a "port class".  For each port class we
+ * build a binary trie over address bits (one for IPv4, one for IPv6), in
+ * which every node remembers the earliest rule whose address prefix ends
+ * there.  The first rule that matches an address and port is then the
+ * earlier of the range's catch-all rule and the earliest rule seen along
+ * the address's path through its port class's trie.  Since catch-all
+ * rules don't go into the classes, policies made of many "accept *:port"
+ * lines after a few address-specific rules need only one class.
+ *
+ * For lookups where we don't know the port, we keep one more pair of
+ * tries over all of the rules, and for lookups where we don't know the
+ * address, we precompute the answer for each port range.  Both give the
+ * same "probably accepted/rejected" answers as the uncompiled versions.
+ */
+
+/** Index of no trie node or no rule. */
+#define POLICY_TRIE_NONE (-1)
+
+/** Don't compile a policy that would need more than this many port
+ * classes... */
+#define POLICY_COMPILE_MAX_CLASSES 64
+/** ...or more than POLICY_COMPILE_BASE_NODES trie nodes, plus
+ * POLICY_COMPILE_NODES_PER_RULE for each rule.  Both grow with the square
+ * of the number of rules for policies whose address-specific rules cover
+ * different ports, so without a limit a single descriptor could make us
+ * allocate hundreds of megabytes.  An IPv4 rule needs at most 32 nodes in
+ * each trie it goes into, so this is enough for long lists of IPv4
+ * rejects. */
+#define POLICY_COMPILE_BASE_NODES 1024
+/** See POLICY_COMPILE_BASE_NODES. */
+#define POLICY_COMPILE_NODES_PER_RULE 64
+
+/** Which of the per-node rule indices in a policy_trie_node_t do we mean?
+ * Port-class tries only use POLICY_TRIE_FIRST. */
+typedef enum {
+  /** The first rule ending here (for the no-port trie, the first one that
+   * covers all ports). */
+  POLICY_TRIE_FIRST = 0,
+  /** No-port trie only: the first reject rule ending here that covers only
+   * some ports. */
+  POLICY_TRIE_PARTIAL_REJECT = 1,
+  /** No-port trie only: the first accept rule ending here that covers only
+   * some ports. */
+  POLICY_TRIE_PARTIAL_ACCEPT = 2,
+} policy_trie_slot_t;
+
+/** A node in one of the address tries of a compiled_addr_policy_t. */
+typedef struct policy_trie_node_t {
+  /** Index of the child node for the next address bit being 0 or 1, or
+   * POLICY_TRIE_NONE. */
+  int child[2];
+  /** Indices of the first rules whose address prefix ends at this node, by
+   * policy_trie_slot_t; INT_MAX for none. */
+  int rule[3];
+} policy_trie_node_t;
+
+/** A set of port ranges that are all covered by the same address-specific
+ * rules. */
+typedef struct policy_port_class_t {
+  /** Which rules with a nonzero mask cover these ports? */
+  bitarray_t *rules;
+  /** Root nodes of the IPv4 and IPv6 tries for this class. */
+  int root[2];
+} policy_port_class_t;
+
+/** A range of ports that every rule either covers entirely or not at
+ * all. */
+typedef struct policy_port_range_t {
+  /** The lowest port in this range.  Range i covers ports ranges[i].min
+   * through ranges[i+1].min-1 (or 65535). */
+  uint16_t min;
+  /** Index into classes of the port class for this range. */
+  int class_idx;
+  /** Index of the first rule covering this range that matches every IPv4
+   * or IPv6 address respectively; INT_MAX for none. */
+  int catchall_rule[2];
+  /** What compare_tor_addr_to_addr_policy() says about an unknown address
+   * on these ports. */
+  addr_policy_result_t unknown_addr_result;
+} policy_port_range_t;
+
+/** An address policy, compiled for fast lookups.  See the comment above
+ * for how it works. */
+struct compiled_addr_policy_t {
+  /** True iff we compiled a NULL policy, which accepts everything. */
+  unsigned int no_policy : 1;
+  /** How many rules are in the policy? */
+  int n_rules;
+  /** For each rule, true iff it's an accept rule. */
+  uint8_t *rule_accepts;
+  /** Number of entries in ranges. */
+  int n_ranges;
+  /** The port ranges, sorted by port. */
+  policy_port_range_t *ranges;
+  /** Number of entries in classes. */
+  int n_classes;
+  /** The port classes. */
+  policy_port_class_t *classes;
+  /** Root nodes of the IPv4 and IPv6 tries we use when we don't know the
+   * port. */
+  int noport_root[2];
+  /** Storage for every trie node. */
+  policy_trie_node_t *nodes;
+  /** Number of used and allocated entries in nodes. */
+  int n_nodes, n_nodes_allocated;
+  /** Give up if we would need more than this many nodes. */
+  int max_nodes;
+};
+
+/** Return 0 for an IPv4 address and 1 for an IPv6 address; return -1 for
+ * any other family. */
+static INLINE int
+policy_trie_family_idx(sa_family_t family)
+{
+  if (family == AF_INET)
+    return 0;
+  else if (family == AF_INET6)
+    return 1;
+  return -1;
+}
+
+/** Return the <b>bit</b>th most significant bit of <b>addr</b>, which must
+ * be an IPv4 or IPv6 address. */
+static INLINE int
+policy_trie_addr_bit(const tor_addr_t *addr, int bit)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    return (tor_addr_to_ipv4h(addr) >> (31 - bit)) & 1;
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    return (a[bit >> 3] >> (7 - (bit & 7))) & 1;
+  }
+}
+
+/** Add a new, empty node to <b>cp</b>, and return its index.  Return
+ * POLICY_TRIE_NONE if <b>cp</b> already has as many nodes as it may. */
+static int
+policy_trie_new_node(compiled_addr_policy_t *cp)
+{
+  policy_trie_node_t *node;
+  if (cp->n_nodes >= cp->max_nodes)
+    return POLICY_TRIE_NONE;
+  if (cp->n_nodes == cp->n_nodes_allocated) {
+    cp->n_nodes_allocated = cp->n_nodes_allocated ?
+      cp->n_nodes_allocated * 2 : 64;
+    cp->nodes = tor_reallocarray(cp->nodes, cp->n_nodes_allocated,
+                                 sizeof(policy_trie_node_t));
+  }
+  node = &cp->nodes[cp->n_nodes];
+  node->child[0] = node->child[1] = POLICY_TRIE_NONE;
+  node->rule[0] = node->rule[1] = node->rule[2] = INT_MAX;
+  return cp->n_nodes++;
+}
+
+/** Record in <b>slot</b> of the trie rooted at *<b>root</b> in <b>cp</b>
+ * that rule number <b>idx</b>, <b>ent</b>, matches every address that
+ * starts with ent's address prefix.  Rules must be added in order.  Return
+ * 0 on success, or -1 if we ran out of trie nodes. */
+static int
+policy_trie_add(compiled_addr_policy_t *cp, int *root,
+                const addr_policy_t *ent, int idx, policy_trie_slot_t slot)
+{
+  const int max_bits = tor_addr_family(&ent->addr) == AF_INET ? 32 : 128;
+  const int bits = MIN(ent->maskbits, max_bits);
+  int node, b;
+
+  if (*root == POLICY_TRIE_NONE &&
+      (*root = policy_trie_new_node(cp)) == POLICY_TRIE_NONE)
+    return -1;
+  node = *root;
+  for (b = 0; b < bits; ++b) {
+    const int bit = policy_trie_addr_bit(&ent->addr, b);
+    if (slot == POLICY_TRIE_FIRST && cp->nodes[node].rule[slot] != INT_MAX)
+      return 0; /* An earlier rule already covers every address we would. */
+    if (cp->nodes[node].child[bit] == POLICY_TRIE_NONE) {
+      const int child = policy_trie_new_node(cp);
+      if (child == POLICY_TRIE_NONE)
+        return -1;
+      cp->nodes[node].child[bit] = child;
+    }
+    node = cp->nodes[node].child[bit];
+  }
+  if (cp->nodes[node].rule[slot] == INT_MAX)
+    cp->nodes[node].rule[slot] = idx;
+  return 0;
+}
+
+/** Walk the trie rooted at <b>root</b> in <b>cp</b> along the bits of
+ * <b>addr</b>, and set <b>out</b>[s] to the earliest rule in each slot s
+ * that we pass, or INT_MAX for none. */
+static void
+policy_trie_lookup(const compiled_addr_policy_t *cp, int root,
+                   const tor_addr_t *addr, int out[3])
+{
+  const int max_bits = tor_addr_family(addr) == AF_INET ? 32 : 128;
+  int node = root, b = 0;
+
+  out[0] = out[1] = out[2] = INT_MAX;
+  while (node != POLICY_TRIE_NONE) {
+    const policy_trie_node_t *n = &cp->nodes[node];
+    out[0] = MIN(out[0], n->rule[0]);
+    out[1] = MIN(out[1], n->rule[1]);
+    out[2] = MIN(out[2], n->rule[2]);
+    if (b == max_bits)
+      break;
+    node = n->child[policy_trie_addr_bit(addr, b++)];
+  }
+}
+
+/** Helper for qsort: compare two ints. */
+static int
+compare_policy_ports_(const void *a, const void *b)
+{
+  const int pa = *(const int *)a, pb = *(const int *)b;
+  return (pa < pb) ? -1 : ((pa > pb) ? 1 : 0);
+}
+
+/** Binary-search the port ranges of <b>cp</b> for the one that holds
+ * <b>port</b>. */
+static const policy_port_range_t *
+compiled_policy_find_range(const compiled_addr_policy_t *cp, uint16_t port)
+{
+  int lo = 0, hi = cp->n_ranges - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (cp->ranges[mid].min <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &cp->ranges[lo];
+}
+
+/** Return a newly allocated compiled copy of <b>policy</b>, for use with
+ * compare_tor_addr_to_compiled_policy().  <b>policy</b> may be NULL.
+ * Return NULL if compiling <b>policy</b> would take more than
+ * POLICY_COMPILE_MAX_CLASSES port classes or too many trie nodes (see
+ * POLICY_COMPILE_BASE_NODES): then callers should use
+ * compare_tor_addr_to_addr_policy() instead. */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t *cp = tor_malloc_zero(sizeof(*cp));
+  const int n = policy ? smartlist_len(policy) : 0;
+  const size_t bitarray_bytes =
+    ((n + BITARRAY_MASK) >> BITARRAY_SHIFT) * sizeof(unsigned int);
+  int *starts = tor_calloc(2 * n + 1, sizeof(int));
+  int n_starts = 0, i;
+
+  cp->no_policy = (policy == NULL);
+  cp->n_rules = n;
+  cp->max_nodes = POLICY_COMPILE_BASE_NODES +
+    POLICY_COMPILE_NODES_PER_RULE * n;
+  cp->rule_accepts = tor_malloc_zero(n ? n : 1);
+  cp->noport_root[0] = cp->noport_root[1] = POLICY_TRIE_NONE;
+
+  /* Find where each port range starts. */
+  starts[n_starts++] = 0;
+  for (i = 0; i < n; ++i) {
+    const addr_policy_t *ent = smartlist_get(policy, i);
+    cp->rule_accepts[i] = ent->policy_type == ADDR_POLICY_ACCEPT;
+    starts[n_starts++] = ent->prt_min;
+    if (ent->prt_max < 65535)
+      starts[n_starts++] = ent->prt_max + 1;
+  }
+  qsort(starts, n_starts, sizeof(int), compare_policy_ports_);
+  for (i = 0; i < n_starts; ++i) {
+    if (i == 0 || starts[i] != starts[i-1])
+      starts[cp->n_ranges++] = starts[i];
+  }
+  cp->ranges = tor_calloc(cp->n_ranges, sizeof(policy_port_range_t));
+  cp->classes = tor_calloc(MIN(cp->n_ranges, POLICY_COMPILE_MAX_CLASSES),
+                           sizeof(policy_port_class_t));
+
+  /* Find each range's catch-all rules and unknown-address answer, and sort
+   * the ranges into port classes. */
+  for (i = 0; i < cp->n_ranges; ++i) {
+    const int port = starts[i];
+    policy_port_range_t *range = &cp->ranges[i];
+    int maybe_accept = 0, maybe_reject = 0, decided = 0;
+    bitarray_t *rules;
+    int j, c;
+    range->min = port;
+    range->catchall_rule[0] = range->catchall_rule[1] = INT_MAX;
+    rules = bitarray_init_zero(n);
+    for (j = 0; j < n; ++j) {
+      const addr_policy_t *ent = smartlist_get(policy, j);
+      const int fam = policy_trie_family_idx(tor_addr_family(&ent->addr));
+      if (port < ent->prt_min || ent->prt_max < port)
+        continue;
+      if (ent->maskbits != 0)
+        bitarray_set(rules, j);
+      else if (fam >= 0 && range->catchall_rule[fam] == INT_MAX)
+        range->catchall_rule[fam] = j;
+      /* This matches compare_unknown_tor_addr_to_addr_policy(). */
+      if (decided) {
+        continue;
+      } else if (ent->maskbits == 0) {
+        if (ent->policy_type == ADDR_POLICY_ACCEPT)
+          range->unknown_addr_result = maybe_reject ?
+            ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+        else
+          range->unknown_addr_result = maybe_accept ?
+            ADDR_POLICY_PROBABLY_REJECTED : ADDR_POLICY_REJECTED;
+        decided = 1;
+      } else if (ent->policy_type == ADDR_POLICY_REJECT) {
+        maybe_reject = 1;
+      } else {
+        maybe_accept = 1;
+      }
+    }
+    if (!decided)
+      range->unknown_addr_result = maybe_reject ?
+        ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+    for (c = 0; c < cp->n_classes; ++c) {
+      if (fast_memeq(cp->classes[c].rules, rules, bitarray_bytes))
+        break;
+    }
+    if (c == cp->n_classes) {
+      if (c == POLICY_COMPILE_MAX_CLASSES) {
+        bitarray_free(rules);
+        tor_free(starts);
+        goto too_big;
+      }
+      cp->classes[c].rules = rules;
+      cp->classes[c].root[0] = cp->classes[c].root[1] = POLICY_TRIE_NONE;
+      ++cp->n_classes;
+    } else {
+      bitarray_free(rules);
+    }
+    range->class_idx = c;
+  }
+  tor_free(starts);
+
+  /* Build the tries for each port class, and for unknown ports. */
+  for (i = 0; i < cp->n_classes; ++i) {
+    policy_port_class_t *pc = &cp->classes[i];
+    int j;
+    for (j = 0; j < n; ++j) {
+      const addr_policy_t *ent = smartlist_get(policy, j);
+      const int fam = policy_trie_family_idx(tor_addr_family(&ent->addr));
+      if (fam < 0 || !bitarray_is_set(pc->rules, j))
+        continue;
+      if (policy_trie_add(cp, &pc->root[fam], ent, j, POLICY_TRIE_FIRST) < 0)
+        goto too_big;
+    }
+  }
+  for (i = 0; i < n; ++i) {
+    const addr_policy_t *ent = smartlist_get(policy, i);
+    const int fam = policy_trie_family_idx(tor_addr_family(&ent->addr));
+    policy_trie_slot_t slot;
+    if (fam < 0)
+      continue;
+    if (ent->prt_min <= 1 && ent->prt_max >= 65535)
+      slot = POLICY_TRIE_FIRST;
+    else if (ent->policy_type == ADDR_POLICY_REJECT)
+      slot = POLICY_TRIE_PARTIAL_REJECT;
+    else
+      slot = POLICY_TRIE_PARTIAL_ACCEPT;
+    if (policy_trie_add(cp, &cp->noport_root[fam], ent, i, slot) < 0)
+      goto too_big;
+  }
+
+  return cp;
+
+ too_big:
+  log_info(LD_GENERAL, "Not compiling an address policy of %d rules: it "
+           "would be too big.", n);
+  compiled_addr_policy_free(cp);
+  return NULL;
+}
+
+/** Release all storage held by <b>cp</b>. */
+void
+compiled_addr_policy_free(compiled_addr_policy_t *cp)
+{
+  int i;
+  if (!cp)
+    return;
+  for (i = 0; i < cp->n_classes; ++i)
+    bitarray_free(cp->classes[i].rules);
+  tor_free(cp->classes);
+  tor_free(cp->ranges);
+  tor_free(cp->rule_accepts);
+  tor_free(cp->nodes);
+  tor_free(cp);
+}
+
+/** As compare_tor_addr_to_addr_policy(), but use the compiled policy
+ * <b>cp</b>.  Takes time proportional to the number of bits in
+ * <b>addr</b>, plus the log of the number of rules, rather than to the
+ * number of rules. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_addr_policy_t *cp)
+{
+  int fam, matches[3];
+
+  tor_assert(cp);
+
+  if (cp->no_policy) {
+    /* no policy? accept all. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return compiled_policy_find_range(cp, port)->unknown_addr_result;
+  }
+
+  fam = policy_trie_family_idx(tor_addr_family(addr));
+  if (fam < 0) {
+    /* No rule can match an address in any other family. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+
+  if (port == 0) {
+    /* This matches compare_known_tor_addr_to_addr_policy_noport(). */
+    int first, maybe_reject, maybe_accept;
+    policy_trie_lookup(cp, cp->noport_root[fam], addr, matches);
+    first = matches[POLICY_TRIE_FIRST];
+    maybe_reject = matches[POLICY_TRIE_PARTIAL_REJECT] < first;
+    maybe_accept = matches[POLICY_TRIE_PARTIAL_ACCEPT] < first;
+    if (first == INT_MAX)
+      return maybe_reject ?
+        ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+    if (cp->rule_accepts[first])
+      return maybe_reject ?
+        ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+    else
+      return maybe_accept ?
+        ADDR_POLICY_PROBABLY_REJECTED : ADDR_POLICY_REJECTED;
+  } else {
+    const policy_port_range_t *range = compiled_policy_find_range(cp, port);
+    int first;
+    policy_trie_lookup(cp, cp->classes[range->class_idx].root[fam],
+                       addr, matches);
+    first = MIN(matches[POLICY_TRIE_FIRST], range->catchall_rule[fam]);
+    if (first == INT_MAX)
+      return ADDR_POLICY_ACCEPTED; /* accept all by default. */
+    return cp->rule_accepts[first] ?
+      ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+  }
+}
+
+/** Decide whether <b>router</b>'s exit policy accepts or rejects addr:port,
+ * as compare_tor_addr_to_addr_policy() would, compiling the policy the
+ * first time we're asked.  If the policy is too big to compile, scan it
+ * instead. */
+addr_policy_result_t
+compare_tor_addr_to_router_exit_policy(const tor_addr_t *addr, uint16_t port,
+                                       routerinfo_t *router)
+{
+  if (!router->exit_policy || router->exit_policy_too_big_to_compile)
+    return compare_tor_addr_to_addr_policy(addr, port, router->exit_policy);
+  if (!router->compiled_exit_policy) {
+    router->compiled_exit_policy = addr_policy_compile(router->exit_policy);
+    if (!router->compiled_exit_policy) {
+      router->exit_policy_too_big_to_compile = 1;
+      return compare_tor_addr_to_addr_policy(addr, port, router->exit_policy);
+    }
+  }
+  return compare_tor_addr_to_compiled_policy(addr, port,
+                                             router->compiled_exit_policy);
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -1096,6 +1576,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_note_exit_policy_changed(node);
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -1754,7 +2235,7 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    return compare_tor_addr_to_router_exit_policy(addr, port, node->ri);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
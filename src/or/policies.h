@@ -48,6 +48,16 @@ MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_addr_policy_free(compiled_addr_policy_t *cp);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const compiled_addr_policy_t *cp);
+addr_policy_result_t compare_tor_addr_to_router_exit_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          routerinfo_t *router);
+
 /*
 int policies_parse_exit_policy(config_line_t *cfg, smartlist_t **dest,
                                int ipv6exit,
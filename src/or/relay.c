@@ -18,12 +18,15 @@
 #include "circpathbias.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuitmux_ewma.h"
 #include "circuituse.h"
 #include "config.h"
+#include "congestion.h"
 #include "connection.h"
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "dns.h"
 #include "geoip.h"
 #include "main.h"
 #include "networkstatus.h"
@@ -50,12 +53,19 @@ static void circuit_consider_sending_sendme(circuit_t *circ,
                                             crypt_path_t *layer_hint);
 static void circuit_resume_edge_reading(circuit_t *circ,
                                         crypt_path_t *layer_hint);
+static double stream_get_package_ewma(edge_connection_t *conn,
+                                      unsigned now_tick);
 static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
                                               circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static void append_packed_cell_to_circuit_queue(circuit_t *circ,
+                                                channel_t *chan,
+                                                packed_cell_t *cell,
+                                                cell_direction_t direction,
+                                                streamid_t fromstream);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
                                                   node_t *node,
@@ -83,22 +93,22 @@ uint64_t stats_n_relay_cells_delivered = 0;
 /** Used to tell which stream to read from first on a circuit. */
 static tor_weak_rng_t stream_choice_rng = TOR_WEAK_RNG_INIT;
 
-/** Update digest from the payload of cell. Assign integrity part to
- * cell.
+/** Update digest from the relay cell payload <b>payload</b>. Assign
+ * integrity part to the payload.
  */
 static void
-relay_set_digest(crypto_digest_t *digest, cell_t *cell)
+relay_set_digest(crypto_digest_t *digest, uint8_t *payload)
 {
   char integrity[4];
   relay_header_t rh;
 
-  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_add_bytes(digest, (char*)payload, CELL_PAYLOAD_SIZE);
   crypto_digest_get_digest(digest, integrity, 4);
 //  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
 //    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
+  relay_header_unpack(&rh, payload);
   memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  relay_header_pack(payload, &rh);
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
@@ -403,7 +413,7 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
+    relay_set_digest(layer_hint->f_digest, cell->payload);
 
     thishop = layer_hint;
     /* moving from farthest to nearest hop */
@@ -429,7 +439,7 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     chan = or_circ->p_chan;
-    relay_set_digest(or_circ->p_digest, cell);
+    relay_set_digest(or_circ->p_digest, cell->payload);
     if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
       return -1;
   }
@@ -1713,6 +1723,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
             return -END_CIRC_REASON_TORPROTOCOL;
           }
           layer_hint->package_window += CIRCWINDOW_INCREMENT;
+          circuit_cc_note_sendme(layer_hint->cc);
           log_debug(LD_APP,"circ-level sendme at origin, packagewindow %d.",
                     layer_hint->package_window);
           circuit_resume_edge_reading(circ, layer_hint);
@@ -1727,6 +1738,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
             return -END_CIRC_REASON_TORPROTOCOL;
           }
           circ->package_window += CIRCWINDOW_INCREMENT;
+          circuit_cc_note_sendme(circ->cc);
           log_debug(LD_APP,
                     "circ-level sendme at non-origin, packagewindow %d.",
                     circ->package_window);
@@ -1814,6 +1826,58 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** Package <b>length</b> bytes from the inbuf of the exit stream
+ * <b>conn</b> into a DATA cell on <b>or_circ</b>, and queue it towards the
+ * client.  This is what connection_edge_send_command() would do, except
+ * that we build the cell in the packed_cell_t that we queue: the data gets
+ * copied once, straight from the inbuf, rather than into a payload, then a
+ * cell_t, then a packed_cell_t.
+ *
+ * If you can't send the cell, mark the circuit for close and return -1.
+ * Else return 0.
+ */
+static int
+connection_exit_package_data_cell(edge_connection_t *conn,
+                                  or_circuit_t *or_circ, size_t length)
+{
+  channel_t *chan = or_circ->p_chan;
+  packed_cell_t *cell = packed_cell_new();
+  uint8_t *payload;
+  relay_header_t rh;
+
+  tor_assert(length <= RELAY_PAYLOAD_SIZE);
+
+  if (chan->wide_circ_ids) {
+    set_uint32(cell->body, htonl(or_circ->p_circ_id));
+    payload = (uint8_t*)cell->body + 5;
+  } else {
+    set_uint16(cell->body, htons(or_circ->p_circ_id));
+    payload = (uint8_t*)cell->body + 3;
+  }
+  set_uint8(payload - 1, CELL_RELAY);
+
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = conn->stream_id;
+  rh.length = length;
+  relay_header_pack(payload, &rh);
+  connection_fetch_from_buf((char*)payload + RELAY_HEADER_SIZE, length,
+                            TO_CONN(conn));
+
+  relay_set_digest(or_circ->p_digest, payload);
+  if (relay_crypt_one_payload(or_circ->p_crypto, payload, 1) < 0) {
+    packed_cell_free(cell);
+    log_warn(LD_BUG,"Couldn't encrypt a DATA cell. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(or_circ), END_CIRC_REASON_INTERNAL);
+    return -1;
+  }
+  ++stats_n_relay_cells_relayed;
+
+  append_packed_cell_to_circuit_queue(TO_CIRCUIT(or_circ), chan, cell,
+                                      CELL_DIRECTION_IN, conn->stream_id);
+  return 0;
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -1833,6 +1897,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   circuit_t *circ;
   const unsigned domain = conn->base_.type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
   int sending_from_optimistic = 0;
+  size_t n_from_optimistic = 0;
   entry_connection_t *entry_conn =
     conn->base_.type == CONN_TYPE_AP ? EDGE_TO_ENTRY_CONN(conn) : NULL;
   const int sending_optimistically =
@@ -1875,15 +1940,15 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   sending_from_optimistic = entry_conn &&
     entry_conn->sending_optimistic_data != NULL;
 
+  bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
   if (PREDICT_UNLIKELY(sending_from_optimistic)) {
-    bytes_to_process = generic_buffer_len(entry_conn->sending_optimistic_data);
-    if (PREDICT_UNLIKELY(!bytes_to_process)) {
+    n_from_optimistic =
+      generic_buffer_len(entry_conn->sending_optimistic_data);
+    if (PREDICT_UNLIKELY(!n_from_optimistic)) {
       log_warn(LD_BUG, "sending_optimistic_data was non-NULL but empty");
-      bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
       sending_from_optimistic = 0;
     }
-  } else {
-    bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
+    bytes_to_process += n_from_optimistic;
   }
 
   if (!bytes_to_process)
@@ -1900,29 +1965,50 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   stats_n_data_bytes_packaged += length;
   stats_n_data_cells_packaged += 1;
 
+  if (!cpath_layer && !CIRCUIT_IS_ORIGIN(circ) &&
+      TO_OR_CIRCUIT(circ)->p_chan) {
+    /* Exit stream: build the cell right where it will wait to be sent. */
+    log_debug(domain,TOR_SOCKET_T_FORMAT": Packaging %d bytes (%d waiting).",
+              conn->base_.s, (int)length,
+              (int)(connection_get_inbuf_len(TO_CONN(conn)) - length));
+    if (connection_exit_package_data_cell(conn, TO_OR_CIRCUIT(circ),
+                                          length) < 0)
+      /* circuit got marked for close, don't continue, don't need to mark
+       * conn */
+      return 0;
+    goto packaged;
+  }
+
   if (PREDICT_UNLIKELY(sending_from_optimistic)) {
-    /* XXXX We could be more efficient here by sometimes packing
-     * previously-sent optimistic data in the same cell with data
-     * from the inbuf. */
-    generic_buffer_get(entry_conn->sending_optimistic_data, payload, length);
+    /* Send the previously-sent optimistic data first, and fill up the rest
+     * of the cell from the inbuf. */
+    if (n_from_optimistic > length)
+      n_from_optimistic = length;
+    generic_buffer_get(entry_conn->sending_optimistic_data, payload,
+                       n_from_optimistic);
     if (!generic_buffer_len(entry_conn->sending_optimistic_data)) {
         generic_buffer_free(entry_conn->sending_optimistic_data);
         entry_conn->sending_optimistic_data = NULL;
     }
   } else {
-    connection_fetch_from_buf(payload, length, TO_CONN(conn));
+    n_from_optimistic = 0;
   }
+  if (length > n_from_optimistic)
+    connection_fetch_from_buf(payload + n_from_optimistic,
+                              length - n_from_optimistic, TO_CONN(conn));
 
   log_debug(domain,TOR_SOCKET_T_FORMAT": Packaging %d bytes (%d waiting).",
             conn->base_.s,
             (int)length, (int)connection_get_inbuf_len(TO_CONN(conn)));
 
-  if (sending_optimistically && !sending_from_optimistic) {
+  if (sending_optimistically && length > n_from_optimistic) {
     /* This is new optimistic data; remember it in case we need to detach and
        retry */
     if (!entry_conn->pending_optimistic_data)
       entry_conn->pending_optimistic_data = generic_buffer_new();
-    generic_buffer_add(entry_conn->pending_optimistic_data, payload, length);
+    generic_buffer_add(entry_conn->pending_optimistic_data,
+                       payload + n_from_optimistic,
+                       length - n_from_optimistic);
   }
 
   if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
@@ -1930,11 +2016,17 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
 
+ packaged:
+  conn->package_ewma = stream_get_package_ewma(conn, cell_ewma_get_tick())
+    + 1.0;
+
   if (!cpath_layer) { /* non-rendezvous exit */
     tor_assert(circ->package_window > 0);
+    circuit_cc_note_cell_sent(&circ->cc, circ->package_window);
     circ->package_window--;
   } else { /* we're an AP, or an exit on a rendezvous circ */
     tor_assert(cpath_layer->package_window > 0);
+    circuit_cc_note_cell_sent(&cpath_layer->cc, cpath_layer->package_window);
     cpath_layer->package_window--;
   }
 
@@ -2020,6 +2112,33 @@ stream_choice_seed_weak_rng(void)
   crypto_seed_weak_rng(&stream_choice_rng);
 }
 
+/** Return the EWMA of cells that <b>conn</b> has packaged, decayed to
+ * <b>now_tick</b>. */
+static double
+stream_get_package_ewma(edge_connection_t *conn, unsigned now_tick)
+{
+  if (conn->package_ewma_tick != now_tick) {
+    conn->package_ewma *=
+      cell_ewma_get_scale_factor(conn->package_ewma_tick, now_tick);
+    conn->package_ewma_tick = now_tick;
+  }
+  return conn->package_ewma;
+}
+
+/** Helper for smartlist_sort: order edge connections so that the ones that
+ * have packaged the fewest cells recently come first. */
+static int
+compare_streams_by_package_ewma_(const void **a, const void **b)
+{
+  const edge_connection_t *ca = *a, *cb = *b;
+  if (ca->package_ewma < cb->package_ewma)
+    return -1;
+  else if (ca->package_ewma > cb->package_ewma)
+    return 1;
+  else
+    return 0;
+}
+
 /** A helper function for circuit_resume_edge_reading() above.
  * The arguments are the same, except that <b>conn</b> is the head
  * of a linked list of edge streams that should each be considered.
@@ -2036,6 +2155,9 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   int cells_per_conn;
   edge_connection_t *chosen_stream = NULL;
   int max_to_package;
+  smartlist_t *streams;
+  unsigned now_tick;
+  int result = 0;
 
   if (first_conn == NULL) {
     /* Don't bother to try to do the rest of this if there are no connections
@@ -2046,7 +2168,16 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   /* How many cells do we have space for?  It will be the minimum of
    * the number needed to exhaust the package window, and the minimum
    * needed to fill the cell queue. */
-  max_to_package = circ->package_window;
+  if (layer_hint)
+    max_to_package = circuit_cc_get_package_window(layer_hint->cc,
+                                                 layer_hint->package_window);
+  else
+    max_to_package = circuit_cc_get_package_window(circ->cc,
+                                                   circ->package_window);
+  if (max_to_package <= 0) {
+    /* The congestion window is still full: leave the streams asleep. */
+    return 0;
+  }
   if (CIRCUIT_IS_ORIGIN(circ)) {
     cells_on_queue = circ->n_chan_cells.n;
   } else {
@@ -2056,17 +2187,11 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   if (CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue < max_to_package)
     max_to_package = CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue;
 
-  /* Once we used to start listening on the streams in the order they
-   * appeared in the linked list.  That leads to starvation on the
-   * streams that appeared later on the list, since the first streams
-   * would always get to read first.  Instead, we just pick a random
-   * stream on the list, and enable reading for streams starting at that
-   * point (and wrapping around as if the list were circular).  It would
-   * probably be better to actually remember which streams we've
-   * serviced in the past, but this is simple and effective. */
-
-  /* Select a stream uniformly at random from the linked list.  We
-   * don't need cryptographic randomness here. */
+  /* Streams take turns packaging cells, and the ones that have packaged the
+   * fewest cells lately go first: that way a stream with a short request
+   * doesn't have to wait behind a bulk download on the same circuit.  We
+   * start from a random stream so that streams that tie (most often, at
+   * zero) aren't always served in list order. */
   {
     int num_streams = 0;
     for (conn = first_conn; conn; conn = conn->next_stream) {
@@ -2087,35 +2212,29 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
     }
   }
 
-  /* Count how many non-marked streams there are that have anything on
-   * their inbuf, and enable reading on all of the connections. */
-  n_packaging_streams = 0;
-  /* Activate reading starting from the chosen stream */
-  for (conn=chosen_stream; conn; conn = conn->next_stream) {
-    /* Start reading for the streams starting from here */
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      connection_start_reading(TO_CONN(conn));
-
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
-    }
-  }
-  /* Go back and do the ones we skipped, circular-style */
-  for (conn = first_conn; conn != chosen_stream; conn = conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
+  /* Enable reading on all of the non-marked connections, and list the ones
+   * that have anything on their inbuf, starting from the chosen stream and
+   * wrapping around. */
+  streams = smartlist_new();
+  now_tick = cell_ewma_get_tick();
+  conn = chosen_stream;
+  do {
+    if (!conn->base_.marked_for_close && conn->package_window > 0 &&
+        (!layer_hint || conn->cpath_layer == layer_hint)) {
       connection_start_reading(TO_CONN(conn));
 
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
+      if (connection_get_inbuf_len(TO_CONN(conn)) > 0) {
+        stream_get_package_ewma(conn, now_tick);
+        smartlist_add(streams, conn);
+      }
     }
-  }
+    conn = conn->next_stream ? conn->next_stream : first_conn;
+  } while (conn != chosen_stream);
 
+  n_packaging_streams = smartlist_len(streams);
   if (n_packaging_streams == 0) /* avoid divide-by-zero */
-    return 0;
+    goto done;
+  smartlist_sort(streams, compare_streams_by_package_ewma_);
 
  again:
 
@@ -2124,42 +2243,42 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   packaged_this_round = 0;
   n_streams_left = 0;
 
-  /* Iterate over all connections.  Package up to cells_per_conn cells on
-   * each.  Update packaged_this_round with the total number of cells
+  /* Iterate over the streams in order.  Package up to cells_per_conn cells
+   * on each.  Update packaged_this_round with the total number of cells
    * packaged, and n_streams_left with the number that still have data to
    * package.
    */
-  for (conn=first_conn; conn; conn=conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+  SMARTLIST_FOREACH_BEGIN(streams, edge_connection_t *, stream) {
+    int n = cells_per_conn, r;
+    if (stream->base_.marked_for_close || stream->package_window <= 0)
       continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      int n = cells_per_conn, r;
-      /* handle whatever might still be on the inbuf */
-      r = connection_edge_package_raw_inbuf(conn, 1, &n);
+    /* handle whatever might still be on the inbuf */
+    r = connection_edge_package_raw_inbuf(stream, 1, &n);
 
-      /* Note how many we packaged */
-      packaged_this_round += (cells_per_conn-n);
+    /* Note how many we packaged */
+    packaged_this_round += (cells_per_conn-n);
 
-      if (r<0) {
-        /* Problem while packaging. (We already sent an end cell if
-         * possible) */
-        connection_mark_for_close(TO_CONN(conn));
-        continue;
-      }
+    if (r<0) {
+      /* Problem while packaging. (We already sent an end cell if
+       * possible) */
+      connection_mark_for_close(TO_CONN(stream));
+      continue;
+    }
 
-      /* If there's still data to read, we'll be coming back to this stream. */
-      if (connection_get_inbuf_len(TO_CONN(conn)))
-          ++n_streams_left;
+    /* If there's still data to read, we'll be coming back to this stream. */
+    if (connection_get_inbuf_len(TO_CONN(stream)))
+        ++n_streams_left;
 
-      /* If the circuit won't accept any more data, return without looking
-       * at any more of the streams. Any connections that should be stopped
-       * have already been stopped by connection_edge_package_raw_inbuf. */
-      if (circuit_consider_stop_edge_reading(circ, layer_hint))
-        return -1;
-      /* XXXX should we also stop immediately if we fill up the cell queue?
-       * Probably. */
+    /* If the circuit won't accept any more data, return without looking
+     * at any more of the streams. Any connections that should be stopped
+     * have already been stopped by connection_edge_package_raw_inbuf. */
+    if (circuit_consider_stop_edge_reading(circ, layer_hint)) {
+      result = -1;
+      goto done;
     }
-  }
+    /* XXXX should we also stop immediately if we fill up the cell queue?
+     * Probably. */
+  } SMARTLIST_FOREACH_END(stream);
 
   /* If we made progress, and we are willing to package more, and there are
    * any streams left that want to package stuff... try again!
@@ -2171,7 +2290,9 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
     goto again;
   }
 
-  return 0;
+ done:
+  smartlist_free(streams);
+  return result;
 }
 
 /** Check if the package window for <b>circ</b> is empty (at
@@ -2190,7 +2311,7 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     log_debug(domain,"considering circ->package_window %d",
               circ->package_window);
-    if (circ->package_window <= 0) {
+    if (circuit_cc_get_package_window(circ->cc, circ->package_window) <= 0) {
       log_debug(domain,"yes, not-at-origin. stopped.");
       for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
         connection_stop_reading(TO_CONN(conn));
@@ -2201,7 +2322,8 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
   /* else, layer hint is defined, use it */
   log_debug(domain,"considering layer_hint->package_window %d",
             layer_hint->package_window);
-  if (layer_hint->package_window <= 0) {
+  if (circuit_cc_get_package_window(layer_hint->cc,
+                                    layer_hint->package_window) <= 0) {
     log_debug(domain,"yes, at-origin. stopped.");
     for (conn = TO_ORIGIN_CIRCUIT(circ)->p_streams; conn;
          conn=conn->next_stream) {
@@ -2397,6 +2519,8 @@ cell_queues_check_size(void)
   alloc += tor_zlib_get_total_allocation();
   const size_t rend_cache_total = rend_cache_get_total_allocation();
   alloc += rend_cache_total;
+  const size_t dns_cache_total = dns_cache_get_total_allocation();
+  alloc += dns_cache_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
@@ -2410,6 +2534,12 @@ cell_queues_check_size(void)
         alloc -= rend_cache_total;
         alloc += rend_cache_get_total_allocation();
       }
+      /* Likewise for the exit DNS cache. */
+      if (dns_cache_total > get_options()->MaxMemInQueues / 5) {
+        const size_t bytes_to_remove =
+          dns_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
+        alloc -= dns_cache_handle_oom(time(NULL), bytes_to_remove);
+      }
       circuits_handle_oom(alloc);
       return 1;
     }
@@ -2717,17 +2847,37 @@ void
 append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  if (circ->marked_for_close)
+    return;
+
+  append_packed_cell_to_circuit_queue(circ, chan,
+                                      packed_cell_copy(cell,
+                                                       chan->wide_circ_ids),
+                                      direction, fromstream);
+}
+
+/** As append_cell_to_circuit_queue(), but take ownership of <b>cell</b>,
+ * which is already packed for <b>chan</b>. */
+static void
+append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                    packed_cell_t *cell,
+                                    cell_direction_t direction,
+                                    streamid_t fromstream)
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
   int streams_blocked;
+  struct timeval now;
 #if 0
   uint32_t tgt_max_middle_cells, p_len, n_len, tmp, hard_max_middle_cells;
 #endif
 
   int exitward;
-  if (circ->marked_for_close)
+  if (circ->marked_for_close) {
+    packed_cell_free(cell);
     return;
+  }
 
   exitward = (direction == CELL_DIRECTION_OUT);
   if (exitward) {
@@ -2800,6 +2950,7 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                         circ->n_chan->global_identifier :
                         orcirc->p_chan->global_identifier));
           circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+          packed_cell_free(cell);
           return;
         } else if ((unsigned)queue->n + 1 == orcirc->max_middle_cells) {
           /* Only use ==, not >= for this test so we don't spam the log */
@@ -2821,8 +2972,9 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   }
 #endif
 
-  cell_queue_append_packed_copy(circ, queue, exitward, cell,
-                                chan->wide_circ_ids, 1);
+  tor_gettimeofday_cached_monotonic(&now);
+  cell->inserted_time = (uint32_t)tv_to_msec(&now);
+  cell_queue_append(queue, cell);
 
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
     /* We ran the OOM handler */
@@ -18,6 +18,7 @@
 #include "config.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -40,6 +41,7 @@
 #include "routerset.h"
 #include "sandbox.h"
 #include "torcert.h"
+#include "workqueue.h"
 
 // #define DEBUG_ROUTERLIST
 
@@ -1029,16 +1031,332 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
-#define RRS_FORCE 1
-#define RRS_DONT_REMOVE_OLD 2
+/** A copy of a descriptor store that a worker thread is writing for us. */
+typedef struct store_rebuild_job_t {
+  /** Which store is this? */
+  store_type_t type;
+  /** Our own mappings of the store and its journal, so that the
+   * descriptors we're writing from them stay put whatever the main thread
+   * does. */
+  tor_mmap_t *store_mmap, *journal_mmap;
+  /** Copies of descriptors that weren't in either file. */
+  smartlist_t *copies;
+  /** A sized_chunk_t for every descriptor to write, in order. */
+  smartlist_t *chunks;
+  /** The digest of every descriptor in <b>chunks</b>, in the same order. */
+  smartlist_t *digests;
+  /** The file to write. */
+  char *fname_tmp;
+  /** True iff we wrote fname_tmp successfully. */
+  int ok;
+  /** True iff the store changed in a way that makes this copy useless. */
+  int cancelled;
+} store_rebuild_job_t;
+
+/** For each store_type_t, the copy of that store that a worker thread is
+ * writing for us, if any. */
+static store_rebuild_job_t *pending_store_rebuild[2] = { NULL, NULL };
+
+/** Note that any copy of a store of type <b>type</b> that a worker thread
+ * is writing will be out of date. */
+static void
+cancel_store_rebuild(store_type_t type)
+{
+  if (pending_store_rebuild[type])
+    pending_store_rebuild[type]->cancelled = 1;
+}
+
+/** Release all storage held by <b>job</b>. */
+static void
+store_rebuild_job_free(store_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  if (job->store_mmap)
+    tor_munmap_file(job->store_mmap);
+  if (job->journal_mmap)
+    tor_munmap_file(job->journal_mmap);
+  if (job->copies) {
+    SMARTLIST_FOREACH(job->copies, char *, cp, tor_free(cp));
+    smartlist_free(job->copies);
+  }
+  if (job->chunks) {
+    SMARTLIST_FOREACH(job->chunks, sized_chunk_t *, c, tor_free(c));
+    smartlist_free(job->chunks);
+  }
+  if (job->digests) {
+    SMARTLIST_FOREACH(job->digests, char *, cp, tor_free(cp));
+    smartlist_free(job->digests);
+  }
+  tor_free(job->fname_tmp);
+  tor_free(job);
+}
+
+/** Return a list of every descriptor that belongs in <b>store</b>, oldest
+ * first. */
+static smartlist_t *
+desc_store_list_descriptors(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+
+  /* We sort the routers by age to enhance locality on disk. */
+  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
+  return signed_descriptors;
+}
+
+/** Worker thread function: write the store that <b>work_</b> describes. */
+static int
+store_rebuild_job_threadfn(void *state_, void *work_)
+{
+  store_rebuild_job_t *job = work_;
+  (void) state_;
+
+  job->ok = write_chunks_to_file(job->fname_tmp, job->chunks, 1, 1) == 0;
+
+  /* We're done with the old files; let the main thread replace them. */
+  if (job->store_mmap)
+    tor_munmap_file(job->store_mmap);
+  if (job->journal_mmap)
+    tor_munmap_file(job->journal_mmap);
+  job->store_mmap = job->journal_mmap = NULL;
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread: the worker has written the store that <b>job</b> describes.
+ * Put it in place of the old store, point every descriptor that is in it
+ * there, and write every other descriptor to a new journal. */
+static void
+store_rebuild_job_finish(store_rebuild_job_t *job, desc_store_t *store)
+{
+  digestmap_t *chunk_idx = digestmap_new();
+  smartlist_t *signed_descriptors = desc_store_list_descriptors(store);
+  smartlist_t *journal = smartlist_new();
+  char *fname = get_datadir_fname(store->fname_base);
+  char *fname_journal = get_datadir_fname_suffix(store->fname_base, ".new");
+  off_t *chunk_offsets = tor_calloc(smartlist_len(job->chunks)+1,
+                                    sizeof(off_t));
+  tor_mmap_t *new_mmap;
+  off_t offset = 0, journal_offset = 0;
+  int n_in_store = 0;
+
+  /* chunk_idx maps each digest we wrote to 1 + the index of its chunk. */
+  SMARTLIST_FOREACH(job->digests, const char *, d,
+                    digestmap_set(chunk_idx, d,
+                                  (void*)(intptr_t)(d_sl_idx+1)));
+  SMARTLIST_FOREACH_BEGIN(job->chunks, const sized_chunk_t *, c) {
+    chunk_offsets[c_sl_idx] = offset;
+    offset += c->len;
+  } SMARTLIST_FOREACH_END(c);
+
+  new_mmap = tor_mmap_file(job->fname_tmp);
+  if (new_mmap ? (new_mmap->size != (size_t)offset) : (offset != 0)) {
+    log_warn(LD_FS, "Descriptor store written to %s doesn't match what we "
+             "asked for; discarding it.", job->fname_tmp);
+    if (new_mmap)
+      tor_munmap_file(new_mmap);
+    unlink(job->fname_tmp);
+    goto done;
+  }
+
+  /* Anything in the old store that isn't in the new one needs a copy
+   * before we unmap the old store. */
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    const size_t len = sd->signed_descriptor_len + sd->annotations_len;
+    intptr_t idx = (intptr_t) digestmap_get(chunk_idx,
+                                            sd->signed_descriptor_digest);
+    const sized_chunk_t *c = idx ? smartlist_get(job->chunks, idx-1) : NULL;
+    if (sd->saved_location == SAVED_IN_CACHE && (!c || c->len != len)) {
+      sd->signed_descriptor_body =
+        tor_memdup_nulterm(signed_descriptor_get_body_impl(sd, 1), len);
+      sd->saved_location = SAVED_NOWHERE;
+    }
+  } SMARTLIST_FOREACH_END(sd);
+
+  if (store->mmap) {
+    if (tor_munmap_file(store->mmap) != 0)
+      log_warn(LD_FS, "Unable to munmap route store in %s", fname);
+    store->mmap = NULL;
+  }
+  if (replace_file(job->fname_tmp, fname) < 0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    if (new_mmap)
+      tor_munmap_file(new_mmap);
+    unlink(job->fname_tmp);
+    store->mmap = tor_mmap_file(fname);
+    goto done;
+  }
+  store->mmap = new_mmap;
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    const size_t len = sd->signed_descriptor_len + sd->annotations_len;
+    intptr_t idx = (intptr_t) digestmap_get(chunk_idx,
+                                            sd->signed_descriptor_digest);
+    const sized_chunk_t *c = idx ? smartlist_get(job->chunks, idx-1) : NULL;
+    if (sd->do_not_cache)
+      continue;
+    if (c && c->len == len &&
+        (sd->saved_location == SAVED_IN_CACHE ||
+         fast_memeq(store->mmap->data + chunk_offsets[idx-1],
+                    signed_descriptor_get_body_impl(sd, 1), len))) {
+      /* It's in the new store. */
+      if (sd->saved_location != SAVED_IN_CACHE)
+        tor_free(sd->signed_descriptor_body);
+      sd->saved_location = SAVED_IN_CACHE;
+      sd->saved_offset = chunk_offsets[idx-1];
+      signed_descriptor_get_body(sd); /* reconstruct and assert */
+      ++n_in_store;
+    } else {
+      /* We got it while the worker was busy. */
+      sized_chunk_t *jc = tor_malloc(sizeof(sized_chunk_t));
+      tor_assert(sd->saved_location != SAVED_IN_CACHE);
+      jc->bytes = signed_descriptor_get_body_impl(sd, 1);
+      jc->len = len;
+      smartlist_add(journal, jc);
+      sd->saved_location = SAVED_IN_JOURNAL;
+      sd->saved_offset = journal_offset;
+      journal_offset += len;
+    }
+  } SMARTLIST_FOREACH_END(sd);
+
+  if (write_chunks_to_file(fname_journal, journal, 1, 0) < 0)
+    log_warn(LD_FS, "Unable to rewrite the journal in %s", fname_journal);
+
+  log_info(LD_DIR, "Done rebuilding %s cache in the background: %d "
+           "descriptors in the store, %d in the journal.", store->description,
+           n_in_store, smartlist_len(journal));
+  store->store_len = (size_t) offset;
+  store->journal_len = (size_t) journal_offset;
+  store->bytes_dropped = 0;
+
+ done:
+  SMARTLIST_FOREACH(journal, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(journal);
+  smartlist_free(signed_descriptors);
+  digestmap_free(chunk_idx, NULL);
+  tor_free(chunk_offsets);
+  tor_free(fname);
+  tor_free(fname_journal);
+}
+
+/** Main thread reply function for store_rebuild_job_threadfn(). */
+static void
+store_rebuild_job_replyfn(void *work_)
+{
+  store_rebuild_job_t *job = work_;
+  desc_store_t *store;
+
+  tor_assert(pending_store_rebuild[job->type] == job);
+  pending_store_rebuild[job->type] = NULL;
+  if (!routerlist) {
+    unlink(job->fname_tmp);
+    store_rebuild_job_free(job);
+    return;
+  }
+  store = (job->type == EXTRAINFO_STORE) ?
+    &routerlist->extrainfo_store : &routerlist->desc_store;
+
+  if (!job->ok || job->cancelled) {
+    log_info(LD_DIR, "Discarding %s cache written in the background.",
+             store->description);
+    unlink(job->fname_tmp);
+  } else {
+    store_rebuild_job_finish(job, store);
+  }
+  store_rebuild_job_free(job);
+}
+
+/** Try to have a worker thread write a new copy of <b>store</b> holding
+ * <b>signed_descriptors</b>.  Return 0 if we queued the work, and -1 if
+ * the caller should rebuild the store itself. */
+static int
+router_rebuild_store_in_background(desc_store_t *store,
+                                   smartlist_t *signed_descriptors)
+{
+  store_rebuild_job_t *job = tor_malloc_zero(sizeof(store_rebuild_job_t));
+  char *fname = get_datadir_fname(store->fname_base);
+  char *fname_journal = get_datadir_fname_suffix(store->fname_base, ".new");
+
+  job->type = store->type;
+  job->copies = smartlist_new();
+  job->chunks = smartlist_new();
+  job->digests = smartlist_new();
+  job->fname_tmp = get_datadir_fname_suffix(store->fname_base, ".bgtmp");
+  if (store->mmap) {
+    job->store_mmap = tor_mmap_file(fname);
+    if (!job->store_mmap || job->store_mmap->size != store->mmap->size)
+      goto err;
+  }
+  if (store->journal_len)
+    job->journal_mmap = tor_mmap_file(fname_journal);
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    const size_t len = sd->signed_descriptor_len + sd->annotations_len;
+    sized_chunk_t *c;
+    if (sd->do_not_cache)
+      continue;
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->len = len;
+    if (sd->saved_location == SAVED_IN_CACHE && job->store_mmap) {
+      c->bytes = job->store_mmap->data + sd->saved_offset;
+    } else if (sd->saved_location == SAVED_IN_JOURNAL && job->journal_mmap &&
+               (size_t)sd->saved_offset + len <= job->journal_mmap->size &&
+               fast_memeq(job->journal_mmap->data + sd->saved_offset,
+                          sd->signed_descriptor_body, len)) {
+      c->bytes = job->journal_mmap->data + sd->saved_offset;
+    } else {
+      char *copy = tor_memdup(signed_descriptor_get_body_impl(sd, 1), len);
+      smartlist_add(job->copies, copy);
+      c->bytes = copy;
+    }
+    smartlist_add(job->chunks, c);
+    smartlist_add(job->digests,
+                  tor_memdup(sd->signed_descriptor_digest, DIGEST_LEN));
+  } SMARTLIST_FOREACH_END(sd);
+
+  if (!cpuworker_queue_background_work(store_rebuild_job_threadfn,
+                                       store_rebuild_job_replyfn, job))
+    goto err;
+
+  log_info(LD_DIR, "Rebuilding %s cache in the background",
+           store->description);
+  pending_store_rebuild[store->type] = job;
+  tor_free(fname);
+  tor_free(fname_journal);
+  return 0;
+
+ err:
+  store_rebuild_job_free(job);
+  tor_free(fname);
+  tor_free(fname_journal);
+  return -1;
+}
 
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
  * routers currently in our routerlist, and clear the journal.  Unless
  * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
  * rebuilding the store.  Return 0 on success, -1 on failure.
+ *
+ * Unless RRS_FORCE is set, we write the new store on a worker thread if we
+ * can, and switch to it once it's written.
  */
-static int
+STATIC int
 router_rebuild_store(int flags, desc_store_t *store)
 {
   smartlist_t *chunk_list = NULL;
@@ -1059,6 +1377,14 @@ router_rebuild_store(int flags, desc_store_t *store)
     r = 0;
     goto done;
   }
+  if (pending_store_rebuild[store->type]) {
+    if (!force) {
+      r = 0;
+      goto done;
+    }
+    /* What the worker writes will be out of date. */
+    cancel_store_rebuild(store->type);
+  }
 
   if (store->type == EXTRAINFO_STORE)
     had_any = !eimap_isempty(routerlist->extra_info_map);
@@ -1070,6 +1396,14 @@ router_rebuild_store(int flags, desc_store_t *store)
   if (!(flags & RRS_DONT_REMOVE_OLD))
     routerlist_remove_old_routers();
 
+  signed_descriptors = desc_store_list_descriptors(store);
+
+  if (!force &&
+      router_rebuild_store_in_background(store, signed_descriptors) == 0) {
+    r = 0;
+    goto done;
+  }
+
   log_info(LD_DIR, "Rebuilding %s cache", store->description);
 
   fname = get_datadir_fname(store->fname_base);
@@ -1077,27 +1411,6 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   chunk_list = smartlist_new();
 
-  /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
-
-  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
-
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
       sized_chunk_t *c;
@@ -1199,6 +1512,7 @@ router_reload_router_list_impl(desc_store_t *store)
   struct stat st;
   int extrainfo = (store->type == EXTRAINFO_STORE);
   store->journal_len = store->store_len = 0;
+  cancel_store_rebuild(store->type);
 
   fname = get_datadir_fname(store->fname_base);
 
@@ -1791,6 +2105,26 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** Return true iff <b>node</b> is one that
+ * router_add_running_nodes_to_smartlist() would add, given the same
+ * arguments. */
+static int
+node_is_running_candidate(const node_t *node, int allow_invalid,
+                          int need_uptime, int need_capacity,
+                          int need_guard, int need_desc)
+{
+  if (!node->is_running ||
+      (!node->is_valid && !allow_invalid))
+    return 0;
+  if (need_desc && !(node->ri || (node->rs && node->md)))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  return 1;
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -1800,17 +2134,9 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running ||
-        (!node->is_valid && !allow_invalid))
-      continue;
-    if (need_desc && !(node->ri || (node->rs && node->md)))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
-
-    smartlist_add(sl, (void *)node);
+    if (node_is_running_candidate(node, allow_invalid, need_uptime,
+                                  need_capacity, need_guard, need_desc))
+      smartlist_add(sl, (void *)node);
   } SMARTLIST_FOREACH_END(node);
 }
 
@@ -2253,6 +2579,153 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** The flags to router_choose_random_node() that decide which nodes are
+ * candidates at all, as opposed to how we weight them. */
+#define CRN_CANDIDATE_FLAGS (CRN_NEED_UPTIME|CRN_NEED_CAPACITY|\
+                             CRN_NEED_GUARD|CRN_ALLOW_INVALID|CRN_NEED_DESC)
+
+/** How many times do we pick from a weighted_node_table_t and hit an
+ * excluded node before we fall back to building the list of candidates by
+ * hand? */
+#define MAX_WEIGHTED_NODE_TABLE_TRIES 16
+
+/** The running nodes that pass one set of router_choose_random_node()
+ * filters, with their weighted bandwidths. */
+typedef struct weighted_node_table_t {
+  /** The weighting rule we used for <b>weights</b>. */
+  bandwidth_weight_rule_t rule;
+  /** The CRN_CANDIDATE_FLAGS that we used to choose <b>nodes</b>. */
+  router_crn_flags_t flags;
+  /** The candidate nodes. */
+  smartlist_t *nodes;
+  /** The weighted bandwidth of each element of <b>nodes</b>, scaled as by
+   * scale_array_elements_to_u64(); or NULL if there were no candidates. */
+  u64_dbl_t *weights;
+  /** The sum of the scaled <b>weights</b>. */
+  uint64_t total_weight;
+} weighted_node_table_t;
+
+/** List of weighted_node_table_t that we've built since our directory
+ * information, the consensus, or its bandwidth weights last changed. */
+STATIC smartlist_t *weighted_node_tables = NULL;
+
+/** Release all storage held by <b>wnt</b>. */
+static void
+weighted_node_table_free(weighted_node_table_t *wnt)
+{
+  if (!wnt)
+    return;
+  smartlist_free(wnt->nodes);
+  tor_free(wnt->weights);
+  tor_free(wnt);
+}
+
+/** Forget every weighted_node_table_t we've built.  Called whenever our
+ * directory information changes, whenever we get a new consensus (which
+ * brings new bandwidth weights), and whenever a node is removed from the
+ * nodelist, since the tables hold pointers to nodes. */
+void
+router_weighted_node_tables_clear(void)
+{
+  if (!weighted_node_tables)
+    return;
+  SMARTLIST_FOREACH(weighted_node_tables, weighted_node_table_t *, wnt,
+                    weighted_node_table_free(wnt));
+  smartlist_free(weighted_node_tables);
+  weighted_node_tables = NULL;
+}
+
+/** Return the weighted_node_table_t for choosing with <b>rule</b> among
+ * the nodes that pass the CRN_CANDIDATE_FLAGS in <b>flags</b>, building
+ * it if we don't have one. */
+static weighted_node_table_t *
+weighted_node_table_get(bandwidth_weight_rule_t rule,
+                        router_crn_flags_t flags)
+{
+  weighted_node_table_t *wnt;
+  int i;
+
+  flags &= CRN_CANDIDATE_FLAGS;
+  if (!weighted_node_tables)
+    weighted_node_tables = smartlist_new();
+  SMARTLIST_FOREACH(weighted_node_tables, weighted_node_table_t *, w,
+                    if (w->rule == rule && w->flags == flags)
+                      return w);
+
+  wnt = tor_malloc_zero(sizeof(weighted_node_table_t));
+  wnt->rule = rule;
+  wnt->flags = flags;
+  wnt->nodes = smartlist_new();
+  router_add_running_nodes_to_smartlist(wnt->nodes,
+                                        (flags & CRN_ALLOW_INVALID) != 0,
+                                        (flags & CRN_NEED_UPTIME) != 0,
+                                        (flags & CRN_NEED_CAPACITY) != 0,
+                                        (flags & CRN_NEED_GUARD) != 0,
+                                        (flags & CRN_NEED_DESC) != 0);
+  if (smartlist_len(wnt->nodes) &&
+      compute_weighted_bandwidths(wnt->nodes, rule, &wnt->weights) == 0) {
+    scale_array_elements_to_u64(wnt->weights, smartlist_len(wnt->nodes),
+                                NULL);
+    for (i = 0; i < smartlist_len(wnt->nodes); ++i)
+      wnt->total_weight += wnt->weights[i].u64;
+  }
+  smartlist_add(weighted_node_tables, wnt);
+  return wnt;
+}
+
+/** Try to choose a node as router_choose_random_node() would, using a
+ * cached weighted_node_table_t.  Nodes in <b>excludednodes</b> or
+ * <b>excludedsmartlist</b>, or that match <b>excludedset</b>, are rejected
+ * and we choose again: this gives the same distribution as removing them
+ * first.  Return NULL if there are no candidates, if every candidate has
+ * zero weight, or if we keep hitting excluded nodes; the caller should then
+ * choose the slow way.
+ *
+ * Each choice still goes through choose_array_element_by_weight(), so it
+ * takes the same time whichever node we pick. */
+static const node_t *
+weighted_node_table_choose(bandwidth_weight_rule_t rule,
+                           router_crn_flags_t flags,
+                           const smartlist_t *excludednodes,
+                           const smartlist_t *excludedsmartlist,
+                           const routerset_t *excludedset)
+{
+  const int exclude_single_hop = get_options()->ExcludeSingleHopRelays;
+  weighted_node_table_t *wnt = weighted_node_table_get(rule, flags);
+  int i;
+
+  if (!wnt->weights || wnt->total_weight == 0)
+    return NULL;
+
+  for (i = 0; i < MAX_WEIGHTED_NODE_TABLE_TRIES; ++i) {
+    const int idx = choose_array_element_by_weight(wnt->weights,
+                                                   smartlist_len(wnt->nodes));
+    const node_t *node;
+    if (idx < 0)
+      return NULL;
+    node = smartlist_get(wnt->nodes, idx);
+    /* Not every change to a node's flags reaches
+     * router_dir_info_changed(), so check that this one still qualifies. */
+    if (!node_is_running_candidate(node,
+                                   (flags & CRN_ALLOW_INVALID) != 0,
+                                   (flags & CRN_NEED_UPTIME) != 0,
+                                   (flags & CRN_NEED_CAPACITY) != 0,
+                                   (flags & CRN_NEED_GUARD) != 0,
+                                   (flags & CRN_NEED_DESC) != 0))
+      continue;
+    if (exclude_single_hop && node_allows_single_hop_exits(node))
+      continue;
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedsmartlist && smartlist_contains(excludedsmartlist, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    return node;
+  }
+  return NULL;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -2293,6 +2766,19 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  if ((r = routerlist_find_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  /* Usually we can choose from a cached table without building the list of
+   * candidates at all. */
+  choice = weighted_node_table_choose(rule, flags, excludednodes,
+                                      excludedsmartlist, excludedset);
+  if (choice) {
+    smartlist_free(sl);
+    smartlist_free(excludednodes);
+    return choice;
+  }
+
   /* Exclude relays that allow single hop exit circuits, if the user
    * wants to (such relays might be risky) */
   if (get_options()->ExcludeSingleHopRelays) {
@@ -2302,9 +2788,6 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
       });
   }
 
-  if ((r = routerlist_find_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
   router_add_running_nodes_to_smartlist(sl, allow_invalid,
                                         need_uptime, need_capacity,
                                         need_guard, need_desc);
@@ -2669,6 +3152,7 @@ routerinfo_free(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  compiled_addr_policy_free(router->compiled_exit_policy);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -2732,6 +3216,9 @@ routerlist_free(routerlist_t *rl)
 {
   if (!rl)
     return;
+  /* Any store being written in the background is no use now. */
+  cancel_store_rebuild(ROUTER_STORE);
+  cancel_store_rebuild(EXTRAINFO_STORE);
   rimap_free(rl->identity_map, NULL);
   sdmap_free(rl->desc_digest_map, NULL);
   sdmap_free(rl->desc_by_eid_map, NULL);
@@ -2934,6 +3421,29 @@ extrainfo_insert,(routerlist_t *rl, extrainfo_t *ei, int warn_if_incompatible))
 #define should_cache_old_descriptors() \
   directory_caches_dir_info(get_options())
 
+/** If we're a directory cache and routerlist <b>rl</b> doesn't have a copy
+ * of the general-purpose router descriptor <b>sd</b> yet, add it to the list
+ * of old (not recommended but still served) descriptors. Else free it. */
+static void
+routerlist_insert_old_desc(routerlist_t *rl, signed_descriptor_t *sd)
+{
+  tor_assert(sd->routerlist_index == -1);
+
+  if (should_cache_old_descriptors() &&
+      !sdmap_get(rl->desc_digest_map, sd->signed_descriptor_digest)) {
+    sdmap_set(rl->desc_digest_map, sd->signed_descriptor_digest, sd);
+    smartlist_add(rl->old_routers, sd);
+    sd->routerlist_index = smartlist_len(rl->old_routers)-1;
+    if (!tor_digest_is_zero(sd->extra_info_digest))
+      sdmap_set(rl->desc_by_eid_map, sd->extra_info_digest, sd);
+  } else {
+    signed_descriptor_free(sd);
+  }
+#ifdef DEBUG_ROUTERLIST
+  routerlist_assert_ok(rl);
+#endif
+}
+
 /** If we're a directory cache and routerlist <b>rl</b> doesn't have
  * a copy of router <b>ri</b> yet, add it to the list of old (not
  * recommended but still served) descriptors. Else free it. */
@@ -2947,21 +3457,11 @@ routerlist_insert_old(routerlist_t *rl, routerinfo_t *ri)
   tor_assert(ri->cache_info.routerlist_index == -1);
 
   if (should_cache_old_descriptors() &&
-      ri->purpose == ROUTER_PURPOSE_GENERAL &&
-      !sdmap_get(rl->desc_digest_map,
-                 ri->cache_info.signed_descriptor_digest)) {
-    signed_descriptor_t *sd = signed_descriptor_from_routerinfo(ri);
-    sdmap_set(rl->desc_digest_map, sd->signed_descriptor_digest, sd);
-    smartlist_add(rl->old_routers, sd);
-    sd->routerlist_index = smartlist_len(rl->old_routers)-1;
-    if (!tor_digest_is_zero(sd->extra_info_digest))
-      sdmap_set(rl->desc_by_eid_map, sd->extra_info_digest, sd);
+      ri->purpose == ROUTER_PURPOSE_GENERAL) {
+    routerlist_insert_old_desc(rl, signed_descriptor_from_routerinfo(ri));
   } else {
     routerinfo_free(ri);
   }
-#ifdef DEBUG_ROUTERLIST
-  routerlist_assert_ok(rl);
-#endif
 }
 
 /** Remove an item <b>ri</b> from the routerlist <b>rl</b>, updating indices
@@ -3224,6 +3724,7 @@ routerlist_free_all(void)
   smartlist_free(trusted_dir_servers);
   smartlist_free(fallback_dir_servers);
   trusted_dir_servers = fallback_dir_servers = NULL;
+  router_weighted_node_tables_clear();
   if (trusted_dir_certs) {
     digestmap_free(trusted_dir_certs, cert_list_free_);
     trusted_dir_certs = NULL;
@@ -3792,6 +4293,15 @@ router_load_single_router(const char *s, uint8_t purpose, int cache,
   }
 }
 
+/** Return true iff the latest "ns" consensus lists the router descriptor
+ * whose digest is <b>digest</b>. */
+static int
+router_desc_is_in_ns_consensus(const char *digest)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus_by_flavor(FLAV_NS);
+  return router_get_consensus_status_by_descriptor_digest(ns, digest) != NULL;
+}
+
 /** Given a string <b>s</b> containing some routerdescs, parse it and put the
  * routers into our directory.  If saved_location is SAVED_NOWHERE, the routers
  * are in response to a query to the network: cache them by adding them to
@@ -3822,9 +4332,28 @@ router_load_routers_from_string(const char *s, const char *eos,
   int any_changed = 0;
   smartlist_t *invalid_digests = smartlist_new();
 
-  router_parse_list_from_string(&s, eos, routers, saved_location, 0,
-                                allow_annotations, prepend_annotations,
-                                invalid_digests);
+  if (from_cache && !prepend_annotations && !requested_fingerprints &&
+      networkstatus_get_latest_consensus_by_flavor(FLAV_NS) &&
+      !authdir_mode_handles_descs(get_options(), ROUTER_PURPOSE_GENERAL)) {
+    /* router_add_to_routerlist() would only keep the descriptors that the
+     * consensus doesn't list as old descriptors, if at all: don't parse
+     * them. */
+    smartlist_t *old_descs = smartlist_new();
+    router_parse_list_from_cache(&s, eos, routers, old_descs,
+                                 router_desc_is_in_ns_consensus,
+                                 saved_location, invalid_digests);
+    log_info(LD_DIR, "Loaded %d descriptors not listed in the consensus "
+             "without parsing them.", smartlist_len(old_descs));
+    if (!routerlist)
+      router_get_routerlist();
+    SMARTLIST_FOREACH(old_descs, signed_descriptor_t *, sd,
+                      routerlist_insert_old_desc(routerlist, sd));
+    smartlist_free(old_descs);
+  } else {
+    router_parse_list_from_string(&s, eos, routers, saved_location, 0,
+                                  allow_annotations, prepend_annotations,
+                                  invalid_digests);
+  }
 
   routers_update_status_from_consensus_networkstatus(routers, !from_cache);
 
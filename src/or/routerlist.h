@@ -74,6 +74,7 @@ double frac_nodes_with_descriptors(const smartlist_t *sl,
 const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
+void router_weighted_node_tables_clear(void);
 
 int router_is_named(const routerinfo_t *router);
 int router_digest_is_trusted_dir_type(const char *digest,
@@ -240,6 +241,18 @@ MOCK_DECL(STATIC void, initiate_descriptor_downloads,
           (const routerstatus_t *source, int purpose, smartlist_t *digests,
            int lo, int hi, int pds_flags));
 
+/** Flags for router_rebuild_store(): rebuild now, even if the journal is
+ * short, and don't hand the work to a worker thread. */
+#define RRS_FORCE 1
+/** Flag for router_rebuild_store(): don't remove expired routers first. */
+#define RRS_DONT_REMOVE_OLD 2
+
+STATIC int router_rebuild_store(int flags, desc_store_t *store);
+
+#ifdef TOR_UNIT_TESTS
+extern smartlist_t *weighted_node_tables;
+#endif
+
 #endif
 
 #endif
@@ -588,13 +588,16 @@ static time_t last_desc_dumped = 0;
 /** For debugging purposes, dump unparseable descriptor *<b>desc</b> of
  * type *<b>type</b> to file $DATADIR/unparseable-desc. Do not write more
  * than one descriptor to disk per minute. If there is already such a
- * file in the data directory, overwrite it. */
+ * file in the data directory, overwrite it.  Outside the main thread, where
+ * we can't look up the data directory, do nothing. */
 static void
 dump_desc(const char *desc, const char *type)
 {
   time_t now = time(NULL);
   tor_assert(desc);
   tor_assert(type);
+  if (!in_main_thread())
+    return;
   if (!last_desc_dumped || last_desc_dumped + 60 < now) {
     char *debugfile = get_datadir_fname("unparseable-desc");
     size_t filelen = 50 + strlen(type) + strlen(desc);
@@ -931,28 +934,185 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
-/** Given a string *<b>s</b> containing a concatenated sequence of router
- * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
- * them and stores the result in <b>dest</b>.  All routers are marked running
- * and valid.  Advances *s to a point immediately following the last router
- * entry.  Ignore any trailing router entries that are not complete.
- *
- * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
- * isn't SAVED_NOWHERE, remember the offset of each descriptor.
+/** Helper: return a pointer to the first line between <b>s</b> and
+ * <b>eos</b> (which must be at the start of a line) that holds the item
+ * <b>keyword</b>, just past the keyword and the space after it, if any.  Set
+ * *<b>eol_out</b> to the end of that line.  Return NULL if there is no such
+ * line. */
+static const char *
+find_item_by_keyword(const char *s, const char *eos, const char *keyword,
+                     const char **eol_out)
+{
+  const size_t kwlen = strlen(keyword);
+  while (s < eos) {
+    const char *eol = memchr(s, '\n', eos-s);
+    if (!eol)
+      eol = eos;
+    if (eol-s > 4 && fast_memeq(s, "opt ", 4))
+      s += 4;
+    if ((size_t)(eol-s) == kwlen && fast_memeq(s, keyword, kwlen)) {
+      *eol_out = eol;
+      return eol;
+    }
+    if ((size_t)(eol-s) > kwlen && fast_memeq(s, keyword, kwlen) &&
+        s[kwlen] == ' ') {
+      *eol_out = eol;
+      return s + kwlen + 1;
+    }
+    s = eol + 1;
+  }
+  return NULL;
+}
+
+#define ED25519_CERT_BEGIN "-----BEGIN ED25519 CERT-----\n"
+#define ED25519_CERT_END "-----END ED25519 CERT-----"
+
+/** Helper: find the first item <b>keyword</b> between <b>s</b> and
+ * <b>eos</b>, and set *<b>valid_until_out</b> to the expiration time of the
+ * ed25519 certificate that follows it.  Don't check the certificate's
+ * signature.  Return 1 on success, 0 if there is no such item, and -1 if
+ * the certificate is missing or malformed. */
+static int
+find_ed25519_cert_expiration(const char *s, const char *eos,
+                             const char *keyword, time_t *valid_until_out)
+{
+  const char *cp, *eol, *obj_end;
+  char buf[256];
+  int n;
+  tor_cert_t *cert;
+
+  if (!find_item_by_keyword(s, eos, keyword, &eol))
+    return 0;
+  cp = eol + 1;
+  if (cp >= eos || (size_t)(eos-cp) < strlen(ED25519_CERT_BEGIN) ||
+      fast_memneq(cp, ED25519_CERT_BEGIN, strlen(ED25519_CERT_BEGIN)))
+    return -1;
+  cp += strlen(ED25519_CERT_BEGIN);
+  obj_end = tor_memstr(cp, eos-cp, ED25519_CERT_END);
+  if (!obj_end)
+    return -1;
+  n = base64_decode(buf, sizeof(buf), cp, obj_end-cp);
+  if (n <= 0)
+    return -1;
+  cert = tor_cert_parse((const uint8_t*)buf, n);
+  if (!cert)
+    return -1;
+  *valid_until_out = cert->valid_until;
+  tor_cert_free(cert);
+  return 1;
+}
+
+/** Read the cache information for the router descriptor, with annotations,
+ * between <b>s</b> and <b>end</b>, without parsing the rest of it or
+ * checking its signature.  We only do this for descriptors that we parsed
+ * and checked once already, before we saved them.  If <b>cache_copy</b> is
+ * true, keep a copy of the descriptor in signed_descriptor_body.
  *
- * Returns 0 on success and -1 on failure.  Adds a digest to
- * <b>invalid_digests_out</b> for every entry that was unparseable or
- * invalid. (This may cause duplicate entries.)
- */
-int
-router_parse_list_from_string(const char **s, const char *eos,
-                              smartlist_t *dest,
-                              saved_location_t saved_location,
-                              int want_extrainfo,
-                              int allow_annotations,
-                              const char *prepend_annotations,
-                              smartlist_t *invalid_digests_out)
+ * Return a new signed_descriptor_t on success.  Return NULL if the
+ * descriptor isn't for a general-purpose router, if its ed25519
+ * certificates have expired, or if we can't find the fields we need: the
+ * caller should parse it in full instead. */
+STATIC signed_descriptor_t *
+router_parse_cache_info_from_string(const char *s, const char *end,
+                                    int cache_copy)
+{
+  const char *start_of_annotations = s, *cp, *eol;
+  char digest[DIGEST_LEN], identity[DIGEST_LEN], ei_digest[DIGEST_LEN];
+  char buf[HEX_DIGEST_LEN+1];
+  time_t published_on, id_cert_expires, cc_cert_expires;
+  signed_descriptor_t *sd;
+  size_t n;
+  int r;
+
+  cp = tor_memstr(s, end-s, "\nrouter ");
+  if (!cp) {
+    if (end-s < 7 || strcmpstart(s, "router "))
+      return NULL;
+  } else {
+    s = cp+1;
+  }
+  /* Only general-purpose routers get here without a full parse. */
+  if (s != start_of_annotations &&
+      find_item_by_keyword(start_of_annotations, s, "@purpose", &eol))
+    return NULL;
+
+  if (router_get_router_hash(s, end - s, digest) < 0)
+    return NULL;
+
+  cp = find_item_by_keyword(s, end, "published", &eol);
+  if (!cp || eol-cp != ISO_TIME_LEN)
+    return NULL;
+  memcpy(buf, cp, ISO_TIME_LEN);
+  buf[ISO_TIME_LEN] = '\0';
+  if (parse_iso_time(buf, &published_on) < 0)
+    return NULL;
+
+  /* The fingerprint line is optional, but every Tor has sent it for years;
+   * we check that it matches the identity key when we first parse it. */
+  cp = find_item_by_keyword(s, end, "fingerprint", &eol);
+  if (!cp)
+    return NULL;
+  for (n = 0; cp < eol; ++cp) {
+    if (*cp == ' ')
+      continue;
+    if (n == HEX_DIGEST_LEN)
+      return NULL;
+    buf[n++] = *cp;
+  }
+  if (n != HEX_DIGEST_LEN ||
+      base16_decode(identity, DIGEST_LEN, buf, HEX_DIGEST_LEN) < 0)
+    return NULL;
+
+  /* router_add_to_routerlist() rejects descriptors whose ed25519
+   * certificates have expired; leave those to the full parse so that it
+   * still can. */
+  r = find_ed25519_cert_expiration(s, end, "identity-ed25519",
+                                   &id_cert_expires);
+  if (r < 0)
+    return NULL;
+  if (r > 0) {
+    if (find_ed25519_cert_expiration(s, end, "ntor-onion-key-crosscert",
+                                     &cc_cert_expires) <= 0)
+      return NULL;
+    if (MIN(id_cert_expires, cc_cert_expires) < approx_time())
+      return NULL;
+  }
+
+  memset(ei_digest, 0, sizeof(ei_digest));
+  cp = find_item_by_keyword(s, end, "extra-info-digest", &eol);
+  if (cp && eol-cp >= HEX_DIGEST_LEN &&
+      (eol-cp == HEX_DIGEST_LEN || cp[HEX_DIGEST_LEN] == ' '))
+    base16_decode(ei_digest, DIGEST_LEN, cp, HEX_DIGEST_LEN);
+
+  sd = tor_malloc_zero(sizeof(signed_descriptor_t));
+  sd->routerlist_index = -1;
+  sd->annotations_len = s - start_of_annotations;
+  sd->signed_descriptor_len = end - s;
+  if (cache_copy)
+    sd->signed_descriptor_body =
+      tor_memdup_nulterm(start_of_annotations, end - start_of_annotations);
+  memcpy(sd->signed_descriptor_digest, digest, DIGEST_LEN);
+  memcpy(sd->identity_digest, identity, DIGEST_LEN);
+  memcpy(sd->extra_info_digest, ei_digest, DIGEST_LEN);
+  sd->published_on = published_on;
+  sd->send_unencrypted = 1;
+  return sd;
+}
+
+/** As router_parse_list_from_string(), but if <b>cache_info_dest</b> is
+ * set, don't parse router descriptors for which <b>want_parsed</b> returns
+ * false given their digest: add their cache information to
+ * <b>cache_info_dest</b> instead, as signed_descriptor_t objects. */
+static int
+router_parse_list_from_string_impl(const char **s, const char *eos,
+                                   smartlist_t *dest,
+                                   smartlist_t *cache_info_dest,
+                                   int (*want_parsed)(const char *digest),
+                                   saved_location_t saved_location,
+                                   int want_extrainfo,
+                                   int allow_annotations,
+                                   const char *prepend_annotations,
+                                   smartlist_t *invalid_digests_out)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
@@ -1001,6 +1161,16 @@ router_parse_list_from_string(const char **s, const char *eos,
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
+      if (cache_info_dest && have_raw_digest && !want_parsed(raw_digest) &&
+          (signed_desc = router_parse_cache_info_from_string(*s, end,
+                                     saved_location != SAVED_IN_CACHE))) {
+        tor_assert(saved_location != SAVED_NOWHERE);
+        signed_desc->saved_location = saved_location;
+        signed_desc->saved_offset = *s - start;
+        smartlist_add(cache_info_dest, signed_desc);
+        *s = end;
+        continue;
+      }
       router = router_parse_entry_from_string(*s, end,
                                               saved_location != SAVED_IN_CACHE,
                                               allow_annotations,
@@ -1032,6 +1202,55 @@ router_parse_list_from_string(const char **s, const char *eos,
   return 0;
 }
 
+/** Given a string *<b>s</b> containing a concatenated sequence of router
+ * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
+ * them and stores the result in <b>dest</b>.  All routers are marked running
+ * and valid.  Advances *s to a point immediately following the last router
+ * entry.  Ignore any trailing router entries that are not complete.
+ *
+ * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
+ * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
+ * isn't SAVED_NOWHERE, remember the offset of each descriptor.
+ *
+ * Returns 0 on success and -1 on failure.  Adds a digest to
+ * <b>invalid_digests_out</b> for every entry that was unparseable or
+ * invalid. (This may cause duplicate entries.)
+ */
+int
+router_parse_list_from_string(const char **s, const char *eos,
+                              smartlist_t *dest,
+                              saved_location_t saved_location,
+                              int want_extrainfo,
+                              int allow_annotations,
+                              const char *prepend_annotations,
+                              smartlist_t *invalid_digests_out)
+{
+  return router_parse_list_from_string_impl(s, eos, dest, NULL, NULL,
+                                            saved_location, want_extrainfo,
+                                            allow_annotations,
+                                            prepend_annotations,
+                                            invalid_digests_out);
+}
+
+/** Parse the router descriptors that we saved in one of our own cache files,
+ * from *<b>s</b> to <b>eos</b>, as router_parse_list_from_string() does.
+ * Parse only those for which <b>want_parsed</b> returns true given their
+ * digest; for the rest, add only their cache information to
+ * <b>cache_info_dest</b>. */
+int
+router_parse_list_from_cache(const char **s, const char *eos,
+                             smartlist_t *dest,
+                             smartlist_t *cache_info_dest,
+                             int (*want_parsed)(const char *digest),
+                             saved_location_t saved_location,
+                             smartlist_t *invalid_digests_out)
+{
+  tor_assert(saved_location != SAVED_NOWHERE);
+  return router_parse_list_from_string_impl(s, eos, dest, cache_info_dest,
+                                            want_parsed, saved_location, 0,
+                                            1, NULL, invalid_digests_out);
+}
+
 /* For debugging: define to count every descriptor digest we've seen so we
  * know if we need to try harder to avoid duplicate verifies. */
 #undef COUNT_DISTINCT_DIGESTS
@@ -1949,8 +2168,9 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
   tor_assert(tok->n_args);
   if (base16_decode(fp_declared, DIGEST_LEN, tok->args[0],
                     strlen(tok->args[0]))) {
-    log_warn(LD_DIR, "Couldn't decode key certificate fingerprint %s",
-             escaped(tok->args[0]));
+    char *esc = esc_for_log(tok->args[0]);
+    log_warn(LD_DIR, "Couldn't decode key certificate fingerprint %s", esc);
+    tor_free(esc);
     goto err;
   }
 
@@ -1996,8 +2216,12 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
     goto err;
   }
 
-  /* If we already have this cert, don't bother checking the signature. */
-  old_cert = authority_cert_get_by_digests(
+  /* If we already have this cert, don't bother checking the signature.
+   * (Outside the main thread, we can't look at the certificates we have, so
+   * we always check it.) */
+  old_cert = NULL;
+  if (in_main_thread())
+    old_cert = authority_cert_get_by_digests(
                                      cert->cache_info.identity_digest,
                                      cert->signing_key_digest);
   found = 0;
@@ -2115,7 +2339,9 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   guardfraction = (uint32_t)tor_parse_ulong(end_of_header+1,
                                             10, 0, 100, &ok, NULL);
   if (!ok) {
-    log_warn(LD_DIR, "Invalid GuardFraction %s", escaped(guardfraction_str));
+    char *esc = esc_for_log(guardfraction_str);
+    log_warn(LD_DIR, "Invalid GuardFraction %s", esc);
+    tor_free(esc);
     return -1;
   }
 
@@ -2203,23 +2429,26 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
 
   if (!is_legal_nickname(tok->args[0])) {
+    char *esc = esc_for_log(tok->args[0]);
     log_warn(LD_DIR,
-             "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             "Invalid nickname %s in router status; skipping.", esc);
+    tor_free(esc);
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
-    log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+    char *esc = esc_for_log(tok->args[1]);
+    log_warn(LD_DIR, "Error decoding identity digest %s", esc);
+    tor_free(esc);
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
-      log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+      char *esc = esc_for_log(tok->args[2]);
+      log_warn(LD_DIR, "Error decoding descriptor digest %s", esc);
+      tor_free(esc);
       goto err;
     }
   }
@@ -2234,8 +2463,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
-    log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+    char *esc = esc_for_log(tok->args[5+offset]);
+    log_warn(LD_DIR, "Error parsing router address in network-status %s", esc);
+    tor_free(esc);
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -2262,8 +2492,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       if (p >= 0) {
         vote_rs->flags |= (U64_LITERAL(1)<<p);
       } else {
+        char *esc = esc_for_log(tok->args[i]);
         log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+                 esc);
+        tor_free(esc);
         goto err;
       }
     }
@@ -2321,7 +2553,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                     10, 0, UINT32_MAX,
                                     &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          char *esc = esc_for_log(tok->args[i]);
+          log_warn(LD_DIR, "Invalid Bandwidth %s", esc);
+          tor_free(esc);
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -2331,8 +2565,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
             (uint32_t)tor_parse_ulong(strchr(tok->args[i], '=')+1,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+          char *esc = esc_for_log(tok->args[i]);
+          log_warn(LD_DIR, "Invalid Measured Bandwidth %s", esc);
+          tor_free(esc);
           goto err;
         }
         vote_rs->has_measured_bw = 1;
@@ -2353,8 +2588,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     tor_assert(tok->n_args == 1);
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
-      log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+      char *esc = esc_for_log(tok->args[0]);
+      log_warn(LD_DIR, "Unknown exit policy summary type %s.", esc);
+      tor_free(esc);
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -2392,8 +2628,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (tok) {
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
-        log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+        char *esc = esc_for_log(tok->args[0]);
+        log_warn(LD_DIR, "Error decoding microdescriptor digest %s", esc);
+        tor_free(esc);
         goto err;
       }
     } else {
@@ -2831,6 +3068,21 @@ networkstatus_verify_bw_weights(networkstatus_t *ns, int consensus_method)
 networkstatus_t *
 networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
                                      networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_from_string_ext(s, eos_out, ns_type,
+                                       LOG_PROTOCOL_WARN,
+                                       get_options()->TestingTorNetwork);
+}
+
+/** As networkstatus_parse_vote_from_string(), but log protocol warnings at
+ * <b>protocol_warn_severity</b>, and allow the short voting intervals of a
+ * testing network iff <b>testing_tor_network</b> is set.  Doesn't look at
+ * our options, so we can call it from a worker thread. */
+networkstatus_t *
+networkstatus_parse_vote_from_string_ext(const char *s, const char **eos_out,
+                                         networkstatus_type_t ns_type,
+                                         int protocol_warn_severity,
+                                         int testing_tor_network)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -2874,8 +3126,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   if (tok->n_args > 1) {
     int flavor = networkstatus_parse_flavor_name(tok->args[1]);
     if (flavor < 0) {
-      log_warn(LD_DIR, "Can't parse document with unknown flavor %s",
-               escaped(tok->args[1]));
+      char *esc = esc_for_log(tok->args[1]);
+      log_warn(LD_DIR, "Can't parse document with unknown flavor %s", esc);
+      tor_free(esc);
       goto err;
     }
     ns->flavor = flav = flavor;
@@ -2904,8 +3157,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   } else if (!strcmp(tok->args[0], "opinion")) {
     ns->type = NS_TYPE_OPINION;
   } else {
-    log_warn(LD_DIR, "Unrecognized vote status %s in network-status",
-             escaped(tok->args[0]));
+    char *esc = esc_for_log(tok->args[0]);
+    log_warn(LD_DIR, "Unrecognized vote status %s in network-status", esc);
+    tor_free(esc);
     goto err;
   }
   if (ns_type != ns->type) {
@@ -2961,13 +3215,13 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   if (!ok)
     goto err;
   if (ns->valid_after +
-      (get_options()->TestingTorNetwork ?
+      (testing_tor_network ?
        MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL) > ns->fresh_until) {
     log_warn(LD_DIR, "Vote/consensus freshness interval is too short");
     goto err;
   }
   if (ns->valid_after +
-      (get_options()->TestingTorNetwork ?
+      (testing_tor_network ?
        MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL)*2 > ns->valid_until) {
     log_warn(LD_DIR, "Vote/consensus liveness interval is too short");
     goto err;
@@ -3033,13 +3287,17 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       char *eq = strchr(tok->args[i], '=');
       size_t eq_pos;
       if (!eq) {
-        log_warn(LD_DIR, "Bad element '%s' in params", escaped(tok->args[i]));
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Bad element '%s' in params", esc);
+        tor_free(esc);
         goto err;
       }
       eq_pos = eq-tok->args[i];
       tor_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
       if (!ok) {
-        log_warn(LD_DIR, "Bad element '%s' in params", escaped(tok->args[i]));
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Bad element '%s' in params", esc);
+        tor_free(esc);
         goto err;
       }
       if (i > 0 && strcmp(tok->args[i-1], tok->args[i]) >= 0) {
@@ -3048,8 +3306,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       }
       if (last_kwd && eq_pos == strlen(last_kwd) &&
           fast_memeq(last_kwd, tok->args[i], eq_pos)) {
-        log_warn(LD_DIR, "Duplicate value for %s parameter",
-                 escaped(tok->args[i]));
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Duplicate value for %s parameter", esc);
+        tor_free(esc);
         any_dups = 1;
       }
       tor_free(last_kwd);
@@ -3084,8 +3343,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       if (strlen(tok->args[1]) != HEX_DIGEST_LEN ||
           base16_decode(voter->identity_digest, sizeof(voter->identity_digest),
                         tok->args[1], HEX_DIGEST_LEN) < 0) {
+        char *esc = esc_for_log(tok->args[1]);
         log_warn(LD_DIR, "Error decoding identity digest %s in "
-                 "network-status vote.", escaped(tok->args[1]));
+                 "network-status vote.", esc);
+        tor_free(esc);
         goto err;
       }
       if (ns->type != NS_TYPE_CONSENSUS &&
@@ -3096,16 +3357,20 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       }
       if (ns->type != NS_TYPE_CONSENSUS) {
         if (authority_cert_is_blacklisted(ns->cert)) {
+          char sk_hex[HEX_DIGEST_LEN+1];
+          base16_encode(sk_hex, sizeof(sk_hex),
+                        ns->cert->signing_key_digest, DIGEST_LEN);
           log_warn(LD_DIR, "Rejecting vote signature made with blacklisted "
-                   "signing key %s",
-                   hex_str(ns->cert->signing_key_digest, DIGEST_LEN));
+                   "signing key %s", sk_hex);
           goto err;
         }
       }
       voter->address = tor_strdup(tok->args[2]);
       if (!tor_inet_aton(tok->args[3], &in)) {
+        char *esc = esc_for_log(tok->args[3]);
         log_warn(LD_DIR, "Error decoding IP address %s in network-status.",
-                 escaped(tok->args[3]));
+                 esc);
+        tor_free(esc);
         goto err;
       }
       voter->addr = ntohl(in.s_addr);
@@ -3133,8 +3398,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       if (strlen(tok->args[0]) != HEX_DIGEST_LEN ||
         base16_decode(voter->vote_digest, sizeof(voter->vote_digest),
                       tok->args[0], HEX_DIGEST_LEN) < 0) {
+        char *esc = esc_for_log(tok->args[0]);
         log_warn(LD_DIR, "Error decoding vote digest %s in "
-                 "network-status consensus.", escaped(tok->args[0]));
+                 "network-status consensus.", esc);
+        tor_free(esc);
         goto err;
       }
     }
@@ -3163,8 +3430,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
         bad = 0;
     }
     if (bad) {
-      log_warn(LD_DIR, "Invalid legacy key digest %s on vote.",
-               escaped(tok->args[0]));
+      char *esc = esc_for_log(tok->args[0]);
+      log_warn(LD_DIR, "Invalid legacy key digest %s on vote.", esc);
+      tor_free(esc);
     }
   }
 
@@ -3267,13 +3535,16 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       int ok=0;
       char *eq = strchr(tok->args[i], '=');
       if (!eq) {
-        log_warn(LD_DIR, "Bad element '%s' in weight params",
-                 escaped(tok->args[i]));
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Bad element '%s' in weight params", esc);
+        tor_free(esc);
         goto err;
       }
       tor_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
       if (!ok) {
-        log_warn(LD_DIR, "Bad element '%s' in params", escaped(tok->args[i]));
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Bad element '%s' in params", esc);
+        tor_free(esc);
         goto err;
       }
       smartlist_add(ns->weight_params, tor_strdup(tok->args[i]));
@@ -3301,8 +3572,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       sk_hexdigest = tok->args[2];
       a = crypto_digest_algorithm_parse_name(algname);
       if (a<0) {
-        log_warn(LD_DIR, "Unknown digest algorithm %s; skipping",
-                 escaped(algname));
+        char *esc = esc_for_log(algname);
+        log_warn(LD_DIR, "Unknown digest algorithm %s; skipping", esc);
+        tor_free(esc);
         continue;
       }
       alg = a;
@@ -3318,8 +3590,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     if (strlen(id_hexdigest) != HEX_DIGEST_LEN ||
         base16_decode(declared_identity, sizeof(declared_identity),
                       id_hexdigest, HEX_DIGEST_LEN) < 0) {
+      char *esc = esc_for_log(id_hexdigest);
       log_warn(LD_DIR, "Error decoding declared identity %s in "
-               "network-status vote.", escaped(id_hexdigest));
+               "network-status vote.", esc);
+      tor_free(esc);
       goto err;
     }
     if (!(v = networkstatus_get_voter_by_id(ns, declared_identity))) {
@@ -3333,8 +3607,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     if (strlen(sk_hexdigest) != HEX_DIGEST_LEN ||
         base16_decode(sig->signing_key_digest, sizeof(sig->signing_key_digest),
                       sk_hexdigest, HEX_DIGEST_LEN) < 0) {
+      char *esc = esc_for_log(sk_hexdigest);
       log_warn(LD_DIR, "Error decoding declared signing key digest %s in "
-               "network-status vote.", escaped(sk_hexdigest));
+               "network-status vote.", esc);
+      tor_free(esc);
       tor_free(sig);
       goto err;
     }
@@ -3352,7 +3628,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     if (voter_get_sig_by_algorithm(v, sig->alg)) {
       /* We already parsed a vote with this algorithm from this voter. Use the
          first one. */
-      log_fn(LOG_PROTOCOL_WARN, LD_DIR, "We received a networkstatus "
+      log_fn(protocol_warn_severity, LD_DIR, "We received a networkstatus "
              "that contains two votes from the same voter with the same "
              "algorithm. Ignoring the second vote.");
       tor_free(sig);
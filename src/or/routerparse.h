@@ -31,6 +31,12 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   int allow_annotations,
                                   const char *prepend_annotations,
                                   smartlist_t *invalid_digests_out);
+int router_parse_list_from_cache(const char **s, const char *eos,
+                                 smartlist_t *dest,
+                                 smartlist_t *cache_info_dest,
+                                 int (*want_parsed)(const char *digest),
+                                 saved_location_t saved_location,
+                                 smartlist_t *invalid_digests_out);
 
 routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,
                                              int cache_copy,
@@ -57,6 +63,11 @@ int networkstatus_verify_bw_weights(networkstatus_t *ns, int);
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                                  const char **eos_out,
                                                  networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_vote_from_string_ext(const char *s,
+                                                 const char **eos_out,
+                                                 networkstatus_type_t ns_type,
+                                                 int protocol_warn_severity,
+                                                 int testing_tor_network);
 ns_detached_signatures_t *networkstatus_parse_detached_signatures(
                                           const char *s, const char *eos);
 
@@ -89,6 +100,9 @@ STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
                                             networkstatus_t *vote,
                                             vote_routerstatus_t *vote_rs,
                                             routerstatus_t *rs);
+STATIC signed_descriptor_t *router_parse_cache_info_from_string(
+                                     const char *s, const char *end,
+                                     int cache_copy);
 #endif
 
 #define ED_DESC_SIGNATURE_PREFIX "Tor router descriptor signature v1"
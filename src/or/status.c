@@ -9,8 +9,10 @@
 #define STATUS_PRIVATE
 
 #include "or.h"
+#include "buffers.h"
 #include "circuituse.h"
 #include "config.h"
+#include "dns.h"
 #include "status.h"
 #include "nodelist.h"
 #include "relay.h"
@@ -23,6 +25,10 @@
 #include "statefile.h"
 
 static void log_accounting(const time_t now, const or_options_t *options);
+static void log_main_thread_cpu_usage(const time_t now);
+static void log_tls_flush_stats(void);
+static void log_tls_session_stats(void);
+static void log_dns_cache_stats(void);
 #include "geoip.h"
 
 /** Return the total number of circuits. */
@@ -139,6 +145,10 @@ log_heartbeat(time_t now)
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
+    log_main_thread_cpu_usage(now);
+    log_tls_flush_stats();
+    log_tls_session_stats();
+    log_dns_cache_stats();
   }
 
   circuit_log_ancient_one_hop_circuits(1800);
@@ -158,6 +168,105 @@ log_heartbeat(time_t now)
   return 0;
 }
 
+/** CPU time, in microseconds, that the main thread had used as of the last
+ * call to log_main_thread_cpu_usage(). */
+static uint64_t heartbeat_last_cpu_usec = 0;
+/** When did we last set heartbeat_last_cpu_usec?  0 if we never did. */
+static time_t heartbeat_last_cpu_sample = 0;
+
+/** If the main thread was on the CPU at least this much of the time between
+ * two heartbeats, tell the operator. */
+#define MAIN_THREAD_BUSY_PCT_THRESHOLD 90
+
+/** Log what fraction of the time since the last heartbeat the main thread
+ * spent running.  All TLS, cell crypto and circuit handling happens on that
+ * one thread, so a relay whose main thread is always busy can't go any
+ * faster no matter how many cores it has. */
+static void
+log_main_thread_cpu_usage(const time_t now)
+{
+  uint64_t cpu_usec;
+
+  if (tor_get_thread_cpu_usec(&cpu_usec) < 0)
+    return;
+
+  if (heartbeat_last_cpu_sample && now > heartbeat_last_cpu_sample &&
+      cpu_usec >= heartbeat_last_cpu_usec) {
+    const double busy_pct =
+      100.0 * U64_TO_DBL(cpu_usec - heartbeat_last_cpu_usec) /
+      (1e6 * (double)(now - heartbeat_last_cpu_sample));
+    const int severity = busy_pct >= MAIN_THREAD_BUSY_PCT_THRESHOLD ?
+      LOG_NOTICE : LOG_INFO;
+
+    log_fn(severity, LD_HEARTBEAT,
+           "Heartbeat: Tor's main thread was busy %.f%% of the time since "
+           "the last heartbeat.%s", busy_pct,
+           severity == LOG_NOTICE ?
+           " This relay is probably limited by the speed of one CPU core; "
+           "see doc/TUNING for how to use more of them." : "");
+  }
+
+  heartbeat_last_cpu_usec = cpu_usec;
+  heartbeat_last_cpu_sample = now;
+}
+
+/** Log how many TLS writes we've made from our connection buffers, and how
+ * many bytes each one carried on average.  Small writes mean we're paying
+ * for more TLS record headers and MACs than we need to. */
+static void
+log_tls_flush_stats(void)
+{
+  uint64_t n_writes, n_bytes, n_coalesced;
+
+  buf_get_tls_flush_stats(&n_writes, &n_bytes, &n_coalesced);
+  if (!n_writes)
+    return;
+
+  log_info(LD_HEARTBEAT, "Heartbeat: Since startup, we have made "
+           U64_FORMAT" TLS writes averaging %.f bytes each; "U64_FORMAT
+           " of them combined more than one buffer chunk.",
+           U64_PRINTF_ARG(n_writes),
+           U64_TO_DBL(n_bytes) / U64_TO_DBL(n_writes),
+           U64_PRINTF_ARG(n_coalesced));
+}
+
+/** If we have tried to resume any TLS sessions, log how often we had one to
+ * offer, and how often the other side accepted it. */
+static void
+log_tls_session_stats(void)
+{
+  uint64_t n_lookups, n_offered, n_resumed;
+
+  tor_tls_get_session_cache_stats(&n_lookups, &n_offered, &n_resumed);
+  if (!n_lookups)
+    return;
+
+  log_info(LD_HEARTBEAT, "Heartbeat: Since startup, we had a cached TLS "
+           "session for "U64_FORMAT" of our "U64_FORMAT" outgoing TLS "
+           "handshakes, and resumed "U64_FORMAT" of them.",
+           U64_PRINTF_ARG(n_offered), U64_PRINTF_ARG(n_lookups),
+           U64_PRINTF_ARG(n_resumed));
+}
+
+/** If we have answered any exit streams from the DNS cache or by launching
+ * resolves, log how often the cache had the answer. */
+static void
+log_dns_cache_stats(void)
+{
+  uint64_t n_hits, n_negative_hits, n_misses, n_evictions;
+
+  dns_cache_get_stats(&n_hits, &n_negative_hits, &n_misses, &n_evictions);
+  if (!n_hits && !n_misses)
+    return;
+
+  log_info(LD_HEARTBEAT, "Heartbeat: Since startup, our DNS cache answered "
+           U64_FORMAT" of "U64_FORMAT" exit lookups ("U64_FORMAT" of them "
+           "with a failure), and we evicted "U64_FORMAT" answers early to "
+           "stay within its size limits.",
+           U64_PRINTF_ARG(n_hits), U64_PRINTF_ARG(n_hits + n_misses),
+           U64_PRINTF_ARG(n_negative_hits), U64_PRINTF_ARG(n_evictions));
+}
+
 static void
 log_accounting(const time_t now, const or_options_t *options)
 {
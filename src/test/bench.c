@@ -14,16 +14,36 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define TOR_CHANNEL_INTERNAL_
 #include "or.h"
 #include "onion_tap.h"
 #include "relay.h"
+#include "channel.h"
+#include "circuitmux.h"
+#include "circuitmux_drr.h"
+#include "circuitmux_ewma.h"
+#include "circuitlist.h"
+#include "connection.h"
+#include "consdiff.h"
+#include "dircollate.h"
+#include "dirvote.h"
+#include "networkstatus.h"
+#include "scheduler.h"
+#include "policies.h"
+#include "routerparse.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/ec.h>
 #include <openssl/ecdh.h>
 #include <openssl/obj_mac.h>
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #include "config.h"
+#include "confparse.h"
 #include "crypto_curve25519.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
@@ -576,6 +596,970 @@ bench_ecdh_p224(void)
   bench_ecdh_impl(NID_secp224r1, "P-224");
 }
 
+/* ==== circuitmux policy simulation ==== */
+
+/** Number of always-backlogged circuits in the cmux simulation. */
+#define CMUX_N_BULK 16
+/** Number of circuits in the cmux simulation that send short bursts. */
+#define CMUX_N_INTERACTIVE 16
+/** How many cells do we let the channel flush each round? */
+#define CMUX_FLUSH_PER_ROUND 32
+/** How many rounds do we simulate for each policy? */
+#define CMUX_N_ROUNDS 20000
+
+/** Simulated clock for the cmux benchmark, counted in cells sent. */
+static uint32_t cmux_bench_clock = 0;
+/** Cells sent so far on each circuit, indexed by circuit ID minus one. */
+static uint64_t cmux_bench_sent[CMUX_N_BULK + CMUX_N_INTERACTIVE];
+/** Queueing latencies (in cells) of bulk and interactive cells. */
+static uint32_t *cmux_bench_lat[2];
+/** Number of entries used in each of cmux_bench_lat. */
+static int cmux_bench_n_lat[2];
+
+/** write_packed_cell method for the cmux benchmark's fake channel: note
+ * which circuit the cell came from and how long it waited. */
+static int
+cmux_bench_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  circid_t circ_id = packed_cell_get_circid(cell, chan->wide_circ_ids);
+  int idx = (int)circ_id - 1;
+  int interactive = idx >= CMUX_N_BULK;
+  /* Each cell carries its enqueue time at the start of its payload. */
+  uint32_t queued_at = get_uint32(cell->body + 5);
+
+  tor_assert(idx >= 0 && idx < CMUX_N_BULK + CMUX_N_INTERACTIVE);
+  ++cmux_bench_sent[idx];
+  cmux_bench_lat[interactive][cmux_bench_n_lat[interactive]++] =
+    cmux_bench_clock - queued_at;
+  ++cmux_bench_clock;
+
+  packed_cell_free(cell);
+  return 1;
+}
+
+/** num_bytes_queued method for the cmux benchmark's fake channel: cells
+ * are "sent" as soon as they're written, so nothing is ever queued. */
+static size_t
+cmux_bench_num_bytes_queued(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+/** Helper: queue <b>n</b> cells on <b>circ</b>, which uses <b>chan</b> in
+ * <b>direction</b>, stamped with the current simulated time. */
+static void
+cmux_bench_queue_cells(circuit_t *circ, channel_t *chan,
+                       cell_direction_t direction, int n)
+{
+  cell_t cell;
+  cell_queue_t *queue;
+  int i;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  if (direction == CELL_DIRECTION_OUT) {
+    cell.circ_id = circ->n_circ_id;
+    queue = &circ->n_chan_cells;
+  } else {
+    cell.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    queue = &TO_OR_CIRCUIT(circ)->p_chan_cells;
+  }
+  set_uint32(cell.payload, cmux_bench_clock);
+
+  for (i = 0; i < n; ++i) {
+    cell_queue_append_packed_copy(circ, queue,
+                                  direction == CELL_DIRECTION_OUT, &cell,
+                                  chan->wide_circ_ids, 0);
+  }
+  update_circuit_on_cmux(circ, direction);
+}
+
+/** Helper for qsort: compare two uint32_t values. */
+static int
+cmux_bench_cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Helper: return the <b>pct</b>th percentile of the <b>n</b> sorted
+ * values in <b>vals</b>. */
+static uint32_t
+cmux_bench_percentile(const uint32_t *vals, int n, int pct)
+{
+  int idx;
+  if (n == 0)
+    return 0;
+  idx = (int)(((int64_t)n * pct) / 100);
+  return vals[MIN(idx, n - 1)];
+}
+
+/** Run the cmux simulation once with <b>pol</b> installed, and report
+ * fairness between the bulk circuits and latency percentiles for both
+ * kinds of circuit. */
+static void
+bench_cmux_policy_impl(const char *name, circuitmux_policy_t *pol)
+{
+  const int n_circs = CMUX_N_BULK + CMUX_N_INTERACTIVE;
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *circs[CMUX_N_BULK + CMUX_N_INTERACTIVE];
+  cell_direction_t dirs[CMUX_N_BULK + CMUX_N_INTERACTIVE];
+  const int max_cells = CMUX_N_ROUNDS * CMUX_FLUSH_PER_ROUND;
+  double sum = 0.0, sum_sq = 0.0;
+  uint64_t start, end;
+  int i, round, kind;
+
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  chan->write_packed_cell = cmux_bench_write_packed_cell;
+  chan->num_bytes_queued = cmux_bench_num_bytes_queued;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, pol);
+
+  cmux_bench_clock = 0;
+  memset(cmux_bench_sent, 0, sizeof(cmux_bench_sent));
+  for (kind = 0; kind < 2; ++kind) {
+    cmux_bench_lat[kind] = tor_calloc(max_cells, sizeof(uint32_t));
+    cmux_bench_n_lat[kind] = 0;
+  }
+
+  /* Bulk circuits carry downloads towards the client; interactive ones are
+   * split between the two directions. */
+  for (i = 0; i < n_circs; ++i) {
+    or_circuit_t *or_circ = circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+    cell_queue_init(&or_circ->base_.n_chan_cells);
+    cell_queue_init(&or_circ->p_chan_cells);
+    if (i < CMUX_N_BULK || (i & 1)) {
+      dirs[i] = CELL_DIRECTION_IN;
+      or_circ->p_chan = chan;
+      or_circ->p_circ_id = i + 1;
+    } else {
+      dirs[i] = CELL_DIRECTION_OUT;
+      or_circ->base_.n_chan = chan;
+      or_circ->base_.n_circ_id = i + 1;
+    }
+    circuitmux_attach_circuit(chan->cmux, TO_CIRCUIT(or_circ), dirs[i]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (round = 0; round < CMUX_N_ROUNDS; ++round) {
+    for (i = 0; i < n_circs; ++i) {
+      circuit_t *circ = TO_CIRCUIT(circs[i]);
+      if (i < CMUX_N_BULK) {
+        /* Keep every bulk circuit backlogged. */
+        if (circuitmux_num_cells_for_circuit(chan->cmux, circ) < 64)
+          cmux_bench_queue_cells(circ, chan, dirs[i], 64);
+      } else if (crypto_rand_int(64) == 0) {
+        /* Now and then, an interactive circuit sends a short request. */
+        cmux_bench_queue_cells(circ, chan, dirs[i], 1 + crypto_rand_int(3));
+      }
+    }
+    channel_flush_from_first_active_circuit(chan, CMUX_FLUSH_PER_ROUND);
+  }
+  end = perftime();
+
+  for (i = 0; i < CMUX_N_BULK; ++i) {
+    sum += (double)cmux_bench_sent[i];
+    sum_sq += (double)cmux_bench_sent[i] * (double)cmux_bench_sent[i];
+  }
+
+  printf("%-5s: %.2f ns per cell; bulk fairness (Jain) %.4f\n",
+         name, NANOCOUNT(start, end, cmux_bench_clock),
+         sum_sq > 0 ? (sum * sum) / (CMUX_N_BULK * sum_sq) : 0.0);
+  for (kind = 0; kind < 2; ++kind) {
+    uint32_t *lat = cmux_bench_lat[kind];
+    int n = cmux_bench_n_lat[kind];
+    qsort(lat, n, sizeof(uint32_t), cmux_bench_cmp_u32);
+    printf("       %s latency (cells): p50 %u  p90 %u  p99 %u  max %u\n",
+           kind ? "interactive" : "bulk       ",
+           (unsigned)cmux_bench_percentile(lat, n, 50),
+           (unsigned)cmux_bench_percentile(lat, n, 90),
+           (unsigned)cmux_bench_percentile(lat, n, 99),
+           (unsigned)(n ? lat[n-1] : 0));
+    tor_free(cmux_bench_lat[kind]);
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    circuitmux_detach_circuit(chan->cmux, TO_CIRCUIT(circs[i]));
+    cell_queue_clear(&circs[i]->base_.n_chan_cells);
+    cell_queue_clear(&circs[i]->p_chan_cells);
+    tor_free(circs[i]);
+  }
+  circuitmux_set_policy(chan->cmux, NULL);
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+}
+
+static void
+bench_cmux(void)
+{
+  or_options_t *options = get_options_mutable();
+
+  options->CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_factor(options, NULL);
+  options->CircuitMuxPolicy_parsed = CMUX_POLICY_DRR;
+  cell_drr_set_parameters(options, NULL);
+
+  bench_cmux_policy_impl("RR", NULL);
+  bench_cmux_policy_impl("EWMA", &ewma_policy);
+  bench_cmux_policy_impl("DRR", &drr_policy);
+  bench_cmux_policy_impl("WDRR", &wdrr_policy);
+}
+
+/* ==== stream scheduling simulation ==== */
+
+/** Number of always-backlogged streams in the stream simulation. */
+#define STREAMS_N_BULK 8
+/** How many rounds (circuit-level SENDMEs) do we simulate? */
+#define STREAMS_N_ROUNDS 5000
+
+/** Callback for the stream benchmark's fake read events; never runs. */
+static void
+streams_bench_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void)fd;
+  (void)what;
+  (void)arg;
+}
+
+/** The client's half of the stream benchmark circuit's inbound crypto. */
+static crypto_cipher_t *streams_bench_client_in = NULL;
+/** Cells written so far on the stream benchmark's channel. */
+static uint64_t streams_bench_n_written = 0;
+/** Stream ID of the interactive stream in the stream benchmark. */
+static streamid_t streams_bench_interactive_id = 0;
+/** Value of streams_bench_n_written when the interactive stream's last cell
+ * was written. */
+static uint64_t streams_bench_interactive_written = 0;
+
+/** write_packed_cell method for the stream benchmark's fake channel:
+ * decrypt the cell as the client would, and note when it belongs to the
+ * interactive stream. */
+static int
+streams_bench_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  char *payload = cell->body + (chan->wide_circ_ids ? 5 : 3);
+  relay_header_t rh;
+
+  crypto_cipher_crypt_inplace(streams_bench_client_in, payload,
+                              CELL_PAYLOAD_SIZE);
+  relay_header_unpack(&rh, (uint8_t*)payload);
+  ++streams_bench_n_written;
+  if (rh.stream_id == streams_bench_interactive_id)
+    streams_bench_interactive_written = streams_bench_n_written;
+
+  packed_cell_free(cell);
+  return 1;
+}
+
+/** Helper: make <b>cell</b> into a circuit-level SENDME that <b>circ</b>
+ * will recognize, as the client with cipher <b>cipher</b> and running
+ * digest <b>digest</b> would send it. */
+static void
+streams_bench_make_sendme(cell_t *cell, or_circuit_t *circ,
+                          crypto_cipher_t *cipher, crypto_digest_t *digest)
+{
+  relay_header_t rh;
+  char integrity[4];
+
+  memset(cell, 0, sizeof(cell_t));
+  cell->command = CELL_RELAY;
+  cell->circ_id = circ->p_circ_id;
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_SENDME;
+  relay_header_pack(cell->payload, &rh);
+  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(digest, integrity, 4);
+  memcpy(rh.integrity, integrity, 4);
+  relay_header_pack(cell->payload, &rh);
+  crypto_cipher_crypt_inplace(cipher, (char*)cell->payload,
+                              CELL_PAYLOAD_SIZE);
+}
+
+/** Simulate an exit circuit carrying STREAMS_N_BULK bulk downloads and one
+ * interactive stream, and report how many other cells the circuit sends
+ * between an answer arriving on the interactive stream and the answer's
+ * last cell going out. */
+static void
+bench_streams(void)
+{
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  edge_connection_t *streams[STREAMS_N_BULK + 1];
+  edge_connection_t *interactive;
+  or_circuit_t *circ;
+  crypto_cipher_t *client_cipher;
+  crypto_digest_t *client_digest;
+  char key[CIPHER_KEY_LEN];
+  char *data = tor_malloc_zero(RELAY_PAYLOAD_SIZE * 64);
+  uint32_t *lat = tor_calloc(STREAMS_N_ROUNDS, sizeof(uint32_t));
+  int n_lat = 0, i, round;
+  uint64_t request_started = 0, start, end, n_cells;
+  tor_libevent_cfg cfg;
+  cell_t cell;
+
+  /* Don't let the OOM handler kill our circuit. */
+  get_options_mutable()->MaxMemInQueues = UINT64_MAX;
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  scheduler_init();
+
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  chan->write_packed_cell = streams_bench_write_packed_cell;
+  chan->num_bytes_queued = cmux_bench_num_bytes_queued;
+  chan->cmux = circuitmux_alloc();
+
+  circ = or_circuit_new(1, chan);
+  circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  crypto_rand(key, sizeof(key));
+  circ->p_crypto = crypto_cipher_new(key);
+  streams_bench_client_in = crypto_cipher_new(key);
+  circ->p_digest = crypto_digest_new();
+  crypto_rand(key, sizeof(key));
+  circ->n_crypto = crypto_cipher_new(key);
+  circ->n_digest = crypto_digest_new();
+  client_cipher = crypto_cipher_new(key);
+  client_digest = crypto_digest_new();
+  /* Every round begins with a SENDME that opens the window. */
+  circ->base_.package_window = 0;
+
+  for (i = 0; i < STREAMS_N_BULK + 1; ++i) {
+    edge_connection_t *conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+    conn->base_.state = EXIT_CONN_STATE_OPEN;
+    conn->base_.read_event = tor_event_new(tor_libevent_get_base(), -1,
+                                           EV_READ, streams_bench_read_cb,
+                                           NULL);
+    conn->stream_id = i + 1;
+    conn->package_window = INT_MAX / 2;
+    conn->on_circuit = TO_CIRCUIT(circ);
+    conn->next_stream = circ->n_streams;
+    circ->n_streams = conn;
+    streams[i] = conn;
+  }
+  interactive = streams[STREAMS_N_BULK];
+  streams_bench_interactive_id = interactive->stream_id;
+  streams_bench_n_written = 0;
+
+  reset_perftime();
+  start = perftime();
+  n_cells = stats_n_data_cells_packaged;
+  for (round = 0; round < STREAMS_N_ROUNDS; ++round) {
+    for (i = 0; i < STREAMS_N_BULK; ++i) {
+      /* Keep every bulk stream backlogged. */
+      if (buf_datalen(streams[i]->base_.inbuf) < RELAY_PAYLOAD_SIZE * 64)
+        write_to_buf(data, RELAY_PAYLOAD_SIZE * 64, streams[i]->base_.inbuf);
+    }
+    if (!request_started && crypto_rand_int(4) == 0) {
+      /* Now and then, the interactive stream gets a short answer. */
+      write_to_buf(data, RELAY_PAYLOAD_SIZE * (1 + crypto_rand_int(3)),
+                   interactive->base_.inbuf);
+      request_started = streams_bench_n_written + 1;
+    }
+
+    streams_bench_make_sendme(&cell, circ, client_cipher, client_digest);
+    circuit_receive_relay_cell(&cell, TO_CIRCUIT(circ), CELL_DIRECTION_OUT);
+    channel_flush_from_first_active_circuit(chan, CIRCWINDOW_INCREMENT * 2);
+
+    if (request_started && !buf_datalen(interactive->base_.inbuf)) {
+      lat[n_lat++] = (uint32_t)(streams_bench_interactive_written -
+                                request_started);
+      request_started = 0;
+    }
+  }
+  end = perftime();
+  n_cells = stats_n_data_cells_packaged - n_cells;
+
+  qsort(lat, n_lat, sizeof(uint32_t), cmux_bench_cmp_u32);
+  printf("%.2f ns per cell packaged\n", NANOCOUNT(start, end, n_cells));
+  printf("interactive latency (cells): p50 %u  p90 %u  p99 %u  max %u\n",
+         (unsigned)cmux_bench_percentile(lat, n_lat, 50),
+         (unsigned)cmux_bench_percentile(lat, n_lat, 90),
+         (unsigned)cmux_bench_percentile(lat, n_lat, 99),
+         (unsigned)(n_lat ? lat[n_lat-1] : 0));
+
+  for (i = 0; i < STREAMS_N_BULK + 1; ++i) {
+    edge_connection_t *conn = streams[i];
+    tor_event_free(conn->base_.read_event);
+    buf_free(conn->base_.inbuf);
+    buf_free(conn->base_.outbuf);
+    tor_free(conn);
+  }
+  circ->n_streams = NULL;
+  circuit_free_all();
+  crypto_cipher_free(client_cipher);
+  crypto_cipher_free(streams_bench_client_in);
+  streams_bench_client_in = NULL;
+  crypto_digest_free(client_digest);
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  tor_free(lat);
+  tor_free(data);
+}
+
+/** Time exit policy lookups against the default exit policy plus
+ * <b>n_extra</b> extra address rules, with and without compiling it. */
+static void
+bench_policy_impl(int n_extra)
+{
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *cp;
+  config_line_t *line = NULL, **next = &line;
+  tor_addr_t *addrs;
+  uint16_t *ports;
+  uint64_t start, end;
+  const int N = 100000;
+  int i, r = 0;
+
+  for (i = 0; i < n_extra; ++i) {
+    *next = tor_malloc_zero(sizeof(config_line_t));
+    (*next)->key = tor_strdup("ExitPolicy");
+    tor_asprintf(&(*next)->value, "reject %d.%d.0.0/16:*",
+                 (i >> 8) + 20, i & 255);
+    next = &(*next)->next;
+  }
+  policies_parse_exit_policy(line, &policy,
+                             EXIT_POLICY_REJECT_PRIVATE |
+                             EXIT_POLICY_ADD_DEFAULT, 0x01020304);
+  config_free_lines(line);
+
+  addrs = tor_calloc(N, sizeof(tor_addr_t));
+  ports = tor_calloc(N, sizeof(uint16_t));
+  for (i = 0; i < N; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(INT_MAX) << 1);
+    ports[i] = crypto_rand_int(2) ? 443 : (uint16_t) crypto_rand_int(65536);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i)
+    r += compare_tor_addr_to_addr_policy(&addrs[i], ports[i], policy);
+  end = perftime();
+  printf("%d rules, linear:   %.2f ns per lookup\n",
+         smartlist_len(policy), NANOCOUNT(start, end, N));
+
+  start = perftime();
+  cp = addr_policy_compile(policy);
+  end = perftime();
+  printf("%d rules, compile:  %.2f usec\n",
+         smartlist_len(policy), NANOCOUNT(start, end, 1) / 1000.0);
+  if (!cp) {
+    /* Callers scan the policy instead, as timed above. */
+    printf("%d rules, compiled: too big to compile\n",
+           smartlist_len(policy));
+    goto done;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i)
+    r -= compare_tor_addr_to_compiled_policy(&addrs[i], ports[i], cp);
+  end = perftime();
+  printf("%d rules, compiled: %.2f ns per lookup\n",
+         smartlist_len(policy), NANOCOUNT(start, end, N));
+  tor_assert(r == 0);
+
+ done:
+  compiled_addr_policy_free(cp);
+  addr_policy_list_free(policy);
+  tor_free(addrs);
+  tor_free(ports);
+}
+
+static void
+bench_policy(void)
+{
+  bench_policy_impl(0);
+  bench_policy_impl(100);
+  bench_policy_impl(1000);
+}
+
+/** Helper: add to <b>cons</b> the lines of a fake consensus with
+ * <b>n_routers</b> router entries; routers with <b>i</b> % 10 ==
+ * <b>changed</b> get a different bandwidth, and every hundredth router is
+ * only present if <b>odd</b>. */
+static void
+bench_consdiff_make_consensus(smartlist_t *cons, int n_routers, int changed,
+                              int odd)
+{
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char id[6];
+  int i, j;
+
+  smartlist_add_asprintf(cons, "network-status-version 3");
+  smartlist_add_asprintf(cons, "vote-status consensus");
+  smartlist_add_asprintf(cons, "valid-after 2015-06-01 %02d:00:00", odd);
+  for (i = 0; i < n_routers; ++i) {
+    if (i % 100 == 50 && !odd)
+      continue;
+    /* Encode i so that the identities sort in base64 order. */
+    for (j = 0; j < 5; ++j)
+      id[j] = b64[(i >> (6 * (4 - j))) & 63];
+    id[5] = '\0';
+    smartlist_add_asprintf(cons, "r router%d %sAAAAAAAAAAAAAAAAAAAAAA "
+                           "AAAAAAAAAAAAAAAAAAAAAAAAAAA 2015-06-01 00:00:00 "
+                           "10.%d.%d.%d 9001 0", i, id, (i >> 16) & 255,
+                           (i >> 8) & 255, i & 255);
+    smartlist_add_asprintf(cons, "s Fast Running Stable Valid");
+    smartlist_add_asprintf(cons, "w Bandwidth=%d",
+                           i % 10 == changed ? i + 1 : i);
+    smartlist_add_asprintf(cons, "p accept 80,443");
+  }
+  smartlist_add_asprintf(cons, "directory-footer");
+  smartlist_add_asprintf(cons, "directory-signature "
+                         "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA "
+                         "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA");
+}
+
+/** Time generating and applying a diff between two consensuses of a
+ * realistic size, about a tenth of whose entries differ. */
+static void
+bench_consdiff(void)
+{
+  const int n_routers = 7000;
+  smartlist_t *cons1 = smartlist_new(), *cons2 = smartlist_new();
+  smartlist_t *diff = NULL;
+  digests_t digests1, digests2;
+  char *cons1_str = NULL, *cons2_str = NULL, *result = NULL;
+  uint64_t start, end;
+
+  bench_consdiff_make_consensus(cons1, n_routers, 3, 0);
+  bench_consdiff_make_consensus(cons2, n_routers, 7, 1);
+  cons1_str = smartlist_join_strings(cons1, "\n", 1, NULL);
+  cons2_str = smartlist_join_strings(cons2, "\n", 1, NULL);
+  tor_assert(!router_get_networkstatus_v3_hashes(cons1_str, &digests1));
+  tor_assert(!router_get_networkstatus_v3_hashes(cons2_str, &digests2));
+
+  reset_perftime();
+  start = perftime();
+  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2);
+  end = perftime();
+  tor_assert(diff);
+  printf("%d lines to %d lines: %d line diff in %.2f msec\n",
+         smartlist_len(cons1), smartlist_len(cons2), smartlist_len(diff),
+         NANOCOUNT(start, end, 1) / 1e6);
+
+  start = perftime();
+  result = consdiff_apply_diff(cons1, diff, &digests1);
+  end = perftime();
+  tor_assert(result);
+  tor_assert(!strcmp(result, cons2_str));
+  printf("Applied in %.2f msec\n", NANOCOUNT(start, end, 1) / 1e6);
+  tor_free(result);
+
+  start = perftime();
+  result = consdiff_apply_diff_from_str(cons1_str, strlen(cons1_str), diff,
+                                        &digests1);
+  end = perftime();
+  tor_assert(result);
+  tor_assert(!strcmp(result, cons2_str));
+  printf("Applied to a string in %.2f msec\n",
+         NANOCOUNT(start, end, 1) / 1e6);
+
+  tor_free(result);
+  tor_free(cons1_str);
+  tor_free(cons2_str);
+  SMARTLIST_FOREACH(cons1, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(cons2, char *, cp, tor_free(cp));
+  smartlist_free(cons1);
+  smartlist_free(cons2);
+  if (diff) {
+    SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+    smartlist_free(diff);
+  }
+}
+
+/** How many authorities vote in bench_voting()? */
+#define BENCH_VOTING_N_AUTHORITIES 9
+/** How many routers do they vote on? */
+#define BENCH_VOTING_N_ROUTERS 10000
+
+/** The keys and certificate of one of the fake authorities in
+ * bench_voting(). */
+typedef struct bench_authority_t {
+  crypto_pk_t *identity_key;
+  crypto_pk_t *signing_key;
+  char identity_hex[HEX_DIGEST_LEN+1];
+  char signing_fp[HEX_DIGEST_LEN+1];
+  char *cert;
+} bench_authority_t;
+
+/** Return the most memory that this process has ever had resident, in KB,
+ * or 0 if we can't tell. */
+static long
+bench_peak_rss_kb(void)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+    return (long) (ru.ru_maxrss / 1024);
+#else
+    return (long) ru.ru_maxrss;
+#endif
+  }
+#endif
+  return 0;
+}
+
+/** Report how long <b>stage</b> took, and how far it raised our peak
+ * memory use above *<b>rss_kb</b>, the peak as of the last stage. */
+static void
+bench_voting_report(const char *stage, uint64_t start, uint64_t end,
+                    long *rss_kb)
+{
+  long now_kb = bench_peak_rss_kb();
+  printf("%-36s %9.2f msec  peak RSS %7ld KB (+%ld)\n", stage,
+         NANOCOUNT(start, end, 1) / 1e6, now_kb, now_kb - *rss_kb);
+  *rss_kb = now_kb;
+}
+
+/** Return a number that looks random, but depends only on <b>a</b> and
+ * <b>b</b>. */
+static uint32_t
+bench_voting_hash(uint32_t a, uint32_t b)
+{
+  uint32_t h = a * 2654435761u ^ (b + 1) * 2246822519u;
+  h ^= h >> 15;
+  h *= 3266489917u;
+  h ^= h >> 13;
+  return h;
+}
+
+/** Give <b>auth</b> fresh keys, and a key certificate that binds them. */
+static void
+bench_voting_make_authority(bench_authority_t *auth)
+{
+  smartlist_t *chunks = smartlist_new();
+  char id_digest[DIGEST_LEN], digest[DIGEST_LEN];
+  char *identity_pem = NULL, *signing_pem = NULL;
+  size_t len;
+
+  auth->identity_key = crypto_pk_new();
+  auth->signing_key = crypto_pk_new();
+  tor_assert(!crypto_pk_generate_key_with_bits(auth->identity_key, 2048));
+  tor_assert(!crypto_pk_generate_key(auth->signing_key));
+  crypto_pk_get_digest(auth->identity_key, id_digest);
+  base16_encode(auth->identity_hex, sizeof(auth->identity_hex),
+                id_digest, DIGEST_LEN);
+  crypto_pk_get_fingerprint(auth->signing_key, auth->signing_fp, 0);
+  tor_assert(!crypto_pk_write_public_key_to_string(auth->identity_key,
+                                                   &identity_pem, &len));
+  tor_assert(!crypto_pk_write_public_key_to_string(auth->signing_key,
+                                                   &signing_pem, &len));
+
+  smartlist_add_asprintf(chunks,
+                         "dir-key-certificate-version 3\n"
+                         "fingerprint %s\n"
+                         "dir-key-published 2015-01-01 00:00:00\n"
+                         "dir-key-expires 2030-01-01 00:00:00\n"
+                         "dir-identity-key\n%s"
+                         "dir-signing-key\n%s"
+                         "dir-key-crosscert\n",
+                         auth->identity_hex, identity_pem, signing_pem);
+  smartlist_add(chunks, router_get_dirobj_signature(id_digest, DIGEST_LEN,
+                                                    auth->signing_key));
+  smartlist_add(chunks, tor_strdup("dir-key-certification\n"));
+  crypto_digest_smartlist(digest, DIGEST_LEN, chunks, "", DIGEST_SHA1);
+  smartlist_add(chunks, router_get_dirobj_signature(digest, DIGEST_LEN,
+                                                    auth->identity_key));
+  auth->cert = smartlist_join_strings(chunks, "", 0, NULL);
+
+  tor_free(identity_pem);
+  tor_free(signing_pem);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+}
+
+/** Return a newly allocated vote, signed by <b>auth</b>, the
+ * <b>auth_idx</b>th of our fake authorities, for voting round
+ * <b>round</b>.  Each authority leaves out about one router in twenty and
+ * has an older descriptor for about one in fifty; the first few measure
+ * bandwidths; and about a tenth of the routers change their bandwidth
+ * from one round to the next. */
+static char *
+bench_voting_make_vote(const bench_authority_t *auth, int auth_idx,
+                       int round)
+{
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *methods = smartlist_new();
+  char va[ISO_TIME_LEN+1], fu[ISO_TIME_LEN+1], vu[ISO_TIME_LEN+1];
+  char published[ISO_TIME_LEN+1];
+  char id[DIGEST_LEN], desc[DIGEST_LEN], md[DIGEST256_LEN];
+  char id64[BASE64_DIGEST_LEN+1], desc64[BASE64_DIGEST_LEN+1];
+  char md64[BASE64_DIGEST256_LEN+1];
+  char digest[DIGEST_LEN];
+  const time_t valid_after = 1433116800 + round * 3600;
+  char *methods_spaces, *methods_commas, *result;
+  int i, m;
+
+  format_iso_time(va, valid_after);
+  format_iso_time(fu, valid_after + 3600);
+  format_iso_time(vu, valid_after + 3*3600);
+  format_iso_time(published, valid_after - 300);
+  for (m = MIN_SUPPORTED_CONSENSUS_METHOD;
+       m <= MAX_SUPPORTED_CONSENSUS_METHOD; ++m)
+    smartlist_add_asprintf(methods, "%d", m);
+  methods_spaces = smartlist_join_strings(methods, " ", 0, NULL);
+  methods_commas = smartlist_join_strings(methods, ",", 0, NULL);
+
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3\n"
+                         "vote-status vote\n"
+                         "consensus-methods %s\n"
+                         "published %s\n"
+                         "valid-after %s\n"
+                         "fresh-until %s\n"
+                         "valid-until %s\n"
+                         "voting-delay 300 300\n"
+                         "client-versions 0.2.5.12,0.2.6.9,0.2.7.1-alpha\n"
+                         "server-versions 0.2.5.12,0.2.6.9,0.2.7.1-alpha\n"
+                         "known-flags Authority BadExit Exit Fast Guard "
+                         "HSDir Running Stable V2Dir Valid\n"
+                         "params CircuitPriorityHalflifeMsec=30000 "
+                         "bwweightscale=10000\n"
+                         "dir-source auth%d %s 127.0.0.%d 127.0.0.%d "
+                         "80 443\n"
+                         "contact auth%d <auth%d@example.com>\n",
+                         methods_spaces, published, va, fu, vu,
+                         auth_idx, auth->identity_hex, auth_idx + 1,
+                         auth_idx + 1, auth_idx, auth_idx);
+  smartlist_add(chunks, tor_strdup(auth->cert));
+
+  /* Routers are listed by identity, so put i in the top bytes of router
+   * i's identity. */
+  for (i = 0; i < BENCH_VOTING_N_ROUTERS; ++i) {
+    const uint32_t h = bench_voting_hash(i, 0);
+    const uint32_t mine = bench_voting_hash(i, auth_idx + 1);
+    const int is_old = (mine % 50) == 1;
+    const int is_exit = (h % 3) == 0;
+    int bw = 20 + (int)(h % 10000);
+    char rpub[ISO_TIME_LEN+1];
+
+    if ((mine % 20) == 0)
+      continue;
+    if (round && bench_voting_hash(i, 1000 + round) % 10 == 0)
+      bw += 100 * round;
+
+    set_uint32(id, htonl((uint32_t) i));
+    memset(id + 4, (int)(h & 0xff), DIGEST_LEN - 4);
+    set_uint32(desc, htonl(h));
+    memset(desc + 4, is_old, DIGEST_LEN - 4);
+    memset(md, 0, sizeof(md));
+    set_uint32(md, htonl(h));
+    md[4] = (char) is_old;
+    digest_to_base64(id64, id);
+    digest_to_base64(desc64, desc);
+    digest256_to_base64(md64, md);
+    format_iso_time(rpub, 1433116800 - 3600 * (is_old ? 20 : 2));
+
+    smartlist_add_asprintf(chunks,
+                           "r router%d %s %s %s 10.%d.%d.%d 9001 %d\n"
+                           "s %sFast %s%sRunning Stable %sValid\n"
+                           "v Tor 0.2.7.1-alpha\n",
+                           i, id64, desc64, rpub, (i >> 16) & 255,
+                           (i >> 8) & 255, i & 255, (h % 5) ? 0 : 9030,
+                           is_exit ? "Exit " : "",
+                           (h % 4) ? "" : "Guard ",
+                           (h % 5) ? "" : "HSDir ",
+                           (h % 5) ? "" : "V2Dir ");
+    if (auth_idx < BENCH_VOTING_N_AUTHORITIES / 2 + 1)
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d Measured=%d\n",
+                             bw, bw * (90 + auth_idx) / 100);
+    else
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d\n", bw);
+    smartlist_add_asprintf(chunks, "p %s\nm %s sha256=%s\n",
+                           is_exit ? "accept 80,443" : "reject 1-65535",
+                           methods_commas, md64);
+  }
+
+  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  crypto_digest_smartlist(digest, DIGEST_LEN, chunks,
+                          "directory-signature ", DIGEST_SHA1);
+  smartlist_add_asprintf(chunks, "directory-signature %s %s\n",
+                         auth->identity_hex, auth->signing_fp);
+  smartlist_add(chunks, router_get_dirobj_signature(digest, DIGEST_LEN,
+                                                    auth->signing_key));
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+
+  tor_free(methods_spaces);
+  tor_free(methods_commas);
+  SMARTLIST_FOREACH(methods, char *, cp, tor_free(cp));
+  smartlist_free(methods);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Run one round of voting among <b>auths</b>: parse their votes for round
+ * <b>round</b>, collate them, and compute and sign both consensus flavors.
+ * If <b>rss_kb</b> is set, report on each stage.  Return the ns-flavored
+ * consensus. */
+static char *
+bench_voting_round(bench_authority_t *auths, int round, long *rss_kb)
+{
+  smartlist_t *votes = smartlist_new();
+  char *vote_bodies[BENCH_VOTING_N_AUTHORITIES];
+  char *consensus = NULL, *md_consensus = NULL;
+  networkstatus_t *ns = NULL;
+  dircollator_t *dc = NULL;
+  digests_t digests;
+  uint64_t start, end;
+  int i;
+
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i)
+    vote_bodies[i] = bench_voting_make_vote(&auths[i], i, round);
+  if (rss_kb)
+    *rss_kb = bench_peak_rss_kb();
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i) {
+    networkstatus_t *v =
+      networkstatus_parse_vote_from_string(vote_bodies[i], NULL,
+                                           NS_TYPE_VOTE);
+    tor_assert(v);
+    smartlist_add(votes, v);
+  }
+  end = perftime();
+  if (rss_kb)
+    bench_voting_report("Parse votes", start, end, rss_kb);
+
+  start = perftime();
+  dc = dircollator_new(BENCH_VOTING_N_AUTHORITIES,
+                       BENCH_VOTING_N_AUTHORITIES);
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, dircollator_add_vote(dc, v));
+  dircollator_collate(dc, MAX_SUPPORTED_CONSENSUS_METHOD);
+  end = perftime();
+  tor_assert(dircollator_n_routers(dc) == BENCH_VOTING_N_ROUTERS);
+  if (rss_kb)
+    bench_voting_report("Collate votes", start, end, rss_kb);
+
+  start = perftime();
+  consensus = networkstatus_compute_consensus(votes,
+                                         BENCH_VOTING_N_AUTHORITIES,
+                                         auths[0].identity_key,
+                                         auths[0].signing_key,
+                                         NULL, NULL, FLAV_NS);
+  end = perftime();
+  tor_assert(consensus);
+  if (rss_kb)
+    bench_voting_report("Compute ns consensus", start, end, rss_kb);
+
+  start = perftime();
+  md_consensus = networkstatus_compute_consensus(votes,
+                                         BENCH_VOTING_N_AUTHORITIES,
+                                         auths[0].identity_key,
+                                         auths[0].signing_key,
+                                         NULL, NULL, FLAV_MICRODESC);
+  end = perftime();
+  tor_assert(md_consensus);
+  if (rss_kb)
+    bench_voting_report("Compute microdesc consensus", start, end, rss_kb);
+
+  /* Computing the consensus signs it once; every other authority signs it
+   * too. */
+  start = perftime();
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i) {
+    char *sig;
+    tor_assert(!router_get_networkstatus_v3_hashes(consensus, &digests));
+    sig = router_get_dirobj_signature(digests.d[DIGEST_SHA1], DIGEST_LEN,
+                                      auths[i].signing_key);
+    tor_assert(sig);
+    tor_free(sig);
+  }
+  end = perftime();
+  if (rss_kb)
+    bench_voting_report("Sign consensus (all authorities)", start, end,
+                        rss_kb);
+
+  start = perftime();
+  ns = networkstatus_parse_vote_from_string(consensus, NULL,
+                                            NS_TYPE_CONSENSUS);
+  end = perftime();
+  tor_assert(ns);
+  if (rss_kb)
+    bench_voting_report("Parse consensus", start, end, rss_kb);
+
+  networkstatus_vote_free(ns);
+  dircollator_free(dc);
+  tor_free(md_consensus);
+  SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+  smartlist_free(votes);
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i)
+    tor_free(vote_bodies[i]);
+  return consensus;
+}
+
+/** Time each stage of a directory authority vote, on synthetic votes from
+ * BENCH_VOTING_N_AUTHORITIES authorities about BENCH_VOTING_N_ROUTERS
+ * routers, and then diffing the resulting consensus against the next
+ * round's.  As on an authority, computing each consensus hands batches of
+ * routers to the consensus batch threads when there is more than one CPU;
+ * every other stage runs on the main thread alone.  The memory figures are
+ * the process's peak resident size, so a stage only shows a rise if it
+ * needed more than any stage before it. */
+static void
+bench_voting(void)
+{
+  bench_authority_t auths[BENCH_VOTING_N_AUTHORITIES];
+  smartlist_t *lines1 = smartlist_new(), *lines2 = smartlist_new();
+  smartlist_t *diff = NULL;
+  char *cons1 = NULL, *cons2 = NULL, *copy1 = NULL, *copy2 = NULL;
+  digests_t digests1, digests2;
+  long rss_kb = bench_peak_rss_kb();
+  uint64_t start, end;
+  int i, n_cpus;
+
+  memset(auths, 0, sizeof(auths));
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i)
+    bench_voting_make_authority(&auths[i]);
+
+  printf("%d authorities voting on %d routers:\n",
+         BENCH_VOTING_N_AUTHORITIES, BENCH_VOTING_N_ROUTERS);
+  n_cpus = get_num_cpus(get_options());
+  if (n_cpus > 1)
+    printf("(Consensus times include up to %d consensus batch threads "
+           "working alongside the main thread.)\n", n_cpus - 1);
+  else
+    printf("(One CPU: every stage runs on the main thread alone.)\n");
+  cons1 = bench_voting_round(auths, 0, &rss_kb);
+  cons2 = bench_voting_round(auths, 1, NULL);
+
+  tor_assert(!router_get_networkstatus_v3_hashes(cons1, &digests1));
+  tor_assert(!router_get_networkstatus_v3_hashes(cons2, &digests2));
+  copy1 = tor_strdup(cons1);
+  copy2 = tor_strdup(cons2);
+  tor_split_lines(lines1, copy1, (int)strlen(copy1));
+  tor_split_lines(lines2, copy2, (int)strlen(copy2));
+  start = perftime();
+  diff = consdiff_gen_diff(lines1, lines2, &digests1, &digests2);
+  end = perftime();
+  tor_assert(diff);
+  bench_voting_report("Diff against next consensus", start, end, &rss_kb);
+  printf("%d lines to %d lines: %d line diff\n", smartlist_len(lines1),
+         smartlist_len(lines2), smartlist_len(diff));
+
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_free(diff);
+  smartlist_free(lines1);
+  smartlist_free(lines2);
+  tor_free(copy1);
+  tor_free(copy2);
+  tor_free(cons1);
+  tor_free(cons2);
+  for (i = 0; i < BENCH_VOTING_N_AUTHORITIES; ++i) {
+    crypto_pk_free(auths[i].identity_key);
+    crypto_pk_free(auths[i].signing_key);
+    tor_free(auths[i].cert);
+  }
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -599,6 +1583,11 @@ static struct benchmark_t benchmarks[] = {
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(cmux),
+  ENT(streams),
+  ENT(policy),
+  ENT(consdiff),
+  ENT(voting),
   {NULL,NULL,0}
 };
 
@@ -750,6 +750,76 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static smartlist_t *tls_write_sizes = NULL;
+
+static int
+mock_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+{
+  (void)tls;
+  (void)cp;
+  smartlist_add_asprintf(tls_write_sizes, "%d", (int)n);
+  return (int)n;
+}
+
+static size_t
+mock_tls_get_forced_write_size(tor_tls_t *tls)
+{
+  (void)tls;
+  return 0;
+}
+
+static void
+test_buffers_tls_write_coalesce(void *arg)
+{
+  buf_t *buf = NULL;
+  char *mem = NULL, *sizes = NULL;
+  size_t flushlen;
+  uint64_t n_writes, n_bytes, n_coalesced;
+  (void)arg;
+
+  MOCK(tor_tls_write, mock_tls_write);
+  MOCK(tor_tls_get_forced_write_size, mock_tls_get_forced_write_size);
+  tls_write_sizes = smartlist_new();
+
+  mem = tor_malloc_zero(8192);
+  buf = buf_new_with_capacity(1024);
+
+  /* A lone small chunk goes out right away, as it is. */
+  write_to_buf(mem, 100, buf);
+  flushlen = buf_datalen(buf);
+  tt_int_op(100, OP_EQ, flush_buf_tls(NULL, buf, flushlen, &flushlen));
+  tt_int_op(0, OP_EQ, flushlen);
+
+  /* Many small chunks get sent as a single full record. */
+  while (buf_datalen(buf) < 40000)
+    write_to_buf(mem, 514, buf);
+  tt_int_op(buf->head->datalen, OP_LT, 16384);
+  flushlen = buf_datalen(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ,
+            flush_buf_tls(NULL, buf, flushlen, &flushlen));
+  tt_int_op(0, OP_EQ, flushlen);
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+
+  sizes = smartlist_join_strings(tls_write_sizes, ",", 0, NULL);
+  tt_str_op(sizes, OP_EQ, "100,16384,16384,7324");
+
+  buf_get_tls_flush_stats(&n_writes, &n_bytes, &n_coalesced);
+  tt_u64_op(n_writes, OP_EQ, 4);
+  tt_u64_op(n_bytes, OP_EQ, 40192);
+  tt_u64_op(n_coalesced, OP_EQ, 3);
+
+ done:
+  UNMOCK(tor_tls_write);
+  UNMOCK(tor_tls_get_forced_write_size);
+  if (tls_write_sizes) {
+    SMARTLIST_FOREACH(tls_write_sizes, char *, cp, tor_free(cp));
+    smartlist_free(tls_write_sizes);
+  }
+  tor_free(mem);
+  tor_free(sizes);
+  buf_free(buf);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -764,6 +834,8 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL},
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "tls_write_coalesce", test_buffers_tls_write_coalesce, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -7,6 +7,9 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_drr.h"
+#include "circuitmux_ewma.h"
+#include "config.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -81,8 +84,185 @@ test_cmux_destroy_cell_queue(void *arg)
   packed_cell_free(pc);
 }
 
+/** Helper: make a fake or_circuit_t with <b>n_cells</b> (pretend) cells
+ * queued on <b>chan</b> in <b>direction</b>, using circuit ID
+ * <b>circ_id</b>. */
+static or_circuit_t *
+new_fake_queued_circuit(channel_t *chan, cell_direction_t direction,
+                        circid_t circ_id, int n_cells)
+{
+  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  if (direction == CELL_DIRECTION_OUT) {
+    or_circ->base_.n_chan = chan;
+    or_circ->base_.n_circ_id = circ_id;
+    or_circ->base_.n_chan_cells.n = n_cells;
+  } else {
+    or_circ->p_chan = chan;
+    or_circ->p_circ_id = circ_id;
+    or_circ->p_chan_cells.n = n_cells;
+  }
+  return or_circ;
+}
+
+/** Helper: send every cell on <b>cmux</b>, one at a time, and return a
+ * string with one character per cell naming which of <b>circs</b> it came
+ * from ('a' for circs[0], 'b' for circs[1], ...). */
+static char *
+drain_cmux(circuitmux_t *cmux, or_circuit_t **circs, int n_circs)
+{
+  smartlist_t *chunks = smartlist_new();
+  circuit_t *circ;
+  cell_queue_t *cq = NULL;
+  char *result;
+  int i;
+
+  while ((circ = circuitmux_get_first_active_circuit(cmux, &cq))) {
+    for (i = 0; i < n_circs; ++i) {
+      if (circ == TO_CIRCUIT(circs[i]))
+        break;
+    }
+    tor_assert(i < n_circs);
+    smartlist_add_asprintf(chunks, "%c", 'a' + i);
+    circuitmux_notify_xmit_cells(cmux, circ, 1);
+  }
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Test that DRR lets each circuit send a quantum of cells in turn. */
+static void
+test_cmux_drr_quantum(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  channel_t *ch = NULL;
+  or_circuit_t *circs[2] = { NULL, NULL };
+  char *order = NULL;
+  int i;
+
+  tor_libevent_cfg cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+
+  tor_libevent_initialize(&cfg);
+  scheduler_init();
+
+  (void) arg;
+
+  cmux = circuitmux_alloc();
+  ch = new_fake_channel();
+  circuitmux_set_policy(cmux, &drr_policy);
+  tt_int_op(cell_drr_get_quantum(), OP_EQ, 4);
+
+  circs[0] = new_fake_queued_circuit(ch, CELL_DIRECTION_OUT, 10, 10);
+  circs[1] = new_fake_queued_circuit(ch, CELL_DIRECTION_OUT, 20, 6);
+  for (i = 0; i < 2; ++i)
+    circuitmux_attach_circuit(cmux, TO_CIRCUIT(circs[i]),
+                              CELL_DIRECTION_OUT);
+  tt_int_op(circuitmux_num_active_circuits(cmux), OP_EQ, 2);
+
+  order = drain_cmux(cmux, circs, 2);
+  /* 4 cells each per round; b's last round is short, so then a gets the
+   * rest of its quantum to itself. */
+  tt_str_op(order, OP_EQ, "aaaabbbbaaaabbaa");
+  tt_int_op(circuitmux_num_active_circuits(cmux), OP_EQ, 0);
+
+ done:
+  tor_free(order);
+  for (i = 0; i < 2; ++i) {
+    if (circs[i])
+      circuitmux_detach_circuit(cmux, TO_CIRCUIT(circs[i]));
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux);
+  channel_free(ch);
+}
+
+/** Test that WDRR gives exitward circuits a bigger quantum than clientward
+ * ones. */
+static void
+test_cmux_wdrr_weights(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  channel_t *ch = NULL;
+  or_circuit_t *circs[2] = { NULL, NULL };
+  char *order = NULL;
+  int i;
+
+  tor_libevent_cfg cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+
+  tor_libevent_initialize(&cfg);
+  scheduler_init();
+
+  (void) arg;
+
+  cmux = circuitmux_alloc();
+  ch = new_fake_channel();
+  circuitmux_set_policy(cmux, &wdrr_policy);
+
+  circs[0] = new_fake_queued_circuit(ch, CELL_DIRECTION_IN, 10, 12);
+  circs[1] = new_fake_queued_circuit(ch, CELL_DIRECTION_OUT, 20, 12);
+  circuitmux_attach_circuit(cmux, TO_CIRCUIT(circs[0]), CELL_DIRECTION_IN);
+  circuitmux_attach_circuit(cmux, TO_CIRCUIT(circs[1]), CELL_DIRECTION_OUT);
+  tt_int_op(circuitmux_num_active_circuits(cmux), OP_EQ, 2);
+
+  order = drain_cmux(cmux, circs, 2);
+  /* Quantum 4 with weights 1 in / 2 out. */
+  tt_str_op(order, OP_EQ, "aaaabbbbbbbbaaaabbbbaaaa");
+
+ done:
+  tor_free(order);
+  for (i = 0; i < 2; ++i) {
+    if (circs[i])
+      circuitmux_detach_circuit(cmux, TO_CIRCUIT(circs[i]));
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux);
+  channel_free(ch);
+}
+
+/** Test that CircuitMuxPolicy EWMA picks EWMA only when the halflife is
+ * positive, and round-robin otherwise, as auto does. */
+static void
+test_cmux_policy_ewma(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  (void) arg;
+
+  options->CircuitPriorityHalflife = 0;
+  options->CircuitMuxPolicy_parsed = CMUX_POLICY_AUTO;
+  channel_update_cmux_policy(options, NULL);
+  tt_assert(!cell_ewma_enabled());
+  tt_ptr_op(channel_get_default_cmux_policy(), OP_EQ, NULL);
+
+  options->CircuitMuxPolicy_parsed = CMUX_POLICY_EWMA;
+  channel_update_cmux_policy(options, NULL);
+  tt_assert(!cell_ewma_enabled());
+  tt_ptr_op(channel_get_default_cmux_policy(), OP_EQ, NULL);
+
+  options->CircuitPriorityHalflife = 30;
+  channel_update_cmux_policy(options, NULL);
+  tt_assert(cell_ewma_enabled());
+  tt_ptr_op(channel_get_default_cmux_policy(), OP_EQ, &ewma_policy);
+
+  options->CircuitMuxPolicy_parsed = CMUX_POLICY_DRR;
+  channel_update_cmux_policy(options, NULL);
+  tt_ptr_op(channel_get_default_cmux_policy(), OP_EQ, &drr_policy);
+
+ done:
+  ;
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "drr_quantum", test_cmux_drr_quantum, TT_FORK, NULL, NULL },
+  { "wdrr_weights", test_cmux_wdrr_weights, TT_FORK, NULL, NULL },
+  { "policy_ewma", test_cmux_policy_ewma, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -180,6 +180,65 @@ test_config_addressmap(void *arg)
   addressmap_free_all();
 }
 
+/** Test that addressmap_clean() expires exactly the mappings that are due,
+ * and that wildcard mappings still match however the address is cased. */
+static void
+test_config_addressmap_expiry(void *arg)
+{
+  char address[256];
+  const time_t now = time(NULL);
+  (void)arg;
+
+  addressmap_init();
+
+  addressmap_register("a.example.com", tor_strdup("1.1.1.1"), now + 10,
+                      ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("b.example.com", tor_strdup("2.2.2.2"), now + 100,
+                      ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("c.example.com", tor_strdup("3.3.3.3"), 0,
+                      ADDRMAPSRC_TORRC, 0, 0);
+  addressmap_register("d.example.com", tor_strdup("d.example.com.foo.exit"),
+                      now + 10, ADDRMAPSRC_TRACKEXIT, 0, 0);
+  /* Using a TrackHostExits mapping pushes back its expiry. */
+  tt_assert(addressmap_have_mapping("d.example.com", 1000));
+
+  addressmap_clean(now + 50);
+  tt_assert(!addressmap_have_mapping("a.example.com", 0));
+  tt_assert(addressmap_have_mapping("b.example.com", 0));
+  tt_assert(addressmap_have_mapping("c.example.com", 0));
+  tt_assert(addressmap_have_mapping("d.example.com", 0));
+
+  /* A mapping that expires right now is kept until the next second. */
+  addressmap_clean(now + 100);
+  tt_assert(addressmap_have_mapping("b.example.com", 0));
+
+  addressmap_clean(now + 500);
+  tt_assert(!addressmap_have_mapping("b.example.com", 0));
+  tt_assert(addressmap_have_mapping("c.example.com", 0));
+  tt_assert(addressmap_have_mapping("d.example.com", 0));
+
+  /* Removing and re-adding a mapping leaves nothing stale behind. */
+  addressmap_register("b.example.com", tor_strdup("2.2.2.2"), now + 100,
+                      ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("b.example.com", NULL, 0, ADDRMAPSRC_NONE, 0, 0);
+  addressmap_clean(now + 5000);
+  tt_assert(!addressmap_have_mapping("d.example.com", 0));
+  tt_assert(addressmap_have_mapping("c.example.com", 0));
+
+  addressmap_register("example.org", tor_strdup("example.net"), 0,
+                      ADDRMAPSRC_TORRC, 1, 1);
+  strlcpy(address, "WWW.Example.ORG", sizeof(address));
+  tt_assert(addressmap_rewrite(address, sizeof(address), ~0, NULL, NULL));
+  tt_str_op(address, OP_EQ, "WWW.example.net");
+
+  addressmap_register("example.org", NULL, 0, ADDRMAPSRC_NONE, 1, 1);
+  strlcpy(address, "www.example.org", sizeof(address));
+  tt_assert(!addressmap_rewrite(address, sizeof(address), ~0, NULL, NULL));
+
+ done:
+  addressmap_free_all();
+}
+
 static int
 is_private_dir(const char* path)
 {
@@ -3216,6 +3275,7 @@ struct testcase_t config_tests[] = {
   CONFIG_TEST(adding_dir_servers, TT_FORK),
   CONFIG_TEST(resolve_my_address, TT_FORK),
   CONFIG_TEST(addressmap, 0),
+  CONFIG_TEST(addressmap_expiry, TT_FORK),
   CONFIG_TEST(parse_bridge_line, 0),
   CONFIG_TEST(parse_transport_options_line, 0),
   CONFIG_TEST(parse_transport_plugin_line, TT_FORK),
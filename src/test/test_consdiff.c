@@ -69,37 +69,87 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
   smartlist_free(sl);
 }
 
+/** Helper: return the length of the longest common subsequence of
+ * <b>sl1</b> and <b>sl2</b>, the slow and obvious way. */
+static int
+lcs_length_slow(smartlist_t *sl1, smartlist_t *sl2)
+{
+  int len1 = smartlist_len(sl1), len2 = smartlist_len(sl2);
+  int *lens = tor_calloc((len1+1) * (len2+1), sizeof(int));
+  int result;
+  for (int i = 1; i <= len1; ++i) {
+    for (int j = 1; j <= len2; ++j) {
+      if (!strcmp(smartlist_get(sl1, i-1), smartlist_get(sl2, j-1)))
+        lens[i*(len2+1) + j] = lens[(i-1)*(len2+1) + j-1] + 1;
+      else
+        lens[i*(len2+1) + j] = MAX(lens[(i-1)*(len2+1) + j],
+                                   lens[i*(len2+1) + j-1]);
+    }
+  }
+  result = lens[len1*(len2+1) + len2];
+  tor_free(lens);
+  return result;
+}
+
 static void
-test_consdiff_lcs_lengths(void *arg)
+test_consdiff_myers_diff(void *arg)
 {
   smartlist_t *sl1 = smartlist_new();
   smartlist_t *sl2 = smartlist_new();
-  smartlist_slice_t *sls1, *sls2;
-  int *lengths1, *lengths2;
-
-  /* Expected lcs lengths in regular and reverse order. */
-  int e_lengths1[] = { 0, 1, 2, 3, 3, 4 };
-  int e_lengths2[] = { 0, 1, 1, 2, 3, 4 };
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = NULL, *changed2 = NULL;
 
   (void)arg;
-  smartlist_split_string(sl1, "a:b:c:d:e", ":", 0, 0);
-  smartlist_split_string(sl2, "a:c:d:i:e", ":", 0, 0);
-
-  sls1 = smartlist_slice(sl1, 0, -1);
-  sls2 = smartlist_slice(sl2, 0, -1);
-
-  lengths1 = lcs_lengths(sls1, sls2, 1);
-  lengths2 = lcs_lengths(sls1, sls2, -1);
-  tt_mem_op(e_lengths1, OP_EQ, lengths1, sizeof(int) * 6);
-  tt_mem_op(e_lengths2, OP_EQ, lengths2, sizeof(int) * 6);
+  for (int iter = 0; iter < 200; ++iter) {
+    int len1 = crypto_rand_int(40), len2 = crypto_rand_int(40);
+    int n_kept1 = 0, n_kept2 = 0, i1 = 0, i2 = 0;
+    for (int i = 0; i < len1; ++i)
+      smartlist_add_asprintf(sl1, "%c", 'a' + crypto_rand_int(4));
+    for (int i = 0; i < len2; ++i)
+      smartlist_add_asprintf(sl2, "%c", 'a' + crypto_rand_int(4));
+    changed1 = bitarray_init_zero(MAX(len1, 1));
+    changed2 = bitarray_init_zero(MAX(len2, 1));
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+
+    calc_changes(sls1, sls2, changed1, changed2);
+
+    /* The unchanged lines of both lists must be the same sequence... */
+    while (1) {
+      while (i1 < len1 && bitarray_is_set(changed1, i1))
+        ++i1;
+      while (i2 < len2 && bitarray_is_set(changed2, i2))
+        ++i2;
+      if (i1 == len1 || i2 == len2)
+        break;
+      tt_str_op(smartlist_get(sl1, i1), OP_EQ, smartlist_get(sl2, i2));
+      ++n_kept1, ++n_kept2, ++i1, ++i2;
+    }
+    for (; i1 < len1; ++i1)
+      tt_assert(bitarray_is_set(changed1, i1));
+    for (; i2 < len2; ++i2)
+      tt_assert(bitarray_is_set(changed2, i2));
+    /* ... and as long as possible, so that the diff is minimal. */
+    tt_int_op(n_kept1, OP_EQ, lcs_length_slow(sl1, sl2));
+
+    bitarray_free(changed1);
+    bitarray_free(changed2);
+    changed1 = changed2 = NULL;
+    tor_free(sls1);
+    tor_free(sls2);
+    SMARTLIST_FOREACH(sl1, char*, line, tor_free(line));
+    SMARTLIST_FOREACH(sl2, char*, line, tor_free(line));
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+  }
 
  done:
-  tor_free(lengths1);
-  tor_free(lengths2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
   tor_free(sls1);
   tor_free(sls2);
-  if (sl1) SMARTLIST_FOREACH(sl1, char*, line, tor_free(line));
-  if (sl2) SMARTLIST_FOREACH(sl2, char*, line, tor_free(line));
+  SMARTLIST_FOREACH(sl1, char*, line, tor_free(line));
+  SMARTLIST_FOREACH(sl2, char*, line, tor_free(line));
   smartlist_free(sl1);
   smartlist_free(sl2);
 }
@@ -943,13 +993,82 @@ test_consdiff_apply_diff(void *arg)
   smartlist_free(diff);
 }
 
+/** Helper: add to <b>diff</b> the header of a consensus diff from the
+ * consensus <b>cons1</b> to <b>cons2</b>. */
+static void
+add_diff_header(smartlist_t *diff, const char *cons1, const char *cons2)
+{
+  digests_t digests1, digests2;
+  char hex1[HEX_DIGEST256_LEN+1], hex2[HEX_DIGEST256_LEN+1];
+  tor_assert(!router_get_networkstatus_v3_hashes(cons1, &digests1));
+  tor_assert(!router_get_networkstatus_v3_hashes(cons2, &digests2));
+  base16_encode(hex1, sizeof(hex1), digests1.d[DIGEST_SHA256],
+                DIGEST256_LEN);
+  base16_encode(hex2, sizeof(hex2), digests2.d[DIGEST_SHA256],
+                DIGEST256_LEN);
+  smartlist_add(diff, tor_strdup(ns_diff_version));
+  smartlist_add_asprintf(diff, "%s %s %s", hash_token, hex1, hex2);
+}
+
+static void
+test_consdiff_apply_diff_from_str(void *arg)
+{
+  smartlist_t *diff = smartlist_new();
+  char *buf = NULL, *cons2 = NULL;
+  digests_t digests1;
+  /* Blank lines and CRs, as tor_split_lines would skip. */
+  const char *cons1_str =
+    "network-status-version 3\r\n"
+    "r name ccccccccccccccccc etc\nfoo\n\n"
+    "r name eeeeeeeeeeeeeeeee etc\nbar\n"
+    "directory-signature foo bar\nsig";
+  const char *expected =
+    "network-status-version 3\n"
+    "r name ccccccccccccccccc etc\nsample\n"
+    "r name eeeeeeeeeeeeeeeee etc\nbar\nbaz\n"
+    "directory-signature foo bar\nsig\n";
+  (void)arg;
+
+  tt_int_op(0, OP_EQ,
+      router_get_networkstatus_v3_hashes(cons1_str, &digests1));
+  add_diff_header(diff, cons1_str, expected);
+  smartlist_add(diff, tor_strdup("5a"));
+  smartlist_add(diff, tor_strdup("baz"));
+  smartlist_add(diff, tor_strdup("."));
+  smartlist_add(diff, tor_strdup("3c"));
+  smartlist_add(diff, tor_strdup("sample"));
+  smartlist_add(diff, tor_strdup("."));
+
+  /* The base consensus needn't be NUL-terminated. */
+  buf = tor_malloc(strlen(cons1_str));
+  memcpy(buf, cons1_str, strlen(cons1_str));
+  cons2 = consdiff_apply_diff_from_str(buf, strlen(cons1_str), diff,
+                                       &digests1);
+  tt_str_op(cons2, OP_EQ, expected);
+  tor_free(cons2);
+
+  /* A diff that leads somewhere else gets refused, though the result
+   * starts and ends as a consensus should. */
+  tor_free(smartlist_get(diff, 3));
+  smartlist_set(diff, 3, tor_strdup("bazz"));
+  cons2 = consdiff_apply_diff_from_str(buf, strlen(cons1_str), diff,
+                                       &digests1);
+  tt_ptr_op(cons2, OP_EQ, NULL);
+
+ done:
+  tor_free(buf);
+  tor_free(cons2);
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_free(diff);
+}
+
 #define CONSDIFF_LEGACY(name)                                          \
   { #name, test_consdiff_ ## name , 0, NULL, NULL }
 
 struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(smartlist_slice),
   CONSDIFF_LEGACY(smartlist_slice_string_pos),
-  CONSDIFF_LEGACY(lcs_lengths),
+  CONSDIFF_LEGACY(myers_diff),
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
@@ -961,6 +1080,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
+  CONSDIFF_LEGACY(apply_diff_from_str),
   END_OF_TESTCASES
 };
 
@@ -10,10 +10,13 @@
 #define DIRVOTE_PRIVATE
 #define ROUTER_PRIVATE
 #define ROUTERLIST_PRIVATE
+#define ROUTERPARSE_PRIVATE
 #define HIBERNATE_PRIVATE
 #define NETWORKSTATUS_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "consdiff.h"
+#include "cpuworker.h"
 #include "crypto_ed25519.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -26,6 +29,7 @@
 #include "routerparse.h"
 #include "test.h"
 #include "torcert.h"
+#include "workqueue.h"
 
 static void
 test_dir_nicknames(void *arg)
@@ -488,6 +492,157 @@ routerinfo_free_wrapper_(void *arg)
   routerinfo_free(arg);
 }
 
+/** Helper: free a signed_descriptor_t that isn't in the routerlist. */
+static void
+cache_info_free(signed_descriptor_t *sd)
+{
+  if (sd)
+    tor_free(sd->signed_descriptor_body);
+  tor_free(sd);
+}
+
+/** Test that we can read the cache information of a descriptor from our
+ * cache without parsing it, and that it matches what a full parse finds. */
+static void
+test_dir_routerinfo_cache_info(void *arg)
+{
+  routerinfo_t *ri = NULL;
+  signed_descriptor_t *sd = NULL;
+  char *annotated = NULL;
+  const char *annotations = "@downloaded-at 2014-10-05 12:00:00\n"
+    "@source \"127.0.0.1\"\n";
+  (void) arg;
+
+  ri = router_parse_entry_from_string(EX_RI_MAXIMAL, NULL, 0, 0, NULL, NULL);
+  tt_assert(ri);
+  sd = router_parse_cache_info_from_string(EX_RI_MAXIMAL,
+                                        EX_RI_MAXIMAL+strlen(EX_RI_MAXIMAL),
+                                        1);
+  tt_assert(sd);
+  tt_mem_op(sd->signed_descriptor_digest, OP_EQ,
+            ri->cache_info.signed_descriptor_digest, DIGEST_LEN);
+  tt_mem_op(sd->identity_digest, OP_EQ, ri->cache_info.identity_digest,
+            DIGEST_LEN);
+  tt_mem_op(sd->extra_info_digest, OP_EQ, ri->cache_info.extra_info_digest,
+            DIGEST_LEN);
+  tt_assert(!tor_digest_is_zero(sd->extra_info_digest));
+  tt_int_op(sd->published_on, OP_EQ, ri->cache_info.published_on);
+  tt_int_op(sd->signed_descriptor_len, OP_EQ,
+            ri->cache_info.signed_descriptor_len);
+  tt_int_op(sd->annotations_len, OP_EQ, 0);
+  tt_int_op(sd->send_unencrypted, OP_EQ, 1);
+  tt_int_op(sd->routerlist_index, OP_EQ, -1);
+  tt_str_op(sd->signed_descriptor_body, OP_EQ, EX_RI_MAXIMAL);
+  cache_info_free(sd);
+
+  /* Annotations are fine, unless they make it something other than a
+   * general-purpose router. */
+  tor_asprintf(&annotated, "%s%s", annotations, EX_RI_MAXIMAL);
+  sd = router_parse_cache_info_from_string(annotated,
+                                           annotated+strlen(annotated), 0);
+  tt_assert(sd);
+  tt_int_op(sd->annotations_len, OP_EQ, strlen(annotations));
+  tt_ptr_op(sd->signed_descriptor_body, OP_EQ, NULL);
+  tt_mem_op(sd->signed_descriptor_digest, OP_EQ,
+            ri->cache_info.signed_descriptor_digest, DIGEST_LEN);
+  cache_info_free(sd);
+  tor_free(annotated);
+  tor_asprintf(&annotated, "@purpose bridge\n%s", EX_RI_MAXIMAL);
+  sd = router_parse_cache_info_from_string(annotated,
+                                           annotated+strlen(annotated), 0);
+  tt_ptr_op(sd, OP_EQ, NULL);
+
+  /* Without a fingerprint line we'd need the identity key. */
+  sd = router_parse_cache_info_from_string(EX_RI_MINIMAL,
+                                        EX_RI_MINIMAL+strlen(EX_RI_MINIMAL),
+                                        0);
+  tt_ptr_op(sd, OP_EQ, NULL);
+
+ done:
+  routerinfo_free(ri);
+  cache_info_free(sd);
+  tor_free(annotated);
+}
+
+/** Helper: return a descriptor, signed by nobody, whose identity-ed25519
+ * and ntor-onion-key-crosscert certificates (if <b>with_crosscert</b>) were
+ * made for <b>lifetime</b> seconds at <b>id_made</b> and <b>cc_made</b>. */
+static char *
+make_cache_info_test_desc(const ed25519_keypair_t *kp, time_t id_made,
+                          time_t cc_made, int with_crosscert)
+{
+  tor_cert_t *id_cert, *cc_cert;
+  char id_b64[256], cc_b64[256];
+  char *desc = NULL;
+
+  id_cert = tor_cert_create(kp, CERT_TYPE_ID_SIGNING, &kp->pubkey,
+                            id_made, 86400, CERT_FLAG_INCLUDE_SIGNING_KEY);
+  cc_cert = tor_cert_create(kp, CERT_TYPE_ONION_ID, &kp->pubkey,
+                            cc_made, 86400, 0);
+  tor_assert(id_cert && cc_cert);
+  base64_encode(id_b64, sizeof(id_b64), (const char*)id_cert->encoded,
+                id_cert->encoded_len, BASE64_ENCODE_MULTILINE);
+  base64_encode(cc_b64, sizeof(cc_b64), (const char*)cc_cert->encoded,
+                cc_cert->encoded_len, BASE64_ENCODE_MULTILINE);
+  tor_asprintf(&desc,
+    "router fake 10.0.0.1 9001 0 0\n"
+    "identity-ed25519\n"
+    "-----BEGIN ED25519 CERT-----\n%s-----END ED25519 CERT-----\n"
+    "published 2015-06-01 00:00:00\n"
+    "fingerprint B7E2 7F10 4213 C36F 13E7 E982 9182 845E 4959 97A0\n"
+    "%s%s%s"
+    "router-signature\n"
+    "-----BEGIN SIGNATURE-----\nAAAA\n-----END SIGNATURE-----\n",
+    id_b64,
+    with_crosscert ? "ntor-onion-key-crosscert 0\n"
+                     "-----BEGIN ED25519 CERT-----\n" : "",
+    with_crosscert ? cc_b64 : "",
+    with_crosscert ? "-----END ED25519 CERT-----\n" : "");
+  tor_cert_free(id_cert);
+  tor_cert_free(cc_cert);
+  return desc;
+}
+
+/** Test that we leave descriptors with expired ed25519 certificates to the
+ * full parse, which rejects them. */
+static void
+test_dir_routerinfo_cache_info_expired(void *arg)
+{
+  ed25519_keypair_t kp;
+  signed_descriptor_t *sd = NULL;
+  char *desc = NULL;
+  const time_t now = approx_time();
+  (void) arg;
+
+  tt_int_op(ed25519_keypair_generate(&kp, 0), OP_EQ, 0);
+
+  desc = make_cache_info_test_desc(&kp, now, now, 1);
+  sd = router_parse_cache_info_from_string(desc, desc+strlen(desc), 0);
+  tt_assert(sd);
+  cache_info_free(sd);
+  sd = NULL;
+  tor_free(desc);
+
+  desc = make_cache_info_test_desc(&kp, now - 2*86400, now, 1);
+  sd = router_parse_cache_info_from_string(desc, desc+strlen(desc), 0);
+  tt_ptr_op(sd, OP_EQ, NULL);
+  tor_free(desc);
+
+  desc = make_cache_info_test_desc(&kp, now, now - 2*86400, 1);
+  sd = router_parse_cache_info_from_string(desc, desc+strlen(desc), 0);
+  tt_ptr_op(sd, OP_EQ, NULL);
+  tor_free(desc);
+
+  /* An identity certificate needs a crosscert to go with it. */
+  desc = make_cache_info_test_desc(&kp, now, now, 0);
+  sd = router_parse_cache_info_from_string(desc, desc+strlen(desc), 0);
+  tt_ptr_op(sd, OP_EQ, NULL);
+
+ done:
+  cache_info_free(sd);
+  tor_free(desc);
+}
+
 static void
 test_dir_extrainfo_parsing(void *arg)
 {
@@ -918,6 +1073,125 @@ test_dir_load_extrainfo(void *arg)
   tor_free(list);
 }
 
+/* What the last call to mock_cpuworker_queue_work() asked for. */
+static int (*queued_fn)(void *, void *) = NULL;
+static void (*queued_reply_fn)(void *) = NULL;
+static void *queued_arg = NULL;
+static int n_queued = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(int (*fn)(void *, void *),
+                          void (*reply_fn)(void *), void *arg)
+{
+  queued_fn = fn;
+  queued_reply_fn = reply_fn;
+  queued_arg = arg;
+  ++n_queued;
+  return (workqueue_entry_t *) &queued_arg; /* anything but NULL */
+}
+
+/** Test that we rebuild the descriptor store on a worker thread, and that
+ * descriptors which arrive in the meantime end up in the new journal. */
+static void
+test_dir_rebuild_store_in_background(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  routerlist_t *rl = NULL;
+  routerinfo_t *ri = NULL, *ri2 = NULL;
+  signed_descriptor_t *sd = NULL;
+  const char *msg = NULL;
+  char *fname = NULL, *contents = NULL;
+  const size_t max_len = strlen(EX_RI_MAXIMAL);
+  const size_t min_len = strlen(EX_RI_MINIMAL);
+  struct stat st;
+  (void) arg;
+
+  MOCK(cpuworker_queue_background_work, mock_cpuworker_queue_work);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("bg-store-datadir"));
+  tt_int_op(check_private_dir(options->DataDirectory, CPD_CREATE, NULL),
+            OP_EQ, 0);
+  update_approx_time(1412510400);
+
+  ri = router_parse_entry_from_string(EX_RI_MAXIMAL, NULL, 1, 0, NULL, NULL);
+  tt_assert(ri);
+  tt_int_op(router_add_to_routerlist(ri, &msg, 0, 0), OP_EQ,
+            ROUTER_ADDED_SUCCESSFULLY);
+  rl = router_get_routerlist();
+  tt_int_op(ri->cache_info.saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  /* Pretend the journal is long enough to need a rebuild. */
+  rl->desc_store.journal_len = (1<<15) + 1;
+  tt_int_op(router_rebuild_store(RRS_DONT_REMOVE_OLD, &rl->desc_store),
+            OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 1);
+  /* Only one at a time. */
+  tt_int_op(router_rebuild_store(RRS_DONT_REMOVE_OLD, &rl->desc_store),
+            OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 1);
+  tt_int_op(ri->cache_info.saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  rl->desc_store.journal_len = max_len;
+
+  /* Another descriptor arrives while the worker is busy. */
+  ri2 = router_parse_entry_from_string(EX_RI_MINIMAL, NULL, 1, 0, NULL, NULL);
+  tt_assert(ri2);
+  sd = &ri2->cache_info;
+  tt_int_op(router_add_to_routerlist(ri2, &msg, 0, 0), OP_EQ,
+            ROUTER_ADDED_SUCCESSFULLY);
+  tt_int_op(smartlist_len(rl->routers), OP_EQ, 2);
+
+  tt_int_op(queued_fn(NULL, queued_arg), OP_EQ, WQ_RPL_REPLY);
+  queued_reply_fn(queued_arg);
+
+  /* The first descriptor is in the new store... */
+  tt_int_op(ri->cache_info.saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(ri->cache_info.saved_offset, OP_EQ, 0);
+  tt_int_op(rl->desc_store.store_len, OP_EQ, max_len);
+  tt_mem_op(signed_descriptor_get_body(&ri->cache_info), OP_EQ,
+            EX_RI_MAXIMAL, max_len);
+  fname = get_datadir_fname("cached-descriptors");
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_str_op(contents, OP_EQ, EX_RI_MAXIMAL);
+  tor_free(contents);
+  tor_free(fname);
+  /* ...and the second one is all that's left in the journal. */
+  tt_int_op(sd->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(sd->saved_offset, OP_EQ, 0);
+  tt_int_op(rl->desc_store.journal_len, OP_EQ, min_len);
+  fname = get_datadir_fname_suffix("cached-descriptors", ".new");
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_str_op(contents, OP_EQ, EX_RI_MINIMAL);
+  tor_free(contents);
+  tor_free(fname);
+
+  /* If we have to rebuild the store ourselves in the meantime, we throw
+   * away what the worker wrote. */
+  rl->desc_store.journal_len = (1<<15) + 1;
+  tt_int_op(router_rebuild_store(RRS_DONT_REMOVE_OLD, &rl->desc_store),
+            OP_EQ, 0);
+  tt_int_op(n_queued, OP_EQ, 2);
+  tt_int_op(router_rebuild_store(RRS_FORCE|RRS_DONT_REMOVE_OLD,
+                                 &rl->desc_store), OP_EQ, 0);
+  tt_int_op(sd->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(rl->desc_store.store_len, OP_EQ, max_len + min_len);
+  tt_int_op(rl->desc_store.journal_len, OP_EQ, 0);
+  tt_int_op(queued_fn(NULL, queued_arg), OP_EQ, WQ_RPL_REPLY);
+  queued_reply_fn(queued_arg);
+  tt_int_op(rl->desc_store.store_len, OP_EQ, max_len + min_len);
+  fname = get_datadir_fname_suffix("cached-descriptors", ".bgtmp");
+  tt_int_op(stat(fname, &st), OP_LT, 0);
+  tor_free(fname);
+  fname = get_datadir_fname("cached-descriptors");
+  tt_int_op(stat(fname, &st), OP_EQ, 0);
+  tt_int_op(st.st_size, OP_EQ, max_len + min_len);
+
+ done:
+  UNMOCK(cpuworker_queue_background_work);
+  routerlist_free_all();
+  tor_free(fname);
+  tor_free(contents);
+}
+
 static void
 test_dir_versions(void *arg)
 {
@@ -2374,6 +2648,148 @@ test_dir_v3_networkstatus(void *arg)
                        test_routerstatus_for_v3ns);
 }
 
+/** Work that mock_cpuworker_run_work() has done, whose replies are
+ * pending. */
+static smartlist_t *replies_pending = NULL;
+static void (*pending_reply_fn)(void *) = NULL;
+
+static workqueue_entry_t *
+mock_cpuworker_run_work(int (*fn)(void *, void *),
+                        void (*reply_fn)(void *), void *arg)
+{
+  tor_assert(fn(NULL, arg) == WQ_RPL_REPLY);
+  pending_reply_fn = reply_fn;
+  smartlist_add(replies_pending, arg);
+  return (workqueue_entry_t *) replies_pending; /* anything but NULL */
+}
+
+/** Run the v3 networkstatus tests again, computing the consensus entries
+ * in batches on worker threads. */
+static void
+test_dir_v3_networkstatus_in_batches(void *arg)
+{
+  (void)arg;
+  get_options_mutable()->NumCPUs = 3;
+  min_routers_per_consensus_batch = 1;
+
+  test_a_networkstatus(gen_routerstatus_for_v3ns,
+                       vote_tweaks_for_v3ns,
+                       test_vrs_for_v3ns,
+                       test_consensus_for_v3ns,
+                       test_routerstatus_for_v3ns);
+  tt_assert(consensus_batch_pool);
+
+  /* The threads exit on shutdown. */
+  dirvote_free_all();
+  tt_ptr_op(consensus_batch_pool, OP_EQ, NULL);
+
+ done:
+  ;
+}
+
+/* What the last call to mock_directory_vote_added() was told. */
+static uint64_t vote_added_conn_id = 0;
+static int vote_added_added = -1;
+static const char *vote_added_msg = NULL;
+static int vote_added_status = 0;
+static int n_vote_added = 0;
+
+static void
+mock_directory_vote_added(uint64_t conn_id, int added, const char *msg,
+                          int status)
+{
+  vote_added_conn_id = conn_id;
+  vote_added_added = added;
+  vote_added_msg = msg;
+  vote_added_status = status;
+  ++n_vote_added;
+}
+
+/** Test that we parse and check the signatures on posted votes in a worker
+ * thread, and answer once that's done; and that past
+ * max_vote_parse_jobs, we parse them right away. */
+static void
+test_dir_add_vote_in_background(void *arg)
+{
+  authority_cert_t *cert = NULL;
+  crypto_pk_t *sign_skey = NULL;
+  networkstatus_t *vote = NULL;
+  networkstatus_voter_info_t *voter;
+  char *vote_text = NULL;
+  time_t now = time(NULL);
+  (void) arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(directory_vote_added, mock_directory_vote_added);
+
+  cert = authority_cert_parse_from_string(AUTHORITY_CERT_1, NULL);
+  tt_assert(cert);
+  sign_skey = crypto_pk_new();
+  tt_assert(!crypto_pk_read_private_key_from_string(sign_skey,
+                                                   AUTHORITY_SIGNKEY_1, -1));
+
+  vote = tor_malloc_zero(sizeof(networkstatus_t));
+  vote->type = NS_TYPE_VOTE;
+  vote->published = now;
+  vote->valid_after = now+1000;
+  vote->fresh_until = now+2000;
+  vote->valid_until = now+3000;
+  vote->vote_seconds = 100;
+  vote->dist_seconds = 200;
+  vote->supported_methods = smartlist_new();
+  smartlist_split_string(vote->supported_methods, "1 2 3", NULL, 0, -1);
+  vote->known_flags = smartlist_new();
+  smartlist_split_string(vote->known_flags, "Fast Running Valid",
+                         0, SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  vote->voters = smartlist_new();
+  voter = tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  voter->nickname = tor_strdup("Voter1");
+  voter->address = tor_strdup("1.2.3.4");
+  voter->addr = 0x01020304;
+  voter->dir_port = 80;
+  voter->or_port = 9000;
+  voter->contact = tor_strdup("voter@example.com");
+  crypto_pk_get_digest(cert->identity_key, voter->identity_digest);
+  smartlist_add(vote->voters, voter);
+  vote->cert = authority_cert_dup(cert);
+  vote->routerstatus_list = smartlist_new();
+  vote_text = format_networkstatus_vote(sign_skey, vote);
+  tt_assert(vote_text);
+
+  /* The vote waits for a worker; nobody hears about it yet. */
+  dirvote_add_vote_in_background(vote_text, 7);
+  tt_int_op(n_queued, OP_EQ, 1);
+  tt_int_op(n_vote_added, OP_EQ, 0);
+
+  /* The worker parses it and checks its signatures; back in the main
+   * thread, we find that we don't know the authority that sent it. */
+  tt_int_op(queued_fn(NULL, queued_arg), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(n_vote_added, OP_EQ, 0);
+  queued_reply_fn(queued_arg);
+  tt_int_op(n_vote_added, OP_EQ, 1);
+  tt_assert(vote_added_conn_id == 7);
+  tt_int_op(vote_added_added, OP_EQ, 0);
+  tt_str_op(vote_added_msg, OP_EQ, "Vote not from a recognized v3 authority");
+  tt_int_op(vote_added_status, OP_EQ, 400);
+
+  /* With no room for more jobs, we parse the vote right away. */
+  max_vote_parse_jobs = 0;
+  dirvote_add_vote_in_background("network-status-version 3\nbogus\n", 0);
+  tt_int_op(n_queued, OP_EQ, 1);
+  tt_int_op(n_vote_added, OP_EQ, 2);
+  tt_assert(vote_added_conn_id == 0);
+  tt_str_op(vote_added_msg, OP_EQ, "Unable to parse vote");
+  tt_int_op(vote_added_status, OP_EQ, 400);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(directory_vote_added);
+  tor_free(vote_text);
+  networkstatus_vote_free(vote);
+  authority_cert_free(cert);
+  crypto_pk_free(sign_skey);
+}
+
 static void
 test_dir_scale_bw(void *testdata)
 {
@@ -3218,6 +3634,345 @@ test_dir_packages(void *arg)
   tor_free(res);
 }
 
+/** Helper: return a small consensus in which the router "b" has bandwidth
+ * <b>bw</b>. */
+static char *
+make_consdiff_test_consensus(int bw)
+{
+  char *s = NULL;
+  tor_asprintf(&s,
+    "network-status-version 3\n"
+    "vote-status consensus\n"
+    "r a AAAAAAAAAAAAAAAAAAAAAAAAAAA BBBBBBBBBBBBBBBBBBBBBBBBBBB "
+    "2015-06-01 00:00:00 10.0.0.1 9001 0\n"
+    "w Bandwidth=10\n"
+    "r b BAAAAAAAAAAAAAAAAAAAAAAAAAA BBBBBBBBBBBBBBBBBBBBBBBBBBB "
+    "2015-06-01 00:00:00 10.0.0.2 9001 0\n"
+    "w Bandwidth=%d\n"
+    "directory-footer\n"
+    "directory-signature AAAA BBBB\n", bw);
+  return s;
+}
+
+/** Helper: check that we're serving a consensus diff that turns
+ * <b>base</b>, valid after <b>valid_after</b>, into <b>target</b>, and that
+ * the same diff is on disk. */
+static void
+check_served_consdiff(const char *base, time_t valid_after,
+                      const char *target)
+{
+  digests_t base_digests;
+  char hex_digest[HEX_DIGEST256_LEN+1];
+  char *base_dup = tor_strdup(base), *diff = NULL, *result = NULL;
+  char *on_disk = NULL, *fname = NULL, *path = NULL;
+  size_t diff_len;
+  smartlist_t *base_sl = smartlist_new(), *diff_sl = smartlist_new();
+  cached_dir_t *d;
+  struct stat st;
+
+  tt_int_op(router_get_networkstatus_v3_hashes(base, &base_digests), OP_EQ,
+            0);
+  base16_encode(hex_digest, sizeof(hex_digest),
+                base_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  d = dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest);
+  tt_assert(d);
+
+  tor_asprintf(&fname, "%ld-%s", (long) valid_after, hex_digest);
+  path = get_datadir_fname2("old-cached-consensus-diffs-ns", fname);
+  on_disk = read_file_to_str(path, RFTS_BIN, &st);
+  tt_assert(on_disk);
+  tt_int_op(st.st_size, OP_EQ, d->dir_z_len);
+  tt_mem_op(on_disk, OP_EQ, d->dir_z, d->dir_z_len);
+
+  tt_int_op(tor_gzip_uncompress(&diff, &diff_len, d->dir_z, d->dir_z_len,
+                                ZLIB_METHOD, 1, LOG_WARN), OP_EQ, 0);
+  tor_split_lines(base_sl, base_dup, (int)strlen(base_dup));
+  tor_split_lines(diff_sl, diff, (int)diff_len);
+  result = consdiff_apply_diff(base_sl, diff_sl, &base_digests);
+  tt_str_op(result, OP_EQ, target);
+
+ done:
+  smartlist_free(base_sl);
+  smartlist_free(diff_sl);
+  tor_free(base_dup);
+  tor_free(diff);
+  tor_free(result);
+  tor_free(on_disk);
+  tor_free(fname);
+  tor_free(path);
+}
+
+/** Test that when a new consensus arrives, we regenerate the diffs to it
+ * from every stored consensus, write them to disk, and serve them. */
+static void
+test_dir_update_consensus_diffs(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  char *cons[3] = { NULL, NULL, NULL };
+  digests_t digests;
+  char hex_digest[HEX_DIGEST256_LEN+1];
+  int i;
+  (void) arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("consdiff-datadir"));
+  tt_int_op(check_private_dir(options->DataDirectory, CPD_CREATE, NULL),
+            OP_EQ, 0);
+  dirserv_refresh_stored_consensuses();
+
+  /* Each consensus arrives, and gets stored once we've updated the diffs
+   * to it, as in networkstatus_set_current_consensus(). */
+  for (i = 0; i < 3; ++i) {
+    cons[i] = make_consdiff_test_consensus(100 + i);
+    tt_int_op(router_get_networkstatus_v3_hashes(cons[i], &digests), OP_EQ,
+              0);
+    base16_encode(hex_digest, sizeof(hex_digest),
+                  digests.d[DIGEST_SHA256], DIGEST256_LEN);
+    tt_int_op(dirserv_update_consensus_diffs(cons[i], 1000 + i, "ns"),
+              OP_EQ, 0);
+    tt_int_op(dirserv_store_consensus(cons[i], "ns", hex_digest, 1000 + i),
+              OP_EQ, 0);
+  }
+
+  /* Both older consensuses have a diff to the newest one, replacing the
+   * diff that the first one had to the second. */
+  check_served_consdiff(cons[0], 1000, cons[2]);
+  check_served_consdiff(cons[1], 1001, cons[2]);
+  /* The newest has no diff yet. */
+  tt_assert(!dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest));
+
+ done:
+  for (i = 0; i < 3; ++i)
+    tor_free(cons[i]);
+}
+
+/** A real thread pool, and its reply queue, for
+ * mock_cpuworker_queue_on_test_pool() to hand work to. */
+static threadpool_t *consdiff_test_pool = NULL;
+static replyqueue_t *consdiff_test_replyqueue = NULL;
+
+static void *
+consdiff_test_new_state(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+consdiff_test_free_state(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_on_test_pool(int (*fn)(void *, void *),
+                                  void (*reply_fn)(void *), void *arg)
+{
+  return threadpool_queue_work(consdiff_test_pool, fn, reply_fn, arg);
+}
+
+/** Helper: set <b>hex_digest</b> to the hex sha256 digest of
+ * <b>consensus</b>. */
+static void
+consdiff_test_hex_digest(const char *consensus, char *hex_digest)
+{
+  digests_t digests;
+  tor_assert(router_get_networkstatus_v3_hashes(consensus, &digests) == 0);
+  base16_encode(hex_digest, HEX_DIGEST256_LEN+1,
+                digests.d[DIGEST_SHA256], DIGEST256_LEN);
+}
+
+/** Test that consensus diffs get generated by a worker thread, and that we
+ * start serving them once the main thread processes the replies. */
+static void
+test_dir_update_consensus_diffs_threaded(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  char *cons[3] = { NULL, NULL, NULL };
+  char hex_digest[3][HEX_DIGEST256_LEN+1];
+  int i;
+  (void) arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("consdiff-threaded"));
+  tt_int_op(check_private_dir(options->DataDirectory, CPD_CREATE, NULL),
+            OP_EQ, 0);
+  dirserv_refresh_stored_consensuses();
+
+  consdiff_test_replyqueue = replyqueue_new(0);
+  tt_assert(consdiff_test_replyqueue);
+  consdiff_test_pool = threadpool_new(1, consdiff_test_replyqueue,
+                                      consdiff_test_new_state,
+                                      consdiff_test_free_state, NULL);
+  tt_assert(consdiff_test_pool);
+  MOCK(cpuworker_queue_background_work, mock_cpuworker_queue_on_test_pool);
+
+  for (i = 0; i < 3; ++i) {
+    cons[i] = make_consdiff_test_consensus(100 + i);
+    consdiff_test_hex_digest(cons[i], hex_digest[i]);
+    tt_int_op(dirserv_update_consensus_diffs(cons[i], 1000 + i, "ns"),
+              OP_EQ, 0);
+    tt_int_op(dirserv_store_consensus(cons[i], "ns", hex_digest[i],
+                                      1000 + i), OP_EQ, 0);
+  }
+
+  /* Nothing is served until the main thread sees the replies. */
+  tt_assert(!dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest[0]));
+  tt_assert(!dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest[1]));
+
+  for (i = 0; i < 1000; ++i) {
+    replyqueue_process(consdiff_test_replyqueue);
+    if (dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest[0]) &&
+        dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest[1]))
+      break;
+    tor_sleep_msec(10);
+  }
+
+  /* The diff from the first consensus to the second was out of date by
+   * the time we saw it, so both diffs lead to the newest consensus. */
+  check_served_consdiff(cons[0], 1000, cons[2]);
+  check_served_consdiff(cons[1], 1001, cons[2]);
+  tt_assert(!dirserv_lookup_cached_consdiff_by_hexdigest256(hex_digest[2]));
+
+ done:
+  UNMOCK(cpuworker_queue_background_work);
+  /* We can't free the thread pool, which is why this test forks. */
+  for (i = 0; i < 3; ++i)
+    tor_free(cons[i]);
+}
+
+/** Test that a diff job which finishes after a newer consensus has arrived
+ * gets thrown away, even if its reply comes after the up-to-date one. */
+static void
+test_dir_update_consensus_diffs_stale(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  char *cons[3] = { NULL, NULL, NULL };
+  char hex_digest[3][HEX_DIGEST256_LEN+1];
+  char *fname = NULL, *stale_tmp_fname = NULL;
+  void *stale_job;
+  int i;
+  (void) arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("consdiff-stale"));
+  tt_int_op(check_private_dir(options->DataDirectory, CPD_CREATE, NULL),
+            OP_EQ, 0);
+  dirserv_refresh_stored_consensuses();
+
+  replies_pending = smartlist_new();
+  MOCK(cpuworker_queue_background_work, mock_cpuworker_run_work);
+
+  for (i = 0; i < 3; ++i) {
+    cons[i] = make_consdiff_test_consensus(100 + i);
+    consdiff_test_hex_digest(cons[i], hex_digest[i]);
+    tt_int_op(dirserv_update_consensus_diffs(cons[i], 1000 + i, "ns"),
+              OP_EQ, 0);
+    tt_int_op(dirserv_store_consensus(cons[i], "ns", hex_digest[i],
+                                      1000 + i), OP_EQ, 0);
+  }
+
+  /* One job from the second update, for the diff from cons[0] to cons[1];
+   * then two from the third. The workers are done, but the main thread
+   * hasn't seen any of the replies yet. */
+  tt_int_op(smartlist_len(replies_pending), OP_EQ, 3);
+  stale_job = smartlist_get(replies_pending, 0);
+  smartlist_del_keeporder(replies_pending, 0);
+
+  SMARTLIST_FOREACH(replies_pending, void *, a, pending_reply_fn(a));
+  smartlist_clear(replies_pending);
+  check_served_consdiff(cons[0], 1000, cons[2]);
+  check_served_consdiff(cons[1], 1001, cons[2]);
+
+  /* The stale job's file went away with the rest of the old diffs; put it
+   * back so we can check that its reply removes it. */
+  tor_asprintf(&fname, "1000-%s.2", hex_digest[0]);
+  stale_tmp_fname = get_datadir_fname2("old-cached-consensus-diffs-ns",
+                                       fname);
+  tt_int_op(write_str_to_file(stale_tmp_fname, "stale", 1), OP_EQ, 0);
+  pending_reply_fn(stale_job);
+  tt_int_op(file_status(stale_tmp_fname), OP_EQ, FN_NOENT);
+  check_served_consdiff(cons[0], 1000, cons[2]);
+
+ done:
+  UNMOCK(cpuworker_queue_background_work);
+  SMARTLIST_FOREACH(replies_pending, void *, a, pending_reply_fn(a));
+  smartlist_free(replies_pending);
+  for (i = 0; i < 3; ++i)
+    tor_free(cons[i]);
+  tor_free(fname);
+  tor_free(stale_tmp_fname);
+}
+
+/** Helper: make a fake consensus listing one router for each of the
+ * characters in <b>ids</b>, each with its descriptor digest and
+ * exit summary taken from the matching character of <b>descs</b>. */
+static networkstatus_t *
+make_fake_consensus_for_reuse(const char *ids, const char *descs)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->routerstatus_list = smartlist_new();
+  for (; *ids; ++ids, ++descs) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, *ids, DIGEST_LEN);
+    memset(rs->descriptor_digest, *descs, DIGEST256_LEN);
+    strlcpy(rs->nickname, "router", sizeof(rs->nickname));
+    rs->addr = 0x7f000001;
+    rs->is_flagged_running = 1;
+    tor_asprintf(&rs->exitsummary, "accept %d", *descs);
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+/** Test that a new consensus keeps the old routerstatus_t for every router
+ * that hasn't changed, and only copies the local state for the rest. */
+static void
+test_dir_reuse_unchanged_routerstatus(void *arg)
+{
+  networkstatus_t *old_c = NULL, *new_c = NULL;
+  routerstatus_t *old_rs[3], *new_rs[4];
+  int i;
+  (void) arg;
+
+  old_c = make_fake_consensus_for_reuse("BCD", "bcd");
+  new_c = make_fake_consensus_for_reuse("ABCD", "abxd");
+  for (i = 0; i < 3; ++i) {
+    old_rs[i] = smartlist_get(old_c->routerstatus_list, i);
+    old_rs[i]->last_dir_503_at = 100 + i;
+    old_rs[i]->dl_status.n_download_failures = 1 + i;
+  }
+  for (i = 0; i < 4; ++i)
+    new_rs[i] = smartlist_get(new_c->routerstatus_list, i);
+  /* D changes only in a flag. */
+  new_rs[3]->is_fast = 1;
+
+  tt_assert(routerstatus_content_eq(old_rs[0], new_rs[1]));
+  tt_assert(!routerstatus_content_eq(old_rs[1], new_rs[2]));
+  tt_assert(!routerstatus_content_eq(old_rs[2], new_rs[3]));
+
+  networkstatus_copy_old_consensus_info(new_c, old_c);
+
+  /* A is new; B is unchanged, so we keep the old one. */
+  tt_ptr_op(smartlist_get(new_c->routerstatus_list, 0), OP_EQ, new_rs[0]);
+  tt_ptr_op(smartlist_get(new_c->routerstatus_list, 1), OP_EQ, old_rs[0]);
+  tt_ptr_op(smartlist_get(old_c->routerstatus_list, 0), OP_EQ, new_rs[1]);
+  tt_int_op(old_rs[0]->dl_status.n_download_failures, OP_EQ, 1);
+  /* C has a new descriptor: only the 503 time carries over. */
+  tt_ptr_op(smartlist_get(new_c->routerstatus_list, 2), OP_EQ, new_rs[2]);
+  tt_int_op(new_rs[2]->last_dir_503_at, OP_EQ, 101);
+  tt_int_op(new_rs[2]->dl_status.n_download_failures, OP_EQ, 0);
+  /* D has the same descriptor but a new flag. */
+  tt_ptr_op(smartlist_get(new_c->routerstatus_list, 3), OP_EQ, new_rs[3]);
+  tt_int_op(new_rs[3]->last_dir_503_at, OP_EQ, 102);
+  tt_int_op(new_rs[3]->dl_status.n_download_failures, OP_EQ, 3);
+
+ done:
+  networkstatus_vote_free(old_c);
+  networkstatus_vote_free(new_c);
+}
+
 #define DIR_LEGACY(name)                                                   \
   { #name, test_dir_ ## name , TT_FORK, NULL, NULL }
 
@@ -3228,10 +3983,13 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(nicknames),
   DIR_LEGACY(formats),
   DIR(routerinfo_parsing, 0),
+  DIR(routerinfo_cache_info, 0),
+  DIR(routerinfo_cache_info_expired, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
+  DIR(rebuild_store_in_background, TT_FORK),
   DIR_LEGACY(versions),
   DIR_LEGACY(fp_pairs),
   DIR(split_fps, 0),
@@ -3239,6 +3997,8 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(measured_bw_kb_cache),
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
+  DIR(v3_networkstatus_in_batches, TT_FORK),
+  DIR(add_vote_in_background, TT_FORK),
   DIR(random_weighted, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
@@ -3248,6 +4008,10 @@ struct testcase_t dir_tests[] = {
   DIR(purpose_needs_anonymity, 0),
   DIR(fetch_type, 0),
   DIR(packages, 0),
+  DIR(update_consensus_diffs, TT_FORK),
+  DIR(update_consensus_diffs_threaded, TT_FORK),
+  DIR(update_consensus_diffs_stale, TT_FORK),
+  DIR(reuse_unchanged_routerstatus, 0),
   END_OF_TESTCASES
 };
 
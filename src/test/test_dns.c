@@ -0,0 +1,302 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#define CONNECTION_PRIVATE
+#define DNS_PRIVATE
+#include "or.h"
+#include "config.h"
+#include "connection.h"
+#include "dns.h"
+#include "router.h"
+#include "test.h"
+
+#ifdef HAVE_EVENT2_DNS_H
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+
+/** How many A queries has our stub nameserver answered? */
+static int n_stub_queries = 0;
+
+/** Callback for our stub nameserver: answer every A query with 10.0.0.1. */
+static void
+stub_nameserver_cb(struct evdns_server_request *req, void *arg)
+{
+  int i;
+  (void) arg;
+  for (i = 0; i < req->nquestions; ++i) {
+    const struct evdns_server_question *q = req->questions[i];
+    if (q->type == EVDNS_TYPE_A) {
+      uint32_t a = htonl(0x0a000001);
+      ++n_stub_queries;
+      evdns_server_request_add_a_reply(req, q->name, 1, &a, 3600);
+    }
+  }
+  evdns_server_request_respond(req, 0);
+}
+
+static int
+router_my_exit_policy_is_reject_star_replacement(void)
+{
+  return 0;
+}
+
+/** Helper: make a fake exit connection for <b>address</b>. */
+static edge_connection_t *
+new_fake_exitconn(const char *address)
+{
+  edge_connection_t *exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->base_.state = EXIT_CONN_STATE_RESOLVING;
+  exitconn->base_.purpose = EXIT_PURPOSE_CONNECT;
+  exitconn->base_.address = tor_strdup(address);
+  return exitconn;
+}
+
+/** Test that simultaneous lookups for one address share one query, that its
+ * answer gets cached, and that the timeout follows how fast the nameserver
+ * answers. */
+static void
+test_dns_stub_nameserver(void *arg)
+{
+  tor_socket_t sock = TOR_INVALID_SOCKET;
+  struct evdns_server_port *port = NULL;
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  or_options_t *options = get_options_mutable();
+  or_circuit_t *oncirc = NULL;
+  edge_connection_t *conns[3] = { NULL, NULL, NULL };
+  cached_resolve_t *resolve = NULL;
+  char *resolv_conf = NULL;
+  char *hostname = NULL;
+  int pending = 0, i;
+  tor_addr_t expected;
+  tor_libevent_cfg cfg;
+  (void) arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
+  MOCK(router_my_exit_policy_is_reject_star,
+       router_my_exit_policy_is_reject_star_replacement);
+
+  /* Run a nameserver on a loopback port. */
+  sock = tor_open_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  tt_assert(SOCKET_OK(sock));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(bind(sock, (struct sockaddr *)&sin, sizeof(sin)), OP_EQ, 0);
+  tt_int_op(getsockname(sock, (struct sockaddr *)&sin, &sinlen), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(sock), OP_EQ, 0);
+  port = evdns_add_server_port_with_base(tor_libevent_get_base(), sock, 0,
+                                         stub_nameserver_cb, NULL);
+  tt_assert(port);
+
+  tor_asprintf(&resolv_conf, "nameserver 127.0.0.1:%d\n",
+               (int) ntohs(sin.sin_port));
+  tt_int_op(write_str_to_file(get_fname("resolv.conf"), resolv_conf, 0),
+            OP_EQ, 0);
+  options->ServerDNSResolvConfFile = tor_strdup(get_fname("resolv.conf"));
+  options->ServerDNSSearchDomains = 0;
+  options->ServerDNSRandomizeCase = 0;
+  tt_int_op(dns_init(), OP_EQ, 0);
+  tt_int_op(configure_nameservers(1), OP_EQ, 0);
+  /* With one nameserver and no answers yet, we're patient. */
+  tt_int_op(dns_get_current_timeout(), OP_EQ, 10);
+  tt_int_op(dns_get_current_max_timeouts(), OP_EQ, 16);
+
+  oncirc = tor_malloc_zero(sizeof(or_circuit_t));
+  oncirc->base_.magic = OR_CIRCUIT_MAGIC;
+
+  /* Two lookups for the same address: one query. */
+  for (i = 0; i < 2; ++i) {
+    conns[i] = new_fake_exitconn("www.example.com");
+    tt_int_op(dns_resolve_impl(conns[i], 0, oncirc, &hostname, &pending,
+                               &resolve), OP_EQ, 0);
+    tt_int_op(pending, OP_EQ, 1);
+  }
+  for (i = 0; i < 2; ++i)
+    connection_dns_remove(conns[i]);
+
+  for (i = 0; i < 100 && n_stub_queries == 0; ++i)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+  /* Let the answer get back to us. */
+  for (i = 0; i < 100 && dns_get_current_timeout() == 10; ++i)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+  tt_int_op(n_stub_queries, OP_EQ, 1);
+  /* A fast answer brings the timeout down as far as it goes, but the
+   * nameserver still gets as long as before to answer before evdns gives
+   * up on it. */
+  tt_int_op(dns_get_current_timeout(), OP_EQ, 2);
+  tt_int_op(dns_get_current_max_timeouts(), OP_EQ, 80);
+
+  /* The third lookup finds the cached answer. */
+  conns[2] = new_fake_exitconn("www.example.com");
+  tt_int_op(dns_resolve_impl(conns[2], 0, oncirc, &hostname, &pending,
+                             &resolve), OP_EQ, 1);
+  tt_int_op(pending, OP_EQ, 0);
+  tor_addr_from_ipv4h(&expected, 0x0a000001);
+  tt_assert(tor_addr_eq(&conns[2]->base_.addr, &expected));
+  tt_int_op(n_stub_queries, OP_EQ, 1);
+
+ done:
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  for (i = 0; i < 3; ++i) {
+    if (conns[i])
+      connection_free_(TO_CONN(conns[i]));
+  }
+  tor_free(oncirc);
+  tor_free(hostname);
+  tor_free(resolv_conf);
+  dns_free_all();
+  if (port)
+    evdns_close_server_port(port);
+  if (SOCKET_OK(sock))
+    tor_close_socket(sock);
+}
+#endif
+
+/** Helper: cache an answer for <b>address</b>, as if its lookup had just
+ * finished, successfully iff <b>ok</b>. */
+static void
+add_cached_answer(const char *address, int ok)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_PENDING;
+  resolve->minheap_idx = -1;
+  strlcpy(resolve->address, address, sizeof(resolve->address));
+  if (ok) {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+    resolve->result_ipv4.addr_ipv4 = 0x0a000001;
+  } else {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_ERR;
+    resolve->result_ipv4.err_ipv4 = DNS_ERR_NOTEXIST;
+  }
+  resolve->ttl_ipv4 = 3600;
+  dns_insert_cache_entry(resolve);
+  make_pending_resolve_cached(resolve);
+  /* The pending resolve was never in the expiry queue, so nothing else
+   * will free it. */
+  tor_free(resolve);
+}
+
+/** Helper: return the cached answer for <b>address</b>, or NULL. */
+static cached_resolve_t *
+get_cached_answer(const char *address)
+{
+  cached_resolve_t search;
+  strlcpy(search.address, address, sizeof(search.address));
+  return dns_get_cache_entry(&search);
+}
+
+/** Test that the cache evicts its least recently used answers, failures
+ * separately from successes, and answers that were asked for again
+ * last. */
+static void
+test_dns_cache_lru(void *arg)
+{
+  uint64_t hits, negative_hits, misses, evictions;
+  (void) arg;
+
+  tt_int_op(dns_init(), OP_EQ, 0);
+  dns_cache_max_negative = 3;
+  dns_cache_max_positive = 4;
+  dns_cache_max_protected = 2;
+
+  /* Past the limit, the oldest failure goes. */
+  add_cached_answer("n0.example", 0);
+  add_cached_answer("n1.example", 0);
+  add_cached_answer("n2.example", 0);
+  add_cached_answer("n3.example", 0);
+  tt_ptr_op(get_cached_answer("n0.example"), OP_EQ, NULL);
+  tt_assert(get_cached_answer("n1.example"));
+  tt_assert(get_cached_answer("n3.example"));
+
+  /* Using a failure makes it the newest. */
+  cache_note_hit(get_cached_answer("n1.example"));
+  add_cached_answer("n4.example", 0);
+  tt_assert(get_cached_answer("n1.example"));
+  tt_ptr_op(get_cached_answer("n2.example"), OP_EQ, NULL);
+
+  /* Failures and successes have separate limits. */
+  add_cached_answer("p0.example", 1);
+  add_cached_answer("p1.example", 1);
+  add_cached_answer("p2.example", 1);
+  add_cached_answer("p3.example", 1);
+  tt_assert(get_cached_answer("n1.example"));
+  tt_assert(get_cached_answer("n3.example"));
+  tt_assert(get_cached_answer("n4.example"));
+
+  /* p0 and p1 get protected; protecting p2 as well sends p0, the oldest,
+   * back to probation, where it's newer than p3. */
+  cache_note_hit(get_cached_answer("p0.example"));
+  cache_note_hit(get_cached_answer("p1.example"));
+  cache_note_hit(get_cached_answer("p2.example"));
+  add_cached_answer("p4.example", 1);
+  tt_ptr_op(get_cached_answer("p3.example"), OP_EQ, NULL);
+  tt_assert(get_cached_answer("p0.example"));
+  add_cached_answer("p5.example", 1);
+  tt_ptr_op(get_cached_answer("p0.example"), OP_EQ, NULL);
+  tt_assert(get_cached_answer("p1.example"));
+  tt_assert(get_cached_answer("p2.example"));
+  tt_assert(get_cached_answer("p4.example"));
+  tt_assert(get_cached_answer("p5.example"));
+
+  dns_cache_get_stats(&hits, &negative_hits, &misses, &evictions);
+  tt_u64_op(hits, OP_EQ, 4);
+  tt_u64_op(negative_hits, OP_EQ, 1);
+  tt_u64_op(misses, OP_EQ, 0);
+  tt_u64_op(evictions, OP_EQ, 4);
+
+ done:
+  dns_free_all();
+}
+
+/** Test that when we're low on memory, the DNS cache frees what we ask
+ * for, failures first, then answers that were never used again. */
+static void
+test_dns_cache_oom(void *arg)
+{
+  const time_t now = time(NULL);
+  size_t before, freed;
+  (void) arg;
+
+  tt_int_op(dns_init(), OP_EQ, 0);
+  add_cached_answer("n0.example", 0);
+  add_cached_answer("n1.example", 0);
+  add_cached_answer("p0.example", 1);
+  add_cached_answer("p1.example", 1);
+  add_cached_answer("p2.example", 1);
+  cache_note_hit(get_cached_answer("p0.example"));
+
+  before = dns_cache_get_total_allocation();
+  freed = dns_cache_handle_oom(now, 3 * sizeof(cached_resolve_t));
+  tt_u64_op(freed, OP_EQ, 3 * sizeof(cached_resolve_t));
+  tt_u64_op(before - dns_cache_get_total_allocation(), OP_EQ, freed);
+  tt_ptr_op(get_cached_answer("n0.example"), OP_EQ, NULL);
+  tt_ptr_op(get_cached_answer("n1.example"), OP_EQ, NULL);
+  tt_ptr_op(get_cached_answer("p1.example"), OP_EQ, NULL);
+  tt_assert(get_cached_answer("p2.example"));
+  tt_assert(get_cached_answer("p0.example"));
+
+  /* Asking for more than there is empties the cache. */
+  freed = dns_cache_handle_oom(now, 100 * sizeof(cached_resolve_t));
+  tt_u64_op(freed, OP_EQ, 2 * sizeof(cached_resolve_t));
+  tt_ptr_op(get_cached_answer("p2.example"), OP_EQ, NULL);
+  tt_ptr_op(get_cached_answer("p0.example"), OP_EQ, NULL);
+
+ done:
+  dns_free_all();
+}
+
+struct testcase_t dns_tests[] = {
+#ifdef HAVE_EVENT2_DNS_H
+  { "stub_nameserver", test_dns_stub_nameserver, TT_FORK, NULL, NULL },
+#endif
+  { "cache_lru", test_dns_cache_lru, TT_FORK, NULL, NULL },
+  { "cache_oom", test_dns_cache_oom, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
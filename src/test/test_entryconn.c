@@ -743,6 +743,74 @@ test_entryconn_rewrite_mapaddress_automap_onion4(void *arg)
   test_entryconn_rewrite_mapaddress_automap_onion_common(arg, 0, 1);
 }
 
+/** Connections that connection_mark_unattached_ap_mock() has been asked to
+ * mark. */
+static smartlist_t *marked_unattached = NULL;
+
+static void
+connection_mark_unattached_ap_mock(entry_connection_t *conn, int endreason,
+                                   int line, const char *file)
+{
+  (void) endreason;
+  (void) line;
+  (void) file;
+  smartlist_add(marked_unattached, conn);
+}
+
+/* Streams waiting for a circuit are found without scanning every
+ * connection, and forgotten when they're freed. */
+static void
+test_entryconn_pending_circuit(void *arg)
+{
+  entry_connection_t *onehop = arg, *other = NULL;
+  char digest[DIGEST_LEN];
+  char hexdigest[HEX_DIGEST_LEN+1];
+
+  marked_unattached = smartlist_new();
+  MOCK(connection_mark_unattached_ap_, connection_mark_unattached_ap_mock);
+
+  memset(digest, 'A', sizeof(digest));
+  base16_encode(hexdigest, sizeof(hexdigest), digest, sizeof(digest));
+  onehop->want_onehop = 1;
+  onehop->chosen_exit_name = tor_strdup(hexdigest);
+  ENTRY_TO_CONN(onehop)->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  connection_ap_mark_as_pending_circuit(onehop);
+  /* Marking twice doesn't add it twice. */
+  connection_ap_mark_as_pending_circuit(onehop);
+  tt_int_op(onehop->is_pending_circuit, OP_EQ, 1);
+
+  other = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ENTRY_TO_CONN(other)->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  connection_ap_mark_as_pending_circuit(other);
+
+  connection_ap_fail_onehop(digest, NULL);
+  tt_int_op(smartlist_len(marked_unattached), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(marked_unattached, 0), OP_EQ, onehop);
+
+  /* A stream that has left the waiting state is skipped. */
+  smartlist_clear(marked_unattached);
+  ENTRY_TO_CONN(onehop)->state = AP_CONN_STATE_CONNECT_WAIT;
+  connection_ap_fail_onehop(digest, NULL);
+  tt_int_op(smartlist_len(marked_unattached), OP_EQ, 0);
+
+  /* Freeing a stream takes it off the list. */
+  connection_free_(ENTRY_TO_CONN(other));
+  other = NULL;
+  ENTRY_TO_CONN(onehop)->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  connection_ap_fail_onehop(digest, NULL);
+  tt_int_op(smartlist_len(marked_unattached), OP_EQ, 1);
+  connection_ap_mark_as_non_pending_circuit(onehop);
+  tt_int_op(onehop->is_pending_circuit, OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_mark_unattached_ap_);
+  if (other)
+    connection_free_(ENTRY_TO_CONN(other));
+  smartlist_free(marked_unattached);
+  marked_unattached = NULL;
+  connection_edge_free_all();
+}
+
 #define REWRITE(name)                           \
   { #name, test_entryconn_##name, TT_FORK, &test_rewrite_setup, NULL }
 
@@ -763,6 +831,7 @@ struct testcase_t entryconn_tests[] = {
   REWRITE(rewrite_mapaddress_automap_onion2),
   REWRITE(rewrite_mapaddress_automap_onion3),
   REWRITE(rewrite_mapaddress_automap_onion4),
+  REWRITE(pending_circuit),
 
   END_OF_TESTCASES
 };
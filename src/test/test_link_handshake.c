@@ -868,8 +868,92 @@ AUTHENTICATE_FAIL(badsig_1,
   { "authenticate/" #name , test_link_handshake_auth_ ## name, TT_FORK, \
       &setup_authenticate, NULL }
 
+/** Helper: run the TLS handshake between <b>client</b> and <b>server</b>
+ * until both are done.  Return 0 on success and -1 on failure. */
+static int
+do_tls_handshake(tor_tls_t *client, tor_tls_t *server)
+{
+  int client_done = 0, server_done = 0, i;
+  for (i = 0; i < 100 && !(client_done && server_done); ++i) {
+    int r;
+    if (!client_done) {
+      r = tor_tls_handshake(client);
+      if (r == TOR_TLS_DONE)
+        client_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(server);
+      if (r == TOR_TLS_DONE)
+        server_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+  }
+  return (client_done && server_done) ? 0 : -1;
+}
+
+/* Test that a second connection to the same relay resumes the first's
+ * TLS session. */
+static void
+test_link_handshake_tls_resume(void *arg)
+{
+  crypto_pk_t *key1 = NULL, *key2 = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  char digest[DIGEST_LEN];
+  uint64_t n_lookups, n_offered, n_resumed;
+  int round;
+  (void)arg;
+
+  memset(digest, 'x', sizeof(digest));
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER|
+                                 TOR_TLS_CTX_ALLOW_RESUMPTION,
+                                 key1, key2, 86400), ==, 0);
+
+  for (round = 0; round < 2; ++round) {
+    tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    tt_int_op(0, ==, set_socket_nonblocking(fds[0]));
+    tt_int_op(0, ==, set_socket_nonblocking(fds[1]));
+    client = tor_tls_new(fds[0], 0);
+    server = tor_tls_new(fds[1], 1);
+    tt_assert(client);
+    tt_assert(server);
+
+    tor_tls_offer_cached_session(client, digest);
+    tt_int_op(0, ==, do_tls_handshake(client, server));
+    tor_tls_cache_session(client, digest);
+
+    tor_tls_free(client);
+    tor_tls_free(server);
+    client = server = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  }
+
+  tor_tls_get_session_cache_stats(&n_lookups, &n_offered, &n_resumed);
+  tt_u64_op(n_lookups, ==, 2);
+  tt_u64_op(n_offered, ==, 1);
+  tt_u64_op(n_resumed, ==, 1);
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+}
+
 struct testcase_t link_handshake_tests[] = {
   TEST(certs_ok, TT_FORK),
+  TEST(tls_resume, TT_FORK),
   //TEST(certs_bad, TT_FORK),
   TEST_RCV_CERTS(ok),
   TEST_RCV_CERTS(ok_server),
@@ -294,6 +294,110 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+/** Test that we load the cache file from its index without parsing it, and
+ * that we notice when the index and the cache file disagree. */
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md3;
+  char d1[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  char *cache_fn = NULL, *index_fn = NULL, *s = NULL;
+  struct stat st;
+  size_t len;
+  time_t now = time(NULL);
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test3"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tor_asprintf(&index_fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->DataDirectory);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+
+  /* Writing the cache file writes its index. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tt_int_op(0, OP_EQ, stat(index_fn, &st));
+  tt_int_op(st.st_size, OP_EQ, 24 + 2*56);
+
+  /* Load the cache from the index: each microdesc gets parsed when we look
+   * it up. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(md3->unparsed, OP_EQ, 0);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md3->last_listed, OP_EQ, now);
+  tt_int_op(md3->bodylen, OP_EQ, strlen(test_md3_noannotation));
+  tt_mem_op(md3->body, OP_EQ, test_md3_noannotation, md3->bodylen);
+  tt_assert(md3->family);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  tt_assert(md3->exit_policy);
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  tt_assert(md1);
+  tt_assert(md1->onion_pkey);
+
+  /* Change md1 in the cache file behind the index's back: we drop it once
+   * we notice. */
+  microdesc_free_all();
+  s = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  len = (size_t) st.st_size;
+  {
+    char *cp = (char*) tor_memstr(s, len, "MIGJAoGBAMjlHH");
+    tt_assert(cp);
+    cp[8] = 'X';
+  }
+  tt_int_op(0, OP_EQ, write_bytes_to_file(cache_fn, s, len, 1));
+  mc = get_microdesc_cache();
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+
+  /* A bad index is ignored, and written again from the cache file. */
+  microdesc_free_all();
+  tt_int_op(0, OP_EQ, write_str_to_file(index_fn, "not an index", 1));
+  mc = get_microdesc_cache();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+  tt_int_op(0, OP_EQ, stat(index_fn, &st));
+  /* md1 doesn't parse any more, so only md3 is in the new index. */
+  tt_int_op(st.st_size, OP_EQ, 24 + 56);
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(s);
+  tor_free(cache_fn);
+  tor_free(index_fn);
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -843,6 +947,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
@@ -8,6 +8,9 @@
 
 #include "or.h"
 #include "nodelist.h"
+#include "policies.h"
+#include "routerlist.h"
+#include "routerparse.h"
 #include "test.h"
 
 /** Test the case when node_get_by_id() returns NULL,
@@ -60,12 +63,138 @@ test_nodelist_node_get_verbose_nickname_not_named(void *arg)
   return;
 }
 
+/** Helper: return a new routerinfo_t whose identity digest is all
+ * <b>id_byte</b>, and whose exit policy is the comma-separated list of
+ * policy items in <b>policy</b>. */
+static routerinfo_t *
+make_exit_routerinfo(char id_byte, const char *policy)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  smartlist_t *items = smartlist_new();
+
+  memset(ri->cache_info.identity_digest, id_byte, DIGEST_LEN);
+  ri->purpose = ROUTER_PURPOSE_GENERAL;
+  ri->exit_policy = smartlist_new();
+  smartlist_split_string(items, policy, ",", 0, 0);
+  SMARTLIST_FOREACH_BEGIN(items, char *, item) {
+    addr_policy_t *p = router_parse_addr_policy_item_from_string(item, -1);
+    tor_assert(p);
+    smartlist_add(ri->exit_policy, p);
+    tor_free(item);
+  } SMARTLIST_FOREACH_END(item);
+  smartlist_free(items);
+  return ri;
+}
+
+/** Helper: return a string with one character for each node in the
+ * nodelist, naming the node by its first identity byte if its bit is set
+ * in the set of nodes exiting to some port in <b>ports</b>, and '-'
+ * otherwise. */
+static char *
+nodes_exiting_to_ports(const char *ports)
+{
+  smartlist_t *port_list = smartlist_new();
+  smartlist_t *items = smartlist_new();
+  const smartlist_t *nodes = nodelist_get_list();
+  bitarray_t *ba;
+  char *result;
+
+  smartlist_split_string(items, ports, ",", 0, 0);
+  SMARTLIST_FOREACH_BEGIN(items, char *, item) {
+    uint16_t *port = tor_malloc(sizeof(uint16_t));
+    *port = (uint16_t) atoi(item);
+    smartlist_add(port_list, port);
+    tor_free(item);
+  } SMARTLIST_FOREACH_END(item);
+  smartlist_free(items);
+
+  ba = nodelist_get_nodes_exiting_to_some_port(port_list);
+  result = tor_malloc_zero(smartlist_len(nodes) + 1);
+  SMARTLIST_FOREACH(nodes, const node_t *, node,
+      result[node_sl_idx] = bitarray_is_set(ba, node_sl_idx) ?
+                            node->identity[0] : '-');
+
+  bitarray_free(ba);
+  SMARTLIST_FOREACH(port_list, uint16_t *, port, tor_free(port));
+  smartlist_free(port_list);
+  return result;
+}
+
+/** Make sure that the per-port sets of exit nodes track the nodelist as
+ * descriptors come and go. */
+static void
+test_nodelist_port_exit_sets(void *arg)
+{
+  routerinfo_t *ri[5] = { NULL, NULL, NULL, NULL, NULL };
+  routerinfo_t *ri_old = NULL;
+  char *s = NULL;
+  int i;
+  (void) arg;
+
+  ri[0] = make_exit_routerinfo('a', "accept *:80,reject *:*");
+  ri[1] = make_exit_routerinfo('b', "accept *:443,reject *:*");
+  ri[2] = make_exit_routerinfo('c', "reject *:*");
+  nodelist_set_routerinfo(ri[0], NULL);
+  nodelist_set_routerinfo(ri[1], NULL);
+  nodelist_set_routerinfo(ri[2], NULL);
+
+  s = nodes_exiting_to_ports("80");
+  tt_str_op(s, OP_EQ, "a--");
+  tor_free(s);
+  s = nodes_exiting_to_ports("80,443");
+  tt_str_op(s, OP_EQ, "ab-");
+  tor_free(s);
+  s = nodes_exiting_to_ports("22");
+  tt_str_op(s, OP_EQ, "---");
+  tor_free(s);
+
+  /* A new node, and a new descriptor for an old one. */
+  ri[3] = make_exit_routerinfo('d', "accept *:22,accept *:80,reject *:*");
+  nodelist_set_routerinfo(ri[3], NULL);
+  ri[4] = make_exit_routerinfo('c', "accept *:443,reject *:*");
+  nodelist_set_routerinfo(ri[4], &ri_old);
+  tt_ptr_op(ri_old, OP_EQ, ri[2]);
+  s = nodes_exiting_to_ports("80");
+  tt_str_op(s, OP_EQ, "a--d");
+  tor_free(s);
+  s = nodes_exiting_to_ports("443");
+  tt_str_op(s, OP_EQ, "-bc-");
+  tor_free(s);
+  s = nodes_exiting_to_ports("22");
+  tt_str_op(s, OP_EQ, "---d");
+  tor_free(s);
+
+  /* Dropping 'a' moves 'd' into its place. */
+  nodelist_remove_routerinfo(ri[0]);
+  s = nodes_exiting_to_ports("80,22");
+  tt_str_op(s, OP_EQ, "d--");
+  tor_free(s);
+  s = nodes_exiting_to_ports("443");
+  tt_str_op(s, OP_EQ, "-bc");
+  tor_free(s);
+
+  /* Rejecting everything takes effect at once. */
+  policies_set_node_exitpolicy_to_reject_all(
+                                node_get_mutable_by_id(ri[1]->
+                                            cache_info.identity_digest));
+  s = nodes_exiting_to_ports("443,80");
+  tt_str_op(s, OP_EQ, "d-c");
+  tor_free(s);
+
+ done:
+  tor_free(s);
+  nodelist_free_all();
+  for (i = 0; i < 5; ++i)
+    routerinfo_free(ri[i]);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
 struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
+  NODE(port_exit_sets, TT_FORK),
   END_OF_TESTCASES
 };
 
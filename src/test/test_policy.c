@@ -438,10 +438,217 @@ test_dump_exit_policy_to_string(void *arg)
  tor_free(ep);
 }
 
+/** Helper: check that the compiled form of <b>policy</b> gives the same
+ * answers as the policy itself for a lot of addresses and ports. */
+static void
+test_compiled_policy_helper(const smartlist_t *policy)
+{
+  static const uint16_t ports[] = {
+    0, 1, 2, 22, 25, 80, 119, 135, 443, 563, 6667, 6699, 65534, 65535,
+  };
+  static const char *addrs[] = {
+    "10.0.0.1", "127.0.0.1", "192.168.1.1", "18.244.0.188", "1.2.3.4",
+    "255.255.255.255", "0.0.0.0", "[::1]", "[fe80::1]", "[2001:db8::1]",
+    "[ffff::1]",
+  };
+  compiled_addr_policy_t *cp = addr_policy_compile(policy);
+  tor_addr_t addr;
+  unsigned i, j;
+  int k;
+
+  tt_assert(cp);
+  for (i = 0; i < ARRAY_LENGTH(ports); ++i) {
+    if (ports[i]) {
+      tt_int_op(compare_tor_addr_to_compiled_policy(NULL, ports[i], cp),
+                OP_EQ, compare_tor_addr_to_addr_policy(NULL, ports[i],
+                                                       policy));
+    }
+    for (j = 0; j < ARRAY_LENGTH(addrs); ++j) {
+      tt_int_op(tor_addr_parse(&addr, addrs[j]), OP_GE, 0);
+      tt_int_op(compare_tor_addr_to_compiled_policy(&addr, ports[i], cp),
+                OP_EQ, compare_tor_addr_to_addr_policy(&addr, ports[i],
+                                                       policy));
+    }
+  }
+  for (k = 0; k < 2000; ++k) {
+    uint16_t port = (uint16_t) crypto_rand_int(65536);
+    if (k & 1) {
+      tor_addr_from_ipv4h(&addr, (uint32_t) crypto_rand_int(INT_MAX) << 1);
+    } else {
+      uint8_t a6[16];
+      crypto_rand((char *)a6, sizeof(a6));
+      tor_addr_from_ipv6_bytes(&addr, (const char *)a6);
+    }
+    tt_int_op(compare_tor_addr_to_compiled_policy(&addr, port, cp),
+              OP_EQ, compare_tor_addr_to_addr_policy(&addr, port, policy));
+  }
+
+ done:
+  compiled_addr_policy_free(cp);
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  static const char *policy_strs[] = {
+    "",
+    "reject *:*",
+    "accept *:80,reject *:*",
+    "reject 18.0.0.0/8:*,accept 18.244.0.0/16:80-443,accept *:22,"
+      "reject *:1-1024",
+    "accept 1.2.3.0/24:*,reject 1.2.0.0/16:25,accept6 [2001:db8::]/32:*,"
+      "reject6 [2001:db8::]/48:*,reject *:25",
+    "reject 10.0.0.0/8:1-1000,accept 10.0.0.0/16:500-2000,"
+      "reject 10.0.0.1:1500,accept 127.0.0.1:*",
+  };
+  unsigned i;
+  (void)arg;
+
+  for (i = 0; i < ARRAY_LENGTH(policy_strs); ++i) {
+    config_line_t line;
+    smartlist_t *policy = NULL;
+
+    line.key = (char*)"ExitPolicy";
+    line.value = (char*)policy_strs[i];
+    line.next = NULL;
+    tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy,
+                                      EXIT_POLICY_IPV6_ENABLED |
+                                      EXIT_POLICY_REJECT_PRIVATE |
+                                      EXIT_POLICY_ADD_DEFAULT, 0x01020304));
+    test_compiled_policy_helper(policy);
+    addr_policy_list_free(policy);
+    policy = NULL;
+
+    tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy,
+                                      EXIT_POLICY_IPV6_ENABLED, 0));
+    test_compiled_policy_helper(policy);
+    addr_policy_list_free(policy);
+  }
+
+  /* No policy at all accepts everything. */
+  test_compiled_policy_helper(NULL);
+
+ done:
+  ;
+}
+
+static void
+test_policies_compiled_many_ports(void *arg)
+{
+  smartlist_t *rules = smartlist_new();
+  smartlist_t *policy = NULL;
+  char *policy_str = NULL;
+  config_line_t line;
+  int i;
+  (void)arg;
+
+  /* Like a ReducedExitPolicy, but with more separate ports than we allow
+   * port classes: the catch-all port rules shouldn't need one each. */
+  for (i = 0; i < 150; ++i)
+    smartlist_add_asprintf(rules, "accept *:%d", i * 7 + 20);
+  smartlist_add(rules, tor_strdup("reject 18.0.0.0/8:1-100"));
+  for (i = 150; i < 200; ++i)
+    smartlist_add_asprintf(rules, "accept *:%d", i * 7 + 20);
+  smartlist_add(rules, tor_strdup("reject *:*"));
+  policy_str = smartlist_join_strings(rules, ",", 0, NULL);
+
+  line.key = (char*)"ExitPolicy";
+  line.value = policy_str;
+  line.next = NULL;
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy,
+                                      EXIT_POLICY_IPV6_ENABLED |
+                                      EXIT_POLICY_REJECT_PRIVATE, 0x01020304));
+  test_compiled_policy_helper(policy);
+
+ done:
+  addr_policy_list_free(policy);
+  SMARTLIST_FOREACH(rules, char *, cp, tor_free(cp));
+  smartlist_free(rules);
+  tor_free(policy_str);
+}
+
+/** Helper: parse <b>policy_str</b> as a router's exit policy, check that
+ * it is too big to compile, and that the router's policy still gives the
+ * same answers as scanning it. */
+static void
+test_compiled_policy_too_big_helper(const char *policy_str)
+{
+  static const char *addrs[] = {
+    "1.2.3.4", "1.2.3.5", "10.0.0.1", "[2001:db8::1]", "[2001:db8::2]",
+  };
+  static const uint16_t ports[] = { 1, 2, 80, 99, 100, 101, 443, 65535 };
+  config_line_t line;
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  compiled_addr_policy_t *cp = NULL;
+  tor_addr_t addr;
+  unsigned i, j;
+
+  line.key = (char*)"ExitPolicy";
+  line.value = (char*)policy_str;
+  line.next = NULL;
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &ri->exit_policy,
+                                          EXIT_POLICY_IPV6_ENABLED, 0));
+  cp = addr_policy_compile(ri->exit_policy);
+  tt_ptr_op(cp, OP_EQ, NULL);
+
+  for (i = 0; i < ARRAY_LENGTH(addrs); ++i) {
+    tt_int_op(tor_addr_parse(&addr, addrs[i]), OP_GE, 0);
+    for (j = 0; j < ARRAY_LENGTH(ports); ++j) {
+      tt_int_op(compare_tor_addr_to_router_exit_policy(&addr, ports[j], ri),
+                OP_EQ, compare_tor_addr_to_addr_policy(&addr, ports[j],
+                                                       ri->exit_policy));
+    }
+  }
+  /* We fell back to the scan, and won't try to compile again. */
+  tt_ptr_op(ri->compiled_exit_policy, OP_EQ, NULL);
+  tt_assert(ri->exit_policy_too_big_to_compile);
+
+ done:
+  compiled_addr_policy_free(cp);
+  addr_policy_list_free(ri->exit_policy);
+  tor_free(ri);
+}
+
+static void
+test_policies_compiled_too_big(void *arg)
+{
+  smartlist_t *rules = smartlist_new();
+  char *policy_str = NULL;
+  int i;
+  (void)arg;
+
+  /* Every port gets a class of its own. */
+  for (i = 1; i <= 100; ++i)
+    smartlist_add_asprintf(rules, "accept 1.2.3.4:%d", i);
+  policy_str = smartlist_join_strings(rules, ",", 0, NULL);
+  test_compiled_policy_too_big_helper(policy_str);
+  SMARTLIST_FOREACH(rules, char *, cp, tor_free(cp));
+  smartlist_clear(rules);
+  tor_free(policy_str);
+
+  /* Long IPv6 prefixes that share nothing need a trie node for every
+   * bit. */
+  for (i = 0; i < 100; ++i)
+    smartlist_add_asprintf(rules, "reject6 [%x:%x:%x:%x:%x:%x:%x:%x]:*",
+                           i * 641 + 1, i * 19 + 3, i * 7, i, i + 5, i * 3,
+                           i * 11, i * 13 + 1);
+  smartlist_add(rules, tor_strdup("accept *:*"));
+  policy_str = smartlist_join_strings(rules, ",", 0, NULL);
+  test_compiled_policy_too_big_helper(policy_str);
+
+  SMARTLIST_FOREACH(rules, char *, cp, tor_free(cp));
+  smartlist_free(rules);
+  tor_free(policy_str);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
+  { "compiled_many_ports", test_policies_compiled_many_ports, 0, NULL,
+    NULL },
+  { "compiled_too_big", test_policies_compiled_too_big, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
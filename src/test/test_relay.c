@@ -4,8 +4,12 @@
 #include "or.h"
 #define CIRCUITBUILD_PRIVATE
 #include "circuitbuild.h"
+#define CONNECTION_PRIVATE
+#include "connection.h"
 #define RELAY_PRIVATE
 #include "relay.h"
+#define CONGESTION_PRIVATE
+#include "congestion.h"
 /* For init/free stuff */
 #include "scheduler.h"
 
@@ -118,9 +122,191 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/** Helper: with congestion state *<b>ccp</b> and package window
+ * <b>*package_window</b>, send <b>n</b> cells at <b>sent_msec</b>, and get
+ * the SENDMEs for them at <b>acked_msec</b>. */
+static void
+cc_send_and_ack(circuit_cc_t **ccp, int *package_window, int n,
+                int64_t sent_msec, int64_t acked_msec)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    circuit_cc_note_cell_sent_at(ccp, *package_window, sent_msec);
+    --*package_window;
+  }
+  for (i = 0; i < n / CIRCWINDOW_INCREMENT; ++i) {
+    *package_window += CIRCWINDOW_INCREMENT;
+    if (*ccp)
+      circuit_cc_note_sendme_at(*ccp, acked_msec);
+  }
+}
+
+static void
+test_relay_congestion_window(void *arg)
+{
+  networkstatus_t ns;
+  circuit_cc_t *cc = NULL;
+  int package_window = CIRCWINDOW_START;
+  int i;
+  (void) arg;
+
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+
+  /* Off by default: the package window is all that counts, and we don't
+   * allocate any state. */
+  circuit_cc_set_parameters(&ns);
+  cc_send_and_ack(&cc, &package_window, 100, 0, 100);
+  tt_ptr_op(cc, OP_EQ, NULL);
+  tt_int_op(circuit_cc_get_package_window(cc, package_window), OP_EQ,
+            CIRCWINDOW_START);
+
+  smartlist_add(ns.net_params, (char*)"CircuitCongestionControl=1");
+  circuit_cc_set_parameters(&ns);
+
+  /* Turned on while cells are in flight: wait until they're all
+   * acknowledged. */
+  for (i = 0; i < 2 * CIRCWINDOW_INCREMENT; ++i) {
+    circuit_cc_note_cell_sent_at(&cc, package_window - 30, 150);
+    tt_ptr_op(cc, OP_EQ, NULL);
+  }
+
+  /* Nothing queued: the window stays as big as the protocol allows. */
+  cc_send_and_ack(&cc, &package_window, 100, 200, 300);
+  tt_assert(cc);
+  tt_int_op(cc->last_rtt_msec, OP_EQ, 100);
+  tt_int_op(cc->min_rtt_msec, OP_EQ, 100);
+  tt_int_op(cc->cwnd, OP_EQ, CIRCWINDOW_START);
+  tt_int_op(circuit_cc_get_package_window(cc, package_window), OP_EQ,
+            CIRCWINDOW_START);
+
+  /* RTT went from 100 to 400 msec: about 750 cells are queued, so the
+   * window shrinks. */
+  cc_send_and_ack(&cc, &package_window, 100, 400, 800);
+  tt_int_op(cc->cwnd, OP_EQ, CIRCWINDOW_START - 50);
+  tt_int_op(circuit_cc_get_package_window(cc, package_window), OP_EQ,
+            CIRCWINDOW_START - 50);
+  /* Cells in flight count against it, down to nothing. */
+  tt_int_op(circuit_cc_get_package_window(cc, package_window - 920),
+            OP_EQ, 30);
+  tt_int_op(circuit_cc_get_package_window(cc, package_window - 950),
+            OP_EQ, 0);
+  tt_int_op(circuit_cc_get_package_window(cc, package_window - 960),
+            OP_EQ, 0);
+
+  /* ... but never below the minimum. */
+  for (i = 0; i < 30; ++i)
+    cc_send_and_ack(&cc, &package_window, 100, 1000, 1400);
+  tt_int_op(cc->cwnd, OP_EQ, 300);
+
+  /* Once the queues drain, it grows again. */
+  cc_send_and_ack(&cc, &package_window, 100, 2000, 2100);
+  tt_int_op(cc->cwnd, OP_EQ, 350);
+  tt_int_op(package_window, OP_EQ, CIRCWINDOW_START);
+
+  /* The path got slower for good.  For an epoch we still think cells are
+   * queued... */
+  cc_send_and_ack(&cc, &package_window, 100, 20000, 20300);
+  tt_int_op(cc->min_rtt_msec, OP_EQ, 100);
+  tt_int_op(cc->cwnd, OP_EQ, 300);
+  /* ... and then we take the new RTT as the smallest one. */
+  cc_send_and_ack(&cc, &package_window, 100, 31000, 31300);
+  tt_int_op(cc->min_rtt_msec, OP_EQ, 300);
+  tt_int_op(cc->cwnd, OP_EQ, 350);
+
+ done:
+  circuit_cc_free(cc);
+  smartlist_free(ns.net_params);
+  circuit_cc_set_parameters(NULL);
+}
+
+/** Test that an exit stream's DATA cells, built in place, are the same
+ * cells that relay_send_command_from_edge() would have queued. */
+static void
+test_relay_exit_package_in_place(void *arg)
+{
+  channel_t *pchan = NULL;
+  or_circuit_t *circs[2] = { NULL, NULL };
+  edge_connection_t *exitconn = NULL;
+  packed_cell_t *cells[2] = { NULL, NULL };
+  char key[CIPHER_KEY_LEN];
+  char data[600];
+  int i;
+  (void)arg;
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  pchan = new_fake_channel();
+  pchan->cmux = circuitmux_alloc();
+  crypto_rand(key, sizeof(key));
+  crypto_rand(data, sizeof(data));
+
+  /* Two circuits with the same ID and keys: one for each way of building
+   * cells. */
+  for (i = 0; i < 2; ++i) {
+    circs[i] = new_fake_orcirc(pchan, pchan);
+    circs[i]->p_circ_id = circs[0]->p_circ_id;
+    circs[i]->p_crypto = crypto_cipher_new(key);
+    circs[i]->p_digest = crypto_digest_new();
+  }
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->base_.state = EXIT_CONN_STATE_OPEN;
+  exitconn->stream_id = 7;
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->on_circuit = TO_CIRCUIT(circs[0]);
+  write_to_buf(data, sizeof(data), exitconn->base_.inbuf);
+
+  tt_int_op(connection_edge_package_raw_inbuf(exitconn, 1, NULL), OP_EQ, 0);
+  tt_int_op(buf_datalen(exitconn->base_.inbuf), OP_EQ, 0);
+  tt_int_op(circs[0]->p_chan_cells.n, OP_EQ, 2);
+  tt_int_op(circs[0]->base_.package_window, OP_EQ, CIRCWINDOW_START_MAX - 2);
+  tt_int_op(exitconn->package_window, OP_EQ, STREAMWINDOW_START - 2);
+
+  tt_int_op(relay_send_command_from_edge(7, TO_CIRCUIT(circs[1]),
+                                         RELAY_COMMAND_DATA, data,
+                                         RELAY_PAYLOAD_SIZE, NULL), OP_EQ, 0);
+  tt_int_op(relay_send_command_from_edge(7, TO_CIRCUIT(circs[1]),
+                                         RELAY_COMMAND_DATA,
+                                         data + RELAY_PAYLOAD_SIZE,
+                                         sizeof(data) - RELAY_PAYLOAD_SIZE,
+                                         NULL), OP_EQ, 0);
+
+  for (i = 0; i < 2; ++i) {
+    cells[0] = cell_queue_pop(&circs[0]->p_chan_cells);
+    cells[1] = cell_queue_pop(&circs[1]->p_chan_cells);
+    tt_assert(cells[0]);
+    tt_assert(cells[1]);
+    tt_mem_op(cells[0]->body, OP_EQ, cells[1]->body, CELL_MAX_NETWORK_SIZE);
+    packed_cell_free(cells[0]);
+    packed_cell_free(cells[1]);
+    cells[0] = cells[1] = NULL;
+  }
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  packed_cell_free(cells[0]);
+  packed_cell_free(cells[1]);
+  if (exitconn)
+    connection_free_(TO_CONN(exitconn));
+  for (i = 0; i < 2; ++i) {
+    if (!circs[i])
+      continue;
+    crypto_cipher_free(circs[i]->p_crypto);
+    crypto_digest_free(circs[i]->p_digest);
+    cell_queue_clear(&circs[i]->p_chan_cells);
+    tor_free(circs[i]);
+  }
+  free_fake_channel(pchan);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "congestion_window", test_relay_congestion_window, TT_FORK, NULL, NULL },
+  { "exit_package_in_place", test_relay_exit_package_in_place, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -5,6 +5,8 @@
 #include "or.h"
 #include "routerlist.h"
 #include "directory.h"
+#include "networkstatus.h"
+#include "nodelist.h"
 #include "test.h"
 
 /* 4 digests + 3 sep + pre + post + NULL */
@@ -92,12 +94,101 @@ test_routerlist_launch_descriptor_downloads(void *arg)
   smartlist_free(downloadable);
 }
 
+/** Helper: return the only cached weighted node table, after checking
+ * that there is just one. */
+static void *
+only_weighted_node_table(void)
+{
+  tt_assert(weighted_node_tables);
+  tt_int_op(smartlist_len(weighted_node_tables), OP_EQ, 1);
+  return smartlist_get(weighted_node_tables, 0);
+ done:
+  return NULL;
+}
+
+static networkstatus_t *mock_ns = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_ns;
+}
+
+static void
+test_routerlist_weighted_node_cache(void *arg)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  const node_t *choice;
+  routerstatus_t *rs;
+  node_t *node;
+  void *table;
+  int i;
+  (void)arg;
+
+  mock_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < 5; ++i) {
+    rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, 'A' + i, DIGEST_LEN);
+    rs->addr = 0x12000001 + i;
+    rs->is_flagged_running = rs->is_valid = rs->is_fast = 1;
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 100 * (i + 1);
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  nodelist_set_consensus(ns);
+  tt_ptr_op(weighted_node_tables, OP_EQ, NULL);
+
+  /* The first choice builds a table, and later ones reuse it. */
+  choice = router_choose_random_node(NULL, NULL, 0);
+  tt_assert(choice);
+  table = only_weighted_node_table();
+  for (i = 0; i < 10; ++i) {
+    choice = router_choose_random_node(NULL, NULL, 0);
+    tt_assert(choice);
+    tt_ptr_op(only_weighted_node_table(), OP_EQ, table);
+  }
+
+  /* Each of these throws the tables away. */
+  router_dir_info_changed();
+  tt_ptr_op(weighted_node_tables, OP_EQ, NULL);
+
+  tt_assert(router_choose_random_node(NULL, NULL, 0));
+  tt_assert(only_weighted_node_table());
+  nodelist_set_consensus(ns);
+  tt_ptr_op(weighted_node_tables, OP_EQ, NULL);
+
+  tt_assert(router_choose_random_node(NULL, NULL, 0));
+  tt_assert(only_weighted_node_table());
+  rs = smartlist_get(ns->routerstatus_list, 0);
+  smartlist_del_keeporder(ns->routerstatus_list, 0);
+  node = node_get_mutable_by_id(rs->identity_digest);
+  tt_assert(node);
+  node->rs = NULL;
+  routerstatus_free(rs);
+  nodelist_purge(); /* Drops the node, which the table may point to. */
+  tt_ptr_op(weighted_node_tables, OP_EQ, NULL);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 4);
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  nodelist_free_all();
+  networkstatus_vote_free(ns);
+  mock_ns = NULL;
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 
 struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
+  NODE(weighted_node_cache, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -4256,6 +4256,28 @@ test_util_max_mem(void *arg)
   ;
 }
 
+static void
+test_util_thread_cpu_usec(void *arg)
+{
+  uint64_t usec1 = 0, usec2 = 0;
+  volatile uint64_t x = 0;
+  int i, r;
+  (void) arg;
+
+  r = tor_get_thread_cpu_usec(&usec1);
+  if (r < 0)
+    tt_skip();
+
+  /* Burn a little CPU, then make sure the counter didn't go backwards. */
+  for (i = 0; i < 1000000; ++i)
+    x += i;
+  tt_int_op(tor_get_thread_cpu_usec(&usec2), OP_EQ, 0);
+  tt_u64_op(usec2, OP_GE, usec1);
+
+ done:
+  ;
+}
+
 static void
 test_util_hostname_validation(void *arg)
 {
@@ -4399,6 +4421,7 @@ struct testcase_t util_tests[] = {
   { "socketpair_ersatz", test_util_socketpair, TT_FORK,
     &passthrough_setup, (void*)"1" },
   UTIL_TEST(max_mem, 0),
+  UTIL_TEST(thread_cpu_usec, 0),
   UTIL_TEST(hostname_validation, 0),
   UTIL_TEST(ipv4_validation, 0),
   UTIL_TEST(writepid, 0),